@@ -0,0 +1,65 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TLSCLIENT_CERTIFICATE_CHAIN_H
+#define TLSCLIENT_CERTIFICATE_CHAIN_H
+
+#include "tlsclient/public/base.h"
+
+namespace tlsclient {
+
+// CertificateChain is an immutable list of certificates, in wire format and
+// wire order. A chain is created once and can then be attached to any number
+// of Connections (see |Connection::SetPredictedCertificateChain|) without
+// being copied.
+//
+// Chains are reference counted and the counting is thread-safe, so a chain
+// may be shared by Connections on different threads.
+class CertificateChain {
+ public:
+  // Create returns a new chain, with a single reference, which holds a copy
+  // of the |len| certificates described by |certs|.
+  static CertificateChain* Create(const struct iovec* certs, unsigned len);
+
+  void AddRef();
+  // DecRef releases a reference and deletes the chain when none remain.
+  void DecRef();
+
+  // size returns the number of certificates in the chain.
+  unsigned size() const {
+    return size_;
+  }
+
+  // certificates returns |size| iovecs, each of which describes a
+  // certificate.
+  const struct iovec* certificates() const {
+    return certs_;
+  }
+
+  // wire returns the certificates as they appear in the body of a
+  // Certificate message: each is preceded by its 24-bit length.
+  const uint8_t* wire() const {
+    return wire_;
+  }
+
+  size_t wire_length() const {
+    return wire_length_;
+  }
+
+ private:
+  CertificateChain();
+  ~CertificateChain();
+  CertificateChain(const CertificateChain&);
+  void operator=(const CertificateChain&);
+
+  unsigned ref_count_;
+  unsigned size_;
+  struct iovec* certs_;
+  uint8_t* wire_;
+  size_t wire_length_;
+};
+
+}  // namespace tlsclient
+
+#endif  // TLSCLIENT_CERTIFICATE_CHAIN_H
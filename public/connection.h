@@ -13,7 +13,84 @@ namespace tlsclient {
 struct ConnectionPrivate;
 class Context;
 class Buffer;
+class CertificateChain;
+class Connection;
+struct Fingerprint;
 class Sink;
+class SnapStartCache;
+class VerificationCache;
+class WorkerPool;
+
+// RecordSpan describes the application level data from a single record, as
+// returned by |Connection::ProcessBatch|.
+struct RecordSpan {
+  // The plaintext of the record is described by |iov_len| elements of the
+  // returned array of iovecs, starting at |iov_offset|.
+  unsigned iov_offset;
+  unsigned iov_len;
+  // length is the number of bytes of plaintext.
+  size_t length;
+  // wire_length is the number of bytes that the record took up in the input,
+  // including the record header.
+  size_t wire_length;
+  // seq_num is the sequence number of the record. See RFC 2246 section 6.
+  uint64_t seq_num;
+};
+
+// EncryptRequest is one element of a batch given to
+// |Connection::EncryptBatch|.
+struct EncryptRequest {
+  // conn is the Connection which the data is to be sent on.
+  Connection* conn;
+  // iov and iov_len are the application level data, as for
+  // |Connection::Encrypt|. This data is encrypted in place.
+  const struct iovec* iov;
+  unsigned iov_len;
+  // start and end are set as for |Connection::Encrypt|.
+  struct iovec start;
+  struct iovec end;
+  // result is set to the result for this request.
+  Result result;
+};
+
+// CorkStats counts the application level data which has passed through
+// |Connection::Write| and the records it was sent in. The packing ratio is
+// |writes| / |records|, and the fraction of the output which is overhead is
+// 1 - |bytes| / |wire_bytes|.
+struct CorkStats {
+  // writes is the number of calls to |Connection::Write| with data.
+  uint64_t writes;
+  // bytes is the number of bytes of application level data written.
+  uint64_t bytes;
+  // records is the number of records which that data was sent in.
+  uint64_t records;
+  // wire_bytes is the total length of those records, including headers.
+  uint64_t wire_bytes;
+};
+
+// CertificateRetention determines which of the server's certificates a
+// Connection keeps once the Certificate message has been processed. See
+// |Connection::set_certificate_retention|.
+enum CertificateRetention {
+  // The whole chain is kept and returned by |Connection::server_certificates|.
+  RETAIN_ALL_CERTIFICATES = 0,
+  // Only the server's own certificate is kept.
+  RETAIN_LEAF_CERTIFICATE = 1,
+  // Nothing is kept. The chain is only available to a
+  // |CertificatesCallback|.
+  RETAIN_NO_CERTIFICATES = 2,
+};
+
+// CertificatesCallback is called with the server's certificate chain, in the
+// order given by the peer. A Certificate message which fits in a record is
+// passed in a single call. A longer one is passed in pieces, as each record
+// completes more of its certificates. |complete| is true for the final call,
+// which is made once the whole message has been processed. The certificates
+// point into the input to |Process|, or into the Connection's reassembly
+// buffer, and are only valid for the duration of the call. (A certificate
+// which spans the iovecs given to |Process| is the exception: it has to be
+// copied so that it can be passed as one.)
+typedef void (*CertificatesCallback)(void* arg, const struct iovec* certs, unsigned len, bool complete);
 
 // Connection represents an association with a TLS peer. Initially the peer is
 // unknown and unauthenticated. As the association progresses, by reading and
@@ -24,7 +101,11 @@ class Sink;
 // library to wait until the server's certificate chain is available and to
 // validate it before sending or receiving application level data.
 //
-// The object is not thread-safe.
+// The object is not thread-safe, with one exception: once the handshake is
+// complete, one thread may receive (with |Process|, |ProcessBatch| or
+// |ProcessInto|) while another sends (with |Encrypt|, |EncryptV|, |Write| and
+// the like, including |ReturnBuffer|). If |Process| returns an error, or
+// |need_to_write| becomes true, then the threads must stop and synchronise.
 //
 // A Connection generates data to be sent in one of two ways: either the data
 // is generated internally and is overhead of the TLS protocol, or the data is
@@ -54,6 +135,16 @@ class Connection {
   //     only remains valid until the next call to |Get|.
   //   returns: 0 on success.
   Result Get(struct iovec* out);
+  // GetOwned is the same as |Get| except that the generated data belongs to
+  // the caller and remains valid until it's passed to |ReturnBuffer|. Thus
+  // several flights may be in the process of being transmitted at once.
+  Result GetOwned(struct iovec* out);
+  // ReturnBuffer frees a buffer from |GetOwned| or |EncryptOwned|. Any
+  // buffers which haven't been returned are freed when the Connection is
+  // destroyed.
+  //   buffer: the |iov_base| of the |out| argument of |GetOwned|, or of the
+  //     |start| argument of |EncryptOwned|.
+  void ReturnBuffer(void* buffer);
 
   // Process processes all data from the peer and splits out any application
   // level data that the user of this object should process furthur.
@@ -76,7 +167,9 @@ class Connection {
   // must be given on subsequent calls.
   //
   // Equally, |used| may be less then the amount given. In this case, the used
-  // bytes must not be given in subsequent calls.
+  // bytes must not be given in subsequent calls. In particular, complete
+  // records which carry part of a handshake message are buffered internally
+  // and counted in |used| even though the message itself isn't yet complete.
   //
   // Data from the peer can consist entirely of overhead so |out_n| may be zero
   // on return even if |used| is non-zero.
@@ -86,6 +179,37 @@ class Connection {
   // false can the user assume that the input buffer has been exhausted.
   Result Process(struct iovec** out, unsigned* out_n, size_t* used,
                  const struct iovec* iov, unsigned n);
+  // bytes_needed returns the number of bytes, in addition to those given to
+  // the last call to |Process| and not consumed by it, which are needed in
+  // order to complete the next record. (This is a lower bound: if a handshake
+  // message spans records then more than one record may be needed.) It
+  // returns 0 if the last call to |Process| stopped for some other reason.
+  size_t bytes_needed() const;
+  // ProcessBatch is the same as |Process| but additionally describes the
+  // record that each part of the application level data came from.
+  //   records: (output) on return, points to an array with one element for
+  //     each record of application level data in |out|, in order.
+  //   records_n: (output) on return, the number of elements in |records|.
+  // All the complete application data records at the beginning of the input
+  // are decrypted in a single pass, so large reads should be given in one
+  // call.
+  Result ProcessBatch(struct iovec** out, unsigned* out_n,
+                      const RecordSpan** records, unsigned* records_n,
+                      size_t* used, const struct iovec* iov, unsigned n);
+  // ProcessInto is the same as |Process| except that application level data
+  // is decrypted into |plaintext| rather than in place. Thus the input can be
+  // reused as soon as this returns. (Handshake records are still processed
+  // in place.)
+  //   plaintext: a buffer into which application level data is written.
+  //   plaintext_len: on entry, the size of |plaintext|. On return, the number
+  //     of bytes of application level data written.
+  // Each record is decrypted whole into |plaintext| before its MAC and
+  // padding are removed, so there must be space for the whole record. (A
+  // buffer of at least 18432 bytes always suffices.) If there isn't, then
+  // any application data decrypted so far is returned. Otherwise the result
+  // is ERR_OUTPUT_BUFFER_TOO_SMALL.
+  Result ProcessInto(uint8_t* plaintext, size_t* plaintext_len, size_t* used,
+                     const struct iovec* iov, unsigned n);
 
   // Encrypt encrypts application level data for transmission to the peer.
   // |is_ready_to_send_application_data| return true otherwise |Encrypt| will
@@ -104,6 +228,142 @@ class Connection {
   //   iov_len: the number of elements in |iov|.
   //   returns: 0 on success.
   Result Encrypt(struct iovec* start, struct iovec* end, const struct iovec* iov, unsigned iov_len);
+  // EncryptOwned is the same as |Encrypt| except that |start| and |end| point
+  // into a buffer which belongs to the caller, rather than to the Connection,
+  // and so remain valid across further calls. The buffer begins at
+  // |start->iov_base| and must be passed to |ReturnBuffer| once the record has
+  // been transmitted.
+  Result EncryptOwned(struct iovec* start, struct iovec* end, const struct iovec* iov, unsigned iov_len);
+  // EncryptBatch is equivalent to calling |Encrypt| for each element of
+  // |requests|, but where consecutive requests are for Connections with the
+  // same CBC cipher suite, their records are processed together: the MAC
+  // hashing and the block cipher operations are interleaved across up to
+  // four Connections at a time. A Connection may appear more than once, in
+  // which case its records are encrypted in the order given. The |start| and
+  // |end| of every request remain valid until the next call to |Encrypt| or
+  // |EncryptBatch| with that Connection.
+  static void EncryptBatch(EncryptRequest* requests, unsigned n);
+  // EncryptV is like |Encrypt| except that any amount of data may be given.
+  // The data is split into as many records as needed and the result is a
+  // single array of vectors, suitable for passing to writev, which
+  // interleaves the record headers, the application level data (encrypted in
+  // place) and the record trailers.
+  //   out: (output) on return, points to the array of vectors to be
+  //     transmitted. This (and the header and trailer data which it points
+  //     to) is valid until the next call to |EncryptV|.
+  //   out_n: (output) on return, the number of elements in |out|.
+  //   iov: an array of vectors of application level data. This data is
+  //     encrypted in place.
+  //   iov_len: the number of elements in |iov|.
+  //   returns: 0 on success. On failure nothing is to be sent and the
+  //     sequence number is unchanged. If the cipher chains from record to
+  //     record, |is_ready_to_send_application_data| is then false.
+  Result EncryptV(const struct iovec** out, unsigned* out_n, const struct iovec* iov, unsigned iov_len);
+  // EncryptTo is like |EncryptV| except that the given data is left untouched
+  // and the complete records are written to |out| instead. The copy is done
+  // as part of the encryption.
+  //   out: a buffer into which the records are written.
+  //   out_len: on entry, the size of |out|. On return, the number of bytes
+  //     written or, if the result is ERR_OUTPUT_BUFFER_TOO_SMALL, the number
+  //     of bytes needed.
+  //   iov: an array of vectors of application level data.
+  //   iov_len: the number of elements in |iov|.
+  //   returns: 0 on success. On failure |out_len| is zero, unless the buffer
+  //     was too small, and the sequence number is unchanged. Whatever was
+  //     written to |out| is to be discarded. If the cipher chains from
+  //     record to record, |is_ready_to_send_application_data| is then false.
+  Result EncryptTo(uint8_t* out, size_t* out_len, const struct iovec* iov, unsigned iov_len);
+  // EncryptFromFile is like |EncryptTo| except that the application level
+  // data is read from a file. Each record's worth is read straight into its
+  // place in |out| and encrypted there, and the kernel is told that the range
+  // will be read sequentially.
+  //   out: a buffer into which the records are written.
+  //   out_len: on entry, the size of |out|. On return, the number of bytes
+  //     written or, if the result is ERR_OUTPUT_BUFFER_TOO_SMALL, the number
+  //     of bytes needed.
+  //   fd: a file descriptor which supports pread.
+  //   offset: the offset in the file of the first byte to be sent.
+  //   len: the number of bytes to send.
+  //   returns: 0 on success or ERR_CANNOT_READ_FILE if the range couldn't be
+  //     read in full, for example because the file is shorter than expected.
+  //     Nothing is consumed from the connection on failure. In particular,
+  //     the sequence number is unchanged. Failures are otherwise as for
+  //     |EncryptTo|.
+  // To send a large file, call this repeatedly with a range that fits in
+  // |out| and transmit the result each time.
+  Result EncryptFromFile(uint8_t* out, size_t* out_len, int fd, uint64_t offset, size_t len);
+
+  // set_worker_pool sets a pool of threads which is used to encrypt and
+  // decrypt the records of a batch (see |EncryptV| and |ProcessBatch|) in
+  // parallel. This only happens when each record can be processed
+  // independently of the others, which is the case for the CBC cipher suites
+  // in TLS 1.1 and later. The pool isn't owned by the Connection and must
+  // outlive it, or be unset with NULL.
+  void set_worker_pool(WorkerPool* pool);
+  // set_record_sizing enables dynamic record sizing for |EncryptV|,
+  // |EncryptTo| and |EncryptFromFile|. The peer can't process any of a record
+  // until all of it has arrived, so the first data sent on a connection (or
+  // after it has been idle) is split into records which fit in a single TCP
+  // segment. Once enough data has been sent, full sized records are used.
+  //   ramp_bytes: the number of bytes of application level data which are
+  //     sent in small records before switching to full sized ones. Zero (the
+  //     default) disables dynamic record sizing.
+  //   idle_seconds: if no data is sent for at least this many seconds then
+  //     small records are used again.
+  // Records created by |Encrypt| are sized by the caller and don't count
+  // towards |ramp_bytes|.
+  void set_record_sizing(size_t ramp_bytes, unsigned idle_seconds);
+
+  // Cork starts coalescing the data given to |Write|. Rather than each write
+  // becoming a record of its own, with a header, MAC and padding, the data is
+  // buffered and sent in as few records as possible when it's flushed.
+  //   flush_bytes: buffered data is flushed by |Write| once there's at least
+  //     this much of it. A value of at most 16384 means that each flush
+  //     results in a single record.
+  //   flush_seconds: if not zero, buffered data is flushed by |Write| once
+  //     it's been waiting for at least this many seconds, according to
+  //     |Context::EpochSeconds|. There are no external signals into this
+  //     object, so this is only checked when |Write| is called: a connection
+  //     which stops writing keeps its data until the caller flushes it.
+  //     Callers which set this must poll |is_flush_due| and call |Flush| when
+  //     it returns true.
+  void Cork(size_t flush_bytes, unsigned flush_seconds);
+  // Uncork stops coalescing and flushes any buffered data, as |Flush|.
+  Result Uncork(const struct iovec** out, unsigned* out_n);
+  // Write copies application level data into the Connection. If the
+  // Connection is corked (see |Cork|) then the data may be buffered.
+  // Otherwise, or if a flush is triggered, the buffered data is encrypted and
+  // the result is returned as for |EncryptV|.
+  //   out: (output) on return, points to the array of vectors to be
+  //     transmitted. This is valid until the next call to |Write|, |Flush|,
+  //     |Uncork| or |EncryptV|.
+  //   out_n: (output) on return, the number of elements in |out|, which is
+  //     zero if nothing is to be sent yet.
+  //   iov: an array of vectors of application level data. This data isn't
+  //     modified.
+  //   iov_len: the number of elements in |iov|.
+  //   returns: 0 on success.
+  Result Write(const struct iovec** out, unsigned* out_n, const struct iovec* iov, unsigned iov_len);
+  // Flush encrypts any data buffered by |Write|. The arguments are as for
+  // |Write|. If it fails then the data remains buffered.
+  Result Flush(const struct iovec** out, unsigned* out_n);
+  // is_flush_due returns true if data buffered by |Write| has been waiting for
+  // at least the time given to |Cork|, and so |Flush| should be called.
+  bool is_flush_due() const;
+  // cork_stats returns counts of the data sent with |Write|.
+  const CorkStats& cork_stats() const;
+  // QueueApplicationData buffers application level data, which may be done
+  // before the handshake has started. If application level data can be sent
+  // by the time that the client's Finished message is generated (i.e. with
+  // False Start, or when resuming a session) then the buffered data is
+  // encrypted and appended to the result of |Get|, so that it's sent along
+  // with the Finished. Otherwise it remains buffered, as if by |Write| on a
+  // corked Connection, and is sent by |Flush| once
+  // |is_ready_to_send_application_data| is true.
+  //   iov: an array of vectors of application level data. This data is
+  //     copied.
+  //   iov_len: the number of elements in |iov|.
+  void QueueApplicationData(const struct iovec* iov, unsigned iov_len);
 
   // is_resumption_data_availible returns true if |GetResumptionData| can
   // return session resumption information for this connection.
@@ -130,9 +390,43 @@ class Connection {
   // did_resume returns true if the last handshake was a resumption.
   bool did_resume() const;
 
+  // ExportState serialises an established connection so that it can be
+  // continued by another Connection, perhaps in another process, with
+  // |ImportState|. The peer can't tell the difference, so long as the
+  // transport (i.e. the socket) goes along with it. The result includes the
+  // connection's keys and so must be protected as carefully as they are.
+  //   iov: (output) on return, the serialised state. This data is freshly
+  //     allocated and will be released when the Connection object is deleted.
+  //   returns:
+  //     0: success
+  //     ERR_CANNOT_EXPORT_STATE: the handshake isn't complete, a record is
+  //       part way through being processed, or data given to |Write| is
+  //       buffered.
+  //     ERR_HANDSHAKE_STATE_FREED: |FreeHandshakeState| has been called.
+  // Any bytes which |Process| didn't use must be given to the new Connection.
+  // Once exported, this Connection must not be used to send or receive.
+  Result ExportState(struct iovec* iov);
+  // ImportState makes this Connection, which must be freshly created,
+  // continue a connection serialised by |ExportState|. The peer's
+  // certificates and any resumption data aren't carried over. The cipher
+  // suite of the serialised connection must be enabled on this one. On
+  // failure, this Connection is left untouched.
+  //   data: the result of |ExportState|.
+  //   len: the number of bytes in |data|.
+  //   returns:
+  //     0: success
+  //     ERR_CANNOT_PARSE_STATE: the data was invalid or this Connection has
+  //       already been used.
+  //     ERR_STATE_CIPHER_SUITE_NOT_ENABLED: the cipher suite isn't enabled.
+  Result ImportState(const uint8_t* data, size_t len);
+
   // is_server_cert_available returns true iff calling |server_certificates|
-  // will return the peer's certificates. This will never be true if the
-  // session is resumed. Once true, this is always true.
+  // will return the peer's certificates (subject to the retention policy).
+  // This becomes true as soon as the server's Certificate message has been
+  // processed, which is before the handshake completes, so verification of
+  // the chain can run while the rest of the handshake proceeds. (See also
+  // |set_certificates_callback|.) This will never be true if the session is
+  // resumed. Once true, this is true until |FreeHandshakeState| is called.
   bool is_server_cert_available() const;
   // is_server_verified returns true once the peer has proved that they hold
   // the private part of whatever certificate they presented. This will always
@@ -149,6 +443,62 @@ class Connection {
   //     contains exactly one certificate.
   //   out_len: (output) on return, the number of elements in |out_iovs|.
   Result server_certificates(const struct iovec** out_iovs, unsigned* out_len);
+  // set_certificate_retention sets which of the server's certificates are
+  // kept for |server_certificates|. The default is RETAIN_ALL_CERTIFICATES.
+  // Callers which only look at the leaf, or which only need the chain at the
+  // point that it arrives (see |set_certificates_callback|), can avoid
+  // copying the rest of it.
+  void set_certificate_retention(CertificateRetention retention);
+  // set_certificates_callback sets a function which is called, from within
+  // |Process|, with the server's certificates as soon as they have been
+  // received, and before any later handshake messages are processed. The
+  // certificates aren't copied for the callback, whatever the retention
+  // policy, which is why a long chain is passed in pieces. The final call is
+  // the earliest point at which verification can be started.
+  void set_certificates_callback(CertificatesCallback callback, void* arg);
+  // set_certificate_fingerprints sets whether the SHA-256 fingerprints of the
+  // server's certificates, and of the chain, are computed as they're
+  // received. The default is false unless a verification cache is set.
+  // Fingerprints which are enabled after the Certificate message has started
+  // to arrive are computed when first needed from the retained certificates,
+  // and so are only available if the whole chain is retained.
+  void set_certificate_fingerprints(bool enabled);
+  // server_certificate_fingerprints returns the fingerprints of the server's
+  // certificates. If they were enabled in time, this works whatever the
+  // retention policy, including from within the final call of the
+  // certificates callback.
+  //   out_fingerprints: (output) on return, points to the fingerprint of each
+  //     certificate in the order given by the peer.
+  //   out_len: (output) on return, the number of elements in
+  //     |out_fingerprints|.
+  //   out_chain: (output) on return, the fingerprint of the chain, which is
+  //     the SHA-256 of the concatenated fingerprints of its certificates.
+  //   returns:
+  //     0: success
+  //     ERR_NO_CERTIFICATE_FINGERPRINTS: fingerprints aren't enabled, the
+  //       server's certificates haven't been received or they were enabled
+  //       too late and not all of the chain was retained.
+  //     ERR_HANDSHAKE_STATE_FREED: |FreeHandshakeState| has been called.
+  Result server_certificate_fingerprints(const Fingerprint** out_fingerprints, unsigned* out_len, Fingerprint* out_chain);
+  // set_verification_cache sets a cache of the results of verifying
+  // certificate chains, keyed by the host name (see |set_host_name|) and the
+  // chain's fingerprint, and enables fingerprints. A caller which finds a
+  // result for a chain can skip verifying it again. The cache isn't owned by
+  // the Connection and must outlive the handshake, or be unset with NULL.
+  void set_verification_cache(VerificationCache* cache);
+  // GetCachedVerificationResult looks up the server's chain in the
+  // verification cache.
+  //   found: (output) on return, true iff an unexpired result was found.
+  //   result: (output) if |*found|, the result.
+  //   returns:
+  //     0: success, including when no cache is set.
+  //     ERR_NO_CERTIFICATE_FINGERPRINTS: see |server_certificate_fingerprints|.
+  //     ERR_HANDSHAKE_STATE_FREED: |FreeHandshakeState| has been called.
+  Result GetCachedVerificationResult(bool* found, int* result);
+  // CacheVerificationResult stores |result| as the result of verifying the
+  // server's chain, for |ttl_seconds|. If no cache is set, nothing happens.
+  // The return values are as for |GetCachedVerificationResult|.
+  Result CacheVerificationResult(int result, uint32_t ttl_seconds);
 
   // cipher_suite_name returns the textual name of the current cipher suite, as
   // defined in the IANA registry of TLS cipher suites. This function can be
@@ -161,12 +511,37 @@ class Connection {
   // |server_certificates()|. Knowning the peer's certificates allows for
   // several optimistic optimisations, including snap-start (see below).
   void SetPredictedCertificates(const struct iovec* iovs, unsigned len);
+  // SetPredictedCertificateChain is the same as |SetPredictedCertificates|
+  // except that, rather than copying the certificates, the Connection takes
+  // a reference to |chain|. When many connections predict the same
+  // certificates, a single chain can be shared between them. NULL clears
+  // the prediction.
+  void SetPredictedCertificateChain(CertificateChain* chain);
 
   void CollectSnapStartData();
   bool is_snap_start_data_available() const;
   Result GetSnapStartData(struct iovec* iov);
   Result SetSnapStartData(const uint8_t* data, size_t len, const uint8_t* application_data, size_t application_data_len);
   bool did_snap_start() const;
+  // set_snap_start_cache sets a cache of predicted server responses which is
+  // shared with other Connections. Snap start attempts which make the same
+  // prediction as an earlier one then reuse its serialised response. The
+  // cache isn't owned by the Connection and must outlive the handshake, or be
+  // unset with NULL.
+  void set_snap_start_cache(SnapStartCache* cache);
+
+  // FreeHandshakeState frees the state which is only needed for the
+  // handshake, leaving the Connection with just what it needs to send and
+  // receive records. This is worthwhile when keeping many connections open.
+  // Afterwards, the functions which return handshake state fail, mostly with
+  // ERR_HANDSHAKE_STATE_FREED, queries about it return false and the
+  // functions which configure the handshake have no effect. Since
+  // renegotiation isn't supported, any further handshake messages from the
+  // peer are an error.
+  //   returns:
+  //     0: success
+  //     ERR_HANDSHAKE_NOT_COMPLETE: the handshake is still in progress.
+  Result FreeHandshakeState();
 
   // set_sslv3 sets whether we should use SSLv3 only. This should never need to
   // be called except to work around buggy TLS server that are intolerant of
@@ -198,6 +573,7 @@ class Connection {
 
  private:
   void SetEnableBit(unsigned bit, bool onoff);
+  Result EncryptCorkFlushed(const struct iovec** out, unsigned* out_n);
 
   ConnectionPrivate* const priv_;
 };
@@ -88,6 +88,14 @@ enum ErrorCode {
   ERR_SNAP_START_DATA_NOT_READY = 58,
   ERR_CANNOT_PARSE_SNAP_START_DATA = 59,
   ERR_NEED_PREDICTED_CERTS_FIRST = 60,
+  ERR_OUTPUT_BUFFER_TOO_SMALL = 61,
+  ERR_CANNOT_READ_FILE = 62,
+  ERR_CANNOT_EXPORT_STATE = 63,
+  ERR_CANNOT_PARSE_STATE = 64,
+  ERR_HANDSHAKE_NOT_COMPLETE = 65,
+  ERR_HANDSHAKE_STATE_FREED = 66,
+  ERR_NO_CERTIFICATE_FINGERPRINTS = 67,
+  ERR_STATE_CIPHER_SUITE_NOT_ENABLED = 68,
 
   // Remember to add the string to the array in src/error.cc!
 
@@ -0,0 +1,40 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TLSCLIENT_SNAP_START_CACHE_H
+#define TLSCLIENT_SNAP_START_CACHE_H
+
+#include "tlsclient/public/base.h"
+
+namespace tlsclient {
+
+struct SnapStartCachePrivate;
+
+// SnapStartCache holds the server responses which snap start attempts have
+// predicted, in wire format, keyed by the predicted certificates and
+// ServerHello. Attempts which make the same prediction then only need to
+// copy the response and patch in their server random, rather than
+// serialising the certificate chain again. See
+// |Connection::set_snap_start_cache|.
+//
+// A single SnapStartCache may be shared by any number of Connections, which
+// may be used from any number of threads.
+class SnapStartCache {
+ public:
+  // max_entries: the number of predictions to remember. Once full, the
+  //   oldest entry is replaced.
+  SnapStartCache(unsigned max_entries);
+  ~SnapStartCache();
+
+  SnapStartCachePrivate* priv() const {
+    return priv_;
+  }
+
+ private:
+  SnapStartCachePrivate* const priv_;
+};
+
+}  // namespace tlsclient
+
+#endif  // TLSCLIENT_SNAP_START_CACHE_H
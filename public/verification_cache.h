@@ -0,0 +1,77 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TLSCLIENT_VERIFICATION_CACHE_H
+#define TLSCLIENT_VERIFICATION_CACHE_H
+
+#include "tlsclient/public/base.h"
+
+namespace tlsclient {
+
+// Fingerprint is the SHA-256 of a certificate or, for a chain, of the
+// concatenated fingerprints of its certificates. See
+// |Connection::server_certificate_fingerprints|.
+struct Fingerprint {
+  uint8_t bytes[32];
+};
+
+// VerificationCache is an abstract class which remembers the results of
+// verifying the server's certificates, keyed by the host name and the
+// fingerprint of the chain. libtlsclient doesn't verify servers itself.
+// Rather, it computes the fingerprints as the certificates arrive so that a
+// caller which has already verified a chain can skip doing so again. See
+// |Connection::set_verification_cache|.
+//
+// Verification checks a chain against the name of the host that's being
+// connected to, so a chain which is valid for one host may not be for
+// another. That's why the host name is part of the key.
+//
+// Results are opaque to libtlsclient. A single VerificationCache may be
+// shared by any number of Connections, which may be used from any number of
+// threads, so implementations must be thread-safe.
+class VerificationCache {
+ public:
+  virtual ~VerificationCache() { }
+
+  // Lookup finds the result stored for |chain| when connecting to
+  // |host_name|.
+  //   host_name: the name of the server, as given to
+  //     |Connection::set_host_name|, or an empty string if none was given.
+  //   chain: the fingerprint of the chain.
+  //   now: the current time, in seconds since the UNIX epoch.
+  //   result: (output) on success, the stored result.
+  //   returns: true iff a result was stored for |host_name| and |chain| and
+  //     it hasn't expired by |now|.
+  virtual bool Lookup(const char* host_name, const Fingerprint& chain, uint64_t now, int* result) = 0;
+  // Store remembers |result| for |host_name| and |chain| for |ttl_seconds|
+  // from |now|, in seconds since the UNIX epoch. Any existing result for
+  // them is replaced.
+  virtual void Store(const char* host_name, const Fingerprint& chain, int result, uint64_t now, uint32_t ttl_seconds) = 0;
+};
+
+struct MemoryVerificationCachePrivate;
+
+// MemoryVerificationCache is a VerificationCache which holds a fixed
+// number of results in memory.
+class MemoryVerificationCache : public VerificationCache {
+ public:
+  // max_entries: the number of results to remember. Once full, expired
+  //   results are dropped and then, if needed, the oldest is replaced.
+  MemoryVerificationCache(unsigned max_entries);
+  ~MemoryVerificationCache();
+
+  bool Lookup(const char* host_name, const Fingerprint& chain, uint64_t now, int* result);
+  void Store(const char* host_name, const Fingerprint& chain, int result, uint64_t now, uint32_t ttl_seconds);
+
+  MemoryVerificationCachePrivate* priv() const {
+    return priv_;
+  }
+
+ private:
+  MemoryVerificationCachePrivate* const priv_;
+};
+
+}  // namespace tlsclient
+
+#endif  // TLSCLIENT_VERIFICATION_CACHE_H
@@ -0,0 +1,39 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TLSCLIENT_WORKER_POOL_H
+#define TLSCLIENT_WORKER_POOL_H
+
+#include "tlsclient/public/base.h"
+
+namespace tlsclient {
+
+struct WorkerPoolPrivate;
+
+// WorkerPool is a small set of threads which Connections can use to encrypt
+// and decrypt the records of a large batch in parallel. See
+// |Connection::set_worker_pool|.
+//
+// A single WorkerPool may be shared by any number of Connections, which may
+// be used from any number of threads.
+class WorkerPool {
+ public:
+  // threads: the number of threads to start. The thread which calls |Run|
+  //   also does work, so a pool with one thread can use two cores.
+  WorkerPool(unsigned threads);
+  // The destructor waits for the threads to exit. There must not be any calls
+  // to |Run| in progress.
+  ~WorkerPool();
+
+  // Run calls |f(arg, i)| for every |i| in [0, n), in no particular order
+  // and possibly concurrently, and returns once all the calls have completed.
+  void Run(void (*f)(void* arg, unsigned i), void* arg, unsigned n);
+
+ private:
+  WorkerPoolPrivate* const priv_;
+};
+
+}  // namespace tlsclient
+
+#endif  // TLSCLIENT_WORKER_POOL_H
@@ -7,28 +7,40 @@
 
 #include "tlsclient/public/base.h"
 
+#include <algorithm>
 #include <vector>
 
 #include <gtest/gtest_prod.h>
 
 namespace tlsclient {
 
+// Buffer is a read cursor over an array of iovecs. The lengths of all but the
+// last iovec are summed when the Buffer is constructed so that the position
+// and size queries (|TellBytes|, |size| and |remaining|) don't need to walk
+// the array. The last iovec is allowed to grow while the Buffer exists, which
+// is what happens when more data from the peer is read into the same block.
 class Buffer {
  public:
   struct Pos {
     Pos()
         : i(0),
-          offset(0) {
+          offset(0),
+          bytes(0) {
     }
 
     unsigned i;
     size_t offset;
+    // bytes is the absolute offset of this position from the beginning of the
+    // Buffer.
+    size_t bytes;
   };
 
   Buffer(const struct iovec *iov, unsigned len)
       : iov_(iov),
         len_(len),
-        delete_(false) {
+        delete_(false),
+        leading_bytes_(LeadingBytes(iov, len)),
+        inline_iov_() {
   }
 
   ~Buffer() {
@@ -39,6 +51,7 @@ class Buffer {
   void Rewind() {
     pos_.i = 0;
     pos_.offset = 0;
+    pos_.bytes = 0;
   }
 
   Pos Tell() const {
@@ -46,13 +59,7 @@ class Buffer {
   }
 
   size_t TellBytes() const {
-    size_t r = 0;
-    for (unsigned i = 0; i < pos_.i; i++) {
-      r += iov_[i].iov_len;
-    }
-    r += pos_.offset;
-
-    return r;
+    return pos_.bytes;
   }
 
   bool Seek(const Pos& pos) {
@@ -68,12 +75,46 @@ class Buffer {
     return true;
   }
 
+  // SeekBytes sets the current position to be |offset| bytes from the
+  // beginning of the Buffer. The first call builds a table of cumulative
+  // iovec offsets, after which each call takes O(log n) time in the number of
+  // iovecs.
+  bool SeekBytes(size_t offset) {
+    if (offset > size())
+      return false;
+    if (offset == size()) {
+      pos_.i = len_;
+      pos_.offset = 0;
+      pos_.bytes = offset;
+      return true;
+    }
+
+    if (offsets_.size() != len_) {
+      offsets_.resize(len_);
+      size_t total = 0;
+      for (unsigned i = 0; i < len_; i++) {
+        offsets_[i] = total;
+        total += iov_[i].iov_len;
+      }
+    }
+
+    // Find the last iovec which starts at, or before, |offset|. Empty iovecs
+    // share their starting offset with the next iovec so we take the last of
+    // any such run.
+    const unsigned i = std::upper_bound(offsets_.begin(), offsets_.end(), offset) - offsets_.begin() - 1;
+    pos_.i = i;
+    pos_.offset = offset - offsets_[i];
+    pos_.bytes = offset;
+    return true;
+  }
+
   void Advance(size_t nbytes) {
     while (nbytes && pos_.i < len_) {
       size_t n = iov_[pos_.i].iov_len - pos_.offset;
       if (n > nbytes)
         n = nbytes;
       nbytes -= n;
+      pos_.bytes += n;
 
       if (nbytes) {
         pos_.i++;
@@ -103,30 +144,54 @@ class Buffer {
         n = nbytes;
       nbytes -= n;
       pos_.offset -= n;
+      pos_.bytes -= n;
     }
   }
 
   size_t size() const {
-    size_t r = 0;
-    for (unsigned i = 0; i < len_; i++) {
-      r += iov_[i].iov_len;
-    }
-
-    return r;
+    if (!len_)
+      return 0;
+    return leading_bytes_ + iov_[len_ - 1].iov_len;
   }
 
   size_t remaining() const {
-    size_t r = 0;
+    return size() - pos_.bytes;
+  }
 
-    for (unsigned i = pos_.i; i < len_; i++) {
-      r += iov_[i].iov_len;
-    }
-    r -= pos_.offset;
+  // vectors_remaining returns the number of iovecs which contain the
+  // remaining data, including the current one.
+  unsigned vectors_remaining() const {
+    return len_ - pos_.i;
+  }
 
-    return r;
+  // Buffers are usually only copied when returned from |SubString| and
+  // |VariableLength|. The copy has to point at its own inline iovec, or its
+  // own copy of the iovec array, if the original owned either.
+  Buffer(const Buffer& other)
+      : iov_(other.iov_ == &other.inline_iov_ ? &inline_iov_ :
+             other.delete_ ? CopyIovecs(other.iov_, other.len_) : other.iov_),
+        len_(other.len_),
+        delete_(other.delete_),
+        leading_bytes_(other.leading_bytes_),
+        offsets_(other.offsets_),
+        inline_iov_(other.inline_iov_),
+        pos_(other.pos_) {
+  }
+
+  // IsContiguous returns true if the next |len| bytes are all contained in a
+  // single iovec.
+  bool IsContiguous(size_t len) const {
+    return pos_.i < len_ && iov_[pos_.i].iov_len - pos_.offset >= len;
   }
 
   Buffer SubString(size_t len) const {
+    if (!len)
+      return Buffer(SPAN, NULL, 0);
+    // In the common case, the input is a single iovec and we can avoid
+    // allocating.
+    if (IsContiguous(len))
+      return Buffer(SPAN, static_cast<uint8_t*>(iov_[pos_.i].iov_base) + pos_.offset, len);
+
     std::vector<struct iovec> iovs;
     PeekV(&iovs, len);
     struct iovec *iovs_copy = new struct iovec[iovs.size()];
@@ -140,6 +205,12 @@ class Buffer {
     if (!len)
       return true;
 
+    if (IsContiguous(len)) {
+      const struct iovec iov = {static_cast<uint8_t*>(iov_[pos_.i].iov_base) + pos_.offset, len};
+      out->push_back(iov);
+      return true;
+    }
+
     while (len && pos.i < len_) {
       size_t n = iov_[pos.i].iov_len - pos.offset;
       if (n > len)
@@ -181,6 +252,20 @@ class Buffer {
   }
 
   bool Read(void* out, size_t len) {
+    // A zero length read may come from an empty |SubString|, whose base is
+    // NULL, and so must not reach memcpy.
+    if (!len)
+      return true;
+
+    // If the data doesn't reach the end of the current iovec then we don't
+    // need to worry about moving to the next one.
+    if (pos_.i < len_ && iov_[pos_.i].iov_len - pos_.offset > len) {
+      memcpy(out, static_cast<uint8_t*>(iov_[pos_.i].iov_base) + pos_.offset, len);
+      pos_.offset += len;
+      pos_.bytes += len;
+      return true;
+    }
+
     uint8_t* o = static_cast<uint8_t*>(out);
     Pos pos(pos_);
 
@@ -188,7 +273,9 @@ class Buffer {
       size_t bytes_to_copy = iov_[pos.i].iov_len - pos.offset;
       if (bytes_to_copy > len)
         bytes_to_copy = len;
-      memcpy(o, static_cast<uint8_t*>(iov_[pos.i].iov_base) + pos.offset, bytes_to_copy);
+      // Empty iovecs may have a NULL base.
+      if (bytes_to_copy)
+        memcpy(o, static_cast<uint8_t*>(iov_[pos.i].iov_base) + pos.offset, bytes_to_copy);
       o += bytes_to_copy;
       len -= bytes_to_copy;
 
@@ -206,6 +293,7 @@ class Buffer {
     }
 
     if (len == 0) {
+      pos.bytes += o - static_cast<uint8_t*>(out);
       pos_ = pos;
       return true;
     }
@@ -214,6 +302,9 @@ class Buffer {
   }
 
   bool Write(void* in, size_t len) {
+    if (!len)
+      return true;
+
     uint8_t* i = static_cast<uint8_t*>(in);
     Pos pos(pos_);
 
@@ -223,7 +314,8 @@ class Buffer {
       size_t bytes_to_write = iov_[pos.i].iov_len - pos.offset;
       if (bytes_to_write > len)
         bytes_to_write = len;
-      memcpy(static_cast<uint8_t*>(iov_[pos.i].iov_base) + pos.offset, i, bytes_to_write);
+      if (bytes_to_write)
+        memcpy(static_cast<uint8_t*>(iov_[pos.i].iov_base) + pos.offset, i, bytes_to_write);
       i += bytes_to_write;
       len -= bytes_to_write;
 
@@ -241,6 +333,7 @@ class Buffer {
     }
 
     if (len == 0) {
+      pos.bytes += i - static_cast<uint8_t*>(in);
       pos_ = pos;
       return true;
     }
@@ -261,6 +354,7 @@ class Buffer {
 
     uint8_t* const ret = static_cast<uint8_t*>(iov_[pos_.i].iov_base) + pos_.offset;
     pos_.offset += len;
+    pos_.bytes += len;
     if (pos_.offset == iov_[pos_.i].iov_len) {
       pos_.i++;
       pos_.offset = 0;
@@ -310,13 +404,10 @@ class Buffer {
 
     if (remaining() < len)
       return Buffer();
-    std::vector<struct iovec> iovs;
-    PeekV(&iovs, len);
+    Buffer ret(SubString(len));
     Advance(len);
     *ok = true;
-    struct iovec *iovs_copy = new struct iovec[iovs.size()];
-    memcpy(iovs_copy, &iovs[0], sizeof(struct iovec) * iovs.size());
-    return Buffer(iovs_copy, iovs.size(), true);
+    return ret;
   }
 
   const struct iovec* iovec() const {
@@ -341,22 +432,84 @@ class Buffer {
     }
   }
 
+  // RemoveLeadingBytes is the counterpart of |RemoveTrailingBytes|. Elements
+  // which are entirely removed are dropped from the front of |iov|.
+  static void RemoveLeadingBytes(struct iovec* iov, unsigned* iov_len, size_t bytes_to_remove) {
+    unsigned dropped = 0;
+    while (bytes_to_remove > 0 && dropped < *iov_len) {
+      struct iovec* first = &iov[dropped];
+      if (first->iov_len > bytes_to_remove) {
+        first->iov_base = static_cast<uint8_t*>(first->iov_base) + bytes_to_remove;
+        first->iov_len -= bytes_to_remove;
+        break;
+      }
+      bytes_to_remove -= first->iov_len;
+      dropped++;
+    }
+
+    if (dropped) {
+      memmove(iov, iov + dropped, (*iov_len - dropped) * sizeof(struct iovec));
+      *iov_len -= dropped;
+    }
+  }
+
  private:
   Buffer()
       : iov_(NULL),
         len_(0),
-        delete_(false) {
+        delete_(false),
+        leading_bytes_(0),
+        inline_iov_() {
   }
 
   Buffer(const struct iovec *iov, unsigned len, bool del)
       : iov_(iov),
         len_(len),
-        delete_(del) {
+        delete_(del),
+        leading_bytes_(LeadingBytes(iov, len)),
+        inline_iov_() {
+  }
+
+  enum SpanTag {
+    SPAN,
+  };
+
+  // This constructs a Buffer which contains a single, contiguous span of data.
+  Buffer(SpanTag, uint8_t* data, size_t len)
+      : iov_(&inline_iov_),
+        len_(1),
+        delete_(false),
+        leading_bytes_(0),
+        inline_iov_() {
+    inline_iov_.iov_base = data;
+    inline_iov_.iov_len = len;
+  }
+
+  static struct iovec* CopyIovecs(const struct iovec* iov, unsigned len) {
+    struct iovec* ret = new struct iovec[len];
+    memcpy(ret, iov, sizeof(struct iovec) * len);
+    return ret;
+  }
+
+  // LeadingBytes returns the number of bytes in all but the last element of
+  // |iov|.
+  static size_t LeadingBytes(const struct iovec* iov, unsigned len) {
+    size_t r = 0;
+    for (unsigned i = 0; i + 1 < len; i++)
+      r += iov[i].iov_len;
+    return r;
   }
 
   const struct iovec *const iov_;
   const unsigned len_;
   const bool delete_;
+  const size_t leading_bytes_;
+  // offsets_ is built on demand by |SeekBytes| and contains the offset of the
+  // start of each iovec.
+  std::vector<size_t> offsets_;
+  // inline_iov_ is used when the Buffer covers a single span of memory, which
+  // saves allocating an array of iovecs.
+  struct iovec inline_iov_;
 
   Pos pos_;
 };
@@ -0,0 +1,57 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tlsclient/public/certificate_chain.h"
+
+namespace tlsclient {
+
+CertificateChain::CertificateChain()
+    : ref_count_(1),
+      size_(0),
+      certs_(NULL),
+      wire_(NULL),
+      wire_length_(0) {
+}
+
+CertificateChain::~CertificateChain() {
+  delete[] certs_;
+  delete[] wire_;
+}
+
+CertificateChain* CertificateChain::Create(const struct iovec* certs, unsigned len) {
+  CertificateChain* const chain = new CertificateChain;
+
+  for (unsigned i = 0; i < len; i++)
+    chain->wire_length_ += 3 + certs[i].iov_len;
+
+  chain->size_ = len;
+  chain->certs_ = new struct iovec[len];
+  chain->wire_ = new uint8_t[chain->wire_length_];
+
+  uint8_t* p = chain->wire_;
+  for (unsigned i = 0; i < len; i++) {
+    const size_t cert_len = certs[i].iov_len;
+    p[0] = cert_len >> 16;
+    p[1] = cert_len >> 8;
+    p[2] = cert_len;
+    p += 3;
+    memcpy(p, certs[i].iov_base, cert_len);
+    chain->certs_[i].iov_base = p;
+    chain->certs_[i].iov_len = cert_len;
+    p += cert_len;
+  }
+
+  return chain;
+}
+
+void CertificateChain::AddRef() {
+  __sync_fetch_and_add(&ref_count_, 1);
+}
+
+void CertificateChain::DecRef() {
+  if (__sync_sub_and_fetch(&ref_count_, 1) == 0)
+    delete this;
+}
+
+}  // namespace tlsclient
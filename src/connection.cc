@@ -4,8 +4,11 @@
 
 #include "tlsclient/public/connection.h"
 
+#include "tlsclient/public/certificate_chain.h"
 #include "tlsclient/public/context.h"
 #include "tlsclient/public/error.h"
+#include "tlsclient/public/verification_cache.h"
+#include "tlsclient/public/worker_pool.h"
 #include "tlsclient/src/buffer.h"
 #include "tlsclient/src/connection_private.h"
 #include "tlsclient/src/crypto/cipher_suites.h"
@@ -14,7 +17,15 @@
 #include "tlsclient/src/handshake.h"
 #include "tlsclient/src/sink.h"
 
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #if 0
 #include <stdio.h>
@@ -32,35 +43,57 @@ static void hexdump(const void* data, size_t length) {
 
 namespace tlsclient {
 
-ConnectionPrivate::~ConnectionPrivate() {
+HandshakeData::~HandshakeData() {
   delete server_cert;
   memset(master_secret, 0, sizeof(master_secret));
+  memset(premaster_secret, 0, sizeof(premaster_secret));
   delete handshake_hash;
 
-  if (read_cipher_spec)
-    read_cipher_spec->DecRef();
-  if (write_cipher_spec)
-    write_cipher_spec->DecRef();
   if (pending_read_cipher_spec)
     pending_read_cipher_spec->DecRef();
   if (pending_write_cipher_spec)
     pending_write_cipher_spec->DecRef();
+  if (predicted_chain)
+    predicted_chain->DecRef();
+}
+
+ConnectionPrivate::~ConnectionPrivate() {
+  delete handshake;
+
+  if (reader.cipher_spec)
+    reader.cipher_spec->DecRef();
+  if (writer.cipher_spec)
+    writer.cipher_spec->DecRef();
+}
+
+// NewConnectionPrivate allocates a ConnectionPrivate. It's aligned to cache
+// lines, which operator new doesn't promise, so posix_memalign is used.
+static ConnectionPrivate* NewConnectionPrivate(Context* ctx) {
+  void* mem;
+  if (posix_memalign(&mem, kCacheLineSize, sizeof(ConnectionPrivate)))
+    abort();
+  return new(mem) ConnectionPrivate(ctx);
 }
 
 Connection::Connection(Context* ctx)
-    : priv_(new ConnectionPrivate(ctx)) {
+    : priv_(NewConnectionPrivate(ctx)) {
 }
 
 Connection::~Connection() {
-  delete priv_;
+  priv_->~ConnectionPrivate();
+  free(priv_);
 }
 
 void Connection::set_sslv3(bool use_sslv3) {
-  priv_->sslv3 = use_sslv3;
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->sslv3 = use_sslv3;
 }
 
 void Connection::set_host_name(const char* name) {
-  priv_->host_name = name;
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->host_name = name;
 }
 
 static bool IsSendState(HandshakeState state) {
@@ -97,8 +130,18 @@ bool Connection::need_to_write() const {
   return IsSendState(priv_->state);
 }
 
+size_t Connection::bytes_needed() const {
+  return priv_->reader.bytes_needed;
+}
+
 bool Connection::is_server_cert_available() const {
-  return false;
+  if (!priv_->handshake)
+    return false;
+  if (priv_->handshake->received_certificates)
+    return true;
+  // An accepted snap start without resumption means that the server's
+  // certificates were the predicted ones.
+  return priv_->did_snap_start && !priv_->did_resume && priv_->handshake->predicted_chain;
 }
 
 bool Connection::is_server_verified() const {
@@ -110,58 +153,303 @@ bool Connection::is_ready_to_send_application_data() const {
 }
 
 Result Connection::server_certificates(const struct iovec** out_iovs, unsigned* out_len) {
-  if (priv_->server_certificates.size() == 0 && priv_->predicted_certificates.size()) {
-    *out_iovs = &priv_->predicted_certificates[0];
-    *out_len = priv_->server_certificates.size();
+  if (!priv_->handshake)
+    return ERROR_RESULT(ERR_HANDSHAKE_STATE_FREED);
+
+  if (!priv_->handshake->received_certificates && priv_->handshake->predicted_chain) {
+    *out_iovs = priv_->handshake->predicted_chain->certificates();
+    *out_len = priv_->handshake->predicted_chain->size();
     return 0;
   }
 
-  *out_iovs = &priv_->server_certificates[0];
-  *out_len = priv_->server_certificates.size();
+  // Depending on the retention policy, this may be empty.
+  *out_len = priv_->handshake->server_certificates.size();
+  *out_iovs = *out_len ? &priv_->handshake->server_certificates[0] : NULL;
   return 0;
 }
 
+void Connection::set_certificate_retention(CertificateRetention retention) {
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->certificate_retention = retention;
+}
+
+void Connection::set_certificates_callback(CertificatesCallback callback, void* arg) {
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->certificates_callback = callback;
+  priv_->handshake->certificates_callback_arg = arg;
+}
+
+void Connection::set_certificate_fingerprints(bool enabled) {
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->fingerprint_certificates = enabled;
+}
+
+// GetFingerprints checks that the fingerprints of the server's certificates
+// are available. If they weren't computed as the certificates arrived then
+// they're computed now from the whole chain, if it was retained, or, after a
+// snap start, from the predicted chain, which is what the server used.
+static Result GetFingerprints(ConnectionPrivate* priv) {
+  HandshakeData* const handshake = priv->handshake;
+  if (!handshake)
+    return ERROR_RESULT(ERR_HANDSHAKE_STATE_FREED);
+  if (!handshake->fingerprint_certificates)
+    return ERROR_RESULT(ERR_NO_CERTIFICATE_FINGERPRINTS);
+  if (handshake->have_fingerprints)
+    return 0;
+
+  const struct iovec* certs;
+  size_t n;
+  if (handshake->received_certificates) {
+    if (handshake->server_certificates.size() != handshake->num_server_certificates)
+      return ERROR_RESULT(ERR_NO_CERTIFICATE_FINGERPRINTS);
+    certs = handshake->server_certificates.empty() ? NULL : &handshake->server_certificates[0];
+    n = handshake->server_certificates.size();
+  } else if (priv->did_snap_start && !priv->did_resume && handshake->predicted_chain) {
+    certs = handshake->predicted_chain->certificates();
+    n = handshake->predicted_chain->size();
+  } else {
+    return ERROR_RESULT(ERR_NO_CERTIFICATE_FINGERPRINTS);
+  }
+
+  handshake->certificate_fingerprints.clear();
+  FingerprintCertificates(priv, certs, n);
+  FingerprintChain(priv);
+  return 0;
+}
+
+Result Connection::server_certificate_fingerprints(const Fingerprint** out_fingerprints, unsigned* out_len, Fingerprint* out_chain) {
+  const Result r = GetFingerprints(priv_);
+  if (r)
+    return r;
+
+  *out_len = priv_->handshake->certificate_fingerprints.size();
+  *out_fingerprints = *out_len ? &priv_->handshake->certificate_fingerprints[0] : NULL;
+  *out_chain = priv_->handshake->chain_fingerprint;
+  return 0;
+}
+
+void Connection::set_verification_cache(VerificationCache* cache) {
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->verification_cache = cache;
+  if (cache)
+    priv_->handshake->fingerprint_certificates = true;
+}
+
+Result Connection::GetCachedVerificationResult(bool* found, int* result) {
+  *found = false;
+  const Result r = GetFingerprints(priv_);
+  if (r)
+    return r;
+
+  if (priv_->handshake->verification_cache)
+    *found = priv_->handshake->verification_cache->Lookup(priv_->handshake->host_name.c_str(), priv_->handshake->chain_fingerprint, priv_->ctx->EpochSeconds(), result);
+  return 0;
+}
+
+Result Connection::CacheVerificationResult(int result, uint32_t ttl_seconds) {
+  const Result r = GetFingerprints(priv_);
+  if (r)
+    return r;
+
+  if (priv_->handshake->verification_cache)
+    priv_->handshake->verification_cache->Store(priv_->handshake->host_name.c_str(), priv_->handshake->chain_fingerprint, result, priv_->ctx->EpochSeconds(), ttl_seconds);
+  return 0;
+}
+
+void Connection::set_worker_pool(WorkerPool* pool) {
+  priv_->worker_pool = pool;
+}
+
+void Connection::set_record_sizing(size_t ramp_bytes, unsigned idle_seconds) {
+  priv_->writer.record_sizing_ramp_bytes = ramp_bytes;
+  priv_->writer.record_sizing_idle_seconds = idle_seconds;
+  priv_->writer.record_sizing_bytes_sent = 0;
+  priv_->writer.record_sizing_last_write = 0;
+}
+
 const char* Connection::cipher_suite_name() const {
   if (!priv_->cipher_suite)
     return NULL;
   return priv_->cipher_suite->name;
 }
 
-Result EncryptApplicationData(struct iovec* start, struct iovec* end, const struct iovec* iov, unsigned iov_len, size_t len, ConnectionPrivate* priv) {
-  // We need an extra element at the end of the array so we have to make a
-  // copy.
-  priv->out_vectors.resize(iov_len + 1);
-  memcpy(&priv->out_vectors[0], iov, iov_len * sizeof(struct iovec));
+// kMaxRecordPayload is the maximum number of bytes of application data that
+// we'll put in a single record. See RFC 2246, section 6.2.1.
+static const size_t kMaxRecordPayload = 16384;
 
-  uint8_t* const header = priv->scratch;
-  header[0] = RECORD_APPLICATION_DATA;
-  uint16_t wire_version = static_cast<uint16_t>(priv->version);
+// ApplicationDataWireVersion returns the version to put in the header of
+// application data records.
+static uint16_t ApplicationDataWireVersion(ConnectionPrivate* priv) {
   if (priv->snap_start_attempt)
-    wire_version = static_cast<uint16_t>(priv->predicted_server_version);
+    return static_cast<uint16_t>(priv->predicted_server_version);
+  return static_cast<uint16_t>(priv->version);
+}
+
+// WriteApplicationDataHeader writes a five byte record header for |len| bytes
+// of application data into |header|.
+static void WriteApplicationDataHeader(uint8_t* header, size_t len, ConnectionPrivate* priv) {
+  header[0] = RECORD_APPLICATION_DATA;
+  const uint16_t wire_version = ApplicationDataWireVersion(priv);
   header[1] = wire_version >> 8;
   header[2] = wire_version;
   header[3] = len >> 8;
   header[4] = len;
+}
+
+// kSmallRecordBytes is the size, including the header and trailer, of the
+// records used at the start of a connection when dynamic record sizing is
+// enabled. It's chosen so that a record fits in a single TCP segment.
+static const size_t kSmallRecordBytes = 1400;
+
+// StartWrite is called at the beginning of each write which is split into
+// records by |RecordSizer|. If the connection has been idle then it goes back
+// to small records.
+static void StartWrite(ConnectionPrivate* priv) {
+  if (!priv->writer.record_sizing_ramp_bytes)
+    return;
+
+  const uint64_t now = priv->ctx->EpochSeconds();
+  if (now >= priv->writer.record_sizing_last_write + priv->writer.record_sizing_idle_seconds)
+    priv->writer.record_sizing_bytes_sent = 0;
+  priv->writer.record_sizing_last_write = now;
+}
+
+// RecordSizer splits a write into records according to the Connection's
+// record sizing policy. See |Connection::set_record_sizing|. It doesn't
+// update the Connection so a write can be sized more than once. Once the
+// records have been sent, call |Commit|.
+class RecordSizer {
+ public:
+  RecordSizer(const ConnectionPrivate* priv, CipherSpec* spec)
+      : spec_(spec),
+        ramp_bytes_(priv->writer.record_sizing_ramp_bytes),
+        bytes_sent_(priv->writer.record_sizing_bytes_sent),
+        small_payload_(0) {
+    if (!ramp_bytes_ || bytes_sent_ >= ramp_bytes_)
+      return;
+    // The trailer can depend on the payload length so the largest payload
+    // which fits is found by searching down from an upper bound.
+    const size_t space = kSmallRecordBytes - 5 - spec->PrefixBytes();
+    small_payload_ = space;
+    while (small_payload_ > 1 && small_payload_ + spec->ScratchBytesNeeded(small_payload_) > space)
+      small_payload_--;
+  }
+
+  // Next returns the payload length of the next record, given that
+  // |remaining| bytes are still to be sent.
+  size_t Next(size_t remaining) {
+    size_t n = kMaxRecordPayload;
+    if (ramp_bytes_ && bytes_sent_ < ramp_bytes_)
+      n = small_payload_;
+    if (n > remaining)
+      n = remaining;
+    bytes_sent_ += n;
+    return n;
+  }
+
+  // RecordLength returns the length on the wire of a record with |n| bytes of
+  // payload.
+  size_t RecordLength(size_t n) const {
+    return 5 + spec_->PrefixBytes() + n + spec_->ScratchBytesNeeded(n);
+  }
+
+  // EncryptedLength returns the number of bytes of records needed to carry
+  // |len| bytes of application data.
+  size_t EncryptedLength(size_t len) {
+    size_t total = 0;
+    while (len) {
+      const size_t n = Next(len);
+      total += RecordLength(n);
+      len -= n;
+    }
+    return total;
+  }
+
+  void Commit(ConnectionPrivate* priv) const {
+    if (ramp_bytes_)
+      priv->writer.record_sizing_bytes_sent = bytes_sent_;
+  }
 
-  size_t scratch_size = sizeof(priv->scratch) - 5;
-  if (!priv->write_cipher_spec)
+ private:
+  CipherSpec* const spec_;
+  const size_t ramp_bytes_;
+  uint64_t bytes_sent_;
+  size_t small_payload_;
+};
+
+// PrepareApplicationDataRecord sets up |record| to encrypt |len| bytes of
+// application data from |iov| as a single record. The header, prefix and
+// trailer are written into the |space| bytes at |header|. The encryption
+// needs an extra element at the end of the input vectors, so they're copied
+// to |in|, which must have space for |iov_len| + 1 of them.
+static Result PrepareApplicationDataRecord(RecordToEncrypt* record, uint8_t* header, size_t space, struct iovec* in, const struct iovec* iov, unsigned iov_len, size_t len, ConnectionPrivate* priv) {
+  CipherSpec* const spec = priv->writer.cipher_spec;
+  if (!spec)
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
-  if (!priv->write_cipher_spec->Encrypt(priv->scratch + 5, &scratch_size, header, &priv->out_vectors[0], iov_len, priv->write_seq_num))
+
+  memcpy(in, iov, iov_len * sizeof(struct iovec));
+
+  WriteApplicationDataHeader(header, len, priv);
+
+  // Any prefix is transmitted along with the header.
+  const unsigned prefix = spec->PrefixBytes();
+  record->spec = spec;
+  record->prefix = header + 5;
+  record->scratch = header + 5 + prefix;
+  record->scratch_size = space - 5 - prefix;
+  record->record_header = header;
+  record->in = in;
+  record->in_len = iov_len;
+  record->seq_num = priv->writer.seq_num++;
+  record->ok = false;
+
+  return 0;
+}
+
+// FinishApplicationDataRecord completes the header of |record|, which carries
+// |len| bytes of application data and has been encrypted, and sets |start|
+// and |end| as described for |Connection::Encrypt|.
+static Result FinishApplicationDataRecord(struct iovec* start, struct iovec* end, const RecordToEncrypt& record, size_t len) {
+  if (!record.ok)
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
-  priv->write_seq_num++;
 
-  len += scratch_size;
+  // The header immediately precedes the prefix.
+  uint8_t* const header = record.prefix - 5;
+  const unsigned prefix = record.spec->PrefixBytes();
+  len += prefix + record.scratch_size;
   header[3] = len >> 8;
   header[4] = len;
 
   start->iov_base = header;
-  start->iov_len = 5;
-  end->iov_base = priv->scratch + 5;
-  end->iov_len = scratch_size;
+  start->iov_len = 5 + prefix;
+  end->iov_base = record.scratch;
+  end->iov_len = record.scratch_size;
 
   return 0;
 }
 
+// EncryptRecordWithScratch is the same as |EncryptApplicationData| except
+// that the header and trailer are written into the |space| bytes at
+// |scratch|.
+static Result EncryptRecordWithScratch(struct iovec* start, struct iovec* end, uint8_t* scratch, size_t space, const struct iovec* iov, unsigned iov_len, size_t len, ConnectionPrivate* priv) {
+  RecordToEncrypt record;
+  Result r;
+
+  priv->writer.in_vectors.resize(iov_len + 1);
+  if ((r = PrepareApplicationDataRecord(&record, scratch, space, &priv->writer.in_vectors[0], iov, iov_len, len, priv)))
+    return r;
+  record.ok = record.spec->Encrypt(record.prefix, record.scratch, &record.scratch_size, record.record_header, record.in, record.in_len, record.seq_num);
+  return FinishApplicationDataRecord(start, end, record, len);
+}
+
+Result EncryptApplicationData(struct iovec* start, struct iovec* end, const struct iovec* iov, unsigned iov_len, size_t len, ConnectionPrivate* priv) {
+  return EncryptRecordWithScratch(start, end, priv->writer.scratch, sizeof(priv->writer.scratch), iov, iov_len, len, priv);
+}
+
 Result Connection::Encrypt(struct iovec* start, struct iovec* end, const struct iovec* iov, unsigned iov_len) {
   if (!is_ready_to_send_application_data())
     return ERROR_RESULT(ERR_NOT_READY_TO_SEND_APPLICATION_DATA);
@@ -169,25 +457,497 @@ Result Connection::Encrypt(struct iovec* start, struct iovec* end, const struct
   Buffer buf(iov, iov_len);
   size_t len = buf.size();
 
-  if (len > 16384)
+  if (len > kMaxRecordPayload)
     return ERROR_RESULT(ERR_ENCRYPT_RECORD_TOO_LONG);
 
   return EncryptApplicationData(start, end, iov, iov_len, len, priv_);
 }
 
+Result Connection::EncryptOwned(struct iovec* start, struct iovec* end, const struct iovec* iov, unsigned iov_len) {
+  if (!is_ready_to_send_application_data())
+    return ERROR_RESULT(ERR_NOT_READY_TO_SEND_APPLICATION_DATA);
+
+  Buffer buf(iov, iov_len);
+  size_t len = buf.size();
+
+  if (len > kMaxRecordPayload)
+    return ERROR_RESULT(ERR_ENCRYPT_RECORD_TOO_LONG);
+
+  const size_t space = sizeof(priv_->writer.scratch);
+  uint8_t* const scratch = static_cast<uint8_t*>(priv_->arena.Allocate(space));
+  const Result r = EncryptRecordWithScratch(start, end, scratch, space, iov, iov_len, len, priv_);
+  if (r)
+    priv_->arena.Free(scratch);
+  return r;
+}
+
+// kEncryptBatchChunk is the number of requests which |EncryptBatch| handles
+// at a time.
+static const unsigned kEncryptBatchChunk = 32;
+
+void Connection::EncryptBatch(EncryptRequest* requests, unsigned n) {
+  RecordToEncrypt records[kEncryptBatchChunk];
+  EncryptRequest* owners[kEncryptBatchChunk];
+  size_t lengths[kEncryptBatchChunk];
+  std::vector<struct iovec> in_vectors;
+
+  // Each record needs its own header and trailer space, which stays valid
+  // once we return, even when a Connection appears more than once. Its first
+  // record uses |scratch|, as |Encrypt| would, and the rest use
+  // |batch_scratch|, which is sized now so that it doesn't move later.
+  for (unsigned i = 0; i < n; i++)
+    requests[i].conn->priv_->writer.batch_records = 0;
+  for (unsigned i = 0; i < n; i++) {
+    RecordWriter* const writer = &requests[i].conn->priv_->writer;
+    const size_t needed = writer->batch_records++ * sizeof(writer->scratch);
+    if (writer->batch_scratch.size() < needed)
+      writer->batch_scratch.resize(needed);
+  }
+  for (unsigned i = 0; i < n; i++)
+    requests[i].conn->priv_->writer.batch_records = 0;
+
+  while (n) {
+    const unsigned chunk = std::min(n, kEncryptBatchChunk);
+    unsigned num_records = 0;
+
+    size_t num_in_vectors = 0;
+    for (unsigned i = 0; i < chunk; i++)
+      num_in_vectors += requests[i].iov_len + 1;
+    in_vectors.resize(num_in_vectors);
+    struct iovec* in = &in_vectors[0];
+
+    for (unsigned i = 0; i < chunk; i++) {
+      EncryptRequest* const request = &requests[i];
+      Connection* const conn = request->conn;
+
+      if (!conn->is_ready_to_send_application_data()) {
+        request->result = ERROR_RESULT(ERR_NOT_READY_TO_SEND_APPLICATION_DATA);
+        continue;
+      }
+      Buffer buf(request->iov, request->iov_len);
+      const size_t len = buf.size();
+      if (len > kMaxRecordPayload) {
+        request->result = ERROR_RESULT(ERR_ENCRYPT_RECORD_TOO_LONG);
+        continue;
+      }
+      ConnectionPrivate* const priv = conn->priv_;
+      RecordWriter* const writer = &priv->writer;
+      const unsigned slot = writer->batch_records++;
+      uint8_t* const scratch = slot ? &writer->batch_scratch[(slot - 1) * sizeof(writer->scratch)] : writer->scratch;
+      request->result = PrepareApplicationDataRecord(&records[num_records], scratch, sizeof(writer->scratch), in, request->iov, request->iov_len, len, priv);
+      if (request->result)
+        continue;
+      in += request->iov_len + 1;
+      owners[num_records] = request;
+      lengths[num_records] = len;
+      num_records++;
+    }
+
+    EncryptRecords(records, num_records);
+
+    for (unsigned i = 0; i < num_records; i++) {
+      EncryptRequest* const request = owners[i];
+      request->result = FinishApplicationDataRecord(&request->start, &request->end, records[i], lengths[i]);
+    }
+
+    requests += chunk;
+    n -= chunk;
+  }
+}
+
+// EncryptRecordJob encrypts the |i|th record of the batch at |arg|.
+static void EncryptRecordJob(void* arg, unsigned i) {
+  RecordBatch* const batch = static_cast<RecordBatch*>(arg);
+  RecordJob* const job = &batch->jobs[i];
+  struct iovec* const in = &batch->vectors[job->iov_offset];
+  size_t len = 0;
+  for (unsigned j = 0; j < job->iov_len; j++)
+    len += in[j].iov_len;
+
+  size_t scratch_size = batch->spec->ScratchBytesNeeded(len);
+  job->ok = batch->spec->Encrypt(job->header + 5, job->trailer, &scratch_size, job->header, in, job->iov_len, job->seq_num);
+  len += batch->spec->PrefixBytes() + scratch_size;
+  job->header[3] = len >> 8;
+  job->header[4] = len;
+}
+
+void RunRecordJobs(ConnectionPrivate* priv, CipherSpec* spec, void (*f)(void* arg, unsigned i), void* arg, unsigned n) {
+  if (priv->worker_pool && n > 1 && spec && spec->SupportsParallelRecords()) {
+    priv->worker_pool->Run(f, arg, n);
+    return;
+  }
+
+  for (unsigned i = 0; i < n; i++)
+    f(arg, i);
+}
+
+// EncryptionFailed is called when a record fails to encrypt. Nothing that
+// was being encrypted is sent, so the sequence number stays where it was.
+// But a cipher which carries state from record to record has been advanced
+// by the records before the failed one and can't be used again.
+static Result EncryptionFailed(ConnectionPrivate* priv, CipherSpec* spec) {
+  if (!spec->SupportsParallelRecords())
+    priv->can_send_application_data = false;
+  return ERROR_RESULT(ERR_INTERNAL_ERROR);
+}
+
+Result Connection::EncryptV(const struct iovec** out, unsigned* out_n, const struct iovec* iov, unsigned iov_len) {
+  *out = NULL;
+  *out_n = 0;
+
+  if (!is_ready_to_send_application_data())
+    return ERROR_RESULT(ERR_NOT_READY_TO_SEND_APPLICATION_DATA);
+  CipherSpec* const spec = priv_->writer.cipher_spec;
+  if (!spec)
+    return ERROR_RESULT(ERR_INTERNAL_ERROR);
+
+  Buffer buf(iov, iov_len);
+  const size_t len = buf.size();
+  if (!len)
+    return 0;
+  StartWrite(priv_);
+
+  // Every record gets its own header, prefix and trailer (MAC and padding) so
+  // that they can all be transmitted at once. The space for them is
+  // allocated up front so that the returned vectors can point into it.
+  const unsigned prefix = spec->PrefixBytes();
+  size_t records = 0;
+  size_t scratch_needed = 0;
+  RecordSizer counter(priv_, spec);
+  for (size_t remaining = len; remaining; records++) {
+    const size_t n = counter.Next(remaining);
+    scratch_needed += counter.RecordLength(n) - n;
+    remaining -= n;
+  }
+  if (priv_->writer.record_scratch_size < scratch_needed) {
+    if (priv_->writer.record_scratch)
+      priv_->arena.Free(priv_->writer.record_scratch);
+    priv_->writer.record_scratch = static_cast<uint8_t*>(priv_->arena.Allocate(scratch_needed));
+    priv_->writer.record_scratch_size = scratch_needed;
+  }
+
+  // Each record needs a header, a trailer and the input vectors which it
+  // covers. Since a record boundary can split an input vector, there can be
+  // up to |records - 1| more of those than there are input vectors.
+  std::vector<struct iovec>& vectors = priv_->writer.encrypt_vectors;
+  vectors.clear();
+  vectors.reserve(iov_len + 3 * records);
+  std::vector<RecordJob>& jobs = priv_->writer.jobs;
+  jobs.resize(records);
+
+  // First the records are laid out and given their sequence numbers. Then
+  // they're encrypted, possibly in parallel.
+  RecordSizer sizer(priv_, spec);
+  uint8_t* scratch = priv_->writer.record_scratch;
+  uint64_t seq_num = priv_->writer.seq_num;
+  for (size_t i = 0; i < records; i++) {
+    const size_t n = sizer.Next(buf.remaining());
+    RecordJob* const job = &jobs[i];
+    job->header = scratch;
+    job->trailer = scratch + 5 + prefix;
+    WriteApplicationDataHeader(job->header, n, priv_);
+    scratch = job->trailer + spec->ScratchBytesNeeded(n);
+
+    const struct iovec header_iov = {job->header, 5 + prefix};
+    vectors.push_back(header_iov);
+    job->iov_offset = vectors.size();
+    buf.PeekV(&vectors, n);
+    buf.Advance(n);
+    job->iov_len = vectors.size() - job->iov_offset;
+    // CipherSpec::Encrypt fills in this extra element with the trailer.
+    vectors.resize(vectors.size() + 1);
+    job->seq_num = seq_num++;
+  }
+
+  RecordBatch batch = {spec, &vectors[0], &jobs[0]};
+  RunRecordJobs(priv_, spec, EncryptRecordJob, &batch, records);
+  for (size_t i = 0; i < records; i++) {
+    if (!jobs[i].ok)
+      return EncryptionFailed(priv_, spec);
+  }
+  // Only now that every record has been encrypted are their sequence
+  // numbers consumed.
+  priv_->writer.seq_num = seq_num;
+  sizer.Commit(priv_);
+
+  *out = &vectors[0];
+  *out_n = vectors.size();
+  return 0;
+}
+
+Result Connection::EncryptTo(uint8_t* out, size_t* out_len, const struct iovec* iov, unsigned iov_len) {
+  const size_t space = *out_len;
+  *out_len = 0;
+
+  if (!is_ready_to_send_application_data())
+    return ERROR_RESULT(ERR_NOT_READY_TO_SEND_APPLICATION_DATA);
+  CipherSpec* const spec = priv_->writer.cipher_spec;
+  if (!spec)
+    return ERROR_RESULT(ERR_INTERNAL_ERROR);
+
+  Buffer buf(iov, iov_len);
+  const size_t len = buf.size();
+  if (!len)
+    return 0;
+  StartWrite(priv_);
+
+  const size_t needed = RecordSizer(priv_, spec).EncryptedLength(len);
+  if (space < needed) {
+    *out_len = needed;
+    return ERROR_RESULT(ERR_OUTPUT_BUFFER_TOO_SMALL);
+  }
+
+  // Each record is built by |CipherSpec::Seal|, which needs its data to be
+  // contiguous. Data which spans input vectors is first gathered into the
+  // place where the record's payload will be and then encrypted in place.
+  const unsigned prefix = spec->PrefixBytes();
+  const uint16_t wire_version = ApplicationDataWireVersion(priv_);
+  RecordSizer sizer(priv_, spec);
+  uint64_t seq_num = priv_->writer.seq_num;
+  size_t total = 0;
+  while (buf.remaining()) {
+    const size_t n = sizer.Next(buf.remaining());
+    uint8_t* const data = out + 5 + prefix;
+    const uint8_t* const in = buf.Get(data, n);
+
+    size_t written;
+    if (!spec->Seal(out, &written, RECORD_APPLICATION_DATA, wire_version, in, n, seq_num++))
+      return EncryptionFailed(priv_, spec);
+
+    out += written;
+    total += written;
+  }
+  // As with |EncryptV|, the sequence numbers are only consumed once every
+  // record has been sealed.
+  priv_->writer.seq_num = seq_num;
+  sizer.Commit(priv_);
+  *out_len = total;
+
+  return 0;
+}
+
+// PreadFully reads exactly |len| bytes from |fd| at |offset| into |out|.
+static bool PreadFully(uint8_t* out, int fd, uint64_t offset, size_t len) {
+  while (len) {
+    const ssize_t n = pread(fd, out, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    out += n;
+    offset += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+Result Connection::EncryptFromFile(uint8_t* out, size_t* out_len, int fd, uint64_t offset, size_t len) {
+  const size_t space = *out_len;
+  *out_len = 0;
+
+  if (!is_ready_to_send_application_data())
+    return ERROR_RESULT(ERR_NOT_READY_TO_SEND_APPLICATION_DATA);
+  CipherSpec* const spec = priv_->writer.cipher_spec;
+  if (!spec)
+    return ERROR_RESULT(ERR_INTERNAL_ERROR);
+
+  if (!len)
+    return 0;
+  StartWrite(priv_);
+
+  // The records are sized once and those sizes are used both to read the
+  // file and to encrypt it.
+  RecordSizer sizer(priv_, spec);
+  std::vector<size_t> sizes;
+  size_t needed = 0;
+  for (size_t remaining = len; remaining; ) {
+    const size_t n = sizer.Next(remaining);
+    sizes.push_back(n);
+    needed += sizer.RecordLength(n);
+    remaining -= n;
+  }
+  if (space < needed) {
+    *out_len = needed;
+    return ERROR_RESULT(ERR_OUTPUT_BUFFER_TOO_SMALL);
+  }
+
+  // The advice is only a hint, so failing to give it doesn't matter.
+  (void) posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+
+  // Each record's payload is read into the place where it will be in |out|
+  // and then encrypted there. Everything is read before anything is
+  // encrypted so that a short read, say because the file was truncated,
+  // doesn't leave sequence numbers consumed by records which the caller
+  // never sees.
+  const unsigned prefix = spec->PrefixBytes();
+  size_t out_offset = 0;
+  uint64_t file_offset = offset;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    if (!PreadFully(out + out_offset + 5 + prefix, fd, file_offset, sizes[i]))
+      return ERROR_RESULT(ERR_CANNOT_READ_FILE);
+    out_offset += sizer.RecordLength(sizes[i]);
+    file_offset += sizes[i];
+  }
+
+  const uint16_t wire_version = ApplicationDataWireVersion(priv_);
+  uint64_t seq_num = priv_->writer.seq_num;
+  size_t total = 0;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    size_t written;
+    if (!spec->Seal(out, &written, RECORD_APPLICATION_DATA, wire_version, out + 5 + prefix, sizes[i], seq_num++))
+      return EncryptionFailed(priv_, spec);
+
+    out += written;
+    total += written;
+  }
+  priv_->writer.seq_num = seq_num;
+  sizer.Commit(priv_);
+  *out_len = total;
+
+  return 0;
+}
+
+void Connection::Cork(size_t flush_bytes, unsigned flush_seconds) {
+  priv_->writer.corked = true;
+  priv_->writer.cork_flush_bytes = flush_bytes;
+  priv_->writer.cork_flush_seconds = flush_seconds;
+}
+
+Result Connection::Uncork(const struct iovec** out, unsigned* out_n) {
+  priv_->writer.corked = false;
+  return Flush(out, out_n);
+}
+
+Result Connection::Write(const struct iovec** out, unsigned* out_n, const struct iovec* iov, unsigned iov_len) {
+  *out = NULL;
+  *out_n = 0;
+
+  if (!is_ready_to_send_application_data())
+    return ERROR_RESULT(ERR_NOT_READY_TO_SEND_APPLICATION_DATA);
+
+  if (!priv_->writer.corked && priv_->writer.cork_buffer.empty()) {
+    // When there's nothing to coalesce with, the data is copied straight to
+    // where it's encrypted rather than going through |cork_buffer|.
+    Buffer buf(iov, iov_len);
+    const size_t len = buf.size();
+    if (!len)
+      return 0;
+    std::vector<uint8_t>& flushed = priv_->writer.cork_flushed;
+    flushed.resize(len);
+    buf.Read(&flushed[0], len);
+    priv_->writer.cork_stats.writes++;
+    priv_->writer.cork_stats.bytes += len;
+
+    const Result r = EncryptCorkFlushed(out, out_n);
+    if (r) {
+      // As for a failed |Flush|, the data stays buffered. The copy has been
+      // encrypted in place so it's taken again from |iov|.
+      priv_->writer.cork_buffer.resize(len);
+      buf.Rewind();
+      buf.Read(&priv_->writer.cork_buffer[0], len);
+    }
+    return r;
+  }
+
+  QueueApplicationData(iov, iov_len);
+
+  if (!priv_->writer.corked ||
+      priv_->writer.cork_buffer.size() >= priv_->writer.cork_flush_bytes ||
+      is_flush_due()) {
+    return Flush(out, out_n);
+  }
+  return 0;
+}
+
+Result Connection::Flush(const struct iovec** out, unsigned* out_n) {
+  *out = NULL;
+  *out_n = 0;
+
+  if (priv_->writer.cork_buffer.empty())
+    return 0;
+  // Data queued before the handshake stays queued until it can be sent.
+  if (!is_ready_to_send_application_data())
+    return ERROR_RESULT(ERR_NOT_READY_TO_SEND_APPLICATION_DATA);
+
+  // The buffered data is encrypted in place, so it's copied aside first in
+  // order that further writes don't disturb the result. The buffer itself is
+  // only emptied once the copy has been encrypted so that nothing is lost if
+  // that fails.
+  priv_->writer.cork_flushed.assign(priv_->writer.cork_buffer.begin(), priv_->writer.cork_buffer.end());
+  const Result r = EncryptCorkFlushed(out, out_n);
+  if (r)
+    return r;
+  priv_->writer.cork_buffer.clear();
+  return 0;
+}
+
+// EncryptCorkFlushed encrypts the data in |cork_flushed|, as for |EncryptV|,
+// and counts the records which result.
+Result Connection::EncryptCorkFlushed(const struct iovec** out, unsigned* out_n) {
+  std::vector<uint8_t>& flushed = priv_->writer.cork_flushed;
+  const uint64_t first_seq_num = priv_->writer.seq_num;
+  const struct iovec iov = {&flushed[0], flushed.size()};
+  const Result r = EncryptV(out, out_n, &iov, 1);
+  if (r)
+    return r;
+
+  CorkStats* const stats = &priv_->writer.cork_stats;
+  stats->records += priv_->writer.seq_num - first_seq_num;
+  for (unsigned i = 0; i < *out_n; i++)
+    stats->wire_bytes += (*out)[i].iov_len;
+  return 0;
+}
+
+void Connection::QueueApplicationData(const struct iovec* iov, unsigned iov_len) {
+  Buffer buf(iov, iov_len);
+  const size_t len = buf.size();
+  if (!len)
+    return;
+
+  std::vector<uint8_t>& buffer = priv_->writer.cork_buffer;
+  if (buffer.empty() && priv_->writer.corked && priv_->writer.cork_flush_seconds)
+    priv_->writer.cork_oldest_write = priv_->ctx->EpochSeconds();
+  const size_t offset = buffer.size();
+  buffer.resize(offset + len);
+  buf.Read(&buffer[offset], len);
+  priv_->writer.cork_stats.writes++;
+  priv_->writer.cork_stats.bytes += len;
+}
+
+bool Connection::is_flush_due() const {
+  if (!priv_->writer.corked || !priv_->writer.cork_flush_seconds || priv_->writer.cork_buffer.empty())
+    return false;
+
+  const uint64_t now = priv_->ctx->EpochSeconds();
+  return now >= priv_->writer.cork_oldest_write + priv_->writer.cork_flush_seconds;
+}
+
+const CorkStats& Connection::cork_stats() const {
+  return priv_->writer.cork_stats;
+}
+
 static Result EncryptRecord(ConnectionPrivate* priv, Sink* sink) {
-  if (!priv->write_cipher_spec)
+  CipherSpec* const spec = priv->writer.cipher_spec;
+  if (!spec)
     return 0;
   sink->WriteLength();
 
+  const size_t len = sink->size();
+  const unsigned prefix = spec->PrefixBytes();
+  size_t scratch_size = spec->ScratchBytesNeeded(len);
+  // Growing the Sink may move its contents, so we only take pointers into it
+  // afterwards. The data is then moved up to make room for the prefix.
+  sink->Block(prefix + scratch_size);
+  uint8_t* const data = const_cast<uint8_t*>(sink->data());
+  memmove(data + prefix, data, len);
+
   struct iovec iov[2];
-  iov[0].iov_base = const_cast<uint8_t*>(sink->data());
-  iov[0].iov_len = sink->size();
-  size_t scratch_size = priv->write_cipher_spec->ScratchBytesNeeded(sink->size());
-  uint8_t* scratch = sink->Block(scratch_size);
-  if (!priv->write_cipher_spec->Encrypt(scratch, &scratch_size, sink->data() - 5, iov, 1, priv->write_seq_num))
+  iov[0].iov_base = data + prefix;
+  iov[0].iov_len = len;
+  if (!spec->Encrypt(data, data + prefix + len, &scratch_size, data - 5, iov, 1, priv->writer.seq_num))
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
-  priv->write_seq_num++;
+  priv->writer.seq_num++;
   return 0;
 }
 
@@ -207,9 +967,9 @@ static Result SendClientHello(Sink* sink, ConnectionPrivate* priv) {
   if (!priv->snap_start_attempt)
     priv->state = RECV_SERVER_HELLO;
 
-  priv->sent_client_hello.iov_len = s.size();
-  priv->sent_client_hello.iov_base = priv->arena.Allocate(s.size());
-  memcpy(priv->sent_client_hello.iov_base, s.data(), s.size());
+  priv->handshake->sent_client_hello.iov_len = s.size();
+  priv->handshake->sent_client_hello.iov_base = priv->arena.Allocate(s.size());
+  memcpy(priv->handshake->sent_client_hello.iov_base, s.data(), s.size());
   if (!priv->snap_start_attempt) {
     if ((r = EncryptRecord(priv, &s)))
       return r;
@@ -228,7 +988,7 @@ static Result SendClientKeyExchange(Sink* sink, ConnectionPrivate* priv) {
       return r;
   }
 
-  priv->handshake_hash->Update(s.data(), s.size());
+  priv->handshake->handshake_hash->Update(s.data(), s.size());
   if ((r = EncryptRecord(priv, &s)))
     return r;
   return 0;
@@ -254,15 +1014,15 @@ static Result SendFinished(Sink* sink, ConnectionPrivate* priv) {
     if ((r = MarshalFinished(&ss, priv)))
       return r;
   }
-  priv->handshake_hash->Update(s.data(), s.size());
+  priv->handshake->handshake_hash->Update(s.data(), s.size());
   if ((r = EncryptRecord(priv, &s)))
     return r;
 
-  if (priv->false_start)
+  if (priv->handshake->false_start)
     priv->can_send_application_data = true;
 
   if (priv->state == SEND_FINISHED) {
-    if (priv->expecting_session_ticket) {
+    if (priv->handshake->expecting_session_ticket) {
       priv->state = RECV_SESSION_TICKET;
     } else {
       priv->state = RECV_CHANGE_CIPHER_SPEC;
@@ -272,6 +1032,35 @@ static Result SendFinished(Sink* sink, ConnectionPrivate* priv) {
   return 0;
 }
 
+// SendQueuedApplicationData encrypts any data from
+// |Connection::QueueApplicationData| and appends the records to |sink|. It's
+// called after the client's Finished so that the data goes out in the same
+// packet.
+static Result SendQueuedApplicationData(Sink* sink, ConnectionPrivate* priv) {
+  std::vector<uint8_t>& buffer = priv->writer.cork_buffer;
+  if (!priv->can_send_application_data || buffer.empty())
+    return 0;
+
+  Result r;
+  for (size_t offset = 0; offset < buffer.size(); ) {
+    const size_t n = std::min(buffer.size() - offset, kMaxRecordPayload);
+    const struct iovec iov = {&buffer[offset], n};
+    struct iovec start, end;
+    if ((r = EncryptApplicationData(&start, &end, &iov, 1, n, priv)))
+      return r;
+    sink->Copy(start.iov_base, start.iov_len);
+    sink->Copy(iov.iov_base, iov.iov_len);
+    sink->Copy(end.iov_base, end.iov_len);
+
+    priv->writer.cork_stats.records++;
+    priv->writer.cork_stats.wire_bytes += start.iov_len + n + end.iov_len;
+    offset += n;
+  }
+  buffer.clear();
+
+  return 0;
+}
+
 extern const HandshakeState kNextState[];
 extern const char *kStateNames[];
 
@@ -313,11 +1102,11 @@ Result SendHandshakeMessages(Sink* sink, ConnectionPrivate* priv) {
       if ((r = SendChangeCipherSpec(sink, priv)))
         return r;
 
-      if (priv->write_cipher_spec)
-        priv->write_cipher_spec->DecRef();
-      priv->write_cipher_spec = priv->pending_write_cipher_spec;
-      priv->pending_write_cipher_spec = NULL;
-      priv->write_seq_num = 0;
+      if (priv->writer.cipher_spec)
+        priv->writer.cipher_spec->DecRef();
+      priv->writer.cipher_spec = priv->handshake->pending_write_cipher_spec;
+      priv->handshake->pending_write_cipher_spec = NULL;
+      priv->writer.seq_num = 0;
 
       break;
     case SEND_FINISHED:
@@ -327,7 +1116,9 @@ Result SendHandshakeMessages(Sink* sink, ConnectionPrivate* priv) {
     case SEND_SNAP_START_RECOVERY_FINISHED:
     case SEND_SNAP_START_RESUME_RECOVERY_FINISHED:
     case SEND_SNAP_START_RESUME_RECOVERY2_FINISHED:
-      r = SendFinished(sink, priv);
+      if ((r = SendFinished(sink, priv)))
+        return r;
+      r = SendQueuedApplicationData(sink, priv);
       break;
     case SEND_SNAP_START_RECOVERY_RETRANSMIT:
     case SEND_SNAP_START_RESUME_RECOVERY_RETRANSMIT:
@@ -336,24 +1127,24 @@ Result SendHandshakeMessages(Sink* sink, ConnectionPrivate* priv) {
 
       {
         struct iovec start, end;
-        if ((r = EncryptApplicationData(&start, &end, &priv->snap_start_application_data, 1, priv->snap_start_application_data.iov_len, priv)))
+        if ((r = EncryptApplicationData(&start, &end, &priv->handshake->snap_start_application_data, 1, priv->handshake->snap_start_application_data.iov_len, priv)))
           return r;
         sink->Copy(start.iov_base, start.iov_len);
-        sink->Copy(priv->snap_start_application_data.iov_base, priv->snap_start_application_data.iov_len);
+        sink->Copy(priv->handshake->snap_start_application_data.iov_base, priv->handshake->snap_start_application_data.iov_len);
         sink->Copy(end.iov_base, end.iov_len);
 
-        priv->arena.Free(priv->snap_start_application_data.iov_base);
-        priv->snap_start_application_data.iov_len = 0;
+        priv->arena.Free(priv->handshake->snap_start_application_data.iov_base);
+        priv->handshake->snap_start_application_data.iov_len = 0;
       }
 
       if (priv->state == SEND_SNAP_START_RECOVERY_RETRANSMIT) {
-        if (priv->expecting_session_ticket) {
+        if (priv->handshake->expecting_session_ticket) {
           priv->state = RECV_SNAP_START_RECOVERY_SESSION_TICKET;
         } else {
           priv->state = RECV_SNAP_START_RECOVERY_CHANGE_CIPHER_SPEC;
         }
       } else if (priv->state == SEND_SNAP_START_RESUME_RECOVERY2_RETRANSMIT) {
-        if (priv->expecting_session_ticket) {
+        if (priv->handshake->expecting_session_ticket) {
           priv->state = RECV_SNAP_START_RESUME_RECOVERY2_SESSION_TICKET;
         } else {
           priv->state = RECV_SNAP_START_RESUME_RECOVERY2_CHANGE_CIPHER_SPEC;
@@ -384,6 +1175,16 @@ Result SendHandshakeMessages(Sink* sink, ConnectionPrivate* priv) {
 Result Connection::Get(struct iovec* out) {
   Result r;
 
+  if ((r = GetOwned(out)))
+    return r;
+
+  priv_->last_buffer = static_cast<uint8_t*>(out->iov_base);
+  return 0;
+}
+
+Result Connection::GetOwned(struct iovec* out) {
+  Result r;
+
   if (priv_->last_buffer) {
     priv_->arena.Free(priv_->last_buffer);
     priv_->last_buffer = NULL;
@@ -397,12 +1198,15 @@ Result Connection::Get(struct iovec* out) {
   if ((r = SendHandshakeMessages(&sink, priv_)))
     return r;
 
-  priv_->last_buffer = sink.Release();
   out->iov_len = sink.size();
-  out->iov_base = priv_->last_buffer;
+  out->iov_base = sink.Release();
   return 0;
 }
 
+void Connection::ReturnBuffer(void* buffer) {
+  priv_->arena.Free(buffer);
+}
+
 void Connection::EnableRSA(bool enable) {
   SetEnableBit(CIPHERSUITE_RSA, enable);
 }
@@ -447,19 +1251,28 @@ void Connection::EnableDefault() {
 }
 
 void Connection::SetEnableBit(unsigned mask, bool enable) {
+  if (!priv_->handshake)
+    return;
   if (enable) {
-    priv_->cipher_suite_flags_enabled |= mask;
+    priv_->handshake->cipher_suite_flags_enabled |= mask;
   } else {
-    priv_->cipher_suite_flags_enabled &= ~mask;
+    priv_->handshake->cipher_suite_flags_enabled &= ~mask;
   }
 }
 
-Result Connection::Process(struct iovec** out, unsigned* out_n, size_t* used,
-                           const struct iovec* iov, unsigned n) {
+// ProcessRecords implements |Connection::Process| and its variants. If
+// |plaintext| is non-NULL then application data is decrypted into
+// |*plaintext|, rather than in place, and it and |plaintext_len| are advanced
+// past the data written.
+static Result ProcessRecords(ConnectionPrivate* priv, struct iovec** out, unsigned* out_n, size_t* used,
+                             const struct iovec* iov, unsigned n,
+                             uint8_t** plaintext, size_t* plaintext_len) {
   *out = NULL;
   *out_n = 0;
   *used = 0;
-  priv_->out_vectors.clear();
+  priv->reader.out_vectors.clear();
+  priv->reader.record_spans.clear();
+  priv->reader.bytes_needed = 0;
 
   Buffer buf(iov, n);
   bool found;
@@ -469,31 +1282,59 @@ Result Connection::Process(struct iovec** out, unsigned* out_n, size_t* used,
   for (;;) {
     // In order to be False Start compatible, if we're waiting to send we stop
     // processing. Otherwise we'll be in the wrong state to process the record.
-    if (need_to_write())
+    if (IsSendState(priv->state))
       return 0;
 
-    if (priv_->out_vectors.size() && !NextIsApplicationData(&buf)) {
+    if (priv->reader.out_vectors.size() && !NextIsApplicationData(&buf)) {
       // We had some amount of application data already and now we have another
       // form of record. We'll return the application level data now.
       return 0;
     }
-    Result r = GetRecordOrHandshake(&found, &type, &htype, &priv_->out_vectors, &buf, priv_);
+
+    Result r;
+    if (priv->application_data_allowed) {
+      // Application data records are decrypted in bulk, which saves
+      // repeatedly growing |out_vectors|.
+      unsigned records;
+      r = GetApplicationDataRecords(&records, &priv->reader.out_vectors, &priv->reader.record_spans, &buf, priv, plaintext, plaintext_len);
+      if (r) {
+        // If we ran out of space for the plaintext after getting some
+        // application data then we return what we have.
+        if (ErrorCodeFromResult(r) == ERR_OUTPUT_BUFFER_TOO_SMALL &&
+            priv->reader.out_vectors.size()) {
+          return 0;
+        }
+        return r;
+      }
+      if (records) {
+        *out = priv->reader.out_vectors.empty() ? NULL : &priv->reader.out_vectors[0];
+        *out_n = priv->reader.out_vectors.size();
+        *used = buf.TellBytes();
+        continue;
+      }
+    }
+
+    r = GetRecordOrHandshake(&found, &type, &htype, &priv->reader.out_vectors, &buf, priv);
     if (r)
       return r;
 
-    if (!found)
+    if (!found) {
+      // Complete handshake records may have been consumed into the
+      // reassembly buffer even though no message was found.
+      *used = buf.TellBytes();
       return 0;
+    }
 
     if (type == RECORD_APPLICATION_DATA) {
-      if (!priv_->application_data_allowed)
+      if (!priv->application_data_allowed)
         return ERROR_RESULT(ERR_UNEXPECTED_APPLICATION_DATA);
-      *out = &priv_->out_vectors[0];
-      *out_n = priv_->out_vectors.size();
+      *out = priv->reader.out_vectors.empty() ? NULL : &priv->reader.out_vectors[0];
+      *out_n = priv->reader.out_vectors.size();
       *used = buf.TellBytes();
       continue;
     }
 
-    Buffer in(&priv_->out_vectors[0], priv_->out_vectors.size());
+    Buffer in(priv->reader.out_vectors.empty() ? NULL : &priv->reader.out_vectors[0], priv->reader.out_vectors.size());
 
     switch (type) {
       case RECORD_ALERT: {
@@ -512,13 +1353,13 @@ Result Connection::Process(struct iovec** out, unsigned* out_n, size_t* used,
         return AlertTypeToResult(static_cast<AlertType>(alert_type));
       }
       case RECORD_CHANGE_CIPHER_SPEC:
-        r = ProcessHandshakeMessage(priv_, CHANGE_CIPHER_SPEC, &in);
+        r = ProcessHandshakeMessage(priv, CHANGE_CIPHER_SPEC, &in);
         if (r)
           return r;
         *used = buf.TellBytes();
         break;
       case RECORD_HANDSHAKE:
-        r = ProcessHandshakeMessage(priv_, htype, &in);
+        r = ProcessHandshakeMessage(priv, htype, &in);
         if (r)
           return r;
         *used = buf.TellBytes();
@@ -527,39 +1368,68 @@ Result Connection::Process(struct iovec** out, unsigned* out_n, size_t* used,
         return ERROR_RESULT(ERR_INTERNAL_ERROR);
     }
 
-    priv_->out_vectors.clear();
+    priv->reader.out_vectors.clear();
   }
 }
 
+Result Connection::Process(struct iovec** out, unsigned* out_n, size_t* used,
+                           const struct iovec* iov, unsigned n) {
+  return ProcessRecords(priv_, out, out_n, used, iov, n, NULL, NULL);
+}
+
+Result Connection::ProcessBatch(struct iovec** out, unsigned* out_n,
+                                const RecordSpan** records, unsigned* records_n,
+                                size_t* used, const struct iovec* iov, unsigned n) {
+  const Result r = Process(out, out_n, used, iov, n);
+  *records = priv_->reader.record_spans.size() ? &priv_->reader.record_spans[0] : NULL;
+  *records_n = priv_->reader.record_spans.size();
+  return r;
+}
+
+Result Connection::ProcessInto(uint8_t* plaintext, size_t* plaintext_len, size_t* used,
+                               const struct iovec* iov, unsigned n) {
+  struct iovec* out;
+  unsigned out_n;
+  uint8_t* dest = plaintext;
+  size_t space = *plaintext_len;
+
+  const Result r = ProcessRecords(priv_, &out, &out_n, used, iov, n, &dest, &space);
+  *plaintext_len = dest - plaintext;
+  return r;
+}
+
 static const uint8_t kResumptionSerialisationVersion = 0;
 
 bool Connection::is_resumption_data_availible() const {
-  return priv_->resumption_data_ready &&
-         (priv_->session_id_len || priv_->expecting_session_ticket);
+  return priv_->handshake &&
+         priv_->handshake->resumption_data_ready &&
+         (priv_->handshake->session_id_len || priv_->handshake->expecting_session_ticket);
 }
 
 Result Connection::GetResumptionData(struct iovec* iov) {
   Sink sink(&priv_->arena);
 
-  if (!priv_->resumption_data_ready)
+  if (!priv_->handshake)
+    return ERROR_RESULT(ERR_HANDSHAKE_STATE_FREED);
+  if (!priv_->handshake->resumption_data_ready)
     return ERROR_RESULT(ERR_RESUMPTION_DATA_NOT_READY);
 
   sink.U8(kResumptionSerialisationVersion);
   sink.U16(priv_->cipher_suite->value);
-  uint8_t* master = sink.Block(sizeof(priv_->master_secret));
-  memcpy(master, priv_->master_secret, sizeof(priv_->master_secret));
+  uint8_t* master = sink.Block(sizeof(priv_->handshake->master_secret));
+  memcpy(master, priv_->handshake->master_secret, sizeof(priv_->handshake->master_secret));
 
-  if (priv_->session_id_len) {
+  if (priv_->handshake->session_id_len) {
     sink.U8(RESUMPTION_METHOD_SESSION_ID);
-    sink.U8(priv_->session_id_len);
-    uint8_t* session_id = sink.Block(priv_->session_id_len);
-    memcpy(session_id, priv_->session_id, priv_->session_id_len);
+    sink.U8(priv_->handshake->session_id_len);
+    uint8_t* session_id = sink.Block(priv_->handshake->session_id_len);
+    memcpy(session_id, priv_->handshake->session_id, priv_->handshake->session_id_len);
   } else {
     sink.U8(RESUMPTION_METHOD_SESSION_TICKET);
-    const size_t len = priv_->session_ticket.iov_len;
+    const size_t len = priv_->handshake->session_ticket.iov_len;
     sink.U16(len);
     uint8_t* ticket = sink.Block(len);
-    memcpy(ticket, priv_->session_ticket.iov_base, len);
+    memcpy(ticket, priv_->handshake->session_ticket.iov_base, len);
   }
 
   iov->iov_base = sink.Release();
@@ -572,6 +1442,9 @@ Result Connection::SetResumptionData(const uint8_t* data, size_t len) {
   const struct iovec iov = {const_cast<uint8_t*>(data), len};
   Buffer buf(&iov, 1);
 
+  if (!priv_->handshake)
+    return ERROR_RESULT(ERR_HANDSHAKE_STATE_FREED);
+
   uint8_t version;
   if (!buf.Read(&version, 1) || version != kResumptionSerialisationVersion)
     return ERROR_RESULT(ERR_CANNOT_PARSE_RESUMPTION_DATA);
@@ -587,7 +1460,7 @@ Result Connection::SetResumptionData(const uint8_t* data, size_t len) {
   const CipherSuite* cipher_suite = NULL;
   for (unsigned i = 0; suites[i].flags; i++) {
     if (suites[i].value == cipher_suite_value) {
-      if ((suites[i].flags & priv_->cipher_suite_flags_enabled) == suites[i].flags) {
+      if ((suites[i].flags & priv_->handshake->cipher_suite_flags_enabled) == suites[i].flags) {
         cipher_suite = &suites[i];
         break;
       } else {
@@ -603,34 +1476,34 @@ Result Connection::SetResumptionData(const uint8_t* data, size_t len) {
 
   uint8_t resumption_type;
 
-  if (!buf.Read(priv_->master_secret, sizeof(priv_->master_secret)) ||
+  if (!buf.Read(priv_->handshake->master_secret, sizeof(priv_->handshake->master_secret)) ||
       !buf.Read(&resumption_type, sizeof(resumption_type))) {
     return ERROR_RESULT(ERR_CANNOT_PARSE_RESUMPTION_DATA);
   }
 
   if (resumption_type == RESUMPTION_METHOD_SESSION_ID) {
-    if (!buf.Read(&priv_->session_id_len, sizeof(priv_->session_id_len)) ||
-        priv_->session_id_len == 0 ||
-        priv_->session_id_len > sizeof(priv_->session_id) ||
-        !buf.Read(priv_->session_id, priv_->session_id_len)) {
-      priv_->session_id_len = 0;
+    if (!buf.Read(&priv_->handshake->session_id_len, sizeof(priv_->handshake->session_id_len)) ||
+        priv_->handshake->session_id_len == 0 ||
+        priv_->handshake->session_id_len > sizeof(priv_->handshake->session_id) ||
+        !buf.Read(priv_->handshake->session_id, priv_->handshake->session_id_len)) {
+      priv_->handshake->session_id_len = 0;
       return ERROR_RESULT(ERR_CANNOT_PARSE_RESUMPTION_DATA);
     }
   } else if (resumption_type == RESUMPTION_METHOD_SESSION_TICKET) {
     uint16_t len;
     if (!buf.U16(&len))
       return ERROR_RESULT(ERR_CANNOT_PARSE_RESUMPTION_DATA);
-    priv_->session_ticket.iov_base = priv_->arena.Allocate(len);
-    priv_->session_ticket.iov_len = len;
-    if (!buf.Read(priv_->session_ticket.iov_base, len))
+    priv_->handshake->session_ticket.iov_base = priv_->arena.Allocate(len);
+    priv_->handshake->session_ticket.iov_len = len;
+    if (!buf.Read(priv_->handshake->session_ticket.iov_base, len))
       return ERROR_RESULT(ERR_CANNOT_PARSE_RESUMPTION_DATA);
-    priv_->session_tickets = true;
-    priv_->have_session_ticket_to_present = true;
+    priv_->handshake->session_tickets = true;
+    priv_->handshake->have_session_ticket_to_present = true;
 
     // We need to send a session id in order to recognise when the server
     // accepted our ticket.
-    priv_->session_id_len = 1;
-    priv_->session_id[0] = 0;
+    priv_->handshake->session_id_len = 1;
+    priv_->handshake->session_id[0] = 0;
   } else {
     return ERROR_RESULT(ERR_CANNOT_PARSE_RESUMPTION_DATA);
   }
@@ -642,31 +1515,191 @@ bool Connection::did_resume() const {
   return priv_->did_resume;
 }
 
+static const uint8_t kStateSerialisationVersion = 0;
+
+Result Connection::ExportState(struct iovec* iov) {
+  // The master secret and randoms, from which the keys are derived, are part
+  // of the handshake state.
+  if (!priv_->handshake)
+    return ERROR_RESULT(ERR_HANDSHAKE_STATE_FREED);
+  if (!priv_->application_data_allowed ||
+      !priv_->can_send_application_data ||
+      priv_->state != AWAIT_HELLO_REQUEST ||
+      !priv_->reader.cipher_spec ||
+      !priv_->writer.cipher_spec ||
+      priv_->partial_record_remaining ||
+      priv_->handshake_reassembly_offset != priv_->handshake_reassembly.size() ||
+      !priv_->writer.cork_buffer.empty()) {
+    return ERROR_RESULT(ERR_CANNOT_EXPORT_STATE);
+  }
+
+  Sink sink(&priv_->arena);
+  sink.U8(kStateSerialisationVersion);
+  sink.U16(priv_->cipher_suite->value);
+  sink.U16(priv_->version);
+  // The keys are derived again from these by |ImportState|.
+  sink.Copy(priv_->handshake->master_secret, sizeof(priv_->handshake->master_secret));
+  sink.Copy(priv_->handshake->client_random, sizeof(priv_->handshake->client_random));
+  sink.Copy(priv_->handshake->server_random, sizeof(priv_->handshake->server_random));
+  sink.U32(priv_->reader.seq_num >> 32);
+  sink.U32(priv_->reader.seq_num);
+  sink.U32(priv_->writer.seq_num >> 32);
+  sink.U32(priv_->writer.seq_num);
+  priv_->reader.cipher_spec->ExportState(&sink);
+  priv_->writer.cipher_spec->ExportState(&sink);
+
+  iov->iov_base = sink.Release();
+  iov->iov_len = sink.size();
+
+  return 0;
+}
+
+// ReadSequenceNumber reads a 64-bit sequence number, as written by
+// |Connection::ExportState|, from |buf|.
+static bool ReadSequenceNumber(uint64_t* out, Buffer* buf) {
+  uint32_t high, low;
+  if (!buf->U32(&high) || !buf->U32(&low))
+    return false;
+  *out = static_cast<uint64_t>(high) << 32 | low;
+  return true;
+}
+
+Result Connection::ImportState(const uint8_t* data, size_t len) {
+  if (!priv_->handshake)
+    return ERROR_RESULT(ERR_HANDSHAKE_STATE_FREED);
+  if (priv_->state != SEND_CLIENT_HELLO ||
+      priv_->reader.cipher_spec ||
+      priv_->writer.cipher_spec) {
+    return ERROR_RESULT(ERR_CANNOT_PARSE_STATE);
+  }
+
+  const struct iovec iov = {const_cast<uint8_t*>(data), len};
+  Buffer buf(&iov, 1);
+
+  uint8_t version;
+  uint16_t cipher_suite_value, tls_version;
+  if (!buf.U8(&version) ||
+      version != kStateSerialisationVersion ||
+      !buf.U16(&cipher_suite_value) ||
+      !buf.U16(&tls_version)) {
+    return ERROR_RESULT(ERR_CANNOT_PARSE_STATE);
+  }
+
+  const CipherSuite* cipher_suite = NULL;
+  for (const CipherSuite* suite = AllCipherSuites(); suite->flags; suite++) {
+    if (suite->value == cipher_suite_value)
+      cipher_suite = suite;
+  }
+  if (!cipher_suite)
+    return ERROR_RESULT(ERR_CANNOT_PARSE_STATE);
+  if ((cipher_suite->flags & priv_->handshake->cipher_suite_flags_enabled) != cipher_suite->flags)
+    return ERROR_RESULT(ERR_STATE_CIPHER_SUITE_NOT_ENABLED);
+  if (tls_version != SSLv3 && tls_version != TLSv10 &&
+      tls_version != TLSv11 && tls_version != TLSv12) {
+    return ERROR_RESULT(ERR_CANNOT_PARSE_STATE);
+  }
+
+  // Nothing is written to the Connection until all the state has been
+  // parsed and checked.
+  uint8_t master_secret[sizeof(priv_->handshake->master_secret)];
+  uint8_t client_random[sizeof(priv_->handshake->client_random)];
+  uint8_t server_random[sizeof(priv_->handshake->server_random)];
+  uint64_t read_seq_num, write_seq_num;
+  if (!buf.Read(master_secret, sizeof(master_secret)) ||
+      !buf.Read(client_random, sizeof(client_random)) ||
+      !buf.Read(server_random, sizeof(server_random)) ||
+      !ReadSequenceNumber(&read_seq_num, &buf) ||
+      !ReadSequenceNumber(&write_seq_num, &buf)) {
+    memset(master_secret, 0, sizeof(master_secret));
+    return ERROR_RESULT(ERR_CANNOT_PARSE_STATE);
+  }
+
+  KeyBlock kb;
+  kb.key_len = cipher_suite->key_len;
+  kb.mac_len = cipher_suite->mac_len;
+  kb.iv_len = cipher_suite->iv_len;
+  const TLSVersion tls = static_cast<TLSVersion>(tls_version);
+  if (!KeysFromMasterSecret(&kb, tls, master_secret, client_random, server_random)) {
+    memset(master_secret, 0, sizeof(master_secret));
+    return ERROR_RESULT(ERR_INTERNAL_ERROR);
+  }
+
+  CipherSpec* const read_spec = cipher_suite->create(tls, kb);
+  CipherSpec* const write_spec = cipher_suite->create(tls, kb);
+  memset(&kb, 0, sizeof(kb));
+  if (!read_spec->ImportState(&buf) ||
+      !write_spec->ImportState(&buf) ||
+      buf.remaining()) {
+    read_spec->DecRef();
+    write_spec->DecRef();
+    memset(master_secret, 0, sizeof(master_secret));
+    return ERROR_RESULT(ERR_CANNOT_PARSE_STATE);
+  }
+
+  memcpy(priv_->handshake->master_secret, master_secret, sizeof(master_secret));
+  memcpy(priv_->handshake->client_random, client_random, sizeof(client_random));
+  memcpy(priv_->handshake->server_random, server_random, sizeof(server_random));
+  memset(master_secret, 0, sizeof(master_secret));
+  priv_->cipher_suite = cipher_suite;
+  priv_->version = tls;
+  priv_->version_established = true;
+  priv_->reader.cipher_spec = read_spec;
+  priv_->reader.seq_num = read_seq_num;
+  priv_->writer.cipher_spec = write_spec;
+  priv_->writer.seq_num = write_seq_num;
+  priv_->application_data_allowed = true;
+  priv_->can_send_application_data = true;
+  priv_->state = AWAIT_HELLO_REQUEST;
+
+  return 0;
+}
+
 void Connection::EnableFalseStart(bool enable) {
-  priv_->false_start = enable;
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->false_start = enable;
 }
 
 void Connection::EnableSessionTickets(bool enable) {
-  priv_->session_tickets = enable;
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->session_tickets = enable;
 }
 
 void Connection::SetPredictedCertificates(const struct iovec* iovs, unsigned len) {
-  priv_->predicted_certificates.resize(len);
-
-  for (unsigned i = 0; i < len; i++) {
-    priv_->predicted_certificates[i].iov_base = priv_->arena.Allocate(iovs[i].iov_len);
-    priv_->predicted_certificates[i].iov_len = iovs[i].iov_len;
-    memcpy(priv_->predicted_certificates[i].iov_base, iovs[i].iov_base, iovs[i].iov_len);
+  if (!priv_->handshake)
+    return;
+  if (!len) {
+    SetPredictedCertificateChain(NULL);
+    return;
   }
+
+  CertificateChain* const chain = CertificateChain::Create(iovs, len);
+  SetPredictedCertificateChain(chain);
+  chain->DecRef();
+}
+
+void Connection::SetPredictedCertificateChain(CertificateChain* chain) {
+  if (!priv_->handshake)
+    return;
+  if (chain && !chain->size())
+    chain = NULL;
+  if (chain)
+    chain->AddRef();
+  if (priv_->handshake->predicted_chain)
+    priv_->handshake->predicted_chain->DecRef();
+  priv_->handshake->predicted_chain = chain;
 }
 
 void Connection::CollectSnapStartData() {
-  priv_->collect_snap_start = true;
-  priv_->session_tickets = true;
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->collect_snap_start = true;
+  priv_->handshake->session_tickets = true;
 }
 
 bool Connection::is_snap_start_data_available() const {
-  return priv_->snap_start_data_available;
+  return priv_->handshake && priv_->handshake->snap_start_data_available;
 }
 
 static const uint8_t kSnapStartSerialisationVersion = 1;
@@ -681,12 +1714,12 @@ Result Connection::GetSnapStartData(struct iovec* iov) {
 
   sink.U16(static_cast<uint16_t>(priv_->version));
   sink.U16(static_cast<uint16_t>(priv_->cipher_suite->value));
-  sink.Copy(priv_->server_epoch, sizeof(priv_->server_epoch));
+  sink.Copy(priv_->handshake->server_epoch, sizeof(priv_->handshake->server_epoch));
 
   {
     Sink server_hello_sink(sink.VariableLengthBlock(2));
-    uint8_t* server_hello = server_hello_sink.Block(priv_->snap_start_server_hello.iov_len);
-    memcpy(server_hello, priv_->snap_start_server_hello.iov_base, priv_->snap_start_server_hello.iov_len);
+    uint8_t* server_hello = server_hello_sink.Block(priv_->handshake->snap_start_server_hello.iov_len);
+    memcpy(server_hello, priv_->handshake->snap_start_server_hello.iov_base, priv_->handshake->snap_start_server_hello.iov_len);
   }
 
   iov->iov_base = sink.Release();
@@ -700,7 +1733,9 @@ Result Connection::SetSnapStartData(const uint8_t* data, size_t len, const uint8
   Buffer buf(&iov, 1);
   bool ok;
 
-  if (priv_->predicted_certificates.size() == 0)
+  if (!priv_->handshake)
+    return ERROR_RESULT(ERR_HANDSHAKE_STATE_FREED);
+  if (!priv_->handshake->predicted_chain)
     return ERROR_RESULT(ERR_NEED_PREDICTED_CERTS_FIRST);
 
   uint8_t version;
@@ -720,7 +1755,7 @@ Result Connection::SetSnapStartData(const uint8_t* data, size_t len, const uint8
   const CipherSuite* cipher_suite = NULL;
   for (unsigned i = 0; suites[i].flags; i++) {
     if (suites[i].value == cipher_suite_value) {
-      if ((suites[i].flags & priv_->cipher_suite_flags_enabled) == suites[i].flags) {
+      if ((suites[i].flags & priv_->handshake->cipher_suite_flags_enabled) == suites[i].flags) {
         cipher_suite = &suites[i];
         break;
       }
@@ -732,7 +1767,7 @@ Result Connection::SetSnapStartData(const uint8_t* data, size_t len, const uint8
 
   priv_->cipher_suite = cipher_suite;
 
-  if (!buf.Read(priv_->predicted_epoch, sizeof(priv_->predicted_epoch)))
+  if (!buf.Read(priv_->handshake->predicted_epoch, sizeof(priv_->handshake->predicted_epoch)))
     return ERROR_RESULT(ERR_CANNOT_PARSE_SNAP_START_DATA);
 
   Buffer server_hello_buf(buf.VariableLength(&ok, 2));
@@ -740,19 +1775,19 @@ Result Connection::SetSnapStartData(const uint8_t* data, size_t len, const uint8
     return ERROR_RESULT(ERR_CANNOT_PARSE_SNAP_START_DATA);
 
   const size_t server_hello_len = server_hello_buf.remaining();
-  priv_->predicted_server_hello.iov_base = priv_->arena.Allocate(server_hello_len);
-  priv_->predicted_server_hello.iov_len = server_hello_len;
+  priv_->handshake->predicted_server_hello.iov_base = priv_->arena.Allocate(server_hello_len);
+  priv_->handshake->predicted_server_hello.iov_len = server_hello_len;
 
-  if (!server_hello_buf.Read(priv_->predicted_server_hello.iov_base, server_hello_len))
+  if (!server_hello_buf.Read(priv_->handshake->predicted_server_hello.iov_base, server_hello_len))
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
 
   priv_->snap_start_attempt = true;
   priv_->version = priv_->predicted_server_version;
-  priv_->session_tickets = true;
+  priv_->handshake->session_tickets = true;
 
-  priv_->snap_start_application_data.iov_base = priv_->arena.Allocate(app_data_len);
-  memcpy(priv_->snap_start_application_data.iov_base, app_data, app_data_len);
-  priv_->snap_start_application_data.iov_len = app_data_len;
+  priv_->handshake->snap_start_application_data.iov_base = priv_->arena.Allocate(app_data_len);
+  memcpy(priv_->handshake->snap_start_application_data.iov_base, app_data, app_data_len);
+  priv_->handshake->snap_start_application_data.iov_len = app_data_len;
 
   return 0;
 }
@@ -761,4 +1796,19 @@ bool Connection::did_snap_start() const {
   return priv_->did_snap_start;
 }
 
+void Connection::set_snap_start_cache(SnapStartCache* cache) {
+  if (!priv_->handshake)
+    return;
+  priv_->handshake->snap_start_cache = cache;
+}
+
+Result Connection::FreeHandshakeState() {
+  if (priv_->state != AWAIT_HELLO_REQUEST)
+    return ERROR_RESULT(ERR_HANDSHAKE_NOT_COMPLETE);
+
+  delete priv_->handshake;
+  priv_->handshake = NULL;
+  return 0;
+}
+
 }  // namespace tlsclient
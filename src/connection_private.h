@@ -6,6 +6,8 @@
 #define TLSCLIENT_CONNECTION_PRIVATE_H
 
 #include "tlsclient/public/base.h"
+#include "tlsclient/public/connection.h"
+#include "tlsclient/public/verification_cache.h"
 #include "tlsclient/src/arena.h"
 #include "tlsclient/src/handshake.h"
 
@@ -15,97 +17,201 @@ namespace tlsclient {
 
 class Context;
 class Certificate;
+class CertificateChain;
 struct CipherSuite;
 class CipherSpec;
 class HandshakeHash;
+class SnapStartCache;
+class VerificationCache;
+class WorkerPool;
 
-struct ConnectionPrivate {
-  ConnectionPrivate(Context* in_ctx)
-      : ctx(in_ctx),
-        state(SEND_CLIENT_HELLO),
-        sslv3(false),
+// RecordJob describes the encryption or decryption of one record of a batch,
+// so that the records can be processed in parallel. See |RunRecordJobs|.
+struct RecordJob {
+  // When encrypting, |header| points to the record header. The prefix (see
+  // |CipherSpec::PrefixBytes|) follows it and the trailer is written to
+  // |trailer|.
+  uint8_t* header;
+  uint8_t* trailer;
+  // When decrypting, this is a copy of the record header.
+  uint8_t header_copy[5];
+  // The record's payload is described by |iov_len| elements of an array of
+  // iovecs, starting at |iov_offset|.
+  unsigned iov_offset;
+  unsigned iov_len;
+  uint64_t seq_num;
+  // ok is set to false if the record failed to encrypt or decrypt.
+  bool ok;
+};
+
+// RecordBatch is the argument to the functions which process RecordJobs.
+struct RecordBatch {
+  CipherSpec* spec;
+  struct iovec* vectors;
+  RecordJob* jobs;
+};
+
+// kCacheLineSize is the size of the cache lines which |reader| and |writer|
+// are aligned to.
+static const size_t kCacheLineSize = 64;
+
+// RecordReader is the state used to process records from the peer.
+struct RecordReader {
+  RecordReader()
+      : cipher_spec(NULL),
+        seq_num(0),
+        bytes_needed(0) {
+  }
+
+  // A NULL pointer means the NULL cipher spec.
+  CipherSpec* cipher_spec;
+  // The sequence number. See RFC 2246 section 6.
+  uint64_t seq_num;
+  // When returning vectors of application data, we need somewhere to store the
+  // iovecs. We want to avoid allocating and freeing then everytime so we keep
+  // this around. It will grow as needed but (hopefully) not shrink.
+  std::vector<struct iovec> out_vectors;
+  // This has one element for each application data record described by
+  // |out_vectors|. It's reused in the same way.
+  std::vector<RecordSpan> record_spans;
+  // The records of the current batch, when decrypting several at once. It's
+  // reused in the same way.
+  std::vector<RecordJob> jobs;
+  // If GetRecordOrHandshake stopped because the input ended part way through
+  // a record, this is the number of additional bytes needed to complete that
+  // record. Otherwise it's zero.
+  size_t bytes_needed;
+};
+
+// RecordWriter is the state used to send records to the peer.
+struct RecordWriter {
+  RecordWriter()
+      : cipher_spec(NULL),
+        seq_num(0),
+        record_scratch(NULL),
+        record_scratch_size(0),
+        batch_records(0),
+        record_sizing_ramp_bytes(0),
+        record_sizing_idle_seconds(0),
+        record_sizing_bytes_sent(0),
+        record_sizing_last_write(0),
+        corked(false),
+        cork_flush_bytes(0),
+        cork_flush_seconds(0),
+        cork_oldest_write(0) {
+    memset(&cork_stats, 0, sizeof(cork_stats));
+  }
+
+  // A NULL pointer means the NULL cipher spec.
+  CipherSpec* cipher_spec;
+  // The sequence number. See RFC 2246 section 6.
+  uint64_t seq_num;
+  // This is buffer space in which we stuff record headers, explicit IVs, MACs
+  // and padding bytes for outbound records. We want to encrypt them in place, but we need
+  // to add some bytes at the beginning and end. So we return an array of
+  // iovecs and the extra space comes from here:
+  uint8_t scratch[96];
+  // |Connection::Encrypt| needs an extra element at the end of the input
+  // vectors, so they're copied here.
+  std::vector<struct iovec> in_vectors;
+  // This is the equivalent of |scratch| for |Connection::EncryptV|, which
+  // needs space for the header and trailer of several records at once. It's
+  // allocated via |ConnectionPrivate::arena| and grows as needed.
+  uint8_t* record_scratch;
+  size_t record_scratch_size;
+  // The vectors returned by |Connection::EncryptV|.
+  std::vector<struct iovec> encrypt_vectors;
+  // The records of the current batch, when encrypting several at once.
+  std::vector<RecordJob> jobs;
+  // When a Connection appears more than once in a |Connection::EncryptBatch|,
+  // |batch_records| counts its records so far and the headers and trailers
+  // of all but the first are kept in |batch_scratch|, in slots the size of
+  // |scratch|.
+  unsigned batch_records;
+  std::vector<uint8_t> batch_scratch;
+  // See |Connection::set_record_sizing|. Dynamic record sizing is disabled if
+  // |record_sizing_ramp_bytes| is zero.
+  size_t record_sizing_ramp_bytes;
+  unsigned record_sizing_idle_seconds;
+  // The number of bytes of application data sent by |EncryptV| and friends
+  // since small records were last started.
+  uint64_t record_sizing_bytes_sent;
+  // The time of the last such write, from |Context::EpochSeconds|.
+  uint64_t record_sizing_last_write;
+  // See |Connection::Cork|.
+  bool corked;
+  size_t cork_flush_bytes;
+  unsigned cork_flush_seconds;
+  // cork_buffer holds the data which |Connection::Write| has buffered. When
+  // it's flushed, it's copied into |cork_flushed| and encrypted in place
+  // there, so that the result stays valid while further writes are buffered.
+  // It's only emptied once the flush has succeeded.
+  std::vector<uint8_t> cork_buffer;
+  std::vector<uint8_t> cork_flushed;
+  // The time at which the oldest byte in |cork_buffer| was written.
+  uint64_t cork_oldest_write;
+  CorkStats cork_stats;
+};
+
+// HandshakeData is the state which is only needed while performing a
+// handshake, and to answer questions about the handshake afterwards (such as
+// |Connection::GetResumptionData|). It's allocated separately from the
+// ConnectionPrivate so that it doesn't get in the way of the record layer and
+// so that it can be freed with |Connection::FreeHandshakeState|.
+struct HandshakeData {
+  HandshakeData()
+      : sslv3(false),
         cipher_suite_flags_enabled(0),
-        last_buffer(NULL),
-        version_established(false),
-        partial_record_remaining(0),
-        pending_records_decrypted(0),
-        application_data_allowed(false),
-        can_send_application_data(false),
-        cipher_suite(NULL),
         server_supports_renegotiation_info(false),
         server_cert(NULL),
         handshake_hash(NULL),
-        read_cipher_spec(NULL),
-        write_cipher_spec(NULL),
         pending_read_cipher_spec(NULL),
         pending_write_cipher_spec(NULL),
         session_id_len(0),
-        did_resume(false),
         resumption_data_ready(false),
         false_start(false),
         collect_snap_start(false),
         server_supports_snap_start(false),
         snap_start_data_available(false),
-        snap_start_attempt(false),
+        predicted_chain(NULL),
         snap_start_recovery(false),
-        did_snap_start(false),
         session_tickets(false),
         have_session_ticket_to_present(false),
-        expecting_session_ticket(false) {
+        expecting_session_ticket(false),
+        snap_start_cache(NULL),
+        certificate_retention(RETAIN_ALL_CERTIFICATES),
+        certificates_callback(NULL),
+        certificates_callback_arg(NULL),
+        received_certificates(false),
+        num_server_certificates(0),
+        streaming_certificates(false),
+        certificates_header_parsed(false),
+        certificates_list_remaining(0),
+        num_streamed_certificates(0),
+        fingerprint_certificates(false),
+        have_fingerprints(false),
+        verification_cache(NULL) {
     sent_client_hello.iov_base = 0;
     server_verify.iov_base = 0;
     server_verify.iov_len = 0;
     snap_start_application_data.iov_len = 0;
   }
 
-  ~ConnectionPrivate();
+  ~HandshakeData();
 
-  Arena arena;
-  Context* const ctx;
-  HandshakeState state;
   std::string host_name;
   bool sslv3;
   // cipher_suite_flags_enabled is a bitmask of CIPHERSUITE_ values (see
   // src/handshake.h) which describes the set of ciphersuites that are
   // acceptable to the user.
   unsigned cipher_suite_flags_enabled;
-  // last_buffer contains a pointer to the last marshall buffer. We assume
-  // that, by the time the client calls Connection::Get() again, it has
-  // finished with the last buffer and so we can free it. This buffer is
-  // allocated via |arena|.
-  uint8_t* last_buffer;
   struct iovec sent_client_hello;
-  // This is true if we have established a common TLS version in |version|
-  bool version_established;
-  TLSVersion version;
-  // This is the number of bytes of record payload data currently pending.
-  // This is non-zero if we parse a handshake message from a record, but
-  // there's another handshake message in the same record. In this case, next
-  // time GetRecordOrHandshake looks at the pending data it needs to know not
-  // to expect a record header at the beginning.
-  unsigned partial_record_remaining;
-  // This is the number of records which we have decrypted but not processed.
-  // This is non-zero if we're looking for a complete handshake message and
-  // it spans several encrypted records.
-  unsigned pending_records_decrypted;
-  // When returning vectors of application data, we need somewhere to store the
-  // iovecs. We want to avoid allocating and freeing then everytime so we keep
-  // this around. It will grow as needed but (hopefully) not shrink.
-  std::vector<struct iovec> out_vectors;
-  // This is true iff we have completed a handshake and are happy to pass
-  // application data records to the client.
-  bool application_data_allowed;
-  // This is true iff we are happy to send application data to the peer.
-  // Typically this is only true if we have completed the handshake but False
-  // Start and Snap Start alter this.
-  bool can_send_application_data;
   uint8_t client_random[32];
   uint8_t server_random[32];
-  const CipherSuite* cipher_suite;
   bool server_supports_renegotiation_info;
   // Each of these vectors contains an element of the server's certificate
   // chain (in the order received from the server). The underlying data is
-  // allocated from |arena|.
+  // allocated from |ConnectionPrivate::arena|.
   std::vector<struct iovec> server_certificates;
   // This is the server's certificate (i.e. the first one in it's certificate
   // chain)
@@ -113,29 +219,16 @@ struct ConnectionPrivate {
   uint8_t master_secret[48];
   uint8_t premaster_secret[48];
   HandshakeHash* handshake_hash;
-  // A NULL pointer for either of these means the NULL cipher spec.
-  CipherSpec* read_cipher_spec;
-  CipherSpec* write_cipher_spec;
   // These are the cipher specs which are waiting for a ChangeCipherSpec in
-  // order to become current.
+  // order to become current. They're distinct objects (see |SetupCiperSpec|)
+  // so that each direction has its own.
   CipherSpec* pending_read_cipher_spec;
   CipherSpec* pending_write_cipher_spec;
-  // The sequence numbers. See RFC 2246 section 6.
-  uint64_t write_seq_num;
-  uint64_t read_seq_num;
-  // This is buffer space in which we stuff record headers, MACs and padding
-  // bytes for outbound records. We want to encrypt them in place, but we need
-  // to add some bytes at the beginning and end. So we return an array of
-  // iovecs and the extra space comes from here:
-  uint8_t scratch[64];
   // If we are attempting a resume then this contains the offered session id
   // until we receive a ServerHello. Afterwards it contains the server's chosen
   // session id.
   uint8_t session_id[32];
   uint8_t session_id_len;
-  // This is set to true when a ServerHello is received which echos our
-  // attempted session resumption.
-  bool did_resume;
   // This is set to true when |session_id_len| and |master_secret| are ready.
   // (Note that session_id_len may still be zero if the server didn't offer
   // resumption.)
@@ -148,14 +241,9 @@ struct ConnectionPrivate {
   struct iovec snap_start_server_hello;
   uint8_t server_epoch[8];
 
-  // The peer's expected certificates in wire format and wire order.
-  std::vector<struct iovec> predicted_certificates;
+  // The peer's expected certificates, or NULL. We hold a reference to it.
+  CertificateChain* predicted_chain;
 
-  // This is true if we are attempting a snap start handshake.
-  bool snap_start_attempt;
-  // If we're attempting a snap start, we need to know the version that the
-  // server will agree on in order to put it in the record headers.
-  TLSVersion predicted_server_version;
   // This is the server's predicted handshake reply at the handshake level
   // (i.e. doesn't include record headers).
   uint8_t predicted_epoch[8];
@@ -163,9 +251,6 @@ struct ConnectionPrivate {
   struct iovec predicted_response;
   // If the server rejected our snap-start then this is true.
   bool snap_start_recovery;
-  // This is true if the handshake successfully managed a snap-start (without
-  // entering recovery)
-  bool did_snap_start;
   struct iovec snap_start_application_data;
 
   // This is the server's expected Finished data for the snap-start resume
@@ -183,6 +268,139 @@ struct ConnectionPrivate {
   // next session ticket will be stored in |session_ticket|.
   bool expecting_session_ticket;
   struct iovec session_ticket;
+
+  // This is the cache of predicted responses shared between Connections, or
+  // NULL. See |Connection::set_snap_start_cache|.
+  SnapStartCache* snap_start_cache;
+
+  // These determine what happens to the server's certificates once they have
+  // been received. See |Connection::set_certificate_retention| and
+  // |Connection::set_certificates_callback|.
+  CertificateRetention certificate_retention;
+  CertificatesCallback certificates_callback;
+  void* certificates_callback_arg;
+  // This is true once the server's Certificate message has been processed,
+  // at which point |server_certificates| holds whatever was retained of the
+  // |num_server_certificates| in the chain.
+  bool received_certificates;
+  unsigned num_server_certificates;
+
+  // A Certificate message which spans records is parsed as it arrives
+  // rather than being reassembled (see |StreamServerCertificate|).
+  // |streaming_certificates| is true from its first record until it has been
+  // processed. Once its header has been parsed, |certificates_list_remaining|
+  // is the number of bytes of the certificate list which are yet to arrive.
+  // |num_streamed_certificates| counts the certificates so far, of which
+  // those which are to be kept are copied into the arena and listed in
+  // |streamed_certificates|.
+  bool streaming_certificates;
+  bool certificates_header_parsed;
+  size_t certificates_list_remaining;
+  unsigned num_streamed_certificates;
+  std::vector<struct iovec> streamed_certificates;
+
+  // If |fingerprint_certificates| is true then the SHA-256 of each of the
+  // server's certificates is appended to |certificate_fingerprints| as it's
+  // received. Once they all have been, |chain_fingerprint| is set and
+  // |have_fingerprints| is true. If fingerprints were enabled too late for
+  // that, they're computed when first asked for, if the whole chain was
+  // retained. See |Connection::server_certificate_fingerprints|.
+  bool fingerprint_certificates;
+  bool have_fingerprints;
+  std::vector<Fingerprint> certificate_fingerprints;
+  Fingerprint chain_fingerprint;
+  // This is the cache of verification results shared between Connections,
+  // or NULL. See |Connection::set_verification_cache|.
+  VerificationCache* verification_cache;
+};
+
+// ConnectionPrivate is laid out for the record layer: the fields which are
+// consulted for every record come first, followed by the state of each
+// direction, each on cache lines of its own. The handshake state is in
+// |handshake|.
+struct ConnectionPrivate {
+  ConnectionPrivate(Context* in_ctx)
+      : ctx(in_ctx),
+        state(SEND_CLIENT_HELLO),
+        version_established(false),
+        application_data_allowed(false),
+        can_send_application_data(false),
+        snap_start_attempt(false),
+        partial_record_remaining(0),
+        partial_record_trailer(0),
+        handshake_reassembly_offset(0),
+        cipher_suite(NULL),
+        worker_pool(NULL),
+        handshake(new HandshakeData),
+        last_buffer(NULL),
+        did_resume(false),
+        did_snap_start(false) {
+  }
+
+  ~ConnectionPrivate();
+
+  Context* const ctx;
+  HandshakeState state;
+  // This is true if we have established a common TLS version in |version|
+  bool version_established;
+  // This is true iff we have completed a handshake and are happy to pass
+  // application data records to the client.
+  bool application_data_allowed;
+  // This is true iff we are happy to send application data to the peer.
+  // Typically this is only true if we have completed the handshake but False
+  // Start and Snap Start alter this.
+  bool can_send_application_data;
+  // This is true if we are attempting a snap start handshake.
+  bool snap_start_attempt;
+  TLSVersion version;
+  // If we're attempting a snap start, we need to know the version that the
+  // server will agree on in order to put it in the record headers.
+  TLSVersion predicted_server_version;
+  // This is the number of bytes of record payload data currently pending.
+  // This is non-zero if we parse a handshake message from a record, but
+  // there's another handshake message in the same record. In this case, next
+  // time GetRecordOrHandshake looks at the pending data it needs to know not
+  // to expect a record header at the beginning. The pending data has already
+  // been decrypted.
+  unsigned partial_record_remaining;
+  // This is the number of MAC and padding bytes which follow the
+  // |partial_record_remaining| bytes of payload.
+  unsigned partial_record_trailer;
+  // See |handshake_reassembly|.
+  size_t handshake_reassembly_offset;
+  const CipherSuite* cipher_suite;
+  // If not NULL, this is used to process the records of a batch in parallel.
+  // It's not owned by the Connection.
+  WorkerPool* worker_pool;
+
+  // The record layer state for each direction. Once the handshake is
+  // complete, |Connection::Process| and friends only change |reader| and the
+  // functions which encrypt application data only change |writer|, so the
+  // two directions can be driven from different threads. Each of them, and
+  // the fields which follow, start a new cache line so that they don't share
+  // one. (|Connection| allocates the ConnectionPrivate to match.)
+  RecordReader reader __attribute__((aligned(kCacheLineSize)));
+  RecordWriter writer __attribute__((aligned(kCacheLineSize)));
+
+  // This is NULL once |Connection::FreeHandshakeState| has been called.
+  HandshakeData* handshake __attribute__((aligned(kCacheLineSize)));
+  Arena arena;
+  // last_buffer contains a pointer to the last marshall buffer. We assume
+  // that, by the time the client calls Connection::Get() again, it has
+  // finished with the last buffer and so we can free it. This buffer is
+  // allocated via |arena|.
+  uint8_t* last_buffer;
+  // When a handshake message spans several records, each record's payload is
+  // decrypted once and appended here and the record is consumed from the
+  // input. Bytes before |handshake_reassembly_offset| belong to messages which
+  // have already been returned.
+  std::vector<uint8_t> handshake_reassembly;
+  // This is set to true when a ServerHello is received which echos our
+  // attempted session resumption.
+  bool did_resume;
+  // This is true if the handshake successfully managed a snap-start (without
+  // entering recovery)
+  bool did_snap_start;
 };
 
 }  // namespace tlsclient
@@ -1038,6 +1038,48 @@ static void Decrypt(const uint32_t *rk, const uint8_t ciphertext[16], uint8_t pl
   PUTU32(plaintext + 12, s3);
 }
 
+// EncryptLanes is the same as calling |Encrypt| for each of |n| blocks, each
+// with its own key schedule. The rounds are interleaved across the blocks so
+// that the table lookups for one aren't waiting on those for another.
+template<int nrounds>
+static void EncryptLanes(const uint32_t* const* rks, uint8_t* const* out, const uint8_t* const* in, unsigned n)
+{
+  uint32_t s[4][4], t[4][4];
+  unsigned i;
+
+  for (i = 0; i < n; i++) {
+    const uint32_t* const rk = rks[i];
+    s[i][0] = GETU32(in[i]     ) ^ rk[0];
+    s[i][1] = GETU32(in[i] +  4) ^ rk[1];
+    s[i][2] = GETU32(in[i] +  8) ^ rk[2];
+    s[i][3] = GETU32(in[i] + 12) ^ rk[3];
+  }
+
+  for (int r = 1; r < nrounds; r++) {
+    for (i = 0; i < n; i++) {
+      const uint32_t* const rk = rks[i] + (r << 2);
+      t[i][0] = Te0[s[i][0] >> 24] ^ Te1[(s[i][1] >> 16) & 0xff] ^ Te2[(s[i][2] >>  8) & 0xff] ^ Te3[s[i][3] & 0xff] ^ rk[0];
+      t[i][1] = Te0[s[i][1] >> 24] ^ Te1[(s[i][2] >> 16) & 0xff] ^ Te2[(s[i][3] >>  8) & 0xff] ^ Te3[s[i][0] & 0xff] ^ rk[1];
+      t[i][2] = Te0[s[i][2] >> 24] ^ Te1[(s[i][3] >> 16) & 0xff] ^ Te2[(s[i][0] >>  8) & 0xff] ^ Te3[s[i][1] & 0xff] ^ rk[2];
+      t[i][3] = Te0[s[i][3] >> 24] ^ Te1[(s[i][0] >> 16) & 0xff] ^ Te2[(s[i][1] >>  8) & 0xff] ^ Te3[s[i][2] & 0xff] ^ rk[3];
+    }
+    memcpy(s, t, sizeof(s));
+  }
+
+  for (i = 0; i < n; i++) {
+    const uint32_t* const rk = rks[i] + (nrounds << 2);
+    for (unsigned j = 0; j < 4; j++) {
+      const uint32_t v =
+        (Te4[(s[i][j          ] >> 24)       ] & 0xff000000) ^
+        (Te4[(s[i][(j + 1) & 3] >> 16) & 0xff] & 0x00ff0000) ^
+        (Te4[(s[i][(j + 2) & 3] >>  8) & 0xff] & 0x0000ff00) ^
+        (Te4[(s[i][(j + 3) & 3]      ) & 0xff] & 0x000000ff) ^
+        rk[j];
+      PUTU32(out[i] + 4 * j, v);
+    }
+  }
+}
+
 namespace tlsclient {
 
 AES128::AES128(const uint8_t key[16], Direction dir)
@@ -1049,7 +1091,7 @@ AES128::AES128(const uint8_t key[16], Direction dir)
   }
 }
 
-void AES128::Crypt(uint8_t out[16], const uint8_t in[16]) {
+void AES128::Crypt(uint8_t out[16], const uint8_t in[16]) const {
   if (dir_ == ENCRYPT) {
     Encrypt<ROUNDS>(c_, in, out);
   } else {
@@ -1057,6 +1099,25 @@ void AES128::Crypt(uint8_t out[16], const uint8_t in[16]) {
   }
 }
 
+void AES128::CryptLanes(const AES128* const* ciphers, uint8_t* const* out, const uint8_t* const* in, unsigned n) {
+  assert(n <= LANES);
+
+  if (!n)
+    return;
+  if (ciphers[0]->dir_ == DECRYPT) {
+    for (unsigned i = 0; i < n; i++)
+      ciphers[i]->Crypt(out[i], in[i]);
+    return;
+  }
+
+  const uint32_t* rks[LANES];
+  for (unsigned i = 0; i < n; i++) {
+    assert(ciphers[i]->dir_ == ENCRYPT);
+    rks[i] = ciphers[i]->c_;
+  }
+  EncryptLanes<ROUNDS>(rks, out, in, n);
+}
+
 AES256::AES256(const uint8_t key[16], Direction dir)
     : dir_(dir) {
   if (dir == ENCRYPT) {
@@ -1066,7 +1127,7 @@ AES256::AES256(const uint8_t key[16], Direction dir)
   }
 }
 
-void AES256::Crypt(uint8_t out[16], const uint8_t in[16]) {
+void AES256::Crypt(uint8_t out[16], const uint8_t in[16]) const {
   if (dir_ == ENCRYPT) {
     Encrypt<ROUNDS>(c_, in, out);
   } else {
@@ -1074,4 +1135,23 @@ void AES256::Crypt(uint8_t out[16], const uint8_t in[16]) {
   }
 }
 
+void AES256::CryptLanes(const AES256* const* ciphers, uint8_t* const* out, const uint8_t* const* in, unsigned n) {
+  assert(n <= LANES);
+
+  if (!n)
+    return;
+  if (ciphers[0]->dir_ == DECRYPT) {
+    for (unsigned i = 0; i < n; i++)
+      ciphers[i]->Crypt(out[i], in[i]);
+    return;
+  }
+
+  const uint32_t* rks[LANES];
+  for (unsigned i = 0; i < n; i++) {
+    assert(ciphers[i]->dir_ == ENCRYPT);
+    rks[i] = ciphers[i]->c_;
+  }
+  EncryptLanes<ROUNDS>(rks, out, in, n);
+}
+
 }  // namespace tlsclient
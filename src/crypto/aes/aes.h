@@ -15,10 +15,18 @@ class AES128 {
   enum {
     ROUNDS = 10,
     BLOCK_SIZE = 16,
+    // LANES is the maximum number of blocks which |CryptLanes| processes
+    // together.
+    LANES = 4,
   };
 
   AES128(const uint8_t key[16], Direction dir);
-  void Crypt(uint8_t out[16], const uint8_t in[16]);
+  void Crypt(uint8_t out[16], const uint8_t in[16]) const;
+  // CryptLanes is equivalent to calling |ciphers[i]->Crypt(out[i], in[i])|
+  // for each |i| < |n|, but encryption is interleaved across the blocks.
+  // The ciphers must all have the same direction and |n| must be at most
+  // |LANES|.
+  static void CryptLanes(const AES128* const* ciphers, uint8_t* const* out, const uint8_t* const* in, unsigned n);
 
  private:
   uint32_t c_[44];
@@ -30,10 +38,18 @@ class AES256 {
   enum {
     ROUNDS = 14,
     BLOCK_SIZE = 16,
+    // LANES is the maximum number of blocks which |CryptLanes| processes
+    // together.
+    LANES = 4,
   };
 
   AES256(const uint8_t key[16], Direction dir);
-  void Crypt(uint8_t out[16], const uint8_t in[16]);
+  void Crypt(uint8_t out[16], const uint8_t in[16]) const;
+  // CryptLanes is equivalent to calling |ciphers[i]->Crypt(out[i], in[i])|
+  // for each |i| < |n|, but encryption is interleaved across the blocks.
+  // The ciphers must all have the same direction and |n| must be at most
+  // |LANES|.
+  static void CryptLanes(const AES256* const* ciphers, uint8_t* const* out, const uint8_t* const* in, unsigned n);
 
  private:
   uint32_t c_[60];
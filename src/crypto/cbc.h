@@ -24,6 +24,20 @@ class CBC {
   }
 
   void Crypt(const struct iovec* in, unsigned in_len) {
+    CryptWithIV(last_, in, in_len);
+  }
+
+  // This variant of |Crypt| writes the result contiguously to |out| and
+  // leaves the input untouched. |out| may be the same as an input but mustn't
+  // otherwise overlap them.
+  void Crypt(uint8_t* out, const struct iovec* in, unsigned in_len) {
+    CryptWithIV(last_, out, in, in_len);
+  }
+
+  // These variants of |Crypt| chain from, and update, the block at |iv|
+  // rather than the object's own state. Since they don't modify the object,
+  // they may be called concurrently.
+  void CryptWithIV(uint8_t* iv, const struct iovec* in, unsigned in_len) const {
     uint8_t blockbuf[BlockCipher::BLOCK_SIZE];
     uint8_t* block;
     uint8_t last[BlockCipher::BLOCK_SIZE];
@@ -37,7 +51,7 @@ class CBC {
       block = buf.Get(blockbuf, BlockCipher::BLOCK_SIZE);
 
       if (direction_ == ENCRYPT) {
-        XorBytes<BlockCipher::BLOCK_SIZE>(block, last_);
+        XorBytes<BlockCipher::BLOCK_SIZE>(block, iv);
       } else {
         memcpy(last, block, sizeof(last));
       }
@@ -45,10 +59,10 @@ class CBC {
       cipher_.Crypt(block, block);
 
       if (direction_ == ENCRYPT) {
-        memcpy(last_, block, sizeof(last_));
+        memcpy(iv, block, BlockCipher::BLOCK_SIZE);
       } else {
-        XorBytes<BlockCipher::BLOCK_SIZE>(block, last_);
-        memcpy(last_, last, sizeof(last_));
+        XorBytes<BlockCipher::BLOCK_SIZE>(block, iv);
+        memcpy(iv, last, BlockCipher::BLOCK_SIZE);
       }
 
       len -= BlockCipher::BLOCK_SIZE;
@@ -62,6 +76,138 @@ class CBC {
     }
   }
 
+  void CryptWithIV(uint8_t* iv, uint8_t* out, const struct iovec* in, unsigned in_len) const {
+    Buffer buf(in, in_len);
+    CryptWithIV(iv, out, &buf, buf.remaining());
+  }
+
+  // This variant processes the next |len| bytes of |in|.
+  void CryptWithIV(uint8_t* iv, uint8_t* out, Buffer* in, size_t len) const {
+    uint8_t blockbuf[BlockCipher::BLOCK_SIZE];
+    uint8_t block[BlockCipher::BLOCK_SIZE];
+
+    assert(len % BlockCipher::BLOCK_SIZE == 0);
+
+    for (; len >= BlockCipher::BLOCK_SIZE; len -= BlockCipher::BLOCK_SIZE) {
+      // We take a copy of the input block since it may be the same as |out|.
+      memcpy(block, in->Get(blockbuf, BlockCipher::BLOCK_SIZE), sizeof(block));
+
+      if (direction_ == ENCRYPT) {
+        XorBytes<BlockCipher::BLOCK_SIZE>(block, iv);
+        cipher_.Crypt(out, block);
+        memcpy(iv, out, BlockCipher::BLOCK_SIZE);
+      } else {
+        cipher_.Crypt(out, block);
+        XorBytes<BlockCipher::BLOCK_SIZE>(out, iv);
+        memcpy(iv, block, BlockCipher::BLOCK_SIZE);
+      }
+
+      out += BlockCipher::BLOCK_SIZE;
+    }
+  }
+
+  // These variants process the |len| bytes at |in|, which must be a multiple
+  // of the block size, and write the result to |out|, which may be the same
+  // as |in|.
+  void Crypt(uint8_t* out, const uint8_t* in, size_t len) {
+    CryptWithIV(last_, out, in, len);
+  }
+
+  void CryptWithIV(uint8_t* iv, uint8_t* out, const uint8_t* in, size_t len) const {
+    uint8_t block[BlockCipher::BLOCK_SIZE];
+
+    assert(len % BlockCipher::BLOCK_SIZE == 0);
+
+    for (; len; len -= BlockCipher::BLOCK_SIZE) {
+      memcpy(block, in, sizeof(block));
+
+      if (direction_ == ENCRYPT) {
+        XorBytes<BlockCipher::BLOCK_SIZE>(block, iv);
+        cipher_.Crypt(out, block);
+        memcpy(iv, out, BlockCipher::BLOCK_SIZE);
+      } else {
+        cipher_.Crypt(out, block);
+        XorBytes<BlockCipher::BLOCK_SIZE>(out, iv);
+        memcpy(iv, block, BlockCipher::BLOCK_SIZE);
+      }
+
+      in += BlockCipher::BLOCK_SIZE;
+      out += BlockCipher::BLOCK_SIZE;
+    }
+  }
+
+  // EncryptLanes encrypts, in place, the next |lengths[i]| bytes of |in[i]|
+  // with |cbcs[i]|, for each |i| < |n|. Each lane chains from, and updates,
+  // the block at |ivs[i]| or, if that's NULL, the CBC's own state. Since
+  // chaining makes each lane serial, the block cipher operations are
+  // interleaved across the lanes instead. |n| must be at most
+  // |BlockCipher::LANES| and, where the CBC's own state is used, the same CBC
+  // mustn't appear twice.
+  static void EncryptLanes(CBC* const* cbcs, uint8_t* const* ivs, Buffer* const* in, const size_t* lengths, unsigned n) {
+    uint8_t blockbufs[BlockCipher::LANES][BlockCipher::BLOCK_SIZE];
+    uint8_t* blocks[BlockCipher::LANES];
+    Buffer::Pos positions[BlockCipher::LANES];
+    const BlockCipher* ciphers[BlockCipher::LANES];
+    uint8_t* chain[BlockCipher::LANES];
+    unsigned lanes[BlockCipher::LANES];
+    size_t remaining[BlockCipher::LANES];
+
+    assert(n <= BlockCipher::LANES);
+    for (unsigned i = 0; i < n; i++) {
+      assert(cbcs[i]->direction_ == ENCRYPT);
+      assert(lengths[i] % BlockCipher::BLOCK_SIZE == 0);
+      remaining[i] = lengths[i];
+    }
+
+    for (;;) {
+      unsigned active = 0;
+      for (unsigned i = 0; i < n; i++) {
+        if (!remaining[i])
+          continue;
+        positions[active] = in[i]->Tell();
+        blocks[active] = in[i]->Get(blockbufs[active], BlockCipher::BLOCK_SIZE);
+        ciphers[active] = &cbcs[i]->cipher_;
+        chain[active] = ivs[i] ? ivs[i] : cbcs[i]->last_;
+        XorBytes<BlockCipher::BLOCK_SIZE>(blocks[active], chain[active]);
+        lanes[active++] = i;
+      }
+      if (!active)
+        break;
+
+      BlockCipher::CryptLanes(ciphers, blocks, blocks, active);
+
+      for (unsigned j = 0; j < active; j++) {
+        const unsigned i = lanes[j];
+        memcpy(chain[j], blocks[j], BlockCipher::BLOCK_SIZE);
+        remaining[i] -= BlockCipher::BLOCK_SIZE;
+        if (blocks[j] == blockbufs[j]) {
+          // We had to assemble a block which spanned iovecs. Thus we need to
+          // write the result back out.
+          const Buffer::Pos end(in[i]->Tell());
+          in[i]->Seek(positions[j]);
+          in[i]->Write(blocks[j], BlockCipher::BLOCK_SIZE);
+          in[i]->Seek(end);
+        }
+      }
+    }
+  }
+
+  // The chaining block is the only state which changes as data is processed.
+  // These functions get and set it.
+  void GetChainingBlock(uint8_t out[BlockCipher::BLOCK_SIZE]) const {
+    memcpy(out, last_, sizeof(last_));
+  }
+
+  void SetChainingBlock(const uint8_t in[BlockCipher::BLOCK_SIZE]) {
+    memcpy(last_, in, sizeof(last_));
+  }
+
+  // CryptBlock applies the block cipher, without chaining, to the single
+  // block at |in|.
+  void CryptBlock(uint8_t* out, const uint8_t* in) const {
+    cipher_.Crypt(out, in);
+  }
+
  private:
   BlockCipher cipher_;
   const Direction direction_;
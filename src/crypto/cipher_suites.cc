@@ -13,6 +13,7 @@
 #include "tlsclient/src/crypto/md5/md5.h"
 #include "tlsclient/src/crypto/sha1/sha1.h"
 #include "tlsclient/src/crypto/sha256/sha256.h"
+#include "tlsclient/src/sink.h"
 
 #if 0
 #include <stdio.h>
@@ -56,6 +57,59 @@ const uint8_t kSSLv3Pad2[48] =
     0x5c, 0x5c, 0x5c, 0x5c, 0x5c, 0x5c, 0x5c, 0x5c,
     0x5c, 0x5c, 0x5c, 0x5c, 0x5c, 0x5c, 0x5c, 0x5c };
 
+// WriteRecordHeader writes a five byte record header to |out|.
+static void WriteRecordHeader(uint8_t* out, uint8_t type, uint16_t wire_version, size_t len) {
+  out[0] = type;
+  out[1] = wire_version >> 8;
+  out[2] = wire_version;
+  out[3] = len >> 8;
+  out[4] = len;
+}
+
+// SetRecordLength updates the length in the record header at |header|.
+static void SetRecordLength(uint8_t* header, size_t len) {
+  header[3] = len >> 8;
+  header[4] = len;
+}
+
+static size_t TotalLength(const struct iovec* iov, unsigned iov_len) {
+  size_t len = 0;
+  for (unsigned i = 0; i < iov_len; i++)
+    len += iov[i].iov_len;
+  return len;
+}
+
+// LaneBuffers holds a Buffer over the input of each of up to |kMaxLanes|
+// records. If |with_trailer| is true then the extra element, in which
+// |Encrypt| puts the trailer, is included.
+class LaneBuffers {
+ public:
+  LaneBuffers(RecordToEncrypt* const* records, unsigned n, bool with_trailer)
+      : buf0_(Make(records, n, 0, with_trailer)),
+        buf1_(Make(records, n, 1, with_trailer)),
+        buf2_(Make(records, n, 2, with_trailer)),
+        buf3_(Make(records, n, 3, with_trailer)) {
+    buffers_[0] = &buf0_;
+    buffers_[1] = &buf1_;
+    buffers_[2] = &buf2_;
+    buffers_[3] = &buf3_;
+  }
+
+  Buffer* const* buffers() {
+    return buffers_;
+  }
+
+ private:
+  static Buffer Make(RecordToEncrypt* const* records, unsigned n, unsigned i, bool with_trailer) {
+    if (i >= n)
+      return Buffer(NULL, 0);
+    return Buffer(records[i]->in, records[i]->in_len + (with_trailer ? 1 : 0));
+  }
+
+  Buffer buf0_, buf1_, buf2_, buf3_;
+  Buffer* buffers_[4];
+};
+
 template<class H, enum TLSVersion>
 class MAC { };
 
@@ -91,6 +145,50 @@ class MAC<H, SSLv3> {
     hash.Update(out, H::DIGEST_SIZE);
     hash.Final(out);
   }
+
+  static void Do(uint8_t* out, const uint8_t* record_header, const uint8_t* in, size_t len, uint64_t seq_num, const uint8_t* mac_secret) {
+    struct iovec iov = {const_cast<uint8_t*>(in), len};
+    Do(out, record_header, &iov, 1, seq_num, mac_secret);
+  }
+
+  // DoLanes is the same as calling |Do| for each of |n| records, with the
+  // MAC written to the record's scratch space, but the hashing of the
+  // records' data is interleaved. See |H::UpdateLanes|.
+  static void DoLanes(RecordToEncrypt* const* records, const uint8_t* const* mac_secrets, unsigned n) {
+    H hashes[kMaxLanes];
+    H* hash_ptrs[kMaxLanes];
+    size_t lengths[kMaxLanes];
+    LaneBuffers bufs(records, n, false);
+    const unsigned pad_length = H::DIGEST_SIZE == 20 ? 40 : 48;
+
+    for (unsigned i = 0; i < n; i++) {
+      H* const hash = &hashes[i];
+      hash->Update(mac_secrets[i], H::DIGEST_SIZE);
+      hash->Update(kSSLv3Pad1, pad_length);
+
+      uint8_t seq[8];
+      MarshalSeqNum(seq, records[i]->seq_num);
+      hash->Update(seq, sizeof(seq));
+
+      hash->Update(records[i]->record_header, 1);
+      hash->Update(records[i]->record_header + 3, 2);
+      hash_ptrs[i] = hash;
+      lengths[i] = bufs.buffers()[i]->size();
+    }
+
+    H::UpdateLanes(hash_ptrs, bufs.buffers(), lengths, n);
+
+    for (unsigned i = 0; i < n; i++) {
+      H* const hash = &hashes[i];
+      uint8_t* const out = records[i]->scratch;
+      hash->Final(out);
+      hash->Init();
+      hash->Update(mac_secrets[i], H::DIGEST_SIZE);
+      hash->Update(kSSLv3Pad2, pad_length);
+      hash->Update(out, H::DIGEST_SIZE);
+      hash->Final(out);
+    }
+  }
 };
 
 // MAC<TLSv10> implements the TLSv10 MAC function, as defined in RFC 2246
@@ -113,6 +211,44 @@ class MAC<H, TLSv10> {
       mac.Update(in[i].iov_base, in[i].iov_len);
     mac.Final(out);
   }
+
+  static void Do(uint8_t* out, const uint8_t* record_header, const uint8_t* in, size_t len, uint64_t seq_num, const uint8_t* mac_secret) {
+    uint8_t seq[8];
+    MarshalSeqNum(seq, seq_num);
+
+    HMAC<H> mac(mac_secret, H::DIGEST_SIZE);
+    mac.Update(seq, sizeof(seq));
+    mac.Update(record_header, 5);
+    mac.Update(in, len);
+    mac.Final(out);
+  }
+
+  // DoLanes is the same as calling |Do| for each of |n| records, with the
+  // MAC written to the record's scratch space, but the hashing of the
+  // records' data is interleaved. See |H::UpdateLanes|.
+  static void DoLanes(RecordToEncrypt* const* records, const uint8_t* const* mac_secrets, unsigned n) {
+    HMAC<H> macs[kMaxLanes];
+    HMAC<H>* mac_ptrs[kMaxLanes];
+    size_t lengths[kMaxLanes];
+    LaneBuffers bufs(records, n, false);
+
+    for (unsigned i = 0; i < n; i++) {
+      uint8_t seq[8];
+      MarshalSeqNum(seq, records[i]->seq_num);
+
+      HMAC<H>* const mac = &macs[i];
+      mac->Init(mac_secrets[i], H::DIGEST_SIZE);
+      mac->Update(seq, sizeof(seq));
+      mac->Update(records[i]->record_header, 5);
+      mac_ptrs[i] = mac;
+      lengths[i] = bufs.buffers()[i]->size();
+    }
+
+    HMAC<H>::UpdateLanes(mac_ptrs, bufs.buffers(), lengths, n);
+
+    for (unsigned i = 0; i < n; i++)
+      macs[i].Final(records[i]->scratch);
+  }
 };
 
 template<class Cipher, class H, enum TLSVersion V>
@@ -125,13 +261,23 @@ class StreamCipherSpec : public CipherSpec {
         write_(kb.client_key, kb.key_len) {
     memcpy(mac_read_, kb.server_mac, sizeof(mac_read_));
     memcpy(mac_write_, kb.client_mac, sizeof(mac_write_));
+    seal_ = SealRecord;
+    open_ = OpenRecord;
   }
 
   virtual unsigned ScratchBytesNeeded(size_t length) {
     return M::MAC_SIZE;
   }
 
-  virtual bool Encrypt(uint8_t* scratch, size_t* scratch_size, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
+  virtual unsigned PrefixBytes() {
+    return 0;
+  }
+
+  virtual bool SupportsParallelRecords() {
+    return false;
+  }
+
+  virtual bool Encrypt(uint8_t* prefix, uint8_t* scratch, size_t* scratch_size, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
     if (*scratch_size < M::MAC_SIZE)
       return false;
 
@@ -144,12 +290,93 @@ class StreamCipherSpec : public CipherSpec {
     return true;
   }
 
+  virtual bool EncryptTo(uint8_t* out, size_t* out_len, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
+    const size_t len = TotalLength(in, in_len);
+    // The MAC is written in the clear where it'll end up and then encrypted
+    // in place along with everything else.
+    M::Do(out + len, record_header, in, in_len, seq_num, mac_write_);
+
+    in[in_len].iov_base = out + len;
+    in[in_len].iov_len = M::MAC_SIZE;
+    write_.Encrypt(out, in, in_len + 1);
+    *out_len = len + M::MAC_SIZE;
+    return true;
+  }
+
   virtual bool Decrypt(unsigned* bytes_stripped, struct iovec* iov, unsigned* iov_len, const uint8_t* record_header, uint64_t seq_num) {
+    read_.Decrypt(iov, *iov_len);
+    return CheckMAC(bytes_stripped, iov, iov_len, record_header, seq_num);
+  }
+
+  virtual bool DecryptTo(uint8_t* out, size_t* out_len, const struct iovec* in, unsigned in_len, const uint8_t* record_header, uint64_t seq_num) {
+    struct iovec iov = {out, TotalLength(in, in_len)};
+    unsigned iov_len = 1;
+    unsigned bytes_stripped;
+
+    read_.Decrypt(out, in, in_len);
+    if (!CheckMAC(&bytes_stripped, &iov, &iov_len, record_header, seq_num))
+      return false;
+    *out_len = iov_len ? iov.iov_len : 0;
+    return true;
+  }
+
+  virtual void ExportState(Sink* sink) {
+    read_.GetState(sink->Block(Cipher::STATE_SIZE));
+    write_.GetState(sink->Block(Cipher::STATE_SIZE));
+  }
+
+  virtual bool ImportState(Buffer* buf) {
+    uint8_t state[Cipher::STATE_SIZE];
+    if (!buf->Read(state, sizeof(state)))
+      return false;
+    read_.SetState(state);
+    if (!buf->Read(state, sizeof(state)))
+      return false;
+    write_.SetState(state);
+    return true;
+  }
+
+  // SealRecord and OpenRecord are the |SealFunction| and |OpenFunction| for
+  // this CipherSpec.
+  static bool SealRecord(CipherSpec* base, uint8_t* record, size_t* record_len, uint8_t type, uint16_t wire_version, const uint8_t* in, size_t len, uint64_t seq_num) {
+    StreamCipherSpec* const spec = static_cast<StreamCipherSpec*>(base);
+    uint8_t* const payload = record + 5;
+    uint8_t* const mac = payload + len;
+
+    WriteRecordHeader(record, type, wire_version, len);
+    M::Do(mac, record, in, len, seq_num, spec->mac_write_);
+    spec->write_.Encrypt(payload, in, len);
+    spec->write_.Encrypt(mac, mac, M::MAC_SIZE);
+    SetRecordLength(record, len + M::MAC_SIZE);
+    *record_len = 5 + len + M::MAC_SIZE;
+    return true;
+  }
+
+  static bool OpenRecord(CipherSpec* base, uint8_t** plaintext, size_t* plaintext_len, const uint8_t* record_header, uint8_t* payload, size_t len, uint64_t seq_num) {
+    StreamCipherSpec* const spec = static_cast<StreamCipherSpec*>(base);
+    if (len < M::MAC_SIZE)
+      return false;
+
+    spec->read_.Encrypt(payload, payload, len);
+    const size_t n = len - M::MAC_SIZE;
+    uint8_t header[5];
+    memcpy(header, record_header, sizeof(header));
+    SetRecordLength(header, n);
+
+    uint8_t mac[M::MAC_SIZE];
+    M::Do(mac, header, payload, n, seq_num, spec->mac_read_);
+    *plaintext = payload;
+    *plaintext_len = n;
+    return CompareBytes(mac, payload + n, sizeof(mac));
+  }
+
+ private:
+  // CheckMAC verifies and removes the MAC from the end of the decrypted
+  // record in |iov|.
+  bool CheckMAC(unsigned* bytes_stripped, struct iovec* iov, unsigned* iov_len, const uint8_t* record_header, uint64_t seq_num) {
     uint8_t scratch1[M::MAC_SIZE];
     uint8_t scratch2[M::MAC_SIZE];
 
-    read_.Decrypt(iov, *iov_len);
-
     Buffer buf(iov, *iov_len);
     const size_t len = buf.size();
     if (len < M::MAC_SIZE)
@@ -167,17 +394,12 @@ class StreamCipherSpec : public CipherSpec {
     record_header_copy[4] = record_length;
 
     Buffer::RemoveTrailingBytes(iov, iov_len, M::MAC_SIZE);
+    *bytes_stripped = M::MAC_SIZE;
 
     M::Do(scratch1, record_header_copy, iov, *iov_len, seq_num, mac_read_);
     return CompareBytes(scratch1, scratch2, sizeof(scratch1));
   }
 
-  virtual unsigned StripMACAndPadding(struct iovec* iov, unsigned* iov_len) {
-    Buffer::RemoveTrailingBytes(iov, iov_len, M::MAC_SIZE);
-    return M::MAC_SIZE;
-  }
-
- private:
   Cipher read_;
   Cipher write_;
   uint8_t mac_read_[H::DIGEST_SIZE];
@@ -189,11 +411,18 @@ class CBCCipherSpec : public CipherSpec {
  public:
   typedef MAC<H, V> M;
 
-  CBCCipherSpec(const KeyBlock& kb)
+  // If |explicit_iv| is true then each record starts with its own IV, as in
+  // TLS 1.1 and later (RFC 4346 section 6.2.3.2). Otherwise the CBC state is
+  // carried from one record to the next.
+  CBCCipherSpec(const KeyBlock& kb, bool explicit_iv)
       : read_(kb.server_key, kb.server_iv, DECRYPT),
-        write_(kb.client_key, kb.client_iv, ENCRYPT) {
+        write_(kb.client_key, kb.client_iv, ENCRYPT),
+        explicit_iv_(explicit_iv) {
     memcpy(mac_read_, kb.server_mac, sizeof(mac_read_));
     memcpy(mac_write_, kb.client_mac, sizeof(mac_write_));
+    memcpy(iv_mask_, kb.client_iv, sizeof(iv_mask_));
+    seal_ = SealRecord;
+    open_ = OpenRecord;
   }
 
   unsigned PaddingNeeded(size_t length) {
@@ -205,7 +434,15 @@ class CBCCipherSpec : public CipherSpec {
     return M::MAC_SIZE + PaddingNeeded(length + M::MAC_SIZE);
   }
 
-  virtual bool Encrypt(uint8_t* scratch, size_t* scratch_size, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
+  virtual unsigned PrefixBytes() {
+    return explicit_iv_ ? Cipher::BLOCK_SIZE : 0;
+  }
+
+  virtual bool SupportsParallelRecords() {
+    return explicit_iv_;
+  }
+
+  virtual bool Encrypt(uint8_t* prefix, uint8_t* scratch, size_t* scratch_size, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
     size_t len = 0;
     for (unsigned i = 0; i < in_len; i++)
       len += in[i].iov_len;
@@ -217,20 +454,222 @@ class CBCCipherSpec : public CipherSpec {
 
     in[in_len].iov_base = scratch;
     in[in_len].iov_len = M::MAC_SIZE + padding;
-    write_.Crypt(in, in_len + 1);
+    if (explicit_iv_) {
+      uint8_t iv[Cipher::BLOCK_SIZE];
+      ExplicitIV(prefix, seq_num);
+      memcpy(iv, prefix, sizeof(iv));
+      write_.CryptWithIV(iv, in, in_len + 1);
+    } else {
+      write_.Crypt(in, in_len + 1);
+    }
+    return true;
+  }
+
+  virtual bool EncryptTo(uint8_t* out, size_t* out_len, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
+    const size_t len = TotalLength(in, in_len);
+    const unsigned padding = PaddingNeeded(len + M::MAC_SIZE);
+    const unsigned prefix = PrefixBytes();
+    // The MAC and padding are written in the clear where they'll end up and
+    // then encrypted in place along with everything else.
+    uint8_t* const trailer = out + prefix + len;
+
+    M::Do(trailer, record_header, in, in_len, seq_num, mac_write_);
+    memset(trailer + M::MAC_SIZE, padding - 1, padding);
+
+    in[in_len].iov_base = trailer;
+    in[in_len].iov_len = M::MAC_SIZE + padding;
+    if (explicit_iv_) {
+      uint8_t iv[Cipher::BLOCK_SIZE];
+      ExplicitIV(out, seq_num);
+      memcpy(iv, out, sizeof(iv));
+      write_.CryptWithIV(iv, out + prefix, in, in_len + 1);
+    } else {
+      write_.Crypt(out, in, in_len + 1);
+    }
+    *out_len = prefix + len + M::MAC_SIZE + padding;
+    return true;
+  }
+
+  virtual void ExportState(Sink* sink) {
+    // With explicit IVs the chaining blocks are reset for every record, so
+    // there's nothing to export.
+    if (explicit_iv_)
+      return;
+    read_.GetChainingBlock(sink->Block(Cipher::BLOCK_SIZE));
+    write_.GetChainingBlock(sink->Block(Cipher::BLOCK_SIZE));
+  }
+
+  virtual bool ImportState(Buffer* buf) {
+    if (explicit_iv_)
+      return true;
+    uint8_t block[Cipher::BLOCK_SIZE];
+    if (!buf->Read(block, sizeof(block)))
+      return false;
+    read_.SetChainingBlock(block);
+    if (!buf->Read(block, sizeof(block)))
+      return false;
+    write_.SetChainingBlock(block);
     return true;
   }
 
+  virtual const void* LaneKind() {
+    return &kLaneKind;
+  }
+
+  virtual void EncryptLanes(RecordToEncrypt* const* records, unsigned n) {
+    CBCCipherSpec* specs[kMaxLanes];
+    CBC<Cipher>* cbcs[kMaxLanes];
+    const uint8_t* mac_secrets[kMaxLanes] = { NULL };
+    uint8_t ivs[kMaxLanes][Cipher::BLOCK_SIZE];
+    uint8_t* iv_ptrs[kMaxLanes];
+    size_t lengths[kMaxLanes];
+
+    for (unsigned i = 0; i < n; i++) {
+      specs[i] = static_cast<CBCCipherSpec*>(records[i]->spec);
+      cbcs[i] = &specs[i]->write_;
+      mac_secrets[i] = specs[i]->mac_write_;
+    }
+
+    M::DoLanes(records, mac_secrets, n);
+
+    for (unsigned i = 0; i < n; i++) {
+      RecordToEncrypt* const r = records[i];
+      const size_t len = TotalLength(r->in, r->in_len);
+      const unsigned padding = PaddingNeeded(len + M::MAC_SIZE);
+      r->scratch_size = M::MAC_SIZE + padding;
+      memset(r->scratch + M::MAC_SIZE, padding - 1, padding);
+      r->in[r->in_len].iov_base = r->scratch;
+      r->in[r->in_len].iov_len = M::MAC_SIZE + padding;
+      lengths[i] = len + M::MAC_SIZE + padding;
+
+      iv_ptrs[i] = NULL;
+      if (specs[i]->explicit_iv_) {
+        specs[i]->ExplicitIV(r->prefix, r->seq_num);
+        memcpy(ivs[i], r->prefix, sizeof(ivs[i]));
+        iv_ptrs[i] = ivs[i];
+      }
+      r->ok = true;
+    }
+
+    LaneBuffers bufs(records, n, true);
+    CBC<Cipher>::EncryptLanes(cbcs, iv_ptrs, bufs.buffers(), lengths, n);
+  }
+
   virtual bool Decrypt(unsigned* bytes_stripped, struct iovec* iov, unsigned* iov_len, const uint8_t* record_header, uint64_t seq_num) {
-    Buffer buf(iov, *iov_len);
+    const size_t len = TotalLength(iov, *iov_len);
+    const unsigned prefix = PrefixBytes();
+    if (len <= prefix || (len - prefix) % Cipher::BLOCK_SIZE || len - prefix < M::MAC_SIZE)
+      return false;
 
-    size_t len = buf.size();
-    if (!len || len % Cipher::BLOCK_SIZE || len < M::MAC_SIZE)
+    if (explicit_iv_) {
+      uint8_t iv[Cipher::BLOCK_SIZE];
+      Buffer buf(iov, *iov_len);
+      buf.Read(iv, sizeof(iv));
+      Buffer::RemoveLeadingBytes(iov, iov_len, prefix);
+      read_.CryptWithIV(iv, iov, *iov_len);
+    } else {
+      read_.Crypt(iov, *iov_len);
+    }
+    return CheckPaddingAndMAC(bytes_stripped, iov, iov_len, record_header, seq_num);
+  }
+
+  virtual bool DecryptTo(uint8_t* out, size_t* out_len, const struct iovec* in, unsigned in_len, const uint8_t* record_header, uint64_t seq_num) {
+    const size_t len = TotalLength(in, in_len);
+    const unsigned prefix = PrefixBytes();
+    struct iovec iov = {out, len - prefix};
+    unsigned iov_len = 1;
+    unsigned bytes_stripped;
+
+    if (len <= prefix || (len - prefix) % Cipher::BLOCK_SIZE || len - prefix < M::MAC_SIZE)
       return false;
 
-    read_.Crypt(iov, *iov_len);
+    if (explicit_iv_) {
+      uint8_t iv[Cipher::BLOCK_SIZE];
+      Buffer buf(in, in_len);
+      buf.Read(iv, sizeof(iv));
+      read_.CryptWithIV(iv, out, &buf, len - prefix);
+    } else {
+      read_.Crypt(out, in, in_len);
+    }
+    if (!CheckPaddingAndMAC(&bytes_stripped, &iov, &iov_len, record_header, seq_num))
+      return false;
+    *out_len = iov_len ? iov.iov_len : 0;
+    return true;
+  }
+
+  // SealRecord and OpenRecord are the |SealFunction| and |OpenFunction| for
+  // this CipherSpec.
+  static bool SealRecord(CipherSpec* base, uint8_t* record, size_t* record_len, uint8_t type, uint16_t wire_version, const uint8_t* in, size_t len, uint64_t seq_num) {
+    CBCCipherSpec* const spec = static_cast<CBCCipherSpec*>(base);
+    const unsigned prefix = spec->explicit_iv_ ? Cipher::BLOCK_SIZE : 0;
+    const unsigned padding = spec->PaddingNeeded(len + M::MAC_SIZE);
+    const size_t n = len + M::MAC_SIZE + padding;
+    uint8_t* const payload = record + 5;
+    uint8_t* const data = payload + prefix;
+
+    // The plaintext, MAC and padding are assembled where they'll end up and
+    // then encrypted in place.
+    if (in != data)
+      memcpy(data, in, len);
+    WriteRecordHeader(record, type, wire_version, len);
+    M::Do(data + len, record, data, len, seq_num, spec->mac_write_);
+    memset(data + len + M::MAC_SIZE, padding - 1, padding);
+
+    if (spec->explicit_iv_) {
+      uint8_t iv[Cipher::BLOCK_SIZE];
+      spec->ExplicitIV(payload, seq_num);
+      memcpy(iv, payload, sizeof(iv));
+      spec->write_.CryptWithIV(iv, data, data, n);
+    } else {
+      spec->write_.Crypt(data, data, n);
+    }
+    SetRecordLength(record, prefix + n);
+    *record_len = 5 + prefix + n;
+    return true;
+  }
+
+  static bool OpenRecord(CipherSpec* base, uint8_t** plaintext, size_t* plaintext_len, const uint8_t* record_header, uint8_t* payload, size_t len, uint64_t seq_num) {
+    CBCCipherSpec* const spec = static_cast<CBCCipherSpec*>(base);
+    const unsigned prefix = spec->explicit_iv_ ? Cipher::BLOCK_SIZE : 0;
+    if (len <= prefix || (len - prefix) % Cipher::BLOCK_SIZE || len - prefix < M::MAC_SIZE)
+      return false;
+
+    uint8_t* const data = payload + prefix;
+    const size_t n = len - prefix;
+    if (spec->explicit_iv_) {
+      uint8_t iv[Cipher::BLOCK_SIZE];
+      memcpy(iv, payload, sizeof(iv));
+      spec->read_.CryptWithIV(iv, data, data, n);
+    } else {
+      spec->read_.Crypt(data, data, n);
+    }
+    return spec->CheckPaddingAndMAC(plaintext, plaintext_len, record_header, data, n, seq_num);
+  }
+
+ private:
+  // ExplicitIV writes the IV for the record with the given sequence number to
+  // |out|. TLS requires that IVs be unpredictable, so rather than use
+  // randomness, which we don't have here, the IV is the encryption of the
+  // sequence number, masked with the (otherwise unused) IV from the key
+  // block. See NIST SP 800-38A, appendix C. This also means that records can
+  // be encrypted independently.
+  void ExplicitIV(uint8_t* out, uint64_t seq_num) {
+    uint8_t block[Cipher::BLOCK_SIZE];
+    memcpy(block, iv_mask_, sizeof(block));
+    uint8_t seq[8];
+    MarshalSeqNum(seq, seq_num);
+    XorBytes<8>(block + sizeof(block) - 8, seq);
+    write_.CryptBlock(out, block);
+  }
+
+  // CheckPaddingAndMAC verifies and removes the padding and MAC from the end
+  // of the decrypted record in |iov|.
+  bool CheckPaddingAndMAC(unsigned* bytes_stripped, struct iovec* iov, unsigned* iov_len, const uint8_t* record_header, uint64_t seq_num) {
+    Buffer buf(iov, *iov_len);
+    const size_t len = buf.size();
+
     buf.Advance(len - 1);
-    uint8_t padding_bytes;
+    uint8_t padding_bytes = 0;
     buf.U8(&padding_bytes);
     unsigned trailing_bytes = M::MAC_SIZE + static_cast<unsigned>(padding_bytes) + 1;
     bool padding_size_failed = false;
@@ -248,19 +687,20 @@ class CBCCipherSpec : public CipherSpec {
     uint8_t padding[256];
     buf.Read(padding, padding_bytes);
 
+    // The MAC covers the length of the plaintext, which excludes any prefix
+    // as well as the trailer.
     uint8_t record_header_copy[5];
     memcpy(record_header_copy, record_header, 5);
-    uint16_t record_length = static_cast<uint16_t>(record_header[3]) << 8 |
-                             record_header[4];
-    record_length -= M::MAC_SIZE;
+    const uint16_t record_length = len - trailing_bytes;
     record_header_copy[3] = record_length >> 8;
     record_header_copy[4] = record_length;
 
     Buffer::RemoveTrailingBytes(iov, iov_len, trailing_bytes);
+    *bytes_stripped = trailing_bytes;
 
     uint8_t scratch2[M::MAC_SIZE];
     M::Do(scratch2, record_header_copy, iov, *iov_len, seq_num, mac_read_);
-    bool mac_failed = CompareBytes(scratch1, scratch2, sizeof(scratch1));
+    const bool mac_failed = !CompareBytes(scratch1, scratch2, sizeof(scratch1));
 
     // We have to check the padding bytes after the MAC otherwise we might leak
     // a strong timing signal that would let an attacker tell the difference
@@ -275,23 +715,51 @@ class CBCCipherSpec : public CipherSpec {
     return !padding_failed && !padding_size_failed && !mac_failed;
   }
 
-  virtual unsigned StripMACAndPadding(struct iovec* iov, unsigned* iov_len) {
-    Buffer buf(iov, *iov_len);
-    buf.Advance(buf.size() - 1);
-    uint8_t padding_bytes;
-    buf.U8(&padding_bytes);
-    const unsigned removed = M::MAC_SIZE + static_cast<unsigned>(padding_bytes) + 1;
-    Buffer::RemoveTrailingBytes(iov, iov_len, removed);
-    return removed;
+  // This variant checks the |len| bytes of decrypted record at |data| and
+  // sets |plaintext| and |plaintext_len| to the data before the MAC.
+  bool CheckPaddingAndMAC(uint8_t** plaintext, size_t* plaintext_len, const uint8_t* record_header, uint8_t* data, size_t len, uint64_t seq_num) {
+    const uint8_t padding_bytes = data[len - 1];
+    size_t trailing_bytes = M::MAC_SIZE + static_cast<unsigned>(padding_bytes) + 1;
+    bool padding_size_failed = false;
+
+    if (trailing_bytes > len) {
+      padding_size_failed = true;
+      trailing_bytes = len;
+    }
+
+    const size_t n = len - trailing_bytes;
+    uint8_t record_header_copy[5];
+    memcpy(record_header_copy, record_header, 5);
+    SetRecordLength(record_header_copy, n);
+
+    uint8_t mac[M::MAC_SIZE];
+    M::Do(mac, record_header_copy, data, n, seq_num, mac_read_);
+    const bool mac_failed = !CompareBytes(mac, data + n, sizeof(mac));
+
+    // As above, the padding is checked after the MAC.
+    uint8_t padding_failed = 0;
+    for (size_t i = n + M::MAC_SIZE; i < len - 1; i++)
+      padding_failed |= data[i] ^ padding_bytes;
+
+    *plaintext = data;
+    *plaintext_len = n;
+    return !padding_failed && !padding_size_failed && !mac_failed;
   }
 
- private:
+  // kLaneKind is the result of |LaneKind|. Only its address matters.
+  static const char kLaneKind;
+
   CBC<Cipher> read_;
   CBC<Cipher> write_;
+  const bool explicit_iv_;
   uint8_t mac_read_[H::DIGEST_SIZE];
   uint8_t mac_write_[H::DIGEST_SIZE];
+  uint8_t iv_mask_[Cipher::BLOCK_SIZE];
 };
 
+template<class Cipher, class H, enum TLSVersion V>
+const char CBCCipherSpec<Cipher, H, V>::kLaneKind = 0;
+
 template<class Cipher, class Hash>
 CipherSpec* CreateStreamCipher(TLSVersion version, const KeyBlock& kb) {
   if (version == SSLv3) {
@@ -304,9 +772,10 @@ CipherSpec* CreateStreamCipher(TLSVersion version, const KeyBlock& kb) {
 template<class Cipher, class Hash>
 CipherSpec* CreateCBCCipher(TLSVersion version, const KeyBlock& kb) {
   if (version == SSLv3) {
-    return new CBCCipherSpec<Cipher, Hash, SSLv3>(kb);
+    return new CBCCipherSpec<Cipher, Hash, SSLv3>(kb, false);
   } else {
-    return new CBCCipherSpec<Cipher, Hash, TLSv10>(kb);
+    // TLS 1.1 and 1.2 use the same MAC as TLS 1.0.
+    return new CBCCipherSpec<Cipher, Hash, TLSv10>(kb, version != TLSv10);
   }
 }
 
@@ -326,10 +795,61 @@ static const CipherSuite kCipherSuites[] = {
   { 0, 0, "", 0, 0, 0, NULL },
 };
 
+bool GenericSeal(CipherSpec* spec, uint8_t* record, size_t* record_len, uint8_t type, uint16_t wire_version, const uint8_t* in, size_t len, uint64_t seq_num) {
+  // EncryptTo needs an extra element at the end.
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<uint8_t*>(in);
+  iov[0].iov_len = len;
+
+  WriteRecordHeader(record, type, wire_version, len);
+  size_t written;
+  if (!spec->EncryptTo(record + 5, &written, record, iov, 1, seq_num))
+    return false;
+  SetRecordLength(record, written);
+  *record_len = 5 + written;
+  return true;
+}
+
+bool GenericOpen(CipherSpec* spec, uint8_t** plaintext, size_t* plaintext_len, const uint8_t* record_header, uint8_t* payload, size_t len, uint64_t seq_num) {
+  struct iovec iov = {payload, len};
+  unsigned iov_len = 1;
+  unsigned bytes_stripped;
+
+  if (!spec->Decrypt(&bytes_stripped, &iov, &iov_len, record_header, seq_num))
+    return false;
+  *plaintext = iov_len ? static_cast<uint8_t*>(iov.iov_base) : payload;
+  *plaintext_len = iov_len ? iov.iov_len : 0;
+  return true;
+}
+
 const CipherSuite* AllCipherSuites() {
   return kCipherSuites;
 }
 
+void EncryptRecords(RecordToEncrypt* records, unsigned n) {
+  for (unsigned i = 0; i < n;) {
+    CipherSpec* const spec = records[i].spec;
+    const void* const kind = spec->LaneKind();
+    RecordToEncrypt* lanes[kMaxLanes];
+    unsigned num_lanes = 0;
+
+    lanes[num_lanes++] = &records[i++];
+    // Records are only taken from a consecutive run so that those for the
+    // same CipherSpec stay in order.
+    while (kind && num_lanes < kMaxLanes && i < n &&
+           records[i].spec->LaneKind() == kind) {
+      bool duplicate = false;
+      for (unsigned j = 0; j < num_lanes; j++)
+        duplicate |= lanes[j]->spec == records[i].spec;
+      if (duplicate)
+        break;
+      lanes[num_lanes++] = &records[i++];
+    }
+
+    spec->EncryptLanes(lanes, num_lanes);
+  }
+}
+
 bool CompareBytes(const uint8_t* a, const uint8_t* b, unsigned len) {
   uint8_t v = 0;
 
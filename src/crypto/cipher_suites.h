@@ -10,7 +10,9 @@
 
 namespace tlsclient {
 
+class Buffer;
 struct KeyBlock;
+class Sink;
 
 enum {
   CIPHERSUITE_RSA = 1 << 0,
@@ -23,10 +25,49 @@ enum {
   CIPHERSUITE_CBC = 1 << 7,
 };
 
+class CipherSpec;
+
+// A SealFunction builds a complete record of the given |type| and
+// |wire_version| at |record|: the five byte header followed by the encrypted
+// payload for the |len| bytes at |in|. |record| must have space for five
+// bytes plus |len| plus |PrefixBytes| plus |ScratchBytesNeeded|, and
+// |record_len| is set to the number of bytes written. |in| may point to
+// |record| + 5 + |PrefixBytes|, in which case the data is encrypted in place,
+// but mustn't otherwise overlap |record|.
+typedef bool (*SealFunction)(CipherSpec* spec, uint8_t* record, size_t* record_len, uint8_t type, uint16_t wire_version, const uint8_t* in, size_t len, uint64_t seq_num);
+// An OpenFunction decrypts, in place, the |len| byte payload at |payload| of
+// the record with the given header and checks its MAC. On success,
+// |plaintext| and |plaintext_len| are set to the plaintext within |payload|.
+typedef bool (*OpenFunction)(CipherSpec* spec, uint8_t** plaintext, size_t* plaintext_len, const uint8_t* record_header, uint8_t* payload, size_t len, uint64_t seq_num);
+
+bool GenericSeal(CipherSpec* spec, uint8_t* record, size_t* record_len, uint8_t type, uint16_t wire_version, const uint8_t* in, size_t len, uint64_t seq_num);
+bool GenericOpen(CipherSpec* spec, uint8_t** plaintext, size_t* plaintext_len, const uint8_t* record_header, uint8_t* payload, size_t len, uint64_t seq_num);
+
+// kMaxLanes is the largest number of records which are encrypted together by
+// |CipherSpec::EncryptLanes|.
+static const unsigned kMaxLanes = 4;
+
+// RecordToEncrypt describes a single record to be encrypted by
+// |EncryptRecords|. The members are the arguments to |CipherSpec::Encrypt|.
+struct RecordToEncrypt {
+  CipherSpec* spec;
+  uint8_t* prefix;
+  uint8_t* scratch;
+  size_t scratch_size;
+  const uint8_t* record_header;
+  struct iovec* in;
+  unsigned in_len;
+  uint64_t seq_num;
+  // ok is set to the result of |Encrypt|.
+  bool ok;
+};
+
 class CipherSpec {
  public:
   CipherSpec()
-      : ref_count_(1) {
+      : seal_(GenericSeal),
+        open_(GenericOpen),
+        ref_count_(1) {
   }
 
   virtual ~CipherSpec() { }
@@ -34,11 +75,78 @@ class CipherSpec {
   // ScratchBytesNeeded returns the number of scratch bytes needed to encrypt
   // data with the given total length.
   virtual unsigned ScratchBytesNeeded(size_t length) = 0;
+  // PrefixBytes returns the number of bytes at the start of each record
+  // payload which precede the encrypted data. (This is the explicit IV of a
+  // CBC cipher in TLS 1.1 and later.)
+  virtual unsigned PrefixBytes() = 0;
+  // SupportsParallelRecords returns true if each record can be processed
+  // given only its sequence number. In that case, the functions below may be
+  // called concurrently for different records.
+  virtual bool SupportsParallelRecords() = 0;
+  // Encrypt writes |PrefixBytes| bytes to |prefix| and the trailer (MAC and
+  // padding) to |scratch| and encrypts |in| in place.
   // WARNING: |in| must have space for an extra element at the end, after
   //   |in_len| elements.
-  virtual bool Encrypt(uint8_t* scratch, size_t* scratch_size, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) = 0;
+  virtual bool Encrypt(uint8_t* prefix, uint8_t* scratch, size_t* scratch_size, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) = 0;
+  // Decrypt decrypts |iov| in place and removes the prefix from the
+  // beginning, and the trailer from the end, of it. |bytes_stripped| is set
+  // to the length of the trailer.
   virtual bool Decrypt(unsigned* bytes_stripped, struct iovec* iov, unsigned* iov_len, const uint8_t* record_header, uint64_t seq_num) = 0;
-  virtual unsigned StripMACAndPadding(struct iovec* iov, unsigned* iov_len) = 0;
+  // EncryptTo is the same as |Encrypt| except that the data in |in| is left
+  // untouched. Instead the whole record payload (prefix, encrypted data, MAC
+  // and padding) is written to |out|, which must have space for the length of
+  // |in| plus |PrefixBytes| plus |ScratchBytesNeeded|. |out_len| is set to the
+  // number of bytes written. If |in_len| is one then |out| + |PrefixBytes| may
+  // point to the data in |in|, in which case the data is encrypted in place.
+  // WARNING: |in| must have space for an extra element at the end, after
+  //   |in_len| elements.
+  virtual bool EncryptTo(uint8_t* out, size_t* out_len, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) = 0;
+  // DecryptTo is the same as |Decrypt| except that the data in |in| is left
+  // untouched. Instead the record payload, less the prefix, is decrypted into
+  // |out|, which must have space for all of it. |out_len| is set to the number
+  // of bytes of plaintext.
+  virtual bool DecryptTo(uint8_t* out, size_t* out_len, const struct iovec* in, unsigned in_len, const uint8_t* record_header, uint64_t seq_num) = 0;
+
+  // ExportState appends to |sink| the part of the CipherSpec's state which
+  // changes as records are processed, i.e. which isn't derived from the key
+  // block. (For example, the RC4 keystream state or the CBC chaining block.)
+  virtual void ExportState(Sink* sink) = 0;
+  // ImportState restores state from the result of |ExportState| on a
+  // CipherSpec of the same type and key block. It returns false if the data
+  // is malformed.
+  virtual bool ImportState(Buffer* buf) = 0;
+
+  // LaneKind returns a value which is the same for all CipherSpecs whose
+  // records can be encrypted together by |EncryptLanes|, or NULL if this
+  // CipherSpec doesn't support that.
+  virtual const void* LaneKind() {
+    return NULL;
+  }
+  // EncryptLanes is equivalent to calling |Encrypt| for each of |n| records,
+  // but the hashing and encryption of the records are interleaved so that
+  // the serial work for each one fills the vector units. The CipherSpecs of
+  // the records must all have the same |LaneKind| as this one and must all
+  // be different. |n| must be at most |kMaxLanes|.
+  virtual void EncryptLanes(RecordToEncrypt* const* records, unsigned n) {
+    for (unsigned i = 0; i < n; i++) {
+      RecordToEncrypt* const r = records[i];
+      r->ok = r->spec->Encrypt(r->prefix, r->scratch, &r->scratch_size, r->record_header, r->in, r->in_len, r->seq_num);
+    }
+  }
+
+  // Seal and Open process a single record whose data is contiguous. They
+  // call the functions installed by the CipherSpec's constructor which, for
+  // the CipherSpecs of |AllCipherSuites|, are specialised for the cipher,
+  // hash and TLS version and so avoid the virtual calls and iovec handling
+  // of the functions above. Otherwise they're built on |EncryptTo| and
+  // |Decrypt|. See |SealFunction| and |OpenFunction|.
+  bool Seal(uint8_t* record, size_t* record_len, uint8_t type, uint16_t wire_version, const uint8_t* in, size_t len, uint64_t seq_num) {
+    return seal_(this, record, record_len, type, wire_version, in, len, seq_num);
+  }
+
+  bool Open(uint8_t** plaintext, size_t* plaintext_len, const uint8_t* record_header, uint8_t* payload, size_t len, uint64_t seq_num) {
+    return open_(this, plaintext, plaintext_len, record_header, payload, len, seq_num);
+  }
 
   void AddRef() {
     ref_count_++;
@@ -50,6 +158,10 @@ class CipherSpec {
       delete this;
   }
 
+ protected:
+  SealFunction seal_;
+  OpenFunction open_;
+
  private:
   unsigned ref_count_;
 };
@@ -73,6 +185,12 @@ struct CipherSuite {
 
 const CipherSuite *AllCipherSuites();
 
+// EncryptRecords encrypts each of |records|, in order. Runs of consecutive
+// records whose CipherSpecs have the same |LaneKind| are encrypted together
+// with |CipherSpec::EncryptLanes|, so callers should group records by
+// cipher suite where they can.
+void EncryptRecords(RecordToEncrypt* records, unsigned n);
+
 // CompareBytes returns true iff a and b are the same and works in constant
 // time.
 bool CompareBytes(const uint8_t* a, const uint8_t* b, unsigned len);
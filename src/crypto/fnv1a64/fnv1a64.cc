@@ -4,8 +4,6 @@
 
 #include "tlsclient/src/crypto/fnv1a64/fnv1a64.h"
 
-#include <stdio.h>
-
 // This is an implementation of the FNV-1a hash as described at
 // http://isthe.com/chongo/tech/comp/fnv/
 
@@ -19,24 +17,28 @@ void FNV1a64::Init() {
   s_ = kOffsetBasis;
 }
 
-static void hexdump(const void*a, unsigned len) {
-  const uint8_t* in = (uint8_t*) a;
-  for (unsigned i = 0; i < len; i++) {
-    printf("%x", in[i] >> 4);
-    printf("%x", in[i] & 15);
-  }
-  printf("\n");
-}
-
 void FNV1a64::Update(const void* data, size_t length) {
   const uint8_t* d = reinterpret_cast<const uint8_t*>(data);
-
-  hexdump(data, length);
-
-  for (size_t i = 0; i < length; i++) {
-    s_ ^= d[i];
-    s_ *= kPrime;
+  // FNV-1a is defined a byte at a time, so that's how the bytes are folded
+  // in. However, the state is kept in a local (which the compiler can't
+  // otherwise do since |d| may alias it) and the input is consumed a word at
+  // a time so that the loop overhead is amortised.
+  uint64_t s = s_;
+
+  for (; length >= 8; length -= 8, d += 8) {
+    s = (s ^ d[0]) * kPrime;
+    s = (s ^ d[1]) * kPrime;
+    s = (s ^ d[2]) * kPrime;
+    s = (s ^ d[3]) * kPrime;
+    s = (s ^ d[4]) * kPrime;
+    s = (s ^ d[5]) * kPrime;
+    s = (s ^ d[6]) * kPrime;
+    s = (s ^ d[7]) * kPrime;
   }
+  for (; length; length--, d++)
+    s = (s ^ *d) * kPrime;
+
+  s_ = s;
 }
 
 void FNV1a64::Final(uint8_t* out_digest) {
@@ -6,6 +6,8 @@
 
 namespace tlsclient {
 
+class Buffer;
+
 template<class H>
 class HMAC {
  public:
@@ -49,6 +51,16 @@ class HMAC {
     hash_.Update(data, length);
   }
 
+  // UpdateLanes is equivalent to calling |macs[i]->Update| with the next
+  // |lengths[i]| bytes of |data[i]|, for each |i| < |n|. See
+  // |H::UpdateLanes|.
+  static void UpdateLanes(HMAC* const* macs, Buffer* const* data, const size_t* lengths, unsigned n) {
+    H* hashes[H::LANES];
+    for (unsigned i = 0; i < n; i++)
+      hashes[i] = &macs[i]->hash_;
+    H::UpdateLanes(hashes, data, lengths, n);
+  }
+
   void Final(uint8_t* out_digest) {
     uint8_t intermediate_digest[H::DIGEST_SIZE];
     hash_.Final(intermediate_digest);
@@ -25,19 +25,40 @@ RC4::RC4(const uint8_t* key, unsigned len) {
   i_ = j_ = 0;
 }
 
+void RC4::GetState(uint8_t out[STATE_SIZE]) const {
+  memcpy(out, s_, sizeof(s_));
+  out[256] = i_;
+  out[257] = j_;
+}
+
+void RC4::SetState(const uint8_t in[STATE_SIZE]) {
+  memcpy(s_, in, sizeof(s_));
+  i_ = in[256];
+  j_ = in[257];
+}
+
 void RC4::Encrypt(const struct iovec* iov, unsigned iov_len) {
-  for (unsigned i = 0; i < iov_len; i++)
-    EncryptSpan(static_cast<uint8_t*>(iov[i].iov_base), iov[i].iov_len);
+  for (unsigned i = 0; i < iov_len; i++) {
+    uint8_t* data = static_cast<uint8_t*>(iov[i].iov_base);
+    Encrypt(data, data, iov[i].iov_len);
+  }
+}
+
+void RC4::Encrypt(uint8_t* out, const struct iovec* iov, unsigned iov_len) {
+  for (unsigned i = 0; i < iov_len; i++) {
+    Encrypt(out, static_cast<const uint8_t*>(iov[i].iov_base), iov[i].iov_len);
+    out += iov[i].iov_len;
+  }
 }
 
-void RC4::EncryptSpan(uint8_t* data, size_t len) {
+void RC4::Encrypt(uint8_t* out, const uint8_t* in, size_t len) {
   for (size_t i = 0; i < len; i++) {
     i_++;
     j_ += s_[i_];
     const uint8_t t = s_[i_];
     s_[i_] = s_[j_];
     s_[j_] = t;
-    data[i] ^= s_[static_cast<uint8_t>(s_[i_] + s_[j_])];
+    out[i] = in[i] ^ s_[static_cast<uint8_t>(s_[i_] + s_[j_])];
   }
 }
 
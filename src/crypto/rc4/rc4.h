@@ -11,15 +11,33 @@ namespace tlsclient {
 
 class RC4 {
  public:
+  enum {
+    // STATE_SIZE is the number of bytes written by |GetState|.
+    STATE_SIZE = 258,
+  };
+
   RC4(const uint8_t* key, unsigned len);
   void Encrypt(const struct iovec* iov, unsigned iov_len);
   void Decrypt(const struct iovec* iov, unsigned iov_len) {
     Encrypt(iov, iov_len);
   }
+  // These variants write the result contiguously to |out|, rather than in
+  // place. |out| may be the same as an input but mustn't otherwise overlap
+  // them.
+  void Encrypt(uint8_t* out, const struct iovec* iov, unsigned iov_len);
+  void Decrypt(uint8_t* out, const struct iovec* iov, unsigned iov_len) {
+    Encrypt(out, iov, iov_len);
+  }
+  // This variant processes the |len| bytes at |in|. |out| may be the same as
+  // |in|.
+  void Encrypt(uint8_t* out, const uint8_t* in, size_t len);
 
- private:
-  void EncryptSpan(uint8_t* data, size_t len);
+  // GetState writes the current keystream state to |out|, from which
+  // |SetState| can restore it.
+  void GetState(uint8_t out[STATE_SIZE]) const;
+  void SetState(const uint8_t in[STATE_SIZE]);
 
+ private:
   uint8_t s_[256];
   uint8_t i_;
   uint8_t j_;
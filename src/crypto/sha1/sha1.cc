@@ -4,6 +4,8 @@
 
 #include "tlsclient/src/crypto/sha1/sha1.h"
 
+#include "tlsclient/src/buffer.h"
+
 namespace tlsclient {
 
 // Implementation of SHA-1. Only handles data in byte-sized blocks,
@@ -143,4 +145,102 @@ void SHA1::Process() {
   cursor = 0;
 }
 
+void SHA1::UpdateLanes(SHA1* const* hashes, Buffer* const* data, const size_t* lengths, unsigned n) {
+  assert(n <= LANES);
+
+  size_t remaining[LANES];
+  for (unsigned i = 0; i < n; i++)
+    remaining[i] = lengths[i];
+
+  // Each time around, every hash takes as much as it can of its next block.
+  // Those which then have a full block are processed together.
+  for (;;) {
+    SHA1* full[LANES];
+    unsigned num_full = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+      SHA1* const h = hashes[i];
+      size_t todo = 64 - h->cursor;
+      if (todo > remaining[i])
+        todo = remaining[i];
+      data[i]->Read(h->M + h->cursor, todo);
+      h->cursor += todo;
+      h->l += todo * 8;
+      remaining[i] -= todo;
+      if (h->cursor == 64)
+        full[num_full++] = h;
+    }
+
+    if (!num_full)
+      break;
+    ProcessLanes(full, num_full);
+  }
+}
+
+static inline uint32_t LoadBigEndian(const uint8_t* in) {
+  return static_cast<uint32_t>(in[0]) << 24 |
+         static_cast<uint32_t>(in[1]) << 16 |
+         static_cast<uint32_t>(in[2]) << 8 |
+         static_cast<uint32_t>(in[3]);
+}
+
+// ProcessLanes is the same as calling |Process| on each of |hashes|, which
+// must all have a full block. The steps are the same as in |Process| but
+// each one is applied to every lane before moving onto the next, and the
+// lanes are always all computed (unused ones duplicate the first) so that the
+// inner loops have a fixed trip count.
+void SHA1::ProcessLanes(SHA1* const* hashes, unsigned n) {
+  SHA1* lanes[LANES];
+  for (unsigned i = 0; i < LANES; i++)
+    lanes[i] = hashes[i < n ? i : 0];
+
+  uint32_t W[80][LANES];
+  uint32_t A[LANES], B[LANES], C[LANES], D[LANES], E[LANES];
+  unsigned t, i;
+
+  // a.
+  for (t = 0; t < 16; ++t) {
+    for (i = 0; i < LANES; i++)
+      W[t][i] = LoadBigEndian(lanes[i]->M + 4 * t);
+  }
+
+  // b.
+  for (t = 16; t < 80; ++t) {
+    for (i = 0; i < LANES; i++)
+      W[t][i] = S(1, W[t - 3][i] ^ W[t - 8][i] ^ W[t - 14][i] ^ W[t - 16][i]);
+  }
+
+  // c.
+  for (i = 0; i < LANES; i++) {
+    A[i] = lanes[i]->H[0];
+    B[i] = lanes[i]->H[1];
+    C[i] = lanes[i]->H[2];
+    D[i] = lanes[i]->H[3];
+    E[i] = lanes[i]->H[4];
+  }
+
+  // d.
+  for (t = 0; t < 80; ++t) {
+    for (i = 0; i < LANES; i++) {
+      uint32_t TEMP = S(5, A[i]) + f(t, B[i], C[i], D[i]) + E[i] + W[t][i] + K(t);
+      E[i] = D[i];
+      D[i] = C[i];
+      C[i] = S(30, B[i]);
+      B[i] = A[i];
+      A[i] = TEMP;
+    }
+  }
+
+  // e.
+  for (i = 0; i < n; i++) {
+    SHA1* const h = hashes[i];
+    h->H[0] += A[i];
+    h->H[1] += B[i];
+    h->H[2] += C[i];
+    h->H[3] += D[i];
+    h->H[4] += E[i];
+    h->cursor = 0;
+  }
+}
+
 }  // namespace base
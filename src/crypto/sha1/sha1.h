@@ -9,6 +9,8 @@
 
 namespace tlsclient {
 
+class Buffer;
+
 class SHA1 {
  public:
   SHA1() {
@@ -18,6 +20,9 @@ class SHA1 {
   enum {
     DIGEST_SIZE = 20,
     BLOCK_SIZE = 64,
+    // LANES is the maximum number of hashes which |UpdateLanes| processes
+    // together.
+    LANES = 4,
   };
 
   // Init resets the SHA1 context. The constructor calls this function so you
@@ -26,7 +31,15 @@ class SHA1 {
   void Update(const void* data, size_t length);
   void Final(uint8_t* out_digest);
 
+  // UpdateLanes is equivalent to calling |hashes[i]->Update| with the next
+  // |lengths[i]| bytes of |data[i]|, for each |i| < |n|. However, the
+  // compression function is run over a block from each of the hashes at
+  // once so that the work for independent hashes is interleaved and can be
+  // vectorised. |n| must be at most |LANES|.
+  static void UpdateLanes(SHA1* const* hashes, Buffer* const* data, const size_t* lengths, unsigned n);
+
  private:
+  static void ProcessLanes(SHA1* const* hashes, unsigned n);
   void Process();
   void Pad();
 
@@ -3,6 +3,8 @@
 
 #include "tlsclient/src/crypto/sha256/sha256.h"
 
+#include "tlsclient/src/buffer.h"
+
 namespace tlsclient {
 
 static uint32_t load_bigendian(const unsigned char *x)
@@ -316,4 +318,103 @@ void SHA256::Final(uint8_t* out_digest) {
   memcpy(out_digest, h_, sizeof(h_));
 }
 
+void SHA256::UpdateLanes(SHA256* const* hashes, Buffer* const* data, const size_t* lengths, unsigned n) {
+  assert(n <= LANES);
+
+  size_t remaining[LANES];
+  for (unsigned i = 0; i < n; i++) {
+    remaining[i] = lengths[i];
+    hashes[i]->bits_ += lengths[i] * 8;
+  }
+
+  // Each time around, every hash takes as much as it can of its next block.
+  // Those which then have a full block are processed together.
+  for (;;) {
+    SHA256* full[LANES];
+    unsigned num_full = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+      SHA256* const h = hashes[i];
+      size_t todo = BLOCK_SIZE - h->block_used_;
+      if (todo > remaining[i])
+        todo = remaining[i];
+      data[i]->Read(h->block_ + h->block_used_, todo);
+      h->block_used_ += todo;
+      remaining[i] -= todo;
+      if (h->block_used_ == BLOCK_SIZE)
+        full[num_full++] = h;
+    }
+
+    if (!num_full)
+      break;
+    ProcessLanes(full, num_full);
+  }
+}
+
+// LaneRound is one round of the compression function, applied to every lane.
+// As in |blocks|, the working variables are rotated by renaming the rows
+// rather than by moving the values.
+static inline void LaneRound(const uint32_t* r0, const uint32_t* r1, const uint32_t* r2, uint32_t* r3,
+                             const uint32_t* r4, const uint32_t* r5, const uint32_t* r6, uint32_t* r7,
+                             const uint32_t* w, uint32_t k) {
+  for (unsigned i = 0; i < SHA256::LANES; i++) {
+    r7[i] += Sigma1(r4[i]) + Ch(r4[i], r5[i], r6[i]) + k + w[i];
+    r3[i] += r7[i];
+    r7[i] += Sigma0(r0[i]) + Maj(r0[i], r1[i], r2[i]);
+  }
+}
+
+// ProcessLanes is the same as calling |blocks| on the full block of each of
+// |hashes|. Each step is applied to every lane before moving onto the next,
+// and the lanes are always all computed (unused ones duplicate the first) so
+// that the inner loops have a fixed trip count.
+void SHA256::ProcessLanes(SHA256* const* hashes, unsigned n) {
+  SHA256* lanes[LANES];
+  for (unsigned i = 0; i < LANES; i++)
+    lanes[i] = hashes[i < n ? i : 0];
+
+  uint32_t w[16][LANES];
+  uint32_t r[8][LANES];
+  unsigned i, j;
+
+  for (j = 0; j < 16; j++) {
+    for (i = 0; i < LANES; i++)
+      w[j][i] = load_bigendian(lanes[i]->block_ + 4 * j);
+  }
+  for (j = 0; j < 8; j++) {
+    for (i = 0; i < LANES; i++)
+      r[j][i] = load_bigendian(lanes[i]->h_ + 4 * j);
+  }
+
+  for (j = 0; j < 64; j += 8) {
+    if (j >= 16) {
+      for (unsigned k = j; k < j + 8; k++) {
+        uint32_t* const wk = w[k & 15];
+        const uint32_t* const w14 = w[(k + 14) & 15];
+        const uint32_t* const w9 = w[(k + 9) & 15];
+        const uint32_t* const w1 = w[(k + 1) & 15];
+        for (i = 0; i < LANES; i++)
+          wk[i] += sigma1(w14[i]) + w9[i] + sigma0(w1[i]);
+      }
+    }
+
+    const unsigned b = j & 15;
+    LaneRound(r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7], w[b + 0], round[j + 0]);
+    LaneRound(r[7], r[0], r[1], r[2], r[3], r[4], r[5], r[6], w[b + 1], round[j + 1]);
+    LaneRound(r[6], r[7], r[0], r[1], r[2], r[3], r[4], r[5], w[b + 2], round[j + 2]);
+    LaneRound(r[5], r[6], r[7], r[0], r[1], r[2], r[3], r[4], w[b + 3], round[j + 3]);
+    LaneRound(r[4], r[5], r[6], r[7], r[0], r[1], r[2], r[3], w[b + 4], round[j + 4]);
+    LaneRound(r[3], r[4], r[5], r[6], r[7], r[0], r[1], r[2], w[b + 5], round[j + 5]);
+    LaneRound(r[2], r[3], r[4], r[5], r[6], r[7], r[0], r[1], w[b + 6], round[j + 6]);
+    LaneRound(r[1], r[2], r[3], r[4], r[5], r[6], r[7], r[0], w[b + 7], round[j + 7]);
+  }
+
+  for (i = 0; i < n; i++) {
+    SHA256* const h = hashes[i];
+    for (j = 0; j < 8; j++)
+      store_bigendian(h->h_ + 4 * j, load_bigendian(h->h_ + 4 * j) + r[j][i]);
+    h->block_used_ = 0;
+  }
+}
+
 }  // namespace tlsclient
@@ -74,6 +74,14 @@ static const char kErrorStrings[][70] = {
   "GetSnapStartData called before the snap start data is ready",
   "Connection::SetSnapStartData failed to parse the given data",
   "Need to call SetPredictedCertificates before SetSnapStartData",
+  "The output buffer is too small",
+  "Failed to read the requested range of a file",
+  "ExportState called before the connection is established or while busy",
+  "Connection::ImportState failed to parse the given data",
+  "FreeHandshakeState called before the handshake is complete",
+  "The handshake state has been freed by FreeHandshakeState",
+  "Certificate fingerprints are not available",
+  "The cipher suite specified by the imported state is not enabled",
 
   // Remember to add an element to the enum in public/error.h!
 
@@ -4,6 +4,7 @@
 
 #include "tlsclient/src/extension.h"
 
+#include "tlsclient/public/certificate_chain.h"
 #include "tlsclient/public/context.h"
 #include "tlsclient/src/base-internal.h"
 #include "tlsclient/src/buffer.h"
@@ -11,6 +12,7 @@
 #include "tlsclient/src/error-internal.h"
 #include "tlsclient/src/handshake.h"
 #include "tlsclient/src/sink.h"
+#include "tlsclient/src/snap_start_cache.h"
 #include "tlsclient/src/crypto/fnv1a64/fnv1a64.h"
 #include "tlsclient/src/crypto/prf/prf.h"
 
@@ -62,7 +64,7 @@ class RenegotiationInfo : public Extension {
   }
 
   Result Process(Buffer* extension, ConnectionPrivate* priv) const {
-    priv->server_supports_renegotiation_info = true;
+    priv->handshake->server_supports_renegotiation_info = true;
     return 0;
   }
 };
@@ -81,7 +83,7 @@ class ServerNameIndication : public Extension {
   }
 
   bool ShouldBeIncluded(ConnectionPrivate* priv) const {
-    const size_t size = priv->host_name.size();
+    const size_t size = priv->handshake->host_name.size();
     return size > 0 && size <= MAX_HOST_NAME;
   }
 
@@ -89,8 +91,8 @@ class ServerNameIndication : public Extension {
     Sink server_name_list(sink->VariableLengthBlock(2));
     server_name_list.U8(SNI_NAME_TYPE_HOST_NAME);
     Sink host_name(server_name_list.VariableLengthBlock(2));
-    uint8_t* name = host_name.Block(priv->host_name.size());
-    memcpy(name, priv->host_name.data(), priv->host_name.size());
+    uint8_t* name = host_name.Block(priv->handshake->host_name.size());
+    memcpy(name, priv->handshake->host_name.data(), priv->handshake->host_name.size());
     return 0;
   }
 
@@ -111,15 +113,15 @@ class SessionTicket : public Extension {
   }
 
   bool ShouldBeIncluded(ConnectionPrivate* priv) const {
-    return priv->session_tickets;
+    return priv->handshake->session_tickets;
   }
 
   Result Marshal(Sink* sink, ConnectionPrivate* priv) const {
-    if (!priv->have_session_ticket_to_present)
+    if (!priv->handshake->have_session_ticket_to_present)
       return 0;
 
-    uint8_t* ticket = sink->Block(priv->session_ticket.iov_len);
-    memcpy(ticket, priv->session_ticket.iov_base, priv->session_ticket.iov_len);
+    uint8_t* ticket = sink->Block(priv->handshake->session_ticket.iov_len);
+    memcpy(ticket, priv->handshake->session_ticket.iov_base, priv->handshake->session_ticket.iov_len);
     return 0;
   }
 
@@ -127,16 +129,16 @@ class SessionTicket : public Extension {
     if (extension->remaining())
       return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
 
-    priv->expecting_session_ticket = true;
+    priv->handshake->expecting_session_ticket = true;
     // If we presented a session ticket then the server may both ack the ticket
     // *and* echo an empty extension. This means that it's going to send us a
     // new ticket.
-    priv->resumption_data_ready = false;
+    priv->handshake->resumption_data_ready = false;
     // If we offer session ticket support then GnuTLS will both echo the empty
     // extension and include a session id. We need to ignore the session id
     // otherwise the rest of the resumption code will assume that we're doing
     // session id based resumption in the future.
-    priv->session_id_len = 0;
+    priv->handshake->session_id_len = 0;
     return 0;
   }
 };
@@ -161,8 +163,8 @@ class SnapStart : public Extension {
     if (!priv->snap_start_attempt)
       return 0;
 
-    priv->handshake_hash = HandshakeHashForVersion(priv->predicted_server_version);
-    if (!priv->handshake_hash)
+    priv->handshake->handshake_hash = HandshakeHashForVersion(priv->predicted_server_version);
+    if (!priv->handshake->handshake_hash)
       return ERROR_RESULT(ERR_INTERNAL_ERROR);
 
     // In the event of a snap start, the Finished hash is calculated over the
@@ -180,61 +182,57 @@ class SnapStart : public Extension {
     // which were written out after syncing the embedded lengths.
     const uint8_t* const raw_data = sink->raw_data();
     const size_t raw_size = sink->raw_size();
-    priv->handshake_hash->Update(raw_data + 5, raw_size - (5 + 4));
+    priv->handshake->handshake_hash->Update(raw_data + 5, raw_size - (5 + 4));
 
     // The first four bytes of the suggested server random are the same as the
     // first four of our random.
-    memcpy(priv->server_random, priv->client_random, 4);
+    memcpy(priv->handshake->server_random, priv->handshake->client_random, 4);
     // The next eight bytes are the server's orbit.
-    memcpy(priv->server_random + 4, priv->predicted_epoch, 8);
+    memcpy(priv->handshake->server_random + 4, priv->handshake->predicted_epoch, 8);
     // And the remainder is random.
-    if (!priv->ctx->RandomBytes(priv->server_random + 12, sizeof(priv->server_random) - 12))
+    if (!priv->ctx->RandomBytes(priv->handshake->server_random + 12, sizeof(priv->handshake->server_random) - 12))
       return ERROR_RESULT(ERR_RANDOM_BYTES_FAILED);
 
     // The first four bytes of the server random are the same as the client
     // random and we don't bother sending them.
-    uint8_t* server_random = sink->Block(sizeof(priv->server_random) - 4);
-    memcpy(server_random, priv->server_random + 4, sizeof(priv->server_random) - 4);
+    uint8_t* server_random = sink->Block(sizeof(priv->handshake->server_random) - 4);
+    memcpy(server_random, priv->handshake->server_random + 4, sizeof(priv->handshake->server_random) - 4);
 
     // Now we predict the server's response and include a hash of that to let
     // the server know if we got it right.
-    Sink predicted_response(&priv->arena);
-    if ((r = BuildPredictedResponse(&predicted_response, priv)))
+    if ((r = PredictResponse(priv)))
       return r;
 
     FNV1a64 fnv;
-    priv->predicted_response.iov_base = predicted_response.Release();
-    priv->predicted_response.iov_len = predicted_response.size();
-
-    fnv.Update(priv->predicted_response.iov_base, priv->predicted_response.iov_len);
+    fnv.Update(priv->handshake->predicted_response.iov_base, priv->handshake->predicted_response.iov_len);
     uint8_t* predicted_hash = sink->Block(FNV1a64::DIGEST_SIZE);
     fnv.Final(predicted_hash);
 
     // The handshake hash includes the predicted response:
-    priv->handshake_hash->Update(priv->predicted_response.iov_base, priv->predicted_response.iov_len);
+    priv->handshake->handshake_hash->Update(priv->handshake->predicted_response.iov_base, priv->handshake->predicted_response.iov_len);
 
     // If we are predicting a resume handshake, then we need to include the
     // server's predicted Finished message at this point.
-    if (!priv->expecting_session_ticket) {
+    if (!priv->handshake->expecting_session_ticket) {
       unsigned verify_data_size;
-      const uint8_t* verify_data = priv->handshake_hash->ServerVerifyData(&verify_data_size, priv->master_secret, sizeof(priv->master_secret));
+      const uint8_t* verify_data = priv->handshake->handshake_hash->ServerVerifyData(&verify_data_size, priv->handshake->master_secret, sizeof(priv->handshake->master_secret));
       // We need to remember the contents of the verify_data so that we can
       // validate it when we receive it.
-      priv->server_verify.iov_base = priv->arena.Allocate(verify_data_size);
-      memcpy(priv->server_verify.iov_base, verify_data, verify_data_size);
-      priv->server_verify.iov_len = verify_data_size;
+      priv->handshake->server_verify.iov_base = priv->arena.Allocate(verify_data_size);
+      memcpy(priv->handshake->server_verify.iov_base, verify_data, verify_data_size);
+      priv->handshake->server_verify.iov_len = verify_data_size;
 
       uint8_t handshake_header[4];
       handshake_header[0] = static_cast<uint8_t>(FINISHED);
       handshake_header[1] = handshake_header[2] = 0;
       handshake_header[3] = verify_data_size;
 
-      priv->handshake_hash->Update(handshake_header, sizeof(handshake_header));
-      priv->handshake_hash->Update(verify_data, verify_data_size);
+      priv->handshake->handshake_hash->Update(handshake_header, sizeof(handshake_header));
+      priv->handshake->handshake_hash->Update(verify_data, verify_data_size);
     }
 
     // Now come the opportunistic records
-    if (priv->expecting_session_ticket) {
+    if (priv->handshake->expecting_session_ticket) {
       priv->state = SEND_SNAP_START_CLIENT_KEY_EXCHANGE;
     } else {
       priv->state = SEND_SNAP_START_RESUME_CHANGE_CIPHER_SPEC;
@@ -247,9 +245,9 @@ class SnapStart : public Extension {
     struct iovec start, end, iov;
     // We need to make a copy of the application data to be sent because we'll
     // be encrypting in place and we might need to retransmit it later.
-    iov.iov_len = priv->snap_start_application_data.iov_len;
+    iov.iov_len = priv->handshake->snap_start_application_data.iov_len;
     iov.iov_base = static_cast<uint8_t*>(priv->arena.Allocate(iov.iov_len));
-    memcpy(iov.iov_base, priv->snap_start_application_data.iov_base, iov.iov_len);
+    memcpy(iov.iov_base, priv->handshake->snap_start_application_data.iov_base, iov.iov_len);
 
     if ((r = EncryptApplicationData(&start, &end, &iov, 1, iov.iov_len, priv)))
       return r;
@@ -265,18 +263,59 @@ class SnapStart : public Extension {
   }
 
   Result Process(Buffer* extension, ConnectionPrivate* priv) const {
-    if (!extension->Read(priv->server_epoch, sizeof(priv->server_epoch)))
+    if (!extension->Read(priv->handshake->server_epoch, sizeof(priv->handshake->server_epoch)))
       return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
 
-    priv->server_supports_snap_start = true;
+    priv->handshake->server_supports_snap_start = true;
     return 0;
   }
 
  private:
+  enum {
+    // The server random in a predicted response follows the handshake
+    // message header and the server's version.
+    SERVER_RANDOM_OFFSET = 4 + 2,
+  };
+
+  // PredictResponse sets |predicted_response| to the server's predicted
+  // handshake messages. Only the server random differs between connections
+  // which make the same prediction so, if there's a |SnapStartCache|, the
+  // rest is serialised once and shared.
+  static Result PredictResponse(ConnectionPrivate* priv) {
+    Result r;
+
+    CertificateChain* const chain = priv->handshake->predicted_chain;
+    if (!chain)
+      return ERROR_RESULT(ERR_INTERNAL_ERROR);
+    priv->handshake->server_cert = priv->ctx->ParseCertificate(static_cast<uint8_t*>(chain->certificates()[0].iov_base), chain->certificates()[0].iov_len);
+
+    const bool resuming = priv->handshake->have_session_ticket_to_present;
+    // If we are resuming, we assume that the server doesn't renew the session
+    // ticket.
+    priv->handshake->expecting_session_ticket = !resuming;
+
+    SnapStartCache* const cache = priv->handshake->snap_start_cache;
+    struct iovec* const response = &priv->handshake->predicted_response;
+    if (cache && SnapStartCacheGet(cache, response, &priv->arena, resuming, priv->handshake->predicted_server_hello, chain)) {
+      memcpy(static_cast<uint8_t*>(response->iov_base) + SERVER_RANDOM_OFFSET, priv->handshake->server_random, sizeof(priv->handshake->server_random));
+      return 0;
+    }
+
+    Sink predicted_response(&priv->arena);
+    if ((r = BuildPredictedResponse(&predicted_response, priv)))
+      return r;
+    response->iov_base = predicted_response.Release();
+    response->iov_len = predicted_response.size();
+
+    if (cache)
+      SnapStartCachePut(cache, *response, resuming, priv->handshake->predicted_server_hello, chain);
+    return 0;
+  }
+
   static Result BuildPredictedResponse(Sink* predicted_response, ConnectionPrivate* priv) {
     {
-      const uint8_t* predicted = static_cast<uint8_t*>(priv->predicted_server_hello.iov_base);
-      const size_t len = priv->predicted_server_hello.iov_len;
+      const uint8_t* predicted = static_cast<uint8_t*>(priv->handshake->predicted_server_hello.iov_base);
+      const size_t len = priv->handshake->predicted_server_hello.iov_len;
 
       // A ServerHello is 8 bytes + session id data + extensions.
       if (len < 38)
@@ -284,21 +323,18 @@ class SnapStart : public Extension {
 
       Sink server_hello_sink(predicted_response->HandshakeMessage(SERVER_HELLO));
       server_hello_sink.Copy(predicted, 2);
-      server_hello_sink.Copy(priv->server_random, sizeof(priv->server_random));
+      server_hello_sink.Copy(priv->handshake->server_random, sizeof(priv->handshake->server_random));
       // We need to make sure that the server doesn't include a random session id
       // in its ServerHello because we can't predict that. We do that by using the
       // session tickets extension. If we are attempting a session tickets
       // resumption, then the server will echo our 1 byte session id: {0x00}.
       // Otherwise, the session id will be empty. Either way, we need to omit
       // the session id in |predicted|.
-      if (priv->have_session_ticket_to_present) {
+      if (priv->handshake->have_session_ticket_to_present) {
         server_hello_sink.U8(1);
         server_hello_sink.U8(0);
-        // We assume that the server doesn't renew the session ticket.
-        priv->expecting_session_ticket = false;
       } else {
         server_hello_sink.U8(0);
-        priv->expecting_session_ticket = true;
       }
 
       const unsigned session_id_len = predicted[34];
@@ -329,7 +365,7 @@ class SnapStart : public Extension {
           if (!ok)
             return ERROR_RESULT(ERR_INTERNAL_ERROR);
 
-          if (priv->have_session_ticket_to_present &&
+          if (priv->handshake->have_session_ticket_to_present &&
               (extension_type == SessionTicket::EXTENSION_VALUE ||
                extension_type == ServerNameIndication::EXTENSION_VALUE)) {
             continue;
@@ -344,22 +380,15 @@ class SnapStart : public Extension {
       }
     }
 
-    if (!priv->predicted_certificates.size())
-      return ERROR_RESULT(ERR_INTERNAL_ERROR);
-    priv->server_cert = priv->ctx->ParseCertificate(static_cast<uint8_t*>(priv->predicted_certificates[0].iov_base), priv->predicted_certificates[0].iov_len);
-
-    if (!priv->have_session_ticket_to_present) {
+    if (!priv->handshake->have_session_ticket_to_present) {
+      // The chain is kept in the form in which it appears in the message.
+      const CertificateChain* const chain = priv->handshake->predicted_chain;
       Sink cert_msg_sink(predicted_response->HandshakeMessage(CERTIFICATE));
       Sink certs_sink(cert_msg_sink.VariableLengthBlock(3));
-
-      for (std::vector<struct iovec>::const_iterator i = priv->predicted_certificates.begin(); i != priv->predicted_certificates.end(); i++) {
-        Sink cert_sink(certs_sink.VariableLengthBlock(3));
-        const uint8_t* cert = static_cast<uint8_t*>(i->iov_base);
-        cert_sink.Copy(cert, i->iov_len);
-      }
+      certs_sink.Copy(chain->wire(), chain->wire_length());
     }
 
-    if (!priv->have_session_ticket_to_present)
+    if (!priv->handshake->have_session_ticket_to_present)
       predicted_response->HandshakeMessage(SERVER_HELLO_DONE);
 
     return 0;
@@ -11,6 +11,7 @@
 #include "tlsclient/src/base-internal.h"
 #include "tlsclient/src/buffer.h"
 #include "tlsclient/src/crypto/prf/prf.h"
+#include "tlsclient/src/crypto/sha256/sha256.h"
 #include "tlsclient/src/connection_private.h"
 #include "tlsclient/src/error-internal.h"
 #include "tlsclient/src/extension.h"
@@ -182,22 +183,263 @@ Result GetHandshakeMessage(bool* found, HandshakeMessage* htype, std::vector<str
   return 0;
 }
 
+// DecryptRecord appends the vectors of the |length| byte record payload at
+// the current position of |in| to |out|, decrypting it if needed. On return,
+// |in| has been advanced past the record.
+static Result DecryptRecord(std::vector<struct iovec>* out, Buffer* in, const uint8_t* header, uint16_t length, ConnectionPrivate* priv) {
+  const size_t orig = out->size();
+  in->PeekV(out, length);
+  if (priv->reader.cipher_spec) {
+    unsigned iov_len = out->size() - orig;
+    unsigned bytes_stripped;
+    if (!priv->reader.cipher_spec->Decrypt(&bytes_stripped, &(*out)[orig], &iov_len, header, priv->reader.seq_num))
+      return ERROR_RESULT(ERR_BAD_MAC);
+    out->resize(orig + iov_len);
+    priv->reader.seq_num++;
+  }
+
+  in->Advance(length);
+  return 0;
+}
+
+// DecryptRecordTo is the same as |DecryptRecord| except that the plaintext is
+// written to |plaintext|, which must have space for |length| bytes, and the
+// input is left untouched. |vectors| is scratch space.
+static Result DecryptRecordTo(uint8_t* plaintext, size_t* plaintext_len, std::vector<struct iovec>* vectors, Buffer* in, const uint8_t* header, uint16_t length, ConnectionPrivate* priv) {
+  if (!priv->reader.cipher_spec) {
+    in->Read(plaintext, length);
+    *plaintext_len = length;
+    return 0;
+  }
+
+  vectors->clear();
+  in->PeekV(vectors, length);
+  if (!priv->reader.cipher_spec->DecryptTo(plaintext, plaintext_len, vectors->empty() ? NULL : &(*vectors)[0], vectors->size(), header, priv->reader.seq_num))
+    return ERROR_RESULT(ERR_BAD_MAC);
+  priv->reader.seq_num++;
+
+  in->Advance(length);
+  return 0;
+}
+
+// DecryptRecordJob decrypts, in place, the |i|th record of the batch at
+// |arg|.
+static void DecryptRecordJob(void* arg, unsigned i) {
+  RecordBatch* const batch = static_cast<RecordBatch*>(arg);
+  RecordJob* const job = &batch->jobs[i];
+  struct iovec* const iov = &batch->vectors[job->iov_offset];
+
+  if (job->iov_len != 1) {
+    unsigned bytes_stripped;
+    job->ok = batch->spec->Decrypt(&bytes_stripped, iov, &job->iov_len, job->header_copy, job->seq_num);
+    return;
+  }
+
+  // The common case of a record which doesn't span input vectors takes the
+  // CipherSpec's specialised path.
+  uint8_t* plaintext;
+  size_t plaintext_len;
+  job->ok = batch->spec->Open(&plaintext, &plaintext_len, job->header_copy, static_cast<uint8_t*>(iov->iov_base), iov->iov_len, job->seq_num);
+  // The outputs of a failed Open aren't set.
+  if (!job->ok)
+    return;
+  iov->iov_base = plaintext;
+  iov->iov_len = plaintext_len;
+  if (!plaintext_len)
+    job->iov_len = 0;
+}
+
+Result GetApplicationDataRecords(unsigned* records, std::vector<struct iovec>* out, std::vector<RecordSpan>* spans, Buffer* in, ConnectionPrivate* priv, uint8_t** plaintext, size_t* plaintext_len) {
+  uint8_t header[5];
+  *records = 0;
+
+  // Application data can't be interleaved with a handshake message. In that
+  // case, GetRecordOrHandshake will report the error.
+  if (priv->partial_record_remaining ||
+      priv->handshake_reassembly_offset < priv->handshake_reassembly.size()) {
+    return 0;
+  }
+
+  // First we find the run of complete application data records at the
+  // beginning of |in| so that the outputs only need to grow once. Records
+  // with a bad header end the run and are left for GetRecordOrHandshake.
+  const Buffer::Pos start = in->Tell();
+  unsigned count = 0;
+  while (in->Read(header, sizeof(header))) {
+    const uint16_t version = static_cast<uint16_t>(header[1]) << 8 | header[2];
+    if (header[0] != RECORD_APPLICATION_DATA ||
+        !priv->version_established ||
+        priv->version != static_cast<TLSVersion>(version)) {
+      break;
+    }
+    const uint16_t length = static_cast<uint16_t>(header[3]) << 8 | header[4];
+    if (in->remaining() < length)
+      break;
+    in->Advance(length);
+    count++;
+  }
+  in->Seek(start);
+
+  if (!count)
+    return 0;
+
+  // Each record can span several of the input vectors, but there can't be
+  // more than one record boundary per record.
+  out->reserve(out->size() + count + in->vectors_remaining());
+  spans->reserve(spans->size() + count);
+
+  if (!plaintext) {
+    // The records are decrypted in place. First the vectors of each record
+    // are collected and the records given their sequence numbers. Then
+    // they're decrypted, possibly in parallel.
+    CipherSpec* const spec = priv->reader.cipher_spec;
+    std::vector<RecordJob>& jobs = priv->reader.jobs;
+    jobs.resize(count);
+    const size_t first_span = spans->size();
+    for (unsigned i = 0; i < count; i++) {
+      RecordJob* const job = &jobs[i];
+      in->Read(job->header_copy, sizeof(job->header_copy));
+      const uint16_t length = static_cast<uint16_t>(job->header_copy[3]) << 8 | job->header_copy[4];
+      RecordSpan span;
+      span.wire_length = sizeof(header) + length;
+      span.seq_num = priv->reader.seq_num;
+      spans->push_back(span);
+      job->iov_offset = out->size();
+      in->PeekV(out, length);
+      in->Advance(length);
+      job->iov_len = out->size() - job->iov_offset;
+      job->seq_num = priv->reader.seq_num;
+      job->ok = true;
+      if (spec)
+        priv->reader.seq_num++;
+    }
+
+    if (spec) {
+      RecordBatch batch = {spec, out->empty() ? NULL : &(*out)[0], &jobs[0]};
+      RunRecordJobs(priv, spec, DecryptRecordJob, &batch, count);
+    }
+
+    // Decryption can remove vectors from the beginning and end of each
+    // record so the gaps are closed up.
+    unsigned j = jobs[0].iov_offset;
+    for (unsigned i = 0; i < count; i++) {
+      const RecordJob& job = jobs[i];
+      if (!job.ok)
+        return ERROR_RESULT(ERR_BAD_MAC);
+      RecordSpan* const span = &(*spans)[first_span + i];
+      span->iov_offset = j;
+      span->iov_len = job.iov_len;
+      span->length = 0;
+      for (unsigned k = 0; k < job.iov_len; k++, j++) {
+        (*out)[j] = (*out)[job.iov_offset + k];
+        span->length += (*out)[j].iov_len;
+      }
+    }
+    out->resize(j);
+
+    *records = count;
+    return 0;
+  }
+
+  std::vector<struct iovec> vectors;
+  unsigned i;
+  for (i = 0; i < count; i++) {
+    in->Read(header, sizeof(header));
+    const uint16_t length = static_cast<uint16_t>(header[3]) << 8 | header[4];
+    RecordSpan span;
+    span.iov_offset = out->size();
+    span.seq_num = priv->reader.seq_num;
+    span.wire_length = sizeof(header) + length;
+
+    // The whole record is decrypted into |plaintext| before the MAC and
+    // padding are removed so we need space for all of it.
+    if (length > *plaintext_len) {
+      in->Retreat(sizeof(header));
+      if (!i)
+        return ERROR_RESULT(ERR_OUTPUT_BUFFER_TOO_SMALL);
+      break;
+    }
+    size_t n;
+    const Result r = DecryptRecordTo(*plaintext, &n, &vectors, in, header, length, priv);
+    if (r)
+      return r;
+    const struct iovec iov = {*plaintext, n};
+    out->push_back(iov);
+    *plaintext += n;
+    *plaintext_len -= n;
+
+    span.iov_len = 1;
+    span.length = n;
+    spans->push_back(span);
+  }
+
+  *records = i;
+  return 0;
+}
+
 Result GetRecordOrHandshake(bool* found, RecordType* type, HandshakeMessage* htype, std::vector<struct iovec>* out, Buffer* in, ConnectionPrivate* priv) {
   uint8_t header[5];
   *found = false;
+  priv->reader.bytes_needed = 0;
   std::vector<struct iovec> handshake_vectors;
 
-  for (unsigned n = 0; ; n++) {
-    const bool first_record = n == 0;
-    uint16_t length;
+  for (;;) {
+    std::vector<uint8_t>& reassembly = priv->handshake_reassembly;
+
+    // A Certificate message which spans records is parsed as it arrives so
+    // that it's never held in full.
+    if (priv->handshake && !priv->handshake->streaming_certificates &&
+        priv->handshake_reassembly_offset < reassembly.size()) {
+      struct iovec iov = {&reassembly[priv->handshake_reassembly_offset],
+                          reassembly.size() - priv->handshake_reassembly_offset};
+      if (ShouldStreamServerCertificate(priv, Buffer(&iov, 1)))
+        priv->handshake->streaming_certificates = true;
+    }
+
+    if (priv->handshake && priv->handshake->streaming_certificates) {
+      const Result r = StreamServerCertificate(found, priv);
+      if (r)
+        return r;
+      if (*found) {
+        *type = RECORD_HANDSHAKE;
+        *htype = CERTIFICATE;
+        return 0;
+      }
+    } else if (priv->handshake_reassembly_offset < reassembly.size()) {
+      // If earlier records left a handshake message incomplete, see whether
+      // we now have all of it. Messages returned from here point into
+      // |reassembly| and are processed before we're called again.
+      struct iovec iov = {&reassembly[priv->handshake_reassembly_offset],
+                          reassembly.size() - priv->handshake_reassembly_offset};
+      Buffer buf(&iov, 1);
+      const Result r = GetHandshakeMessage(found, htype, out, &buf);
+      if (r)
+        return r;
+      if (*found) {
+        *type = RECORD_HANDSHAKE;
+        priv->handshake_reassembly_offset += buf.TellBytes();
+        return 0;
+      }
+    }
 
-    if (priv->partial_record_remaining && first_record) {
-      length = priv->partial_record_remaining;
-      // We only ever half-process a record if it's a handshake record.
-      *type = RECORD_HANDSHAKE;
+    // |payload| is the number of handshake bytes that we'll look at and
+    // |trailer| is the number of MAC and padding bytes which follow them in
+    // |in|.
+    size_t payload, trailer;
+    handshake_vectors.clear();
+
+    if (priv->partial_record_remaining) {
+      // We only ever half-process a record if it's a handshake record and
+      // the remaining bytes have already been decrypted.
+      payload = priv->partial_record_remaining;
+      trailer = priv->partial_record_trailer;
+      in->PeekV(&handshake_vectors, payload);
     } else {
-      if (!in->Read(header, sizeof(header)))
+      const Buffer::Pos record_start = in->Tell();
+      if (!in->Read(header, sizeof(header))) {
+        priv->reader.bytes_needed = sizeof(header) - in->remaining();
         return 0;
+      }
       if (!IsValidRecordType(header[0]))
         return ERROR_RESULT(ERR_INVALID_RECORD_TYPE);
       *type = static_cast<RecordType>(header[0]);
@@ -213,75 +455,89 @@ Result GetRecordOrHandshake(bool* found, RecordType* type, HandshakeMessage* hty
         priv->version = static_cast<TLSVersion>(version);
       }
 
-      length = static_cast<uint16_t>(header[3]) << 8 | header[4];
-      if (in->remaining() < length)
+      const uint16_t length = static_cast<uint16_t>(header[3]) << 8 | header[4];
+      if (in->remaining() < length) {
+        priv->reader.bytes_needed = length - in->remaining();
+        // Leave |in| at the start of the record so that the caller knows
+        // that everything before it has been consumed.
+        in->Seek(record_start);
         return 0;
+      }
 
       if (*type != RECORD_HANDSHAKE) {
-        if (!first_record)
+        if (priv->handshake_reassembly_offset < reassembly.size() ||
+            (priv->handshake && priv->handshake->streaming_certificates)) {
           return ERROR_RESULT(ERR_TRUNCATED_HANDSHAKE_MESSAGE);
+        }
         // Records other than handshake records are processed one at a time and
         // we can store the vectors directly into |out|.
-        const size_t orig = out->size();
-        in->PeekV(out, length);
-        if (priv->read_cipher_spec) {
-          unsigned iov_len = out->size() - orig;
-          unsigned bytes_stripped;
-          if (!priv->read_cipher_spec->Decrypt(&bytes_stripped, &(*out)[orig], &iov_len, header, priv->read_seq_num))
-            return ERROR_RESULT(ERR_BAD_MAC);
-          out->resize(orig + iov_len);
-          priv->read_seq_num++;
-        }
-
-        in->Advance(length);
+        const Result r = DecryptRecord(out, in, header, length, priv);
+        if (r)
+          return r;
         *found = true;
         return 0;
       }
-    }
 
-    // Otherwise we append the vectors of the handshake message into
-    // |handshake_vectors|
-    const size_t orig = handshake_vectors.size();
-    in->PeekV(&handshake_vectors, length);
-    // This is the number of bytes of padding and MAC removed from the end.
-    unsigned bytes_stripped = 0;
-    if (priv->read_cipher_spec) {
-      unsigned iov_len = handshake_vectors.size() - orig;
-      if (n < priv->pending_records_decrypted) {
-        bytes_stripped = priv->read_cipher_spec->StripMACAndPadding(&handshake_vectors[orig], &iov_len);
-      } else {
-        if (!priv->read_cipher_spec->Decrypt(&bytes_stripped, &handshake_vectors[orig], &iov_len, header, priv->read_seq_num))
-            return ERROR_RESULT(ERR_BAD_MAC);
-        priv->read_seq_num++;
-        priv->pending_records_decrypted++;
+      in->PeekV(&handshake_vectors, length);
+      // These are the number of bytes removed from the beginning (i.e. an
+      // explicit IV) and from the end (padding and MAC) of the record.
+      unsigned prefix = 0, bytes_stripped = 0;
+      if (priv->reader.cipher_spec) {
+        unsigned iov_len = handshake_vectors.size();
+        if (!priv->reader.cipher_spec->Decrypt(&bytes_stripped, handshake_vectors.empty() ? NULL : &handshake_vectors[0], &iov_len, header, priv->reader.seq_num))
+          return ERROR_RESULT(ERR_BAD_MAC);
+        priv->reader.seq_num++;
+        handshake_vectors.resize(iov_len);
+        prefix = priv->reader.cipher_spec->PrefixBytes();
       }
-      handshake_vectors.resize(orig + iov_len);
+      in->Advance(prefix);
+      payload = length - prefix - bytes_stripped;
+      trailer = bytes_stripped;
     }
-    Buffer buf(&handshake_vectors[0], handshake_vectors.size());
 
-    const Result r = GetHandshakeMessage(found, htype, out, &buf);
-    if (r)
-      return r;
-    if (*found == false) {
-      // If we didn't find a complete handshake message then we consumed the
-      // whole record.
-      in->Advance(length);
-    } else {
-      // If we did find a complete handshake message then it might not have
-      // taken up the whole record. In this case, we advance the record, less
-      // the amount of data left over in the handshake message buffer.
-      priv->partial_record_remaining = buf.remaining() + bytes_stripped;
-      in->Advance(length - priv->partial_record_remaining);
-      // If we have a partial record remaining, then it has been decrypted.
-      // Otherwise, we can consumed all the decrypted records.
-      priv->pending_records_decrypted = priv->partial_record_remaining > 0;
-      return 0;
+    Buffer buf(handshake_vectors.empty() ? NULL : &handshake_vectors[0], handshake_vectors.size());
+
+    if (priv->handshake_reassembly_offset == reassembly.size() &&
+        !(priv->handshake && priv->handshake->streaming_certificates) &&
+        !ShouldStreamServerCertificate(priv, buf)) {
+      // In the common case, the handshake message is contained within a
+      // single record and we can return it without copying.
+      const Result r = GetHandshakeMessage(found, htype, out, &buf);
+      if (r)
+        return r;
+      if (*found) {
+        *type = RECORD_HANDSHAKE;
+        in->Advance(payload - buf.remaining());
+        if (buf.remaining()) {
+          priv->partial_record_remaining = buf.remaining();
+          priv->partial_record_trailer = trailer;
+        } else {
+          in->Advance(trailer);
+          priv->partial_record_remaining = 0;
+          priv->partial_record_trailer = 0;
+        }
+        return 0;
+      }
+      buf.Rewind();
     }
+
+    // Otherwise the handshake message spans records. We append the (already
+    // decrypted) payload to |reassembly| and consume the record so that it
+    // never needs to be looked at again.
+    reassembly.erase(reassembly.begin(), reassembly.begin() + priv->handshake_reassembly_offset);
+    priv->handshake_reassembly_offset = 0;
+    const size_t orig = reassembly.size();
+    reassembly.resize(orig + payload);
+    if (payload)
+      buf.Read(&reassembly[orig], payload);
+    in->Advance(payload + trailer);
+    priv->partial_record_remaining = 0;
+    priv->partial_record_trailer = 0;
   }
 }
 
 uint16_t TLSVersionToOffer(ConnectionPrivate* priv) {
-  if (priv->sslv3)
+  if (priv->handshake->sslv3)
     return static_cast<uint16_t>(SSLv3);
 
   return static_cast<uint16_t>(TLSv12);
@@ -292,31 +548,31 @@ Result MarshalClientHello(Sink* sink, ConnectionPrivate* priv) {
   if (!now)
     return ERROR_RESULT(ERR_EPOCH_SECONDS_FAILED);
 
-  priv->client_random[0] = now >> 24;
-  priv->client_random[1] = now >> 16;
-  priv->client_random[2] = now >> 8;
-  priv->client_random[3] = now;
-  if (!priv->ctx->RandomBytes(priv->client_random + 4, sizeof(priv->client_random) - 4))
+  priv->handshake->client_random[0] = now >> 24;
+  priv->handshake->client_random[1] = now >> 16;
+  priv->handshake->client_random[2] = now >> 8;
+  priv->handshake->client_random[3] = now;
+  if (!priv->ctx->RandomBytes(priv->handshake->client_random + 4, sizeof(priv->handshake->client_random) - 4))
     return ERROR_RESULT(ERR_RANDOM_BYTES_FAILED);
 
   sink->U16(TLSVersionToOffer(priv));
-  sink->Append(priv->client_random, sizeof(priv->client_random));
+  sink->Append(priv->handshake->client_random, sizeof(priv->handshake->client_random));
 
-  sink->U8(priv->session_id_len);
-  uint8_t* session_id = sink->Block(priv->session_id_len);
-  memcpy(session_id, priv->session_id, priv->session_id_len);
+  sink->U8(priv->handshake->session_id_len);
+  uint8_t* session_id = sink->Block(priv->handshake->session_id_len);
+  memcpy(session_id, priv->handshake->session_id, priv->handshake->session_id_len);
 
   {
     Sink s(sink->VariableLengthBlock(2));
 
     // For SSLv3 we'll include the SCSV. See RFC 5746.
-    if (priv->sslv3)
+    if (priv->handshake->sslv3)
       sink->U16(kSignalingCipherSuiteValue);
 
     unsigned written = 0;
     const CipherSuite* suites = AllCipherSuites();
     for (unsigned i = 0; suites[i].flags; i++) {
-      if ((suites[i].flags & priv->cipher_suite_flags_enabled) == suites[i].flags) {
+      if ((suites[i].flags & priv->handshake->cipher_suite_flags_enabled) == suites[i].flags) {
         s.U16(suites[i].value);
         written++;
       }
@@ -329,7 +585,7 @@ Result MarshalClientHello(Sink* sink, ConnectionPrivate* priv) {
   sink->U8(1);  // number of compression methods
   sink->U8(0);  // no compression.
 
-  if (priv->sslv3) // no extensions in SSLv3
+  if (priv->handshake->sslv3) // no extensions in SSLv3
     return 0;
 
   {
@@ -343,11 +599,11 @@ Result MarshalClientHello(Sink* sink, ConnectionPrivate* priv) {
 }
 
 Result GenerateMasterSecret(ConnectionPrivate* priv) {
-  if (!MasterSecretFromPreMasterSecret(priv->master_secret, priv->version, priv->premaster_secret, sizeof(priv->premaster_secret), priv->client_random, priv->server_random))
+  if (!MasterSecretFromPreMasterSecret(priv->handshake->master_secret, priv->version, priv->handshake->premaster_secret, sizeof(priv->handshake->premaster_secret), priv->handshake->client_random, priv->handshake->server_random))
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
 
-  if (!priv->expecting_session_ticket)
-    priv->resumption_data_ready = true;
+  if (!priv->handshake->expecting_session_ticket)
+    priv->handshake->resumption_data_ready = true;
   return 0;
 }
 
@@ -357,15 +613,18 @@ Result SetupCiperSpec(ConnectionPrivate* priv) {
   kb.mac_len = priv->cipher_suite->mac_len;
   kb.iv_len = priv->cipher_suite->iv_len;
 
-  if (!KeysFromMasterSecret(&kb, priv->version, priv->master_secret, priv->client_random, priv->server_random))
+  if (!KeysFromMasterSecret(&kb, priv->version, priv->handshake->master_secret, priv->handshake->client_random, priv->handshake->server_random))
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
 
-  if (priv->pending_read_cipher_spec)
-    priv->pending_read_cipher_spec->DecRef();
-  if (priv->pending_write_cipher_spec)
-    priv->pending_write_cipher_spec->DecRef();
-  priv->pending_read_cipher_spec = priv->pending_write_cipher_spec = priv->cipher_suite->create(priv->version, kb);
-  priv->pending_write_cipher_spec->AddRef();
+  if (priv->handshake->pending_read_cipher_spec)
+    priv->handshake->pending_read_cipher_spec->DecRef();
+  if (priv->handshake->pending_write_cipher_spec)
+    priv->handshake->pending_write_cipher_spec->DecRef();
+  // Each direction gets a CipherSpec of its own so that, once the handshake
+  // is complete, reading and writing don't share any state, not even a
+  // reference count.
+  priv->handshake->pending_read_cipher_spec = priv->cipher_suite->create(priv->version, kb);
+  priv->handshake->pending_write_cipher_spec = priv->cipher_suite->create(priv->version, kb);
 
   return 0;
 }
@@ -375,21 +634,21 @@ Result MarshalClientKeyExchange(Sink* sink, ConnectionPrivate* priv) {
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
 
   const uint16_t offered_version = TLSVersionToOffer(priv);
-  priv->premaster_secret[0] = offered_version >> 8;
-  priv->premaster_secret[1] = offered_version;
+  priv->handshake->premaster_secret[0] = offered_version >> 8;
+  priv->handshake->premaster_secret[1] = offered_version;
   const bool is_sslv3 = priv->version == SSLv3;
 
-  if (!priv->ctx->RandomBytes(&priv->premaster_secret[2], sizeof(priv->premaster_secret) - 2))
+  if (!priv->ctx->RandomBytes(&priv->handshake->premaster_secret[2], sizeof(priv->handshake->premaster_secret) - 2))
     return ERROR_RESULT(ERR_RANDOM_BYTES_FAILED);
 
-  const size_t encrypted_premaster_size = priv->server_cert->SizeEncryptPKCS1();
+  const size_t encrypted_premaster_size = priv->handshake->server_cert->SizeEncryptPKCS1();
   if (!encrypted_premaster_size)
     return ERROR_RESULT(ERR_SIZE_ENCRYPT_PKCS1_FAILED);
 
   // SSLv3 doesn't prefix the encrypted premaster secret with length bytes.
   Sink s(sink->VariableLengthBlock(is_sslv3 ? 0 : 2));
   uint8_t* encrypted_premaster_secret = s.Block(encrypted_premaster_size);
-  if (!priv->server_cert->EncryptPKCS1(encrypted_premaster_secret, priv->premaster_secret, sizeof(priv->premaster_secret)))
+  if (!priv->handshake->server_cert->EncryptPKCS1(encrypted_premaster_secret, priv->handshake->premaster_secret, sizeof(priv->handshake->premaster_secret)))
     return ERROR_RESULT(ERR_ENCRYPT_PKCS1_FAILED);
 
   return 0;
@@ -397,7 +656,7 @@ Result MarshalClientKeyExchange(Sink* sink, ConnectionPrivate* priv) {
 
 Result MarshalFinished(Sink* sink, ConnectionPrivate* priv) {
   unsigned verify_data_size;
-  const uint8_t* const verify_data = priv->handshake_hash->ClientVerifyData(&verify_data_size, priv->master_secret, sizeof(priv->master_secret));
+  const uint8_t* const verify_data = priv->handshake->handshake_hash->ClientVerifyData(&verify_data_size, priv->handshake->master_secret, sizeof(priv->handshake->master_secret));
   uint8_t* b = sink->Block(verify_data_size);
   memcpy(b, verify_data, verify_data_size);
   return 0;
@@ -593,28 +852,37 @@ static void AddHandshakeMessageToVerifyHash(HandshakeHash* handshake_hash, Hands
   }
 }
 
-Result ProcessHandshakeMessage(ConnectionPrivate* priv, HandshakeMessage type, Buffer* in) {
-  bool ok = false;
-  Result r;
-
+// IsPermittedHandshakeMessage returns true if a handshake message of type
+// |type| may be received in the current state.
+static bool IsPermittedHandshakeMessage(ConnectionPrivate* priv, HandshakeMessage type) {
   for (size_t i = 0; i < arraysize(kPermittedHandshakeMessagesPerState[0]); i++) {
     const HandshakeMessage permitted = kPermittedHandshakeMessagesPerState[priv->state][i];
     if (permitted == INVALID_MESSAGE)
       break;
-    if (permitted == type) {
-      ok = true;
-      break;
-    }
+    if (permitted == type)
+      return true;
   }
 
-  if (!ok)
+  return false;
+}
+
+Result ProcessHandshakeMessage(ConnectionPrivate* priv, HandshakeMessage type, Buffer* in) {
+  Result r;
+
+  // Once the handshake state has been freed there's no handshake to process
+  // messages with.
+  if (!IsPermittedHandshakeMessage(priv, type) || !priv->handshake)
     return ERROR_RESULT(ERR_UNEXPECTED_HANDSHAKE_MESSAGE);
 
-  if (priv->handshake_hash &&
+  // A streamed Certificate message was hashed as it arrived.
+  const bool streamed = type == CERTIFICATE && priv->handshake->streaming_certificates;
+
+  if (priv->handshake->handshake_hash &&
+      !streamed &&
       type != FINISHED &&
       type != SERVER_HELLO &&
       type != CHANGE_CIPHER_SPEC) {
-    AddHandshakeMessageToVerifyHash(priv->handshake_hash, type, in);
+    AddHandshakeMessageToVerifyHash(priv->handshake->handshake_hash, type, in);
   }
 
   const HandshakeState prev_state = priv->state;
@@ -624,7 +892,11 @@ Result ProcessHandshakeMessage(ConnectionPrivate* priv, HandshakeMessage type, B
       r = ProcessServerHello(priv, in);
       break;
     case CERTIFICATE:
-      r = ProcessServerCertificate(priv, in);
+      if (streamed) {
+        r = FinishStreamedServerCertificate(priv);
+      } else {
+        r = ProcessServerCertificate(priv, in);
+      }
       break;
     case SERVER_HELLO_DONE:
       r = ProcessServerHelloDone(priv, in);
@@ -633,11 +905,11 @@ Result ProcessHandshakeMessage(ConnectionPrivate* priv, HandshakeMessage type, B
       uint8_t b;
       if (!in->Read(&b, 1) || b != 1 || in->remaining() != 0)
         return ERROR_RESULT(ERR_UNEXPECTED_HANDSHAKE_MESSAGE);
-      if (priv->read_cipher_spec)
-        priv->read_cipher_spec->DecRef();
-      priv->read_cipher_spec = priv->pending_read_cipher_spec;
-      priv->pending_read_cipher_spec = NULL;
-      priv->read_seq_num = 0;
+      if (priv->reader.cipher_spec)
+        priv->reader.cipher_spec->DecRef();
+      priv->reader.cipher_spec = priv->handshake->pending_read_cipher_spec;
+      priv->handshake->pending_read_cipher_spec = NULL;
+      priv->reader.seq_num = 0;
       r = 0;
       break;
     case FINISHED:
@@ -670,13 +942,13 @@ Result ProcessServerHello(ConnectionPrivate* priv, Buffer* in) {
       priv->state == RECV_SNAP_START_RESUME_CHANGE_CIPHER_SPEC) {
     // We were expecting to perform a snap-start, but the server responded with
     // a normal ServerHello. We need to enter recovery.
-    priv->server_verify.iov_base = NULL;
-    priv->server_verify.iov_len = 0;
-    priv->expecting_session_ticket = false;
+    priv->handshake->server_verify.iov_base = NULL;
+    priv->handshake->server_verify.iov_len = 0;
+    priv->handshake->expecting_session_ticket = false;
 
-    if (priv->write_cipher_spec)
-      priv->write_cipher_spec->DecRef();
-    priv->write_cipher_spec = NULL;
+    if (priv->writer.cipher_spec)
+      priv->writer.cipher_spec->DecRef();
+    priv->writer.cipher_spec = NULL;
   }
 
   uint16_t server_wire_version;
@@ -688,26 +960,26 @@ Result ProcessServerHello(ConnectionPrivate* priv, Buffer* in) {
   if (priv->version_established && priv->version != version)
     return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
 
-  if (!in->Read(priv->server_random, sizeof(priv->server_random)))
+  if (!in->Read(priv->handshake->server_random, sizeof(priv->handshake->server_random)))
     return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
 
   Buffer session_id_buf(in->VariableLength(&ok, 1));
   if (!ok)
     return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
-  if (session_id_buf.remaining() > sizeof(priv->session_id))
+  if (session_id_buf.remaining() > sizeof(priv->handshake->session_id))
     return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
-  uint8_t session_id[sizeof(priv->session_id)];
+  uint8_t session_id[sizeof(priv->handshake->session_id)];
   bool resumption = false;
-  if (priv->session_id_len &&
-      session_id_buf.remaining() == priv->session_id_len &&
-      session_id_buf.Read(session_id, priv->session_id_len) &&
-      memcmp(session_id, priv->session_id, priv->session_id_len) == 0) {
+  if (priv->handshake->session_id_len &&
+      session_id_buf.remaining() == priv->handshake->session_id_len &&
+      session_id_buf.Read(session_id, priv->handshake->session_id_len) &&
+      memcmp(session_id, priv->handshake->session_id, priv->handshake->session_id_len) == 0) {
     // Session ids match. We're resuming a session.
     resumption = true;
   } else {
     session_id_buf.Rewind();
-    priv->session_id_len = session_id_buf.remaining();
-    if (!session_id_buf.Read(priv->session_id, priv->session_id_len))
+    priv->handshake->session_id_len = session_id_buf.remaining();
+    if (!session_id_buf.Read(priv->handshake->session_id, priv->handshake->session_id_len))
       return ERROR_RESULT(ERR_INTERNAL_ERROR);
   }
 
@@ -726,7 +998,7 @@ Result ProcessServerHello(ConnectionPrivate* priv, Buffer* in) {
       const CipherSuite* suite = &suites[i];
       if (suite->value == cipher_suite) {
         // Check that the ciphersuite was one that we offered.
-        if ((suite->flags & priv->cipher_suite_flags_enabled) == suite->flags)
+        if ((suite->flags & priv->handshake->cipher_suite_flags_enabled) == suite->flags)
           priv->cipher_suite = suite;
         break;
       }
@@ -744,9 +1016,9 @@ Result ProcessServerHello(ConnectionPrivate* priv, Buffer* in) {
   if (compression_method)
     return ERROR_RESULT(ERR_UNSUPPORTED_COMPRESSION_METHOD);
 
-  delete priv->handshake_hash;
-  priv->handshake_hash = HandshakeHashForVersion(version);
-  if (!priv->handshake_hash)
+  delete priv->handshake->handshake_hash;
+  priv->handshake->handshake_hash = HandshakeHashForVersion(version);
+  if (!priv->handshake->handshake_hash)
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
 
   // We didn't know, until now, which TLS version to use. That meant that we
@@ -754,9 +1026,9 @@ Result ProcessServerHello(ConnectionPrivate* priv, Buffer* in) {
   // ClientHello is still hanging around sent_client_hello so we can add it,
   // and this message, now.
 
-  if (priv->sent_client_hello.iov_base)
-    priv->handshake_hash->Update(priv->sent_client_hello.iov_base, priv->sent_client_hello.iov_len);
-  AddHandshakeMessageToVerifyHash(priv->handshake_hash, SERVER_HELLO, in);
+  if (priv->handshake->sent_client_hello.iov_base)
+    priv->handshake->handshake_hash->Update(priv->handshake->sent_client_hello.iov_base, priv->handshake->sent_client_hello.iov_len);
+  AddHandshakeMessageToVerifyHash(priv->handshake->handshake_hash, SERVER_HELLO, in);
 
   if (resumption) {
     Result r = SetupCiperSpec(priv);
@@ -767,7 +1039,7 @@ Result ProcessServerHello(ConnectionPrivate* priv, Buffer* in) {
     priv->did_resume = true;
     // This will be flipped back to false if we find a session tickets
     // extension.
-    priv->resumption_data_ready = !priv->have_session_ticket_to_present;
+    priv->handshake->resumption_data_ready = !priv->handshake->have_session_ticket_to_present;
   } else if (priv->state == RECV_SERVER_HELLO) {
     priv->state = RECV_CERTIFICATE;
   } else if (priv->state == RECV_SNAP_START_SESSION_TICKET) {
@@ -792,27 +1064,27 @@ Result ProcessServerHello(ConnectionPrivate* priv, Buffer* in) {
   if (in->remaining())
     return ERROR_RESULT(ERR_HANDSHAKE_TRAILING_DATA);
 
-  if (priv->server_supports_snap_start && priv->collect_snap_start) {
+  if (priv->handshake->server_supports_snap_start && priv->handshake->collect_snap_start) {
     const Buffer::Pos end = in->Tell();
     in->Seek(start_of_server_hello);
     const size_t server_hello_len = in->remaining();
     uint8_t* server_hello = static_cast<uint8_t*>(priv->arena.Allocate(server_hello_len));
     if (!in->Read(server_hello, server_hello_len))
       return ERROR_RESULT(ERR_INTERNAL_ERROR);
-    priv->snap_start_server_hello.iov_base = server_hello;
-    priv->snap_start_server_hello.iov_len = server_hello_len;
+    priv->handshake->snap_start_server_hello.iov_base = server_hello;
+    priv->handshake->snap_start_server_hello.iov_len = server_hello_len;
     in->Seek(end);
   }
 
   if (resumption) {
     if (priv->state == RECV_SERVER_HELLO) {
-      if (priv->expecting_session_ticket) {
+      if (priv->handshake->expecting_session_ticket) {
         priv->state = RECV_RESUME_SESSION_TICKET;
       } else {
         priv->state = RECV_RESUME_CHANGE_CIPHER_SPEC;
       }
     } else if (priv->state == RECV_SNAP_START_RESUME_CHANGE_CIPHER_SPEC) {
-      if (priv->expecting_session_ticket) {
+      if (priv->handshake->expecting_session_ticket) {
         priv->state = RECV_SNAP_START_RESUME_RECOVERY_SESSION_TICKET;
       } else {
         priv->state = RECV_SNAP_START_RESUME_RECOVERY_CHANGE_CIPHER_SPEC;
@@ -825,6 +1097,36 @@ Result ProcessServerHello(ConnectionPrivate* priv, Buffer* in) {
   return 0;
 }
 
+// RetainCertificates keeps the first |n| of |certs| in |server_certificates|
+// and frees the remainder of those in |copied|. Certificates which were
+// copied into the arena are kept without copying them again.
+static void RetainCertificates(ConnectionPrivate* priv, const std::vector<struct iovec>& certs, const std::vector<bool>& copied, size_t n) {
+  for (size_t i = 0; i < certs.size(); i++) {
+    if (i >= n) {
+      if (copied[i])
+        priv->arena.Free(certs[i].iov_base);
+      continue;
+    }
+
+    struct iovec iov = certs[i];
+    if (!copied[i]) {
+      iov.iov_base = priv->arena.Allocate(iov.iov_len);
+      memcpy(iov.iov_base, certs[i].iov_base, iov.iov_len);
+    }
+    priv->handshake->server_certificates.push_back(iov);
+  }
+}
+
+// CertificatesToRetain returns how many of a chain of |n| certificates the
+// retention policy keeps.
+static size_t CertificatesToRetain(ConnectionPrivate* priv, size_t n) {
+  if (priv->handshake->certificate_retention == RETAIN_LEAF_CERTIFICATE)
+    return n < 1 ? n : 1;
+  if (priv->handshake->certificate_retention == RETAIN_NO_CERTIFICATES)
+    return 0;
+  return n;
+}
+
 Result ProcessServerCertificate(ConnectionPrivate* priv, Buffer* in) {
   bool ok;
 
@@ -832,39 +1134,276 @@ Result ProcessServerCertificate(ConnectionPrivate* priv, Buffer* in) {
   if (!ok)
     return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
 
+  // Where a certificate is contiguous in the input, |certs| points at it
+  // there. Otherwise it has to be assembled in the arena, and |copied| is
+  // set.
+  std::vector<struct iovec> certs;
+  std::vector<bool> copied;
+  Result r = 0;
+
   while (certificates.remaining()) {
     Buffer certificate(certificates.VariableLength(&ok, 3));
-    if (!ok)
-      return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
+    if (!ok) {
+      r = ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
+      break;
+    }
     const size_t size = certificate.size();
-    if (!size)
+    if (!size) {
+      r = ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
+      break;
+    }
+    const bool is_copy = !certificate.IsContiguous(size);
+    uint8_t* const copy = is_copy ? static_cast<uint8_t*>(priv->arena.Allocate(size)) : NULL;
+    struct iovec iov = {certificate.Get(copy, size), size};
+    if (!iov.iov_base) {
+      if (copy)
+        priv->arena.Free(copy);
+      r = ERROR_RESULT(ERR_INTERNAL_ERROR);
+      break;
+    }
+    certs.push_back(iov);
+    copied.push_back(is_copy);
+  }
+
+  if (!r && !certs.size())
+    r = ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
+  if (!r && in->remaining())
+    r = ERROR_RESULT(ERR_HANDSHAKE_TRAILING_DATA);
+  if (r) {
+    RetainCertificates(priv, certs, copied, 0);
+    return r;
+  }
+
+  // A chain whose leaf can't be parsed is dropped without being reported.
+  priv->handshake->server_cert = priv->ctx->ParseCertificate(static_cast<uint8_t*>(certs[0].iov_base), certs[0].iov_len);
+  if (!priv->handshake->server_cert) {
+    RetainCertificates(priv, certs, copied, 0);
+    return ERROR_RESULT(ERR_CANNOT_PARSE_CERTIFICATE);
+  }
+
+  if (priv->handshake->fingerprint_certificates) {
+    priv->handshake->certificate_fingerprints.clear();
+    FingerprintCertificates(priv, &certs[0], certs.size());
+    FingerprintChain(priv);
+  }
+  if (priv->handshake->certificates_callback)
+    priv->handshake->certificates_callback(priv->handshake->certificates_callback_arg, &certs[0], certs.size(), true);
+
+  RetainCertificates(priv, certs, copied, CertificatesToRetain(priv, certs.size()));
+  priv->handshake->received_certificates = true;
+  priv->handshake->num_server_certificates = certs.size();
+
+  return 0;
+}
+
+bool ShouldStreamServerCertificate(ConnectionPrivate* priv, const Buffer& in) {
+  if (!priv->handshake || !IsPermittedHandshakeMessage(priv, CERTIFICATE))
+    return false;
+
+  Buffer peek(in);
+  uint8_t header[4];
+  if (!peek.Read(header, sizeof(header)) || header[0] != CERTIFICATE)
+    return false;
+  const uint32_t length = static_cast<uint32_t>(header[1]) << 16 |
+                          static_cast<uint32_t>(header[2]) << 8 |
+                          header[3];
+  return peek.remaining() < length;
+}
+
+// AddStreamedCertificate is called with each certificate of a streamed
+// Certificate message in turn. The leaf is parsed at once so that a chain
+// which we can't use is rejected before the rest of it arrives.
+static Result AddStreamedCertificate(ConnectionPrivate* priv, const uint8_t* bytes, size_t size) {
+  if (!priv->handshake->num_streamed_certificates) {
+    priv->handshake->server_cert = priv->ctx->ParseCertificate(bytes, size);
+    if (!priv->handshake->server_cert)
+      return ERROR_RESULT(ERR_CANNOT_PARSE_CERTIFICATE);
+    priv->handshake->certificate_fingerprints.clear();
+  }
+
+  // If fingerprints were enabled part way through the chain then none are
+  // computed here. See |FingerprintStreamedChain|.
+  if (priv->handshake->fingerprint_certificates &&
+      priv->handshake->certificate_fingerprints.size() == priv->handshake->num_streamed_certificates) {
+    const struct iovec iov = {const_cast<uint8_t*>(bytes), size};
+    FingerprintCertificates(priv, &iov, 1);
+  }
+
+  // Only those certificates which will be retained are copied. The callback
+  // is given them where they are, in the reassembly buffer.
+  if (priv->handshake->num_streamed_certificates < CertificatesToRetain(priv, priv->handshake->num_streamed_certificates + 1)) {
+    struct iovec iov = {priv->arena.Allocate(size), size};
+    memcpy(iov.iov_base, bytes, size);
+    priv->handshake->streamed_certificates.push_back(iov);
+  }
+  priv->handshake->num_streamed_certificates++;
+
+  return 0;
+}
+
+// FingerprintStreamedChain is called once the last certificate of a
+// streamed Certificate message has been added.
+static void FingerprintStreamedChain(ConnectionPrivate* priv) {
+  // The chain is only fingerprinted if every certificate was. Otherwise the
+  // fingerprints are computed later, if they can be, from the retained
+  // certificates.
+  if (priv->handshake->fingerprint_certificates &&
+      priv->handshake->num_streamed_certificates &&
+      priv->handshake->certificate_fingerprints.size() == priv->handshake->num_streamed_certificates) {
+    FingerprintChain(priv);
+  } else {
+    priv->handshake->certificate_fingerprints.clear();
+  }
+}
+
+Result StreamServerCertificate(bool* found, ConnectionPrivate* priv) {
+  std::vector<uint8_t>& reassembly = priv->handshake_reassembly;
+  size_t offset = priv->handshake_reassembly_offset;
+  // These are the certificates which are completed by this call. They're
+  // passed to the callback from the reassembly buffer.
+  std::vector<struct iovec> certs;
+  Result r = 0;
+  *found = false;
+
+  if (!priv->handshake->certificates_header_parsed) {
+    // The handshake header is followed by the length of the certificate
+    // list, which must fill the rest of the message.
+    if (reassembly.size() - offset < 7)
+      return 0;
+    const uint8_t* const header = &reassembly[offset];
+    const uint32_t length = static_cast<uint32_t>(header[1]) << 16 |
+                            static_cast<uint32_t>(header[2]) << 8 |
+                            header[3];
+    const uint32_t list_length = static_cast<uint32_t>(header[4]) << 16 |
+                                 static_cast<uint32_t>(header[5]) << 8 |
+                                 header[6];
+    if (list_length + 3 > length)
       return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
-    void* certbytes = priv->arena.Allocate(size);
-    if (!certificate.Read(certbytes, size))
-      return ERROR_RESULT(ERR_INTERNAL_ERROR);
-    struct iovec iov = {certbytes, size};
-    priv->server_certificates.push_back(iov);
+    if (list_length + 3 < length)
+      return ERROR_RESULT(ERR_HANDSHAKE_TRAILING_DATA);
+    if (priv->handshake->handshake_hash)
+      priv->handshake->handshake_hash->Update(header, 7);
+    priv->handshake->certificates_header_parsed = true;
+    priv->handshake->certificates_list_remaining = list_length;
+    offset += 7;
   }
 
-  if (!priv->server_certificates.size())
-    return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
+  while (priv->handshake->certificates_list_remaining) {
+    const size_t available = reassembly.size() - offset;
+    if (available < 3)
+      break;
+    const uint8_t* const certificate = &reassembly[offset];
+    const uint32_t size = static_cast<uint32_t>(certificate[0]) << 16 |
+                          static_cast<uint32_t>(certificate[1]) << 8 |
+                          certificate[2];
+    if (!size || 3 + size > priv->handshake->certificates_list_remaining) {
+      r = ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
+      break;
+    }
+    // Only a single certificate is ever buffered, but that's still bounded.
+    if (size > kMaxHandshakeLength) {
+      r = ERROR_RESULT(ERR_HANDSHAKE_MESSAGE_TOO_LONG);
+      break;
+    }
+    if (available < 3 + size)
+      break;
 
-  if (in->remaining())
-    return ERROR_RESULT(ERR_HANDSHAKE_TRAILING_DATA);
+    if (priv->handshake->handshake_hash)
+      priv->handshake->handshake_hash->Update(certificate, 3 + size);
+    r = AddStreamedCertificate(priv, certificate + 3, size);
+    if (r)
+      break;
+    const struct iovec iov = {const_cast<uint8_t*>(certificate + 3), size};
+    certs.push_back(iov);
+    offset += 3 + size;
+    priv->handshake->certificates_list_remaining -= 3 + size;
+  }
 
-  priv->server_cert = priv->ctx->ParseCertificate(static_cast<uint8_t*>(priv->server_certificates[0].iov_base), priv->server_certificates[0].iov_len);
-  if (!priv->server_cert)
-    return ERROR_RESULT(ERR_CANNOT_PARSE_CERTIFICATE);
+  const bool complete = priv->handshake->certificates_header_parsed &&
+                        !priv->handshake->certificates_list_remaining;
+  if (!r && complete)
+    FingerprintStreamedChain(priv);
+  if (!r && !certs.empty() && priv->handshake->certificates_callback)
+    priv->handshake->certificates_callback(priv->handshake->certificates_callback_arg, &certs[0], certs.size(), complete);
+
+  // Whatever has been parsed is dropped so that only the current
+  // certificate is ever held.
+  reassembly.erase(reassembly.begin(), reassembly.begin() + offset);
+  priv->handshake_reassembly_offset = 0;
+  if (r)
+    return r;
+
+  *found = complete;
+  return 0;
+}
+
+Result FinishStreamedServerCertificate(ConnectionPrivate* priv) {
+  std::vector<struct iovec>& certs = priv->handshake->streamed_certificates;
+  const unsigned n = priv->handshake->num_streamed_certificates;
+  priv->handshake->streaming_certificates = false;
+  priv->handshake->certificates_header_parsed = false;
+  priv->handshake->num_streamed_certificates = 0;
+
+  if (!n)
+    return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
+
+  // The chain has already been fingerprinted and passed to the callback by
+  // |StreamServerCertificate|.
+  const std::vector<bool> copied(certs.size(), true);
+  RetainCertificates(priv, certs, copied, CertificatesToRetain(priv, certs.size()));
+  certs.clear();
+  priv->handshake->received_certificates = true;
+  priv->handshake->num_server_certificates = n;
 
   return 0;
 }
 
+void FingerprintCertificates(ConnectionPrivate* priv, const struct iovec* certs, size_t n) {
+  const size_t kLanes = SHA256::LANES;
+
+  // The certificates are independent so they're hashed in parallel.
+  for (size_t i = 0; i < n; i += kLanes) {
+    const unsigned lanes = n - i < kLanes ? n - i : kLanes;
+    SHA256 sha256[SHA256::LANES];
+    SHA256* hashes[SHA256::LANES];
+    std::vector<Buffer> buffers;
+    Buffer* data[SHA256::LANES];
+    size_t lengths[SHA256::LANES];
+
+    buffers.reserve(lanes);
+    for (unsigned j = 0; j < lanes; j++)
+      buffers.push_back(Buffer(&certs[i + j], 1));
+    for (unsigned j = 0; j < lanes; j++) {
+      hashes[j] = &sha256[j];
+      data[j] = &buffers[j];
+      lengths[j] = certs[i + j].iov_len;
+    }
+    SHA256::UpdateLanes(hashes, data, lengths, lanes);
+
+    for (unsigned j = 0; j < lanes; j++) {
+      Fingerprint fingerprint;
+      sha256[j].Final(fingerprint.bytes);
+      priv->handshake->certificate_fingerprints.push_back(fingerprint);
+    }
+  }
+}
+
+void FingerprintChain(ConnectionPrivate* priv) {
+  const std::vector<Fingerprint>& fingerprints = priv->handshake->certificate_fingerprints;
+  SHA256 sha256;
+
+  for (size_t i = 0; i < fingerprints.size(); i++)
+    sha256.Update(fingerprints[i].bytes, sizeof(fingerprints[i].bytes));
+  sha256.Final(priv->handshake->chain_fingerprint.bytes);
+  priv->handshake->have_fingerprints = true;
+}
+
 Result ProcessServerHelloDone(ConnectionPrivate* priv, Buffer* in) {
   if (in->remaining())
     return ERROR_RESULT(ERR_HANDSHAKE_TRAILING_DATA);
 
-  if (priv->server_supports_snap_start && priv->collect_snap_start)
-    priv->snap_start_data_available = true;
+  if (priv->handshake->server_supports_snap_start && priv->handshake->collect_snap_start)
+    priv->handshake->snap_start_data_available = true;
 
   return 0;
 }
@@ -880,11 +1419,11 @@ Result ProcessServerFinished(ConnectionPrivate* priv, Buffer* in) {
   unsigned server_verify_len;
   const uint8_t* server_verify;
 
-  if (priv->server_verify.iov_base) {
-    server_verify = static_cast<uint8_t*>(priv->server_verify.iov_base);
-    server_verify_len = priv->server_verify.iov_len;
+  if (priv->handshake->server_verify.iov_base) {
+    server_verify = static_cast<uint8_t*>(priv->handshake->server_verify.iov_base);
+    server_verify_len = priv->handshake->server_verify.iov_len;
   } else {
-    server_verify = priv->handshake_hash->ServerVerifyData(&server_verify_len, priv->master_secret, sizeof(priv->master_secret));
+    server_verify = priv->handshake->handshake_hash->ServerVerifyData(&server_verify_len, priv->handshake->master_secret, sizeof(priv->handshake->master_secret));
   }
 
   uint8_t verify_data[36];
@@ -908,10 +1447,10 @@ Result ProcessServerFinished(ConnectionPrivate* priv, Buffer* in) {
       priv->state == RECV_SNAP_START_RESUME_RECOVERY2_FINISHED) {
     priv->state = AWAIT_HELLO_REQUEST;
   } else if (priv->state == RECV_RESUME_FINISHED) {
-    AddHandshakeMessageToVerifyHash(priv->handshake_hash, FINISHED, in);
+    AddHandshakeMessageToVerifyHash(priv->handshake->handshake_hash, FINISHED, in);
     priv->state = SEND_RESUME_CHANGE_CIPHER_SPEC;
   } else if (priv->state == RECV_SNAP_START_RESUME_RECOVERY_FINISHED) {
-    AddHandshakeMessageToVerifyHash(priv->handshake_hash, FINISHED, in);
+    AddHandshakeMessageToVerifyHash(priv->handshake->handshake_hash, FINISHED, in);
     priv->state = SEND_SNAP_START_RESUME_RECOVERY_CHANGE_CIPHER_SPEC;
   } else {
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
@@ -938,13 +1477,13 @@ Result ProcessSessionTicket(ConnectionPrivate* priv, Buffer* in) {
   if (!ok || !len)
     return ERROR_RESULT(ERR_INVALID_HANDSHAKE_MESSAGE);
 
-  priv->session_ticket.iov_len = len;
-  priv->session_ticket.iov_base = priv->arena.Allocate(len);
-  if (!ticket.Read(priv->session_ticket.iov_base, len))
+  priv->handshake->session_ticket.iov_len = len;
+  priv->handshake->session_ticket.iov_base = priv->arena.Allocate(len);
+  if (!ticket.Read(priv->handshake->session_ticket.iov_base, len))
     return ERROR_RESULT(ERR_INTERNAL_ERROR);
 
-  priv->resumption_data_ready = true;
-  priv->session_id_len = 0;
+  priv->handshake->resumption_data_ready = true;
+  priv->handshake->session_id_len = 0;
 
   if (priv->state == RECV_SESSION_TICKET) {
     priv->state = RECV_CHANGE_CIPHER_SPEC;
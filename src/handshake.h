@@ -117,7 +117,9 @@ enum ResumptionTypes {
 
 class Sink;
 struct ConnectionPrivate;
+struct RecordSpan;
 class Buffer;
+class CipherSpec;
 
 bool IsValidAlertLevel(uint8_t wire_level);
 bool IsValidVersion(uint16_t wire_version);
@@ -127,11 +129,35 @@ Result MarshalFinished(Sink* sink, ConnectionPrivate* priv);
 bool NextIsApplicationData(Buffer* in);
 Result GetHandshakeMessage(bool* found, HandshakeMessage* htype, std::vector<struct iovec>* out, Buffer* in);
 Result GetRecordOrHandshake(bool* found, RecordType* type, HandshakeMessage* htype, std::vector<struct iovec>* out, Buffer* in, ConnectionPrivate* priv);
+// GetApplicationDataRecords decrypts every complete application data record
+// at the beginning of |in|, appending the plaintext vectors to |out| and one
+// element per record to |spans|. |records| is set to the number of records
+// processed, which may be zero. If |plaintext| is non-NULL then records are
+// decrypted into |*plaintext| rather than in place, until the
+// |*plaintext_len| bytes of space there run out. Both are advanced past the
+// plaintext written.
+Result GetApplicationDataRecords(unsigned* records, std::vector<struct iovec>* out, std::vector<RecordSpan>* spans, Buffer* in, ConnectionPrivate* priv, uint8_t** plaintext, size_t* plaintext_len);
 Result AlertTypeToResult(AlertType);
 
 Result ProcessServerHello(ConnectionPrivate* priv, Buffer* in);
 Result ProcessHandshakeMessage(ConnectionPrivate* priv, HandshakeMessage type, Buffer* in);
 Result ProcessServerCertificate(ConnectionPrivate* priv, Buffer* in);
+// These functions parse a Certificate message which spans records as it
+// arrives, rather than after it has been reassembled.
+// ShouldStreamServerCertificate returns true if |in| starts with such a
+// message and it's one that we're expecting. StreamServerCertificate
+// consumes what it can of the message from |ConnectionPrivate::handshake_reassembly|,
+// passing the certificates which it completes to the certificates callback,
+// and sets |*found| once it's complete, at which point
+// FinishStreamedServerCertificate takes the place of ProcessServerCertificate.
+bool ShouldStreamServerCertificate(ConnectionPrivate* priv, const Buffer& in);
+Result StreamServerCertificate(bool* found, ConnectionPrivate* priv);
+Result FinishStreamedServerCertificate(ConnectionPrivate* priv);
+// FingerprintCertificates appends the SHA-256 of each of the |n|
+// certificates at |certs| to |HandshakeData::certificate_fingerprints|.
+// FingerprintChain then sets the fingerprint of the chain from them.
+void FingerprintCertificates(ConnectionPrivate* priv, const struct iovec* certs, size_t n);
+void FingerprintChain(ConnectionPrivate* priv);
 Result ProcessServerHelloDone(ConnectionPrivate* priv, Buffer* in);
 Result ProcessServerFinished(ConnectionPrivate* priv, Buffer* in);
 Result ProcessSessionTicket(ConnectionPrivate* priv, Buffer* in);
@@ -140,6 +166,10 @@ Result SetupCiperSpec(ConnectionPrivate* priv);
 
 Result SendHandshakeMessages(Sink* sink, ConnectionPrivate* priv);
 Result EncryptApplicationData(struct iovec* start, struct iovec* end, const struct iovec* iov, unsigned iov_len, size_t len, ConnectionPrivate* priv);
+// RunRecordJobs calls |f(arg, i)| for each of the |n| records of a batch. If
+// the connection has a worker pool and |spec| allows it then the calls are
+// made in parallel. Otherwise they are made in order.
+void RunRecordJobs(ConnectionPrivate* priv, CipherSpec* spec, void (*f)(void* arg, unsigned i), void* arg, unsigned n);
 
 }  // namespace tlsclient
 
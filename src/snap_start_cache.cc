@@ -0,0 +1,147 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tlsclient/public/snap_start_cache.h"
+
+#include "tlsclient/public/certificate_chain.h"
+#include "tlsclient/src/arena.h"
+#include "tlsclient/src/snap_start_cache.h"
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+namespace tlsclient {
+
+namespace {
+
+// Entry is a single cached prediction and the resulting response.
+struct Entry {
+  Entry()
+      : chain(NULL) {
+  }
+
+  ~Entry() {
+    if (chain)
+      chain->DecRef();
+  }
+
+  bool resuming;
+  std::vector<uint8_t> server_hello;
+  // We hold a reference to |chain|.
+  CertificateChain* chain;
+  std::vector<uint8_t> response;
+};
+
+}  // anonymous namespace
+
+struct SnapStartCachePrivate {
+  pthread_mutex_t lock;
+  unsigned max_entries;
+  // entries is ordered from the oldest to the newest.
+  std::deque<Entry*> entries;
+};
+
+static bool BytesEqual(const std::vector<uint8_t>& a, const struct iovec& b) {
+  return a.size() == b.iov_len &&
+         (a.empty() || memcmp(&a[0], b.iov_base, a.size()) == 0);
+}
+
+// Matches returns true if |entry| is for the given prediction. |lock| must
+// be held.
+static bool Matches(const Entry* entry, bool resuming,
+                    const struct iovec& server_hello,
+                    const CertificateChain* chain) {
+  if (entry->resuming != resuming ||
+      !BytesEqual(entry->server_hello, server_hello)) {
+    return false;
+  }
+
+  // Connections which make the same prediction will usually share a chain.
+  if (entry->chain == chain)
+    return true;
+  return entry->chain->wire_length() == chain->wire_length() &&
+         memcmp(entry->chain->wire(), chain->wire(), chain->wire_length()) == 0;
+}
+
+SnapStartCache::SnapStartCache(unsigned max_entries)
+    : priv_(new SnapStartCachePrivate) {
+  pthread_mutex_init(&priv_->lock, NULL);
+  priv_->max_entries = max_entries;
+}
+
+SnapStartCache::~SnapStartCache() {
+  for (std::deque<Entry*>::const_iterator i = priv_->entries.begin();
+       i != priv_->entries.end(); ++i) {
+    delete *i;
+  }
+
+  pthread_mutex_destroy(&priv_->lock);
+  delete priv_;
+}
+
+bool SnapStartCacheGet(SnapStartCache* cache, struct iovec* out, Arena* arena,
+                       bool resuming, const struct iovec& server_hello,
+                       CertificateChain* chain) {
+  SnapStartCachePrivate* const priv = cache->priv();
+  bool found = false;
+
+  pthread_mutex_lock(&priv->lock);
+  for (std::deque<Entry*>::const_iterator i = priv->entries.begin();
+       i != priv->entries.end(); ++i) {
+    const Entry* const entry = *i;
+    if (!Matches(entry, resuming, server_hello, chain))
+      continue;
+    out->iov_len = entry->response.size();
+    out->iov_base = arena->Allocate(out->iov_len);
+    memcpy(out->iov_base, &entry->response[0], out->iov_len);
+    found = true;
+    break;
+  }
+  pthread_mutex_unlock(&priv->lock);
+
+  return found;
+}
+
+void SnapStartCachePut(SnapStartCache* cache, const struct iovec& response,
+                       bool resuming, const struct iovec& server_hello,
+                       CertificateChain* chain) {
+  SnapStartCachePrivate* const priv = cache->priv();
+  if (!priv->max_entries || !response.iov_len)
+    return;
+
+  // The entry is built before taking the lock since it involves copying
+  // the response.
+  Entry* const entry = new Entry;
+  entry->resuming = resuming;
+  const uint8_t* const server_hello_bytes = static_cast<const uint8_t*>(server_hello.iov_base);
+  entry->server_hello.assign(server_hello_bytes, server_hello_bytes + server_hello.iov_len);
+  chain->AddRef();
+  entry->chain = chain;
+  const uint8_t* const response_bytes = static_cast<const uint8_t*>(response.iov_base);
+  entry->response.assign(response_bytes, response_bytes + response.iov_len);
+
+  Entry* evicted = NULL;
+  pthread_mutex_lock(&priv->lock);
+  for (std::deque<Entry*>::const_iterator i = priv->entries.begin();
+       i != priv->entries.end(); ++i) {
+    if (Matches(*i, resuming, server_hello, chain)) {
+      // Another connection got here first.
+      pthread_mutex_unlock(&priv->lock);
+      delete entry;
+      return;
+    }
+  }
+  if (priv->entries.size() == priv->max_entries) {
+    evicted = priv->entries.front();
+    priv->entries.pop_front();
+  }
+  priv->entries.push_back(entry);
+  pthread_mutex_unlock(&priv->lock);
+
+  delete evicted;
+}
+
+}  // namespace tlsclient
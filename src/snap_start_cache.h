@@ -0,0 +1,38 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef TLSCLIENT_SRC_SNAP_START_CACHE_H
+#define TLSCLIENT_SRC_SNAP_START_CACHE_H
+
+#include "tlsclient/public/base.h"
+
+namespace tlsclient {
+
+class Arena;
+class CertificateChain;
+class SnapStartCache;
+
+// These functions are the interface between the snap start extension and a
+// |SnapStartCache|. A prediction is identified by whether a session ticket
+// is being presented, the predicted ServerHello (as given to
+// |Connection::SetSnapStartData|) and the predicted certificates. Entries
+// hold a reference to their chain so that a Connection which shares it can
+// be matched without comparing the certificates.
+
+// SnapStartCacheGet copies the cached predicted response for the given
+// prediction into a buffer allocated from |arena| and sets |out| to point to
+// it. It returns false if there's no such entry.
+bool SnapStartCacheGet(SnapStartCache* cache, struct iovec* out, Arena* arena,
+                       bool resuming, const struct iovec& server_hello,
+                       CertificateChain* chain);
+
+// SnapStartCachePut records |response| as the predicted response for the
+// given prediction.
+void SnapStartCachePut(SnapStartCache* cache, const struct iovec& response,
+                       bool resuming, const struct iovec& server_hello,
+                       CertificateChain* chain);
+
+}  // namespace tlsclient
+
+#endif  // TLSCLIENT_SRC_SNAP_START_CACHE_H
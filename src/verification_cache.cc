@@ -0,0 +1,103 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tlsclient/public/verification_cache.h"
+
+#include <deque>
+#include <string>
+
+#include <pthread.h>
+
+namespace tlsclient {
+
+namespace {
+
+// Entry is a single cached result.
+struct Entry {
+  std::string host_name;
+  Fingerprint chain;
+  int result;
+  uint64_t expiry;
+};
+
+}  // anonymous namespace
+
+struct MemoryVerificationCachePrivate {
+  pthread_mutex_t lock;
+  unsigned max_entries;
+  // entries is ordered from the oldest to the newest.
+  std::deque<Entry> entries;
+};
+
+static bool EntryMatches(const Entry& entry, const char* host_name, const Fingerprint& chain) {
+  return memcmp(entry.chain.bytes, chain.bytes, sizeof(chain.bytes)) == 0 &&
+         entry.host_name == host_name;
+}
+
+MemoryVerificationCache::MemoryVerificationCache(unsigned max_entries)
+    : priv_(new MemoryVerificationCachePrivate) {
+  pthread_mutex_init(&priv_->lock, NULL);
+  priv_->max_entries = max_entries;
+}
+
+MemoryVerificationCache::~MemoryVerificationCache() {
+  pthread_mutex_destroy(&priv_->lock);
+  delete priv_;
+}
+
+bool MemoryVerificationCache::Lookup(const char* host_name, const Fingerprint& chain, uint64_t now, int* result) {
+  bool found = false;
+
+  pthread_mutex_lock(&priv_->lock);
+  for (std::deque<Entry>::const_iterator i = priv_->entries.begin();
+       i != priv_->entries.end(); ++i) {
+    if (!EntryMatches(*i, host_name, chain))
+      continue;
+    if (now < i->expiry) {
+      *result = i->result;
+      found = true;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&priv_->lock);
+
+  return found;
+}
+
+void MemoryVerificationCache::Store(const char* host_name, const Fingerprint& chain, int result, uint64_t now, uint32_t ttl_seconds) {
+  if (!priv_->max_entries)
+    return;
+
+  Entry entry;
+  entry.host_name = host_name;
+  entry.chain = chain;
+  entry.result = result;
+  entry.expiry = now + ttl_seconds;
+
+  pthread_mutex_lock(&priv_->lock);
+  for (std::deque<Entry>::iterator i = priv_->entries.begin();
+       i != priv_->entries.end(); ++i) {
+    if (EntryMatches(*i, host_name, chain)) {
+      priv_->entries.erase(i);
+      break;
+    }
+  }
+  if (priv_->entries.size() == priv_->max_entries) {
+    // Results may have been stored with different lifetimes so any which
+    // have expired are dropped before the oldest live one is.
+    std::deque<Entry> live;
+    for (std::deque<Entry>::const_iterator i = priv_->entries.begin();
+         i != priv_->entries.end(); ++i) {
+      if (now < i->expiry)
+        live.push_back(*i);
+    }
+    priv_->entries.swap(live);
+  }
+  if (priv_->entries.size() == priv_->max_entries)
+    priv_->entries.pop_front();
+  priv_->entries.push_back(entry);
+  pthread_mutex_unlock(&priv_->lock);
+}
+
+}  // namespace tlsclient
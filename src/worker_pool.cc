@@ -0,0 +1,146 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tlsclient/public/worker_pool.h"
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+namespace tlsclient {
+
+namespace {
+
+// Job is a single call to |WorkerPool::Run|. It lives on the stack of the
+// caller of |Run|.
+struct Job {
+  void (*f)(void* arg, unsigned i);
+  void* arg;
+  unsigned n;
+  // next is the next value of |i| to be handed out.
+  unsigned next;
+  // done is the number of calls to |f| which have completed.
+  unsigned done;
+};
+
+}  // anonymous namespace
+
+struct WorkerPoolPrivate {
+  pthread_mutex_t lock;
+  // work_available is signaled when a job is added to |jobs| or when
+  // |shutting_down| is set.
+  pthread_cond_t work_available;
+  // work_done is signaled when every call for a job has completed.
+  pthread_cond_t work_done;
+  // jobs contains those jobs which have values of |i| still to be handed
+  // out.
+  std::deque<Job*> jobs;
+  bool shutting_down;
+  std::vector<pthread_t> threads;
+};
+
+// TakeWork returns the next value of |i| for |job| and removes the job from
+// |jobs| once there are none left. |lock| must be held.
+static unsigned TakeWork(WorkerPoolPrivate* priv, Job* job) {
+  const unsigned i = job->next++;
+  if (job->next == job->n)
+    priv->jobs.erase(std::find(priv->jobs.begin(), priv->jobs.end(), job));
+  return i;
+}
+
+// FinishWork records that a call for |job| has completed. |lock| must be
+// held.
+static void FinishWork(WorkerPoolPrivate* priv, Job* job) {
+  job->done++;
+  if (job->done == job->n)
+    pthread_cond_broadcast(&priv->work_done);
+}
+
+static void* WorkerMain(void* arg) {
+  WorkerPoolPrivate* const priv = static_cast<WorkerPoolPrivate*>(arg);
+
+  pthread_mutex_lock(&priv->lock);
+  for (;;) {
+    while (priv->jobs.empty() && !priv->shutting_down)
+      pthread_cond_wait(&priv->work_available, &priv->lock);
+    if (priv->jobs.empty())
+      break;
+
+    Job* const job = priv->jobs.front();
+    const unsigned i = TakeWork(priv, job);
+    pthread_mutex_unlock(&priv->lock);
+    job->f(job->arg, i);
+    pthread_mutex_lock(&priv->lock);
+    FinishWork(priv, job);
+  }
+  pthread_mutex_unlock(&priv->lock);
+
+  return NULL;
+}
+
+WorkerPool::WorkerPool(unsigned threads)
+    : priv_(new WorkerPoolPrivate) {
+  pthread_mutex_init(&priv_->lock, NULL);
+  pthread_cond_init(&priv_->work_available, NULL);
+  pthread_cond_init(&priv_->work_done, NULL);
+  priv_->shutting_down = false;
+
+  for (unsigned i = 0; i < threads; i++) {
+    pthread_t thread;
+    // If we can't start a thread then we just have fewer of them. |Run|
+    // still works with none at all.
+    if (pthread_create(&thread, NULL, WorkerMain, priv_) == 0)
+      priv_->threads.push_back(thread);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  pthread_mutex_lock(&priv_->lock);
+  priv_->shutting_down = true;
+  pthread_cond_broadcast(&priv_->work_available);
+  pthread_mutex_unlock(&priv_->lock);
+
+  for (std::vector<pthread_t>::const_iterator i = priv_->threads.begin();
+       i != priv_->threads.end(); ++i) {
+    pthread_join(*i, NULL);
+  }
+
+  pthread_cond_destroy(&priv_->work_done);
+  pthread_cond_destroy(&priv_->work_available);
+  pthread_mutex_destroy(&priv_->lock);
+  delete priv_;
+}
+
+void WorkerPool::Run(void (*f)(void* arg, unsigned i), void* arg, unsigned n) {
+  if (!n)
+    return;
+
+  Job job;
+  job.f = f;
+  job.arg = arg;
+  job.n = n;
+  job.next = 0;
+  job.done = 0;
+
+  pthread_mutex_lock(&priv_->lock);
+  priv_->jobs.push_back(&job);
+  pthread_cond_broadcast(&priv_->work_available);
+
+  // The calling thread works on its own job rather than waiting idly.
+  while (job.next < job.n) {
+    const unsigned i = TakeWork(priv_, &job);
+    pthread_mutex_unlock(&priv_->lock);
+    f(arg, i);
+    pthread_mutex_lock(&priv_->lock);
+    FinishWork(priv_, &job);
+  }
+
+  while (job.done < job.n)
+    pthread_cond_wait(&priv_->work_done, &priv_->lock);
+  pthread_mutex_unlock(&priv_->lock);
+}
+
+}  // namespace tlsclient
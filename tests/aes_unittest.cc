@@ -5486,6 +5486,44 @@ static void TestAES(const AESTestCase* tests, size_t len) {
   }
 }
 
+// CryptLanes gives the same results as |Crypt| for each lane.
+template<class AES>
+static void TestAESLanes(const AESTestCase* tests, size_t len, Direction d) {
+  for (size_t start = 0; start + AES::LANES <= len; start += AES::LANES) {
+    AES* ciphers[AES::LANES];
+    uint8_t blocks[AES::LANES][16];
+    uint8_t* out[AES::LANES];
+
+    for (unsigned i = 0; i < AES::LANES; i++) {
+      const AESTestCase* const test = &tests[start + i];
+      uint8_t key[32];
+      FromHex(key, test->key);
+      FromHex(blocks[i], test->plaintext);
+      ciphers[i] = new AES(key, d);
+      out[i] = blocks[i];
+    }
+
+    AES::CryptLanes(ciphers, out, out, AES::LANES);
+
+    for (unsigned i = 0; i < AES::LANES; i++) {
+      char hex[33];
+      HexDump(hex, blocks[i], 16);
+      ASSERT_STREQ(tests[start + i].ciphertext, hex);
+      delete ciphers[i];
+    }
+  }
+}
+
+TEST_F(AESTest, 128Lanes) {
+  TestAESLanes<AES128>(AES128EncryptTests, arraysize(AES128EncryptTests), ENCRYPT);
+  TestAESLanes<AES128>(AES128DecryptTests, arraysize(AES128DecryptTests), DECRYPT);
+}
+
+TEST_F(AESTest, 256Lanes) {
+  TestAESLanes<AES256>(AES256EncryptTests, arraysize(AES256EncryptTests), ENCRYPT);
+  TestAESLanes<AES256>(AES256DecryptTests, arraysize(AES256DecryptTests), DECRYPT);
+}
+
 TEST_F(AESTest, 128Encrypt) {
   TestAES<AES128, ENCRYPT>(AES128EncryptTests, arraysize(AES128EncryptTests));
 }
@@ -286,6 +286,49 @@ TEST_F(BufferTest, VariableLength2) {
   ASSERT_TRUE(memcmp(b2.Get(temp, 3), "\x01\x02\x03", 3) == 0);
 }
 
+TEST_F(BufferTest, CopySubString) {
+  static const char kTestString1[] = "hello";
+  static const char kTestString2[] = "world";
+  struct iovec iov[2] = {
+    {const_cast<char*>(kTestString1), sizeof(kTestString1) - 1},
+    {const_cast<char*>(kTestString2), sizeof(kTestString2) - 1},
+  };
+  Buffer b(iov, 2);
+  char c[10];
+
+  // A contiguous substring uses an inline iovec which must survive copying.
+  Buffer* contiguous = new Buffer(b.SubString(4));
+  Buffer contiguous_copy(*contiguous);
+  delete contiguous;
+  ASSERT_TRUE(contiguous_copy.IsContiguous(4));
+  ASSERT_TRUE(contiguous_copy.Read(c, 4));
+  ASSERT_TRUE(memcmp(c, "hell", 4) == 0);
+
+  // A substring spanning both iovecs owns a copy of the iovec array.
+  b.Advance(3);
+  Buffer* spanning = new Buffer(b.SubString(4));
+  Buffer spanning_copy(*spanning);
+  delete spanning;
+  ASSERT_FALSE(spanning_copy.IsContiguous(4));
+  ASSERT_TRUE(spanning_copy.Read(c, 4));
+  ASSERT_TRUE(memcmp(c, "lowo", 4) == 0);
+}
+
+TEST_F(BufferTest, EmptySubString) {
+  static const char kTestString[] = "testing";
+  struct iovec iov = {const_cast<char*>(kTestString), sizeof(kTestString)};
+  Buffer b(&iov, 1);
+  char c;
+
+  // An empty substring has no backing memory but zero length reads and
+  // writes still succeed.
+  Buffer empty(b.SubString(0));
+  ASSERT_TRUE(empty.Read(&c, 0));
+  ASSERT_TRUE(empty.Read(NULL, 0));
+  ASSERT_TRUE(empty.Write(&c, 0));
+  ASSERT_FALSE(empty.Read(&c, 1));
+}
+
 TEST_F(BufferTest, U16) {
   static const char kTestString[] = "\x01\x03";
   struct iovec iov = {const_cast<char*>(kTestString), sizeof(kTestString) - 1};
@@ -352,4 +395,92 @@ TEST_F(BufferTest, Retreat) {
   ASSERT_EQ(1, v);
 }
 
+TEST_F(BufferTest, TellBytes) {
+  static const char kTestString[] = "\x01\x02\x03\x04\x05\x06";
+  struct iovec iov[4] = {
+    {const_cast<char*>(kTestString), 2},
+    {NULL, 0},
+    {const_cast<char*>(kTestString + 2), 1},
+    {const_cast<char*>(kTestString + 3), 3},
+  };
+  Buffer b(iov, 4);
+  uint8_t buf[4];
+
+  ASSERT_EQ(6u, b.size());
+  ASSERT_EQ(0u, b.TellBytes());
+  ASSERT_TRUE(b.Read(buf, 3));
+  ASSERT_EQ(3u, b.TellBytes());
+  ASSERT_EQ(3u, b.remaining());
+  ASSERT_TRUE(b.Get(buf, 2));
+  ASSERT_EQ(5u, b.TellBytes());
+  b.Retreat(4);
+  ASSERT_EQ(1u, b.TellBytes());
+  ASSERT_EQ(5u, b.remaining());
+  b.Advance(5);
+  ASSERT_EQ(6u, b.TellBytes());
+  ASSERT_EQ(0u, b.remaining());
+
+  // The last iovec may grow while the Buffer is live.
+  iov[3].iov_len = 2;
+  b.Rewind();
+  ASSERT_EQ(5u, b.size());
+  iov[3].iov_len = 3;
+  ASSERT_EQ(6u, b.size());
+}
+
+TEST_F(BufferTest, SeekBytes) {
+  static const char kTestString[] = "\x01\x02\x03\x04\x05\x06";
+  struct iovec iov[5] = {
+    {NULL, 0},
+    {const_cast<char*>(kTestString), 2},
+    {NULL, 0},
+    {const_cast<char*>(kTestString + 2), 1},
+    {const_cast<char*>(kTestString + 3), 3},
+  };
+  Buffer b(iov, 5);
+  uint8_t v;
+
+  for (unsigned i = 0; i < 6; i++) {
+    ASSERT_TRUE(b.SeekBytes(i));
+    ASSERT_EQ(i, b.TellBytes());
+    ASSERT_EQ(6 - i, b.remaining());
+    ASSERT_TRUE(b.U8(&v));
+    ASSERT_EQ(i + 1, v);
+  }
+
+  ASSERT_TRUE(b.SeekBytes(6));
+  ASSERT_EQ(0u, b.remaining());
+  ASSERT_FALSE(b.U8(&v));
+  ASSERT_FALSE(b.SeekBytes(7));
+
+  ASSERT_TRUE(b.SeekBytes(1));
+  uint16_t v16;
+  ASSERT_TRUE(b.U16(&v16));
+  ASSERT_EQ(0x203u, v16);
+  ASSERT_EQ(3u, b.TellBytes());
+}
+
+TEST_F(BufferTest, RemoveLeadingBytes) {
+  static const char kTestString[] = "\x01\x02\x03\x04\x05\x06";
+  struct iovec iov[3] = {
+    {const_cast<char*>(kTestString), 2},
+    {const_cast<char*>(kTestString + 2), 1},
+    {const_cast<char*>(kTestString + 3), 3},
+  };
+  unsigned iov_len = 3;
+
+  Buffer::RemoveLeadingBytes(iov, &iov_len, 1);
+  ASSERT_EQ(3u, iov_len);
+  ASSERT_EQ(kTestString + 1, static_cast<const char*>(iov[0].iov_base));
+  ASSERT_EQ(1u, iov[0].iov_len);
+
+  Buffer::RemoveLeadingBytes(iov, &iov_len, 3);
+  ASSERT_EQ(1u, iov_len);
+  ASSERT_EQ(kTestString + 4, static_cast<const char*>(iov[0].iov_base));
+  ASSERT_EQ(2u, iov[0].iov_len);
+
+  Buffer::RemoveLeadingBytes(iov, &iov_len, 2);
+  ASSERT_EQ(0u, iov_len);
+}
+
 }  // anonymous namespace
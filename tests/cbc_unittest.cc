@@ -4,6 +4,7 @@
 
 #include "tlsclient/src/crypto/cbc.h"
 
+#include "tlsclient/src/buffer.h"
 #include "tlsclient/src/crypto/aes/aes.h"
 
 #include <gtest/gtest.h>
@@ -93,4 +94,99 @@ TEST_F(CBCTest, Many) {
   ASSERT_TRUE(memcmp(parts, kBase, sizeof(simple)) == 0);
 }
 
+// CryptWithIV chains from the given IV and leaves the object's state alone.
+TEST_F(CBCTest, CryptWithIV) {
+  static const uint8_t key[16] = {0,1,2,3,4,5,6,7,8,9,0,1,2,3,4,5};
+  static const uint8_t iv[16] = {5,4,3,2,1,0,9,8,7,6,5,4,3,2,1,0};
+  CBC<AES128> enc(key, iv, ENCRYPT);
+  const CBC<AES128> other(key, kBase, ENCRYPT);
+  CBC<AES128> dec(key, kBase, DECRYPT);
+
+  uint8_t expected[32], out[32];
+  memcpy(expected, kBase, sizeof(expected));
+  const struct iovec iov_expected = {expected, sizeof(expected)};
+  const struct iovec iov_base = {const_cast<uint8_t*>(kBase), sizeof(kBase)};
+  enc.Crypt(&iov_expected, 1);
+
+  uint8_t chain[16];
+  memcpy(chain, iv, sizeof(chain));
+  other.CryptWithIV(chain, out, &iov_base, 1);
+  ASSERT_TRUE(memcmp(expected, out, sizeof(out)) == 0);
+  ASSERT_TRUE(memcmp(chain, out + 16, sizeof(chain)) == 0);
+
+  memcpy(chain, iv, sizeof(chain));
+  const struct iovec iov_out = {out, sizeof(out)};
+  dec.CryptWithIV(chain, &iov_out, 1);
+  ASSERT_TRUE(memcmp(kBase, out, sizeof(out)) == 0);
+}
+
+// EncryptLanes gives the same results as encrypting each lane by itself,
+// even when the lanes are of different lengths and split across iovecs.
+TEST_F(CBCTest, EncryptLanes) {
+  static const uint8_t key[16] = {0,1,2,3,4,5,6,7,8,9,0,1,2,3,4,5};
+  static const uint8_t iv[16] = {5,4,3,2,1,0,9,8,7,6,5,4,3,2,1,0};
+  static const unsigned kLanes = AES128::LANES;
+
+  CBC<AES128>* lanes[kLanes];
+  CBC<AES128>* singles[kLanes];
+  uint8_t data[kLanes][64], expected[kLanes][64];
+  struct iovec iovs[kLanes][2];
+  Buffer* bufs[kLanes];
+  size_t lengths[kLanes];
+  uint8_t chain[16];
+  uint8_t* ivs[kLanes];
+
+  for (unsigned i = 0; i < kLanes; i++) {
+    uint8_t lane_key[16];
+    memcpy(lane_key, key, sizeof(lane_key));
+    lane_key[0] = i;
+    lanes[i] = new CBC<AES128>(lane_key, iv, ENCRYPT);
+    singles[i] = new CBC<AES128>(lane_key, iv, ENCRYPT);
+    for (unsigned j = 0; j < sizeof(data[i]); j++)
+      data[i][j] = i * 64 + j;
+    memcpy(expected[i], data[i], sizeof(expected[i]));
+
+    lengths[i] = 16 * (i + 1);
+    iovs[i][0].iov_base = data[i];
+    iovs[i][0].iov_len = 7;
+    iovs[i][1].iov_base = data[i] + 7;
+    iovs[i][1].iov_len = lengths[i] - 7;
+    bufs[i] = new Buffer(iovs[i], 2);
+    ivs[i] = NULL;
+  }
+  // The last lane chains from an explicit IV.
+  memcpy(chain, kBase, sizeof(chain));
+  ivs[kLanes - 1] = chain;
+
+  CBC<AES128>::EncryptLanes(lanes, ivs, bufs, lengths, kLanes);
+
+  for (unsigned i = 0; i < kLanes; i++) {
+    const struct iovec iov = {expected[i], lengths[i]};
+    if (i == kLanes - 1) {
+      uint8_t expected_chain[16];
+      memcpy(expected_chain, kBase, sizeof(expected_chain));
+      singles[i]->CryptWithIV(expected_chain, &iov, 1);
+      ASSERT_TRUE(memcmp(expected_chain, chain, sizeof(chain)) == 0);
+    } else {
+      singles[i]->Crypt(&iov, 1);
+    }
+    ASSERT_TRUE(memcmp(expected[i], data[i], sizeof(data[i])) == 0);
+    ASSERT_EQ(lengths[i], bufs[i]->TellBytes());
+
+    // Both objects are left in the same state.
+    uint8_t next1[16], next2[16];
+    memcpy(next1, kBase, sizeof(next1));
+    memcpy(next2, kBase, sizeof(next2));
+    const struct iovec next1_iov = {next1, sizeof(next1)};
+    const struct iovec next2_iov = {next2, sizeof(next2)};
+    singles[i]->Crypt(&next1_iov, 1);
+    lanes[i]->Crypt(&next2_iov, 1);
+    ASSERT_TRUE(memcmp(next1, next2, sizeof(next1)) == 0);
+
+    delete bufs[i];
+    delete singles[i];
+    delete lanes[i];
+  }
+}
+
 }  // anonymous namespace
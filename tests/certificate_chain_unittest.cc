@@ -0,0 +1,80 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tlsclient/public/certificate_chain.h"
+
+#include <gtest/gtest.h>
+
+#include "tlsclient/public/connection.h"
+#include "tlsclient/public/context.h"
+#include "tlsclient/tests/util.h"
+
+using namespace tlsclient;
+
+namespace {
+
+class CertificateChainTest : public ::testing::Test {
+};
+
+class NullContext : public Context {
+ public:
+  bool RandomBytes(void* addr, size_t len) {
+    return false;
+  }
+
+  uint64_t EpochSeconds() {
+    return 0;
+  }
+
+  Certificate* ParseCertificate(const uint8_t* bytes, size_t length) {
+    return NULL;
+  }
+};
+
+TEST_F(CertificateChainTest, Create) {
+  static const char kLeaf[] = "leaf";
+  static const char kIntermediate[] = "intermediate";
+  struct iovec certs[2];
+  certs[0].iov_base = const_cast<char*>(kLeaf);
+  certs[0].iov_len = sizeof(kLeaf) - 1;
+  certs[1].iov_base = const_cast<char*>(kIntermediate);
+  certs[1].iov_len = sizeof(kIntermediate) - 1;
+
+  CertificateChain* chain = CertificateChain::Create(certs, 2);
+  ASSERT_EQ(2u, chain->size());
+  for (unsigned i = 0; i < 2; i++) {
+    ASSERT_EQ(certs[i].iov_len, chain->certificates()[i].iov_len);
+    ASSERT_EQ(0, memcmp(certs[i].iov_base, chain->certificates()[i].iov_base, certs[i].iov_len));
+  }
+
+  char wire_hex[(3 + 4 + 3 + 12) * 2 + 1];
+  ASSERT_EQ(3 + 4 + 3 + 12u, chain->wire_length());
+  HexDump(wire_hex, chain->wire(), chain->wire_length());
+  ASSERT_STREQ("0000046c656166" "00000c696e7465726d656469617465", wire_hex);
+
+  chain->DecRef();
+}
+
+// A Connection which is given a chain reports it as the server's
+// certificates, without copying it, until the real ones arrive.
+TEST_F(CertificateChainTest, Predicted) {
+  static const char kLeaf[] = "leaf";
+  struct iovec cert = {const_cast<char*>(kLeaf), sizeof(kLeaf) - 1};
+  CertificateChain* chain = CertificateChain::Create(&cert, 1);
+
+  NullContext ctx;
+  Connection* conn = new Connection(&ctx);
+  conn->SetPredictedCertificateChain(chain);
+  chain->DecRef();
+
+  const struct iovec* iovs;
+  unsigned len;
+  ASSERT_EQ(0, conn->server_certificates(&iovs, &len));
+  ASSERT_EQ(1u, len);
+  ASSERT_EQ(chain->certificates(), iovs);
+
+  delete conn;
+}
+
+}  // anonymous namespace
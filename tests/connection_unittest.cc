@@ -445,6 +445,24 @@ TEST_F(ConnectionTest, OpenSSLFalseStart) {
   PerformConnection(client_, &conn);
 }
 
+// With False Start, queued application data is sent along with the client's
+// Finished message.
+TEST_F(ConnectionTest, OpenSSLFalseStartQueuedData) {
+  static const char* const args[] = {OpenSSLHelper(), NULL};
+
+  OpenSSLContext ctx;
+  Connection conn(&ctx);
+  conn.EnableDefault();
+  conn.EnableFalseStart(true);
+  const struct iovec iov = {const_cast<uint8_t*>(kMsg), sizeof(kMsg)};
+  conn.QueueApplicationData(&iov, 1);
+  StartServer(args);
+  // The application data has already been given so PerformConnection is
+  // told not to send it again.
+  PerformConnection(client_, &conn, true);
+  ASSERT_EQ(1u, conn.cork_stats().records);
+}
+
 TEST_F(ConnectionTest, OpenSSLSessionTickets) {
   static const char* const args[] = {OpenSSLHelper(), "session-tickets", NULL};
   Result r;
@@ -0,0 +1,68 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tlsclient/src/crypto/fnv1a64/fnv1a64.h"
+
+#include <gtest/gtest.h>
+
+#include "tlsclient/src/base-internal.h"
+#include "tlsclient/tests/util.h"
+
+using namespace tlsclient;
+
+namespace {
+
+class FNV1a64Test : public ::testing::Test {
+};
+
+struct FNV1a64TestCase {
+  const char* digest;
+  const char* input;
+};
+
+// These values are from the test vectors at
+// http://www.isthe.com/chongo/src/fnv/test_fnv.c
+static const FNV1a64TestCase FNV1a64Tests[] = {
+  {"cbf29ce484222325", ""},
+  {"af63dc4c8601ec8c", "a"},
+  {"85944171f73967e8", "foobar"},
+};
+
+TEST_F(FNV1a64Test, Simple) {
+  for (size_t i = 0; i < arraysize(FNV1a64Tests); i++) {
+    const FNV1a64TestCase* test = &FNV1a64Tests[i];
+    FNV1a64 fnv;
+    uint8_t digest[FNV1a64::DIGEST_SIZE];
+    char digest_hex[FNV1a64::DIGEST_SIZE * 2 + 1];
+
+    fnv.Update(test->input, strlen(test->input));
+    fnv.Final(digest);
+    HexDump(digest_hex, digest, sizeof(digest));
+    ASSERT_STREQ(test->digest, digest_hex);
+  }
+}
+
+// The result mustn't depend on how the input is split between calls to
+// |Update|.
+TEST_F(FNV1a64Test, Split) {
+  uint8_t input[100];
+  for (unsigned i = 0; i < sizeof(input); i++)
+    input[i] = i * 13;
+
+  FNV1a64 whole;
+  uint8_t expected[FNV1a64::DIGEST_SIZE];
+  whole.Update(input, sizeof(input));
+  whole.Final(expected);
+
+  for (unsigned split = 0; split <= sizeof(input); split++) {
+    FNV1a64 fnv;
+    uint8_t digest[FNV1a64::DIGEST_SIZE];
+    fnv.Update(input, split);
+    fnv.Update(input + split, sizeof(input) - split);
+    fnv.Final(digest);
+    ASSERT_EQ(0, memcmp(expected, digest, sizeof(digest)));
+  }
+}
+
+}  // anonymous namespace
@@ -2,12 +2,24 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
 #include <vector>
 
 #include "tlsclient/public/connection.h"
 #include "tlsclient/public/context.h"
+#include "tlsclient/public/verification_cache.h"
+#include "tlsclient/public/worker_pool.h"
 #include "tlsclient/src/buffer.h"
 #include "tlsclient/src/crypto/cipher_suites.h"
+#include "tlsclient/src/crypto/prf/prf.h"
+#include "tlsclient/src/crypto/sha256/sha256.h"
 #include "tlsclient/src/connection_private.h"
 #include "tlsclient/src/handshake.h"
 #include "tlsclient/src/sink.h"
@@ -268,6 +280,35 @@ TEST_F(HandshakeTest, GetIncompleteHandshake) {
   ASSERT_FALSE(found);
 }
 
+// A partial record reports how many more bytes are needed to complete it and
+// leaves the input at the start of the record.
+TEST_F(HandshakeTest, GetRecordBytesNeeded) {
+  static const char kData[] = "\x15\x03\x00\x00\x02\x01\x02";
+  struct iovec iov = {const_cast<char*>(kData), 0};
+  bool found;
+  RecordType type;
+  HandshakeMessage htype;
+  std::vector<struct iovec> out;
+  ConnectionPrivate priv(NULL);
+
+  for (iov.iov_len = 0; iov.iov_len < sizeof(kData) - 1; iov.iov_len++) {
+    Buffer in(&iov, 1);
+    const Result r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
+    ASSERT_EQ(0, ErrorCodeFromResult(r));
+    ASSERT_FALSE(found);
+    // Until the header is complete, we only know that we need the header.
+    const size_t expected = iov.iov_len < 5 ? 5 - iov.iov_len : sizeof(kData) - 1 - iov.iov_len;
+    ASSERT_EQ(expected, priv.reader.bytes_needed);
+    ASSERT_EQ(0u, in.TellBytes());
+  }
+
+  Buffer in(&iov, 1);
+  const Result r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_TRUE(found);
+  ASSERT_EQ(0u, priv.reader.bytes_needed);
+}
+
 // The handshake message is split across two records.
 TEST_F(HandshakeTest, GetSplitHandshake) {
   static const char kData[] = "\x16\x03\x00\x00\x04\x01\x00\x00\x01\x16\x03\x00\x00\x01\x05";
@@ -279,10 +320,14 @@ TEST_F(HandshakeTest, GetSplitHandshake) {
   std::vector<struct iovec> out;
   ConnectionPrivate priv(NULL);
   Result r;
+  // Records which have been consumed into the reassembly buffer must not be
+  // given again so each call resumes from where the last one stopped.
+  size_t consumed = 0;
 
   for (iov.iov_len = 1; iov.iov_len < sizeof(kData); iov.iov_len++) {
-    in.Rewind();
+    in.SeekBytes(consumed);
     r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
+    consumed = in.TellBytes();
     ASSERT_EQ(0, ErrorCodeFromResult(r));
     if (iov.iov_len != sizeof(kData) - 1) {
       ASSERT_FALSE(found);
@@ -312,9 +357,12 @@ TEST_F(HandshakeTest, GetSplitHandshakes) {
   ConnectionPrivate priv(NULL);
   Result r;
 
+  size_t consumed = 0;
+
   for (iov.iov_len = 1; iov.iov_len < 21; iov.iov_len++) {
-    in.Rewind();
+    in.SeekBytes(consumed);
     r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
+    consumed = in.TellBytes();
     ASSERT_EQ(0, ErrorCodeFromResult(r));
     if (iov.iov_len != 20) {
       ASSERT_FALSE(found);
@@ -331,13 +379,15 @@ TEST_F(HandshakeTest, GetSplitHandshakes) {
   ASSERT_TRUE(buf.Read(contents, 4));
   ASSERT_TRUE(memcmp(contents, "\x10\x11\x12\x13", 4) == 0);
 
-  ASSERT_EQ(18u, in.TellBytes());
+  // The second record completed the first message and so was consumed whole.
+  // The start of the second message is held in the reassembly buffer.
+  ASSERT_EQ(20u, in.TellBytes());
   out.clear();
-  const Buffer::Pos pos = in.Tell();
 
   for (iov.iov_len = 20; iov.iov_len < sizeof(kData); iov.iov_len++) {
-    in.Seek(pos);
+    in.SeekBytes(consumed);
     r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
+    consumed = in.TellBytes();
     ASSERT_EQ(0, ErrorCodeFromResult(r));
     if (iov.iov_len != sizeof(kData) - 1) {
       ASSERT_FALSE(found);
@@ -435,7 +485,15 @@ class TestCipherSpec : public CipherSpec {
     assert(false);
   }
 
-  virtual bool Encrypt(uint8_t* scratch, size_t* scratch_size, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
+  unsigned PrefixBytes() {
+    return 0;
+  }
+
+  bool SupportsParallelRecords() {
+    return false;
+  }
+
+  virtual bool Encrypt(uint8_t* prefix, uint8_t* scratch, size_t* scratch_size, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
     assert(false);
   }
 
@@ -452,12 +510,137 @@ class TestCipherSpec : public CipherSpec {
     return true;
   }
 
-  virtual unsigned StripMACAndPadding(struct iovec* iov, unsigned* iov_len) {
-    Buffer::RemoveTrailingBytes(iov, iov_len, MAC_SIZE);
-    return MAC_SIZE;
+  virtual bool EncryptTo(uint8_t* out, size_t* out_len, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
+    assert(false);
+  }
+
+  virtual bool DecryptTo(uint8_t* out, size_t* out_len, const struct iovec* in, unsigned in_len, const uint8_t* record_header, uint64_t seq_num) {
+    assert(false);
+  }
+
+  virtual void ExportState(Sink* sink) {
+    assert(false);
+  }
+
+  virtual bool ImportState(Buffer* buf) {
+    assert(false);
+  }
+};
+
+// FailingCipherSpec "encrypts" records by leaving them alone, except that
+// the record with sequence number |fail_at| fails.
+class FailingCipherSpec : public TestCipherSpec {
+ public:
+  FailingCipherSpec(bool parallel, uint64_t fail_at)
+      : parallel_(parallel),
+        fail_at_(fail_at) {
+  }
+
+  unsigned ScratchBytesNeeded(size_t length) {
+    return 0;
+  }
+
+  bool SupportsParallelRecords() {
+    return parallel_;
   }
+
+  virtual bool Encrypt(uint8_t* prefix, uint8_t* scratch, size_t* scratch_size, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
+    *scratch_size = 0;
+    in[in_len].iov_base = scratch;
+    in[in_len].iov_len = 0;
+    return seq_num != fail_at_;
+  }
+
+  virtual bool EncryptTo(uint8_t* out, size_t* out_len, const uint8_t* record_header, struct iovec* in, unsigned in_len, uint64_t seq_num) {
+    *out_len = 0;
+    for (unsigned i = 0; i < in_len; i++) {
+      memmove(out + *out_len, in[i].iov_base, in[i].iov_len);
+      *out_len += in[i].iov_len;
+    }
+    return seq_num != fail_at_;
+  }
+
+ private:
+  const bool parallel_;
+  const uint64_t fail_at_;
 };
 
+// If any record of a batch fails to encrypt then none of the batch's
+// sequence numbers are used.
+TEST_F(HandshakeTest, EncryptVFailureKeepsSequenceNumber) {
+  for (unsigned parallel = 0; parallel < 2; parallel++) {
+    SCOPED_TRACE(parallel);
+    ContextBase ctx;
+    Connection conn(&ctx);
+    ConnectionPrivate* const priv = conn.priv();
+    priv->version = TLSv10;
+    priv->can_send_application_data = true;
+    priv->writer.seq_num = 5;
+    priv->writer.cipher_spec = new FailingCipherSpec(parallel, 6);
+
+    std::vector<uint8_t> data(20000, 'a');
+    const struct iovec iov = {&data[0], data.size()};
+    const struct iovec* out;
+    unsigned out_n;
+    ASSERT_EQ(ERR_INTERNAL_ERROR, ErrorCodeFromResult(conn.EncryptV(&out, &out_n, &iov, 1)));
+    ASSERT_EQ(5u, priv->writer.seq_num);
+    // A cipher which chains from record to record can't be used again.
+    ASSERT_EQ(parallel != 0, conn.is_ready_to_send_application_data());
+  }
+}
+
+// If any record fails to be sealed by EncryptTo then nothing is written and
+// no sequence numbers are used.
+TEST_F(HandshakeTest, EncryptToFailureKeepsSequenceNumber) {
+  for (unsigned parallel = 0; parallel < 2; parallel++) {
+    SCOPED_TRACE(parallel);
+    ContextBase ctx;
+    Connection conn(&ctx);
+    ConnectionPrivate* const priv = conn.priv();
+    priv->version = TLSv10;
+    priv->can_send_application_data = true;
+    priv->writer.seq_num = 5;
+    priv->writer.cipher_spec = new FailingCipherSpec(parallel, 6);
+
+    std::vector<uint8_t> data(20000, 'a');
+    const struct iovec iov = {&data[0], data.size()};
+    std::vector<uint8_t> out(30000);
+    size_t out_len = out.size();
+    ASSERT_EQ(ERR_INTERNAL_ERROR, ErrorCodeFromResult(conn.EncryptTo(&out[0], &out_len, &iov, 1)));
+    ASSERT_EQ(0u, out_len);
+    ASSERT_EQ(5u, priv->writer.seq_num);
+    ASSERT_EQ(parallel != 0, conn.is_ready_to_send_application_data());
+
+    if (!parallel)
+      continue;
+    // Otherwise the same data can be encrypted again.
+    priv->writer.seq_num = 7;
+    out_len = out.size();
+    ASSERT_EQ(0, ErrorCodeFromResult(conn.EncryptTo(&out[0], &out_len, &iov, 1)));
+    ASSERT_EQ(20010u, out_len);
+    ASSERT_EQ(9u, priv->writer.seq_num);
+  }
+}
+
+// Data buffered by Write isn't lost when it fails to be encrypted.
+TEST_F(HandshakeTest, FlushFailureKeepsData) {
+  ContextBase ctx;
+  Connection conn(&ctx);
+  conn.priv()->version = TLSv11;
+  conn.priv()->can_send_application_data = true;
+  conn.priv()->writer.cipher_spec = new FailingCipherSpec(true, 0);
+
+  conn.Cork(100, 0);
+  char data[] = "GET / HTTP/1.0\r\n\r\n";
+  const struct iovec iov = {data, sizeof(data) - 1};
+  const struct iovec* out;
+  unsigned out_n;
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+  ASSERT_EQ(ERR_INTERNAL_ERROR, ErrorCodeFromResult(conn.Flush(&out, &out_n)));
+  const std::vector<uint8_t>& buffered = conn.priv()->writer.cork_buffer;
+  ASSERT_EQ(std::string(data), std::string(buffered.begin(), buffered.end()));
+}
+
 // 'Decrypt' a single record.
 TEST_F(HandshakeTest, DecryptRecord) {
   char kData[] = "\x17\x03\x00\x00\x05\xf0\x00\x00\x00\x00";
@@ -469,7 +652,7 @@ TEST_F(HandshakeTest, DecryptRecord) {
   std::vector<struct iovec> out;
   ConnectionPrivate priv(NULL);
   TestCipherSpec* test_cipher_spec = new TestCipherSpec;
-  priv.read_cipher_spec = test_cipher_spec;
+  priv.reader.cipher_spec = test_cipher_spec;
 
   const Result r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
   ASSERT_EQ(0, ErrorCodeFromResult(r));
@@ -492,13 +675,16 @@ TEST_F(HandshakeTest, GetSplitEncryptedHandshakes) {
   ConnectionPrivate priv(NULL);
   Result r;
   TestCipherSpec* test_cipher_spec = new TestCipherSpec;
-  priv.read_cipher_spec = test_cipher_spec;
+  priv.reader.cipher_spec = test_cipher_spec;
+
+  size_t consumed = 0;
 
   for (iov.iov_len = 1; iov.iov_len < 29; iov.iov_len++) {
-    in.Rewind();
+    in.SeekBytes(consumed);
     if (iov.iov_len == 28)
       r++;
     r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
+    consumed = in.TellBytes();
     ASSERT_EQ(0, ErrorCodeFromResult(r));
     if (iov.iov_len != 28) {
       ASSERT_FALSE(found);
@@ -515,13 +701,15 @@ TEST_F(HandshakeTest, GetSplitEncryptedHandshakes) {
   ASSERT_TRUE(buf.Read(contents, 4));
   ASSERT_TRUE(memcmp(contents, "\x10\x11\x12\x13", 4) == 0);
 
-  ASSERT_EQ(22u, in.TellBytes());
+  // The second record completed the first message and so was consumed whole.
+  // The start of the second message is held in the reassembly buffer.
+  ASSERT_EQ(28u, in.TellBytes());
   out.clear();
-  const Buffer::Pos pos = in.Tell();
 
   for (iov.iov_len = 28; iov.iov_len < sizeof(kData); iov.iov_len++) {
-    in.Seek(pos);
+    in.SeekBytes(consumed);
     r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
+    consumed = in.TellBytes();
     ASSERT_EQ(0, ErrorCodeFromResult(r));
     if (iov.iov_len != sizeof(kData) - 1) {
       ASSERT_FALSE(found);
@@ -537,6 +725,1629 @@ TEST_F(HandshakeTest, GetSplitEncryptedHandshakes) {
   ASSERT_TRUE(memcmp(contents, "\x14\x15\x16", 3) == 0);
 }
 
+// 'Decrypt' a run of application data records in one go.
+TEST_F(HandshakeTest, GetApplicationDataRecords) {
+  char kData[] = "\x17\x03\x01\x00\x05\xf0\x00\x00\x00\x00\x17\x03\x01\x00\x06\xf1\xf2\x00\x00\x00\x00\x15\x03\x01\x00\x02\x01\x00";
+  struct iovec iov[2] = {{kData, 16}, {kData + 16, sizeof(kData) - 1 - 16}};
+  Buffer in(iov, 2);
+  std::vector<struct iovec> out;
+  std::vector<RecordSpan> spans;
+  ConnectionPrivate priv(NULL);
+  priv.version_established = true;
+  priv.version = TLSv10;
+  priv.reader.seq_num = 7;
+  TestCipherSpec* test_cipher_spec = new TestCipherSpec;
+  priv.reader.cipher_spec = test_cipher_spec;
+
+  unsigned records;
+  const Result r = GetApplicationDataRecords(&records, &out, &spans, &in, &priv, NULL, NULL);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(2u, records);
+  ASSERT_EQ(2u, spans.size());
+  ASSERT_EQ(21u, in.TellBytes());
+  ASSERT_EQ(9u, priv.reader.seq_num);
+
+  ASSERT_EQ(0u, spans[0].iov_offset);
+  ASSERT_EQ(1u, spans[0].iov_len);
+  ASSERT_EQ(1u, spans[0].length);
+  ASSERT_EQ(10u, spans[0].wire_length);
+  ASSERT_EQ(7u, spans[0].seq_num);
+  ASSERT_EQ(15, static_cast<uint8_t*>(out[0].iov_base)[0]);
+
+  // The second record's plaintext is split across the two input vectors.
+  ASSERT_EQ(1u, spans[1].iov_offset);
+  ASSERT_EQ(2u, spans[1].iov_len);
+  ASSERT_EQ(2u, spans[1].length);
+  ASSERT_EQ(11u, spans[1].wire_length);
+  ASSERT_EQ(8u, spans[1].seq_num);
+  ASSERT_EQ(3u, out.size());
+  ASSERT_EQ(14, static_cast<uint8_t*>(out[1].iov_base)[0]);
+  ASSERT_EQ(13, static_cast<uint8_t*>(out[2].iov_base)[0]);
+}
+
+// An empty application data record has no vectors at all. It's valid
+// unencrypted but, when encrypted, too short to hold a MAC.
+TEST_F(HandshakeTest, GetApplicationDataRecordsEmpty) {
+  char kData[] = "\x17\x03\x01\x00\x00";
+  struct iovec iov = {kData, sizeof(kData) - 1};
+  std::vector<struct iovec> out;
+  std::vector<RecordSpan> spans;
+  ConnectionPrivate priv(NULL);
+  priv.version_established = true;
+  priv.version = TLSv10;
+
+  Buffer in(&iov, 1);
+  unsigned records;
+  Result r = GetApplicationDataRecords(&records, &out, &spans, &in, &priv, NULL, NULL);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(1u, records);
+  ASSERT_EQ(0u, out.size());
+  ASSERT_EQ(0u, spans[0].length);
+
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  priv.reader.cipher_spec = suite->create(TLSv10, kb);
+
+  uint8_t plaintext_buf[16];
+  uint8_t* plaintext = plaintext_buf;
+  size_t plaintext_len = sizeof(plaintext_buf);
+  Buffer encrypted(&iov, 1);
+  out.clear();
+  spans.clear();
+  r = GetApplicationDataRecords(&records, &out, &spans, &encrypted, &priv, &plaintext, &plaintext_len);
+  ASSERT_EQ(ERR_BAD_MAC, ErrorCodeFromResult(r));
+}
+
+// EncryptV splits large writes into records which decrypt back to the
+// original data.
+TEST_F(HandshakeTest, EncryptVMultipleRecords) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  // The client's write keys are the server's read keys.
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+  ContextBase ctx;
+  Connection conn(&ctx);
+  conn.priv()->version = TLSv10;
+  conn.priv()->can_send_application_data = true;
+  conn.priv()->writer.cipher_spec = suite->create(TLSv10, kb);
+
+  std::vector<uint8_t> plaintext(40000);
+  for (size_t i = 0; i < plaintext.size(); i++)
+    plaintext[i] = i * 13;
+  std::vector<uint8_t> data(plaintext);
+  struct iovec iov[2] = {{&data[0], 100}, {&data[100], data.size() - 100}};
+
+  const struct iovec* out;
+  unsigned out_n;
+  Result r = conn.EncryptV(&out, &out_n, iov, 2);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  // Three records, each with a header and trailer. The first record covers
+  // both input vectors.
+  ASSERT_EQ(10u, out_n);
+  ASSERT_EQ(3u, conn.priv()->writer.seq_num);
+
+  std::vector<uint8_t> wire;
+  for (unsigned i = 0; i < out_n; i++) {
+    const uint8_t* p = static_cast<const uint8_t*>(out[i].iov_base);
+    wire.insert(wire.end(), p, p + out[i].iov_len);
+  }
+
+  ConnectionPrivate priv(NULL);
+  priv.version_established = true;
+  priv.version = TLSv10;
+  priv.reader.cipher_spec = suite->create(TLSv10, kb);
+  struct iovec wire_iov = {&wire[0], wire.size()};
+  Buffer in(&wire_iov, 1);
+  std::vector<struct iovec> decrypted;
+  std::vector<RecordSpan> spans;
+  unsigned records;
+  r = GetApplicationDataRecords(&records, &decrypted, &spans, &in, &priv, NULL, NULL);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(3u, records);
+  ASSERT_EQ(0u, in.remaining());
+  ASSERT_EQ(16384u, spans[0].length);
+  ASSERT_EQ(16384u, spans[1].length);
+  ASSERT_EQ(40000u - 2 * 16384, spans[2].length);
+
+  Buffer result(&decrypted[0], decrypted.size());
+  ASSERT_EQ(plaintext.size(), result.size());
+  std::vector<uint8_t> contents(plaintext.size());
+  ASSERT_TRUE(result.Read(&contents[0], contents.size()));
+  ASSERT_TRUE(contents == plaintext);
+}
+
+class ContextSettableEpochSeconds : public ContextBase {
+ public:
+  ContextSettableEpochSeconds()
+      : now(100000) {
+  }
+
+  uint64_t EpochSeconds() {
+    return now;
+  }
+
+  uint64_t now;
+};
+
+// EncryptVRecordLengths encrypts |len| bytes with |conn|, decrypts them with
+// |peer| and sets |lengths| to the plaintext length of each record.
+static void EncryptVRecordLengths(std::vector<size_t>* lengths, Connection* conn, ConnectionPrivate* peer, size_t len) {
+  std::vector<uint8_t> data(len);
+  struct iovec iov = {&data[0], data.size()};
+  const struct iovec* out;
+  unsigned out_n;
+  ASSERT_EQ(0, ErrorCodeFromResult(conn->EncryptV(&out, &out_n, &iov, 1)));
+
+  std::vector<uint8_t> wire;
+  for (unsigned i = 0; i < out_n; i++) {
+    const uint8_t* p = static_cast<const uint8_t*>(out[i].iov_base);
+    wire.insert(wire.end(), p, p + out[i].iov_len);
+  }
+
+  struct iovec wire_iov = {&wire[0], wire.size()};
+  Buffer in(&wire_iov, 1);
+  std::vector<struct iovec> decrypted;
+  std::vector<RecordSpan> spans;
+  unsigned records;
+  ASSERT_EQ(0, ErrorCodeFromResult(GetApplicationDataRecords(&records, &decrypted, &spans, &in, peer, NULL, NULL)));
+  ASSERT_EQ(0u, in.remaining());
+
+  lengths->clear();
+  for (unsigned i = 0; i < records; i++)
+    lengths->push_back(spans[i].length);
+}
+
+// With dynamic record sizing, a connection starts with records which fit in
+// a single TCP segment, moves to full sized records and then goes back to
+// small records after being idle.
+TEST_F(HandshakeTest, DynamicRecordSizing) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+  ContextSettableEpochSeconds ctx;
+  Connection conn(&ctx);
+  conn.priv()->version = TLSv10;
+  conn.priv()->can_send_application_data = true;
+  conn.priv()->writer.cipher_spec = suite->create(TLSv10, kb);
+  conn.set_record_sizing(3000, 10);
+
+  ConnectionPrivate peer(NULL);
+  peer.version_established = true;
+  peer.version = TLSv10;
+  peer.reader.cipher_spec = suite->create(TLSv10, kb);
+
+  // 16-byte blocks: 1400 = 5 + 1392 + 3 and 1392 = 1371 + 20 (MAC) + 1
+  // (padding length).
+  static const size_t kSmall = 1371;
+
+  std::vector<size_t> lengths;
+  EncryptVRecordLengths(&lengths, &conn, &peer, 40000);
+  ASSERT_EQ(6u, lengths.size());
+  ASSERT_EQ(kSmall, lengths[0]);
+  ASSERT_EQ(kSmall, lengths[1]);
+  ASSERT_EQ(kSmall, lengths[2]);
+  ASSERT_EQ(16384u, lengths[3]);
+  ASSERT_EQ(16384u, lengths[4]);
+  ASSERT_EQ(40000u - 3 * kSmall - 2 * 16384, lengths[5]);
+
+  // The ramp is already complete so the next write goes straight to full
+  // sized records, even after a short pause.
+  ctx.now += 9;
+  EncryptVRecordLengths(&lengths, &conn, &peer, 20000);
+  ASSERT_EQ(2u, lengths.size());
+  ASSERT_EQ(16384u, lengths[0]);
+
+  // After being idle, small records are used again.
+  ctx.now += 10;
+  EncryptVRecordLengths(&lengths, &conn, &peer, 20000);
+  ASSERT_EQ(4u, lengths.size());
+  ASSERT_EQ(kSmall, lengths[0]);
+  ASSERT_EQ(kSmall, lengths[1]);
+  ASSERT_EQ(kSmall, lengths[2]);
+  ASSERT_EQ(20000u - 3 * kSmall, lengths[3]);
+
+  // EncryptTo sizes records in the same way.
+  ctx.now += 10;
+  std::vector<uint8_t> data(5000);
+  struct iovec iov = {&data[0], data.size()};
+  std::vector<uint8_t> out(8000);
+  size_t out_len = out.size();
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.EncryptTo(&out[0], &out_len, &iov, 1)));
+  ASSERT_EQ(3 * 1397u + 5 + (5000 - 3 * kSmall + 20 + 16) / 16 * 16, out_len);
+  ASSERT_EQ(1392u, static_cast<size_t>(out[3]) << 8 | out[4]);
+}
+
+// DecryptVectors decrypts the records in |out| with |peer| and appends the
+// plaintext to |plaintext|.
+static void DecryptVectors(std::vector<uint8_t>* plaintext, unsigned* records, ConnectionPrivate* peer, const struct iovec* out, unsigned out_n) {
+  std::vector<uint8_t> wire;
+  for (unsigned i = 0; i < out_n; i++) {
+    const uint8_t* p = static_cast<const uint8_t*>(out[i].iov_base);
+    wire.insert(wire.end(), p, p + out[i].iov_len);
+  }
+
+  struct iovec wire_iov = {&wire[0], wire.size()};
+  Buffer in(&wire_iov, 1);
+  std::vector<struct iovec> decrypted;
+  std::vector<RecordSpan> spans;
+  ASSERT_EQ(0, ErrorCodeFromResult(GetApplicationDataRecords(records, &decrypted, &spans, &in, peer, NULL, NULL)));
+  ASSERT_EQ(0u, in.remaining());
+
+  for (unsigned i = 0; i < decrypted.size(); i++) {
+    const uint8_t* p = static_cast<const uint8_t*>(decrypted[i].iov_base);
+    plaintext->insert(plaintext->end(), p, p + decrypted[i].iov_len);
+  }
+}
+
+// When corked, small writes are coalesced into a single record which is sent
+// once enough data, or old enough data, is buffered.
+TEST_F(HandshakeTest, Cork) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+  ContextSettableEpochSeconds ctx;
+  Connection conn(&ctx);
+  conn.priv()->version = TLSv10;
+  conn.priv()->can_send_application_data = true;
+  conn.priv()->writer.cipher_spec = suite->create(TLSv10, kb);
+
+  ConnectionPrivate peer(NULL);
+  peer.version_established = true;
+  peer.version = TLSv10;
+  peer.reader.cipher_spec = suite->create(TLSv10, kb);
+
+  const struct iovec* out;
+  unsigned out_n;
+  unsigned records;
+  std::vector<uint8_t> expected, received;
+  char data[30];
+  struct iovec iov = {data, sizeof(data)};
+
+  // Without Cork, each write is sent immediately.
+  memset(data, 'a', sizeof(data));
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+  ASSERT_NE(0u, out_n);
+  expected.insert(expected.end(), data, data + sizeof(data));
+  DecryptVectors(&received, &records, &peer, out, out_n);
+  ASSERT_EQ(1u, records);
+
+  conn.Cork(100, 5);
+  for (unsigned i = 0; i < 3; i++) {
+    memset(data, 'b' + i, sizeof(data));
+    ASSERT_EQ(0, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+    ASSERT_EQ(0u, out_n);
+    expected.insert(expected.end(), data, data + sizeof(data));
+  }
+  // The fourth write takes the buffer past |flush_bytes|.
+  memset(data, 'e', sizeof(data));
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+  ASSERT_NE(0u, out_n);
+  expected.insert(expected.end(), data, data + sizeof(data));
+  DecryptVectors(&received, &records, &peer, out, out_n);
+  ASSERT_EQ(1u, records);
+
+  // Old data is flushed.
+  memset(data, 'f', sizeof(data));
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+  ASSERT_EQ(0u, out_n);
+  expected.insert(expected.end(), data, data + sizeof(data));
+  ctx.now += 4;
+  ASSERT_FALSE(conn.is_flush_due());
+  ctx.now += 1;
+  ASSERT_TRUE(conn.is_flush_due());
+  memset(data, 'g', sizeof(data));
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+  ASSERT_NE(0u, out_n);
+  ASSERT_FALSE(conn.is_flush_due());
+  expected.insert(expected.end(), data, data + sizeof(data));
+  DecryptVectors(&received, &records, &peer, out, out_n);
+  ASSERT_EQ(1u, records);
+
+  // Uncork flushes whatever is left.
+  memset(data, 'h', sizeof(data));
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+  ASSERT_EQ(0u, out_n);
+  expected.insert(expected.end(), data, data + sizeof(data));
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Uncork(&out, &out_n)));
+  DecryptVectors(&received, &records, &peer, out, out_n);
+  ASSERT_EQ(1u, records);
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Flush(&out, &out_n)));
+  ASSERT_EQ(0u, out_n);
+
+  ASSERT_TRUE(received == expected);
+
+  const CorkStats& stats = conn.cork_stats();
+  ASSERT_EQ(8u, stats.writes);
+  ASSERT_EQ(8u * sizeof(data), stats.bytes);
+  ASSERT_EQ(4u, stats.records);
+  // Each record has a five byte header, a 20 byte MAC and padding.
+  ASSERT_EQ(5 + 64u + 5 + 144u + 5 + 96u + 5 + 64u, stats.wire_bytes);
+}
+
+// An uncorked Write encrypts the data without buffering it, but keeps it
+// buffered if that fails.
+TEST_F(HandshakeTest, UncorkedWrite) {
+  ContextBase ctx;
+  Connection conn(&ctx);
+  conn.priv()->version = TLSv11;
+  conn.priv()->can_send_application_data = true;
+  conn.priv()->writer.cipher_spec = new FailingCipherSpec(true, 1);
+
+  char data[] = "GET / HTTP/1.0\r\n\r\n";
+  const struct iovec iov = {data, sizeof(data) - 1};
+  const struct iovec* out;
+  unsigned out_n;
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+  ASSERT_EQ(3u, out_n);
+  ASSERT_EQ(std::string(data), std::string(static_cast<char*>(out[1].iov_base), out[1].iov_len));
+  ASSERT_TRUE(conn.priv()->writer.cork_buffer.empty());
+  ASSERT_EQ(1u, conn.cork_stats().records);
+
+  ASSERT_EQ(ERR_INTERNAL_ERROR, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+  const std::vector<uint8_t>& buffered = conn.priv()->writer.cork_buffer;
+  ASSERT_EQ(std::string(data), std::string(buffered.begin(), buffered.end()));
+  ASSERT_EQ(2u, conn.cork_stats().writes);
+  ASSERT_EQ(1u, conn.cork_stats().records);
+}
+
+// Data queued before the Connection is ready to send application data is
+// sent by Flush once it is.
+TEST_F(HandshakeTest, QueueApplicationData) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x0005)  // TLS_RSA_WITH_RC4_128_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+  ContextBase ctx;
+  Connection conn(&ctx);
+  char data[] = "GET / HTTP/1.0\r\n\r\n";
+  const struct iovec iov = {data, sizeof(data) - 1};
+  conn.QueueApplicationData(&iov, 1);
+  // The data was copied.
+  memset(data, 0, sizeof(data));
+
+  const struct iovec* out;
+  unsigned out_n;
+  ASSERT_EQ(ERR_NOT_READY_TO_SEND_APPLICATION_DATA, ErrorCodeFromResult(conn.Write(&out, &out_n, &iov, 1)));
+  // Flushing too early fails but keeps the data.
+  ASSERT_EQ(ERR_NOT_READY_TO_SEND_APPLICATION_DATA, ErrorCodeFromResult(conn.Flush(&out, &out_n)));
+  ASSERT_EQ(18u, conn.priv()->writer.cork_buffer.size());
+
+  conn.priv()->version = TLSv10;
+  conn.priv()->can_send_application_data = true;
+  conn.priv()->writer.cipher_spec = suite->create(TLSv10, kb);
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.Flush(&out, &out_n)));
+
+  ConnectionPrivate peer(NULL);
+  peer.version_established = true;
+  peer.version = TLSv10;
+  peer.reader.cipher_spec = suite->create(TLSv10, kb);
+  std::vector<uint8_t> received;
+  unsigned records;
+  DecryptVectors(&received, &records, &peer, out, out_n);
+  ASSERT_EQ(1u, records);
+  ASSERT_EQ(std::string("GET / HTTP/1.0\r\n\r\n"), std::string(received.begin(), received.end()));
+  ASSERT_EQ(1u, conn.cork_stats().writes);
+}
+
+// A flight from GetOwned isn't freed by the next call to Get.
+TEST_F(HandshakeTest, GetOwned) {
+  ContextBothWorking ctx;
+  Connection conn(&ctx);
+  conn.EnableDefault();
+
+  struct iovec out;
+  ASSERT_EQ(0, ErrorCodeFromResult(conn.GetOwned(&out)));
+  ASSERT_LT(5u, out.iov_len);
+  ASSERT_EQ(RECORD_HANDSHAKE, static_cast<uint8_t*>(out.iov_base)[0]);
+  const size_t allocated = conn.priv()->arena.bytes_allocated();
+
+  struct iovec out2;
+  ASSERT_EQ(ERR_UNNEEDED_GET, ErrorCodeFromResult(conn.Get(&out2)));
+  ASSERT_EQ(allocated, conn.priv()->arena.bytes_allocated());
+  ASSERT_EQ(RECORD_HANDSHAKE, static_cast<uint8_t*>(out.iov_base)[0]);
+
+  conn.ReturnBuffer(out.iov_base);
+  ASSERT_GT(allocated, conn.priv()->arena.bytes_allocated());
+}
+
+// Records from EncryptOwned remain valid while further records are
+// encrypted.
+TEST_F(HandshakeTest, EncryptOwned) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+  ContextBase ctx;
+  Connection conn(&ctx);
+  conn.priv()->version = TLSv11;
+  conn.priv()->can_send_application_data = true;
+  conn.priv()->writer.cipher_spec = suite->create(TLSv11, kb);
+
+  static const unsigned kRecords = 3;
+  char data[kRecords][20];
+  struct iovec records[kRecords][3];
+  for (unsigned i = 0; i < kRecords; i++) {
+    memset(data[i], 'a' + i, sizeof(data[i]));
+    records[i][1].iov_base = data[i];
+    records[i][1].iov_len = sizeof(data[i]);
+    ASSERT_EQ(0, ErrorCodeFromResult(conn.EncryptOwned(&records[i][0], &records[i][2], &records[i][1], 1)));
+  }
+  // Each of the records has its own header.
+  ASSERT_NE(records[0][0].iov_base, records[1][0].iov_base);
+  ASSERT_NE(records[1][0].iov_base, records[2][0].iov_base);
+
+  ConnectionPrivate peer(NULL);
+  peer.version_established = true;
+  peer.version = TLSv11;
+  peer.reader.cipher_spec = suite->create(TLSv11, kb);
+  std::vector<uint8_t> received;
+  unsigned n;
+  DecryptVectors(&received, &n, &peer, &records[0][0], 3 * kRecords);
+  ASSERT_EQ(kRecords, n);
+  ASSERT_EQ(kRecords * 20, received.size());
+  for (unsigned i = 0; i < kRecords; i++) {
+    ASSERT_EQ('a' + i, received[i * 20]);
+    conn.ReturnBuffer(records[i][0].iov_base);
+  }
+}
+
+struct DuplexArgs {
+  Connection* conn;
+  std::vector<uint8_t>* wire;
+  size_t plaintext_bytes;
+  bool ok;
+};
+
+static void* DuplexReader(void* arg) {
+  DuplexArgs* const args = static_cast<DuplexArgs*>(arg);
+  size_t offset = 0;
+  args->plaintext_bytes = 0;
+  args->ok = false;
+
+  while (offset < args->wire->size()) {
+    const struct iovec iov = {&(*args->wire)[offset], args->wire->size() - offset};
+    struct iovec* out;
+    unsigned out_n;
+    size_t used;
+    if (args->conn->Process(&out, &out_n, &used, &iov, 1) || !used)
+      return NULL;
+    for (unsigned i = 0; i < out_n; i++)
+      args->plaintext_bytes += out[i].iov_len;
+    offset += used;
+  }
+
+  args->ok = true;
+  return NULL;
+}
+
+static void* DuplexWriter(void* arg) {
+  DuplexArgs* const args = static_cast<DuplexArgs*>(arg);
+  std::vector<uint8_t> data(1000);
+  args->ok = false;
+
+  for (unsigned i = 0; i < 200; i++) {
+    const struct iovec iov = {&data[0], data.size()};
+    const struct iovec* out;
+    unsigned out_n;
+    if (args->conn->EncryptV(&out, &out_n, &iov, 1))
+      return NULL;
+    for (unsigned j = 0; j < out_n; j++) {
+      const uint8_t* p = static_cast<const uint8_t*>(out[j].iov_base);
+      args->wire->insert(args->wire->end(), p, p + out[j].iov_len);
+    }
+  }
+
+  args->ok = true;
+  return NULL;
+}
+
+// Once the handshake is complete, one thread can process records while
+// another encrypts them.
+TEST_F(HandshakeTest, FullDuplexThreads) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  // The same keys are used in each direction so that a Connection can read
+  // what another wrote.
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+  memcpy(kb.server_iv, kb.client_iv, sizeof(kb.server_iv));
+
+  ContextBase ctx;
+  Connection sender(&ctx), conn(&ctx);
+  sender.priv()->version = TLSv10;
+  sender.priv()->can_send_application_data = true;
+  sender.priv()->writer.cipher_spec = suite->create(TLSv10, kb);
+
+  ConnectionPrivate* const priv = conn.priv();
+  priv->state = AWAIT_HELLO_REQUEST;
+  priv->version_established = true;
+  priv->version = TLSv10;
+  priv->application_data_allowed = true;
+  priv->can_send_application_data = true;
+  priv->reader.cipher_spec = suite->create(TLSv10, kb);
+  priv->writer.cipher_spec = suite->create(TLSv10, kb);
+
+  // The two halves don't share a cache line.
+  const uintptr_t reader_last = reinterpret_cast<uintptr_t>(&priv->reader + 1) - 1;
+  const uintptr_t writer_start = reinterpret_cast<uintptr_t>(&priv->writer);
+  ASSERT_LT(reader_last / kCacheLineSize, writer_start / kCacheLineSize);
+
+  std::vector<uint8_t> incoming;
+  DuplexArgs sender_args = {&sender, &incoming, 0, false};
+  DuplexWriter(&sender_args);
+  ASSERT_TRUE(sender_args.ok);
+
+  std::vector<uint8_t> outgoing;
+  DuplexArgs reader_args = {&conn, &incoming, 0, false};
+  DuplexArgs writer_args = {&conn, &outgoing, 0, false};
+  pthread_t reader_thread, writer_thread;
+  ASSERT_EQ(0, pthread_create(&reader_thread, NULL, DuplexReader, &reader_args));
+  ASSERT_EQ(0, pthread_create(&writer_thread, NULL, DuplexWriter, &writer_args));
+  pthread_join(reader_thread, NULL);
+  pthread_join(writer_thread, NULL);
+
+  ASSERT_TRUE(reader_args.ok);
+  ASSERT_EQ(200u * 1000, reader_args.plaintext_bytes);
+  ASSERT_TRUE(writer_args.ok);
+  ASSERT_EQ(200u, priv->reader.seq_num);
+  ASSERT_EQ(200u, priv->writer.seq_num);
+
+  // What was written can be read back.
+  Connection receiver(&ctx);
+  receiver.priv()->state = AWAIT_HELLO_REQUEST;
+  receiver.priv()->version_established = true;
+  receiver.priv()->version = TLSv10;
+  receiver.priv()->application_data_allowed = true;
+  receiver.priv()->reader.cipher_spec = suite->create(TLSv10, kb);
+  DuplexArgs receiver_args = {&receiver, &outgoing, 0, false};
+  DuplexReader(&receiver_args);
+  ASSERT_TRUE(receiver_args.ok);
+  ASSERT_EQ(200u * 1000, receiver_args.plaintext_bytes);
+}
+
+// SetUpEstablished makes |conn| look as if it has completed a handshake for
+// |suite| and |version|, with keys derived from the given secrets. If
+// |is_server| is true then the keys are used the other way around, so that
+// |conn| can talk to a client Connection.
+static void SetUpEstablished(Connection* conn, const CipherSuite* suite, TLSVersion version, bool is_server) {
+  ConnectionPrivate* const priv = conn->priv();
+  memset(priv->handshake->master_secret, 1, sizeof(priv->handshake->master_secret));
+  memset(priv->handshake->client_random, 2, sizeof(priv->handshake->client_random));
+  memset(priv->handshake->server_random, 3, sizeof(priv->handshake->server_random));
+
+  KeyBlock kb;
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  ASSERT_TRUE(KeysFromMasterSecret(&kb, version, priv->handshake->master_secret, priv->handshake->client_random, priv->handshake->server_random));
+  if (is_server) {
+    KeyBlock swapped(kb);
+    memcpy(swapped.client_key, kb.server_key, sizeof(kb.server_key));
+    memcpy(swapped.server_key, kb.client_key, sizeof(kb.client_key));
+    memcpy(swapped.client_mac, kb.server_mac, sizeof(kb.server_mac));
+    memcpy(swapped.server_mac, kb.client_mac, sizeof(kb.client_mac));
+    memcpy(swapped.client_iv, kb.server_iv, sizeof(kb.server_iv));
+    memcpy(swapped.server_iv, kb.client_iv, sizeof(kb.client_iv));
+    kb = swapped;
+  }
+
+  priv->state = AWAIT_HELLO_REQUEST;
+  priv->cipher_suite = suite;
+  priv->version = version;
+  priv->version_established = true;
+  priv->application_data_allowed = true;
+  priv->can_send_application_data = true;
+  priv->reader.cipher_spec = suite->create(version, kb);
+  priv->writer.cipher_spec = suite->create(version, kb);
+}
+
+// SendMessage sends |msg| from |from| to |to| and checks that it arrives.
+static void SendMessage(Connection* from, Connection* to, const char* msg) {
+  std::vector<uint8_t> data(msg, msg + strlen(msg));
+  const struct iovec iov = {&data[0], data.size()};
+  const struct iovec* out;
+  unsigned out_n;
+  ASSERT_EQ(0, ErrorCodeFromResult(from->EncryptV(&out, &out_n, &iov, 1)));
+  std::vector<uint8_t> wire;
+  for (unsigned i = 0; i < out_n; i++) {
+    const uint8_t* p = static_cast<const uint8_t*>(out[i].iov_base);
+    wire.insert(wire.end(), p, p + out[i].iov_len);
+  }
+
+  const struct iovec wire_iov = {&wire[0], wire.size()};
+  struct iovec* plaintext;
+  unsigned plaintext_n;
+  size_t used;
+  ASSERT_EQ(0, ErrorCodeFromResult(to->Process(&plaintext, &plaintext_n, &used, &wire_iov, 1)));
+  ASSERT_EQ(wire.size(), used);
+  Buffer buf(plaintext, plaintext_n);
+  ASSERT_EQ(strlen(msg), buf.size());
+  std::vector<char> received(strlen(msg));
+  ASSERT_TRUE(buf.Read(&received[0], received.size()));
+  ASSERT_TRUE(memcmp(&received[0], msg, received.size()) == 0);
+}
+
+// An established connection can be exported and continued by another
+// Connection object.
+TEST_F(HandshakeTest, ExportImportState) {
+  static const struct {
+    uint16_t suite;
+    TLSVersion version;
+  } kCases[] = {
+    { 0x0005, TLSv10 },  // RC4: the keystream state is carried over.
+    { 0x002f, TLSv10 },  // CBC with chaining between records.
+    { 0x002f, TLSv11 },  // CBC with explicit IVs.
+    { 0x0035, TLSv12 },
+  };
+
+  for (unsigned i = 0; i < sizeof(kCases) / sizeof(kCases[0]); i++) {
+    SCOPED_TRACE(i);
+    const CipherSuite* suite = NULL;
+    for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+      if (s->value == kCases[i].suite)
+        suite = s;
+    }
+    ASSERT_TRUE(suite);
+
+    ContextBase ctx;
+    Connection client(&ctx), server(&ctx);
+    SetUpEstablished(&client, suite, kCases[i].version, false);
+    SetUpEstablished(&server, suite, kCases[i].version, true);
+    SendMessage(&client, &server, "GET / HTTP/1.1");
+    SendMessage(&server, &client, "HTTP/1.1 200 OK");
+
+    struct iovec state;
+    ASSERT_EQ(0, ErrorCodeFromResult(client.ExportState(&state)));
+    const uint8_t* const data = static_cast<uint8_t*>(state.iov_base);
+
+    // Truncated or extended state is rejected and leaves the Connection
+    // untouched.
+    uint8_t pattern[48];
+    memset(pattern, 0x55, sizeof(pattern));
+    Connection truncated(&ctx);
+    truncated.EnableDefault();
+    memcpy(truncated.priv()->handshake->master_secret, pattern, sizeof(pattern));
+    ASSERT_EQ(ERR_CANNOT_PARSE_STATE, ErrorCodeFromResult(truncated.ImportState(data, state.iov_len - 1)));
+    ASSERT_TRUE(memcmp(truncated.priv()->handshake->master_secret, pattern, sizeof(pattern)) == 0);
+    ASSERT_FALSE(truncated.priv()->reader.cipher_spec);
+    ASSERT_FALSE(truncated.is_ready_to_send_application_data());
+    std::vector<uint8_t> extended(data, data + state.iov_len);
+    extended.push_back(0);
+    Connection long_state(&ctx);
+    long_state.EnableDefault();
+    memcpy(long_state.priv()->handshake->master_secret, pattern, sizeof(pattern));
+    ASSERT_EQ(ERR_CANNOT_PARSE_STATE, ErrorCodeFromResult(long_state.ImportState(&extended[0], extended.size())));
+    ASSERT_TRUE(memcmp(long_state.priv()->handshake->master_secret, pattern, sizeof(pattern)) == 0);
+
+    // The cipher suite has to be enabled.
+    Connection disabled(&ctx);
+    ASSERT_EQ(ERR_STATE_CIPHER_SUITE_NOT_ENABLED, ErrorCodeFromResult(disabled.ImportState(data, state.iov_len)));
+    ASSERT_FALSE(disabled.is_ready_to_send_application_data());
+
+    Connection migrated(&ctx);
+    migrated.EnableDefault();
+    ASSERT_EQ(0, ErrorCodeFromResult(migrated.ImportState(data, state.iov_len)));
+    ASSERT_TRUE(migrated.is_ready_to_send_application_data());
+    ASSERT_STREQ(suite->name, migrated.cipher_suite_name());
+    SendMessage(&migrated, &server, "GET /again HTTP/1.1");
+    SendMessage(&server, &migrated, "HTTP/1.1 304 Not Modified");
+
+    // A Connection can only be imported into once.
+    ASSERT_EQ(ERR_CANNOT_PARSE_STATE, ErrorCodeFromResult(migrated.ImportState(data, state.iov_len)));
+  }
+}
+
+// Only established, idle connections can be exported.
+TEST_F(HandshakeTest, ExportStateNotEstablished) {
+  ContextBase ctx;
+  Connection conn(&ctx);
+  struct iovec state;
+  ASSERT_EQ(ERR_CANNOT_EXPORT_STATE, ErrorCodeFromResult(conn.ExportState(&state)));
+}
+
+// Once the handshake state is freed, records can still be sent and received
+// but questions about the handshake can't be answered.
+TEST_F(HandshakeTest, FreeHandshakeState) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  ContextBase ctx;
+  Connection client(&ctx), server(&ctx);
+  ASSERT_EQ(ERR_HANDSHAKE_NOT_COMPLETE, ErrorCodeFromResult(client.FreeHandshakeState()));
+
+  SetUpEstablished(&client, suite, TLSv10, false);
+  SetUpEstablished(&server, suite, TLSv10, true);
+  SendMessage(&client, &server, "before");
+  ASSERT_EQ(0, ErrorCodeFromResult(client.FreeHandshakeState()));
+  ASSERT_TRUE(client.priv()->handshake == NULL);
+
+  SendMessage(&client, &server, "after");
+  SendMessage(&server, &client, "reply");
+
+  const struct iovec* certs;
+  unsigned num_certs;
+  ASSERT_EQ(ERR_HANDSHAKE_STATE_FREED, ErrorCodeFromResult(client.server_certificates(&certs, &num_certs)));
+  ASSERT_FALSE(client.is_resumption_data_availible());
+  struct iovec data;
+  ASSERT_EQ(ERR_HANDSHAKE_STATE_FREED, ErrorCodeFromResult(client.GetResumptionData(&data)));
+  ASSERT_EQ(ERR_HANDSHAKE_STATE_FREED, ErrorCodeFromResult(client.ExportState(&data)));
+  ASSERT_FALSE(client.is_server_cert_available());
+
+  // Configuring the handshake has no effect.
+  static const uint8_t kData[1] = {0};
+  ASSERT_EQ(ERR_HANDSHAKE_STATE_FREED, ErrorCodeFromResult(client.SetResumptionData(kData, sizeof(kData))));
+  ASSERT_EQ(ERR_HANDSHAKE_STATE_FREED, ErrorCodeFromResult(client.SetSnapStartData(kData, sizeof(kData), NULL, 0)));
+  client.set_sslv3(true);
+  client.set_host_name("example.com");
+  client.set_certificate_retention(RETAIN_ALL_CERTIFICATES);
+  client.set_certificates_callback(NULL, NULL);
+  client.set_certificate_fingerprints(true);
+  client.set_verification_cache(NULL);
+  client.SetPredictedCertificates(NULL, 0);
+  client.SetPredictedCertificateChain(NULL);
+  client.CollectSnapStartData();
+  client.set_snap_start_cache(NULL);
+  client.EnableDefault();
+  client.EnableFalseStart(true);
+  client.EnableSessionTickets(true);
+  ASSERT_TRUE(client.priv()->handshake == NULL);
+
+  SendMessage(&client, &server, "still");
+}
+
+// The fields which are used for every record come before the record layer
+// state, and the reader, the writer and the fields which follow them each
+// start a cache line of their own.
+TEST_F(HandshakeTest, ConnectionPrivateLayout) {
+  ContextBase ctx;
+  Connection conn(&ctx);
+  const ConnectionPrivate* const priv = conn.priv();
+  const uintptr_t start = reinterpret_cast<uintptr_t>(priv);
+  const uintptr_t reader = reinterpret_cast<uintptr_t>(&priv->reader);
+  const uintptr_t writer = reinterpret_cast<uintptr_t>(&priv->writer);
+  const uintptr_t handshake = reinterpret_cast<uintptr_t>(&priv->handshake);
+
+  ASSERT_EQ(0u, start % kCacheLineSize);
+  ASSERT_LE(reinterpret_cast<uintptr_t>(&priv->worker_pool + 1) - start, kCacheLineSize);
+  ASSERT_EQ(0u, reader % kCacheLineSize);
+  ASSERT_EQ(0u, writer % kCacheLineSize);
+  ASSERT_EQ(0u, handshake % kCacheLineSize);
+  ASSERT_LT(start, reader);
+  ASSERT_LE(reader + sizeof(priv->reader), writer);
+  ASSERT_LE(writer + sizeof(priv->writer), handshake);
+}
+
+// EncryptTo leaves its input untouched and ProcessInto decrypts into a
+// separate buffer, a record at a time if space is short.
+TEST_F(HandshakeTest, EncryptToProcessInto) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x0005)  // TLS_RSA_WITH_RC4_128_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+  ContextBase ctx;
+  Connection client(&ctx);
+  client.priv()->version = TLSv10;
+  client.priv()->can_send_application_data = true;
+  client.priv()->writer.cipher_spec = suite->create(TLSv10, kb);
+
+  std::vector<uint8_t> plaintext(20000);
+  for (size_t i = 0; i < plaintext.size(); i++)
+    plaintext[i] = i * 13;
+  const std::vector<uint8_t> orig(plaintext);
+  const struct iovec iov = {&plaintext[0], plaintext.size()};
+
+  std::vector<uint8_t> wire(10);
+  size_t wire_len = wire.size();
+  Result r = client.EncryptTo(&wire[0], &wire_len, &iov, 1);
+  ASSERT_EQ(ERR_OUTPUT_BUFFER_TOO_SMALL, ErrorCodeFromResult(r));
+  // Two records, each with a header and a 20 byte MAC.
+  ASSERT_EQ(plaintext.size() + 2 * (5 + 20), wire_len);
+  wire.resize(wire_len);
+  r = client.EncryptTo(&wire[0], &wire_len, &iov, 1);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(wire.size(), wire_len);
+  ASSERT_TRUE(plaintext == orig);
+
+  Connection server(&ctx);
+  server.priv()->state = AWAIT_HELLO_REQUEST;
+  server.priv()->version_established = true;
+  server.priv()->version = TLSv10;
+  server.priv()->application_data_allowed = true;
+  server.priv()->reader.cipher_spec = suite->create(TLSv10, kb);
+
+  const std::vector<uint8_t> wire_orig(wire);
+  // There's only space for the first record.
+  std::vector<uint8_t> result(16384 + 20 + 100);
+  size_t result_len = result.size();
+  size_t used;
+  struct iovec wire_iov = {&wire[0], wire.size()};
+  r = server.ProcessInto(&result[0], &result_len, &used, &wire_iov, 1);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(16384u, result_len);
+  ASSERT_EQ(5u + 16384 + 20, used);
+  ASSERT_TRUE(memcmp(&result[0], &orig[0], result_len) == 0);
+
+  wire_iov.iov_base = &wire[used];
+  wire_iov.iov_len = wire.size() - used;
+  result_len = result.size();
+  r = server.ProcessInto(&result[0], &result_len, &used, &wire_iov, 1);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(orig.size() - 16384, result_len);
+  ASSERT_EQ(wire_iov.iov_len, used);
+  ASSERT_TRUE(memcmp(&result[0], &orig[16384], result_len) == 0);
+  ASSERT_TRUE(wire == wire_orig);
+}
+
+static Connection* NewWriter(ContextBase* ctx, const CipherSuite* suite, const KeyBlock& kb) {
+  Connection* conn = new Connection(ctx);
+  conn->priv()->version = TLSv10;
+  conn->priv()->can_send_application_data = true;
+  conn->priv()->writer.cipher_spec = suite->create(TLSv10, kb);
+  return conn;
+}
+
+TEST_F(HandshakeTest, EncryptFromFile) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.client_iv, 3, sizeof(kb.client_iv));
+
+  std::vector<uint8_t> contents(40000);
+  for (size_t i = 0; i < contents.size(); i++)
+    contents[i] = i * 7;
+  FILE* file = tmpfile();
+  ASSERT_TRUE(file);
+  ASSERT_EQ(contents.size(), fwrite(&contents[0], 1, contents.size(), file));
+  ASSERT_EQ(0, fflush(file));
+  const int fd = fileno(file);
+
+  ContextBase ctx;
+  Connection* const from_file = NewWriter(&ctx, suite, kb);
+  Connection* const from_memory = NewWriter(&ctx, suite, kb);
+
+  static const size_t kOffset = 100, kLen = 35000;
+  std::vector<uint8_t> expected(kLen + 200);
+  size_t expected_len = expected.size();
+  const struct iovec iov = {&contents[kOffset], kLen};
+  ASSERT_EQ(0, ErrorCodeFromResult(from_memory->EncryptTo(&expected[0], &expected_len, &iov, 1)));
+
+  std::vector<uint8_t> wire(10);
+  size_t wire_len = wire.size();
+  Result r = from_file->EncryptFromFile(&wire[0], &wire_len, fd, kOffset, kLen);
+  ASSERT_EQ(ERR_OUTPUT_BUFFER_TOO_SMALL, ErrorCodeFromResult(r));
+  ASSERT_EQ(expected_len, wire_len);
+  wire.resize(wire_len);
+  r = from_file->EncryptFromFile(&wire[0], &wire_len, fd, kOffset, kLen);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(expected_len, wire_len);
+  ASSERT_TRUE(memcmp(&wire[0], &expected[0], wire_len) == 0);
+
+  // Ranges which extend past the end of the file are rejected, including
+  // when the file has been truncated since it was last used, and no sequence
+  // numbers are consumed.
+  const uint64_t seq_num = from_file->priv()->writer.seq_num;
+  wire_len = wire.size();
+  r = from_file->EncryptFromFile(&wire[0], &wire_len, fd, contents.size() - 10, 20);
+  ASSERT_EQ(ERR_CANNOT_READ_FILE, ErrorCodeFromResult(r));
+  ASSERT_EQ(0, ftruncate(fd, kOffset + 1000));
+  wire_len = wire.size();
+  r = from_file->EncryptFromFile(&wire[0], &wire_len, fd, kOffset, kLen);
+  ASSERT_EQ(ERR_CANNOT_READ_FILE, ErrorCodeFromResult(r));
+  ASSERT_EQ(seq_num, from_file->priv()->writer.seq_num);
+  fclose(file);
+
+  // Nor are they consumed if a record fails to be sealed once the data has
+  // been read.
+  const int zero_fd = open("/dev/zero", O_RDONLY);
+  ASSERT_LE(0, zero_fd);
+  {
+    Connection failing(&ctx);
+    failing.priv()->version = TLSv11;
+    failing.priv()->can_send_application_data = true;
+    failing.priv()->writer.seq_num = 3;
+    failing.priv()->writer.cipher_spec = new FailingCipherSpec(true, 4);
+    wire_len = wire.size();
+    r = failing.EncryptFromFile(&wire[0], &wire_len, zero_fd, 0, kLen);
+    ASSERT_EQ(ERR_INTERNAL_ERROR, ErrorCodeFromResult(r));
+    ASSERT_EQ(0u, wire_len);
+    ASSERT_EQ(3u, failing.priv()->writer.seq_num);
+  }
+
+  // Descriptors which aren't regular files work too.
+  std::vector<uint8_t> zeros(kLen);
+  const struct iovec zeros_iov = {&zeros[0], zeros.size()};
+  expected_len = expected.size();
+  ASSERT_EQ(0, ErrorCodeFromResult(from_memory->EncryptTo(&expected[0], &expected_len, &zeros_iov, 1)));
+  wire_len = wire.size();
+  r = from_file->EncryptFromFile(&wire[0], &wire_len, zero_fd, 0, kLen);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(expected_len, wire_len);
+  ASSERT_TRUE(memcmp(&wire[0], &expected[0], wire_len) == 0);
+
+  // With dynamic record sizing the records match those of |EncryptTo|, even
+  // when every write restarts the ramp.
+  from_file->set_record_sizing(3000, 0);
+  from_memory->set_record_sizing(3000, 0);
+  expected_len = expected.size();
+  ASSERT_EQ(0, ErrorCodeFromResult(from_memory->EncryptTo(&expected[0], &expected_len, &zeros_iov, 1)));
+  wire.resize(expected_len);
+  wire_len = wire.size();
+  r = from_file->EncryptFromFile(&wire[0], &wire_len, zero_fd, 0, kLen);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(expected_len, wire_len);
+  ASSERT_TRUE(memcmp(&wire[0], &expected[0], wire_len) == 0);
+  close(zero_fd);
+
+  delete from_file;
+  delete from_memory;
+}
+
+static void AppendU24(std::vector<uint8_t>* out, size_t v) {
+  out->push_back(v >> 16);
+  out->push_back(v >> 8);
+  out->push_back(v);
+}
+
+// Flatten returns the concatenation of the data in |iov|.
+static std::vector<uint8_t> Flatten(const struct iovec* iov, unsigned n) {
+  std::vector<uint8_t> ret;
+  for (unsigned i = 0; i < n; i++) {
+    const uint8_t* p = static_cast<const uint8_t*>(iov[i].iov_base);
+    ret.insert(ret.end(), p, p + iov[i].iov_len);
+  }
+  return ret;
+}
+
+// NewReader returns a Connection which is ready to process application data
+// records of the given version.
+static Connection* NewReader(ContextBase* ctx, TLSVersion version, const CipherSuite* suite, const KeyBlock& kb) {
+  Connection* conn = new Connection(ctx);
+  conn->priv()->state = AWAIT_HELLO_REQUEST;
+  conn->priv()->version_established = true;
+  conn->priv()->version = version;
+  conn->priv()->application_data_allowed = true;
+  conn->priv()->reader.cipher_spec = suite->create(version, kb);
+  return conn;
+}
+
+TEST_F(HandshakeTest, ExplicitIVParallel) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  // The client's write keys are the server's read keys.
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+  memset(kb.client_iv, 3, sizeof(kb.client_iv));
+  memset(kb.server_iv, 3, sizeof(kb.server_iv));
+
+  ContextBase ctx;
+  WorkerPool pool(3);
+  Connection sequential(&ctx), parallel(&ctx);
+  Connection* const writers[2] = {&sequential, &parallel};
+  for (unsigned i = 0; i < 2; i++) {
+    writers[i]->priv()->version = TLSv11;
+    writers[i]->priv()->can_send_application_data = true;
+    writers[i]->priv()->writer.cipher_spec = suite->create(TLSv11, kb);
+  }
+  parallel.set_worker_pool(&pool);
+
+  std::vector<uint8_t> plaintext(100000);
+  for (size_t i = 0; i < plaintext.size(); i++)
+    plaintext[i] = i * 11;
+  std::vector<uint8_t> data1(plaintext), data2(plaintext);
+  const struct iovec iov1 = {&data1[0], data1.size()};
+  const struct iovec iov2 = {&data2[0], data2.size()};
+
+  const struct iovec* out;
+  unsigned out_n;
+  ASSERT_EQ(0, ErrorCodeFromResult(sequential.EncryptV(&out, &out_n, &iov1, 1)));
+  const std::vector<uint8_t> wire1 = Flatten(out, out_n);
+  ASSERT_EQ(0, ErrorCodeFromResult(parallel.EncryptV(&out, &out_n, &iov2, 1)));
+  std::vector<uint8_t> wire2 = Flatten(out, out_n);
+  // The IVs depend only on the sequence numbers so both results match.
+  ASSERT_TRUE(wire1 == wire2);
+  ASSERT_EQ(7u, parallel.priv()->writer.seq_num);
+  // The first record has a 16 byte IV, 16384 bytes of data, a 20 byte MAC
+  // and 12 bytes of padding.
+  ASSERT_EQ(16 + 16384 + 20 + 12, wire2[3] << 8 | wire2[4]);
+
+  Connection* const server = NewReader(&ctx, TLSv11, suite, kb);
+  server->set_worker_pool(&pool);
+  struct iovec* decrypted;
+  unsigned decrypted_n;
+  const RecordSpan* spans;
+  unsigned spans_n;
+  size_t used;
+  struct iovec wire_iov = {&wire2[0], wire2.size()};
+  Result r = server->ProcessBatch(&decrypted, &decrypted_n, &spans, &spans_n, &used, &wire_iov, 1);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(7u, spans_n);
+  ASSERT_EQ(wire2.size(), used);
+  for (unsigned i = 0; i < spans_n; i++)
+    ASSERT_EQ(i, spans[i].seq_num);
+  ASSERT_TRUE(Flatten(decrypted, decrypted_n) == plaintext);
+  delete server;
+
+  // Changing a byte of any record causes the batch to be rejected.
+  std::vector<uint8_t> tampered(wire1);
+  tampered[tampered.size() - 100] ^= 1;
+  Connection* const server2 = NewReader(&ctx, TLSv11, suite, kb);
+  server2->set_worker_pool(&pool);
+  wire_iov.iov_base = &tampered[0];
+  wire_iov.iov_len = tampered.size();
+  r = server2->ProcessBatch(&decrypted, &decrypted_n, &spans, &spans_n, &used, &wire_iov, 1);
+  ASSERT_EQ(ERR_BAD_MAC, ErrorCodeFromResult(r));
+  delete server2;
+}
+
+TEST_F(HandshakeTest, CBCBadMAC) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+  static const TLSVersion kVersions[] = {SSLv3, TLSv10, TLSv11, TLSv12};
+  for (unsigned i = 0; i < sizeof(kVersions) / sizeof(kVersions[0]); i++) {
+    ContextBase ctx;
+    Connection client(&ctx);
+    client.priv()->version = kVersions[i];
+    client.priv()->can_send_application_data = true;
+    client.priv()->writer.cipher_spec = suite->create(kVersions[i], kb);
+
+    uint8_t data[100];
+    memset(data, 42, sizeof(data));
+    const struct iovec iov = {data, sizeof(data)};
+    const struct iovec* out;
+    unsigned out_n;
+    ASSERT_EQ(0, ErrorCodeFromResult(client.EncryptV(&out, &out_n, &iov, 1)));
+    const std::vector<uint8_t> wire = Flatten(out, out_n);
+
+    // Flipping a bit in the first block of ciphertext leaves the padding
+    // intact but changes the data and so the MAC must fail to match.
+    for (unsigned tamper = 0; tamper < 2; tamper++) {
+      std::vector<uint8_t> copy(wire);
+      if (tamper)
+        copy[5 + client.priv()->writer.cipher_spec->PrefixBytes()] ^= 1;
+      Connection* const server = NewReader(&ctx, kVersions[i], suite, kb);
+      struct iovec* decrypted;
+      unsigned decrypted_n;
+      size_t used;
+      struct iovec wire_iov = {&copy[0], copy.size()};
+      const Result r = server->Process(&decrypted, &decrypted_n, &used, &wire_iov, 1);
+      if (tamper) {
+        ASSERT_EQ(ERR_BAD_MAC, ErrorCodeFromResult(r));
+      } else {
+        ASSERT_EQ(0, ErrorCodeFromResult(r));
+        ASSERT_EQ(sizeof(data), Flatten(decrypted, decrypted_n).size());
+      }
+      delete server;
+    }
+  }
+}
+
+// Every way of decrypting a CBC record accepts it, whatever its padding
+// length, and rejects it once its ciphertext has been altered.
+TEST_F(HandshakeTest, CBCMACCheck) {
+  const CipherSuite* suite = NULL;
+  for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+    if (s->value == 0x002f)  // TLS_RSA_WITH_AES_128_CBC_SHA
+      suite = s;
+  }
+  ASSERT_TRUE(suite);
+
+  KeyBlock kb;
+  memset(&kb, 0, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+  memset(kb.client_key, 1, sizeof(kb.client_key));
+  memset(kb.server_key, 1, sizeof(kb.server_key));
+  memset(kb.client_mac, 2, sizeof(kb.client_mac));
+  memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+  static const TLSVersion kVersions[] = {SSLv3, TLSv10, TLSv11, TLSv12};
+  for (unsigned i = 0; i < sizeof(kVersions) / sizeof(kVersions[0]); i++) {
+    // Between them, these lengths give every possible amount of padding.
+    for (size_t len = 0; len < 48; len++) {
+      uint8_t data[48];
+      memset(data, 42, sizeof(data));
+      CipherSpec* const writer = suite->create(kVersions[i], kb);
+      uint8_t record[256];
+      size_t record_len;
+      ASSERT_TRUE(writer->Seal(record, &record_len, RECORD_APPLICATION_DATA, 0x0301, data, len, 0));
+      const unsigned prefix = writer->PrefixBytes();
+      writer->DecRef();
+
+      for (unsigned tamper = 0; tamper < 2; tamper++) {
+        for (unsigned method = 0; method < 3; method++) {
+          uint8_t copy[256];
+          memcpy(copy, record, record_len);
+          if (tamper)
+            copy[5 + prefix] ^= 1;
+          uint8_t* const payload = copy + 5;
+          const size_t payload_len = record_len - 5;
+
+          CipherSpec* const reader = suite->create(kVersions[i], kb);
+          bool ok;
+          size_t plaintext_len = 0;
+          if (method == 0) {
+            struct iovec iov = {payload, payload_len};
+            unsigned iov_len = 1;
+            unsigned bytes_stripped;
+            ok = reader->Decrypt(&bytes_stripped, &iov, &iov_len, copy, 0);
+            if (ok)
+              plaintext_len = iov_len ? iov.iov_len : 0;
+          } else if (method == 1) {
+            uint8_t out[256];
+            const struct iovec iov = {payload, payload_len};
+            ok = reader->DecryptTo(out, &plaintext_len, &iov, 1, copy, 0);
+          } else {
+            uint8_t* plaintext;
+            ok = reader->Open(&plaintext, &plaintext_len, copy, payload, payload_len, 0);
+          }
+          reader->DecRef();
+
+          ASSERT_EQ(!tamper, ok) << "version " << i << " length " << len << " method " << method;
+          if (ok) {
+            ASSERT_EQ(len, plaintext_len);
+          }
+        }
+      }
+    }
+  }
+}
+
+// The specialised Seal and Open functions of each cipher suite give the same
+// results as the generic ones, which are built on the virtual functions.
+// Handshake messages which are split across records encrypted with the real
+// cipher specs are reassembled from just the plaintext of each record.
+TEST_F(HandshakeTest, GetSplitHandshakesRealCipherSpecs) {
+  static const uint16_t kSuites[] = {
+    0x0005,  // TLS_RSA_WITH_RC4_128_SHA
+    0x002f,  // TLS_RSA_WITH_AES_128_CBC_SHA
+  };
+  static const TLSVersion kVersions[] = {TLSv10, TLSv11};
+
+  // Two messages: one of 300 bytes and one of 5.
+  std::vector<uint8_t> stream;
+  stream.push_back(CLIENT_HELLO);
+  AppendU24(&stream, 300);
+  for (unsigned i = 0; i < 300; i++)
+    stream.push_back(i);
+  stream.push_back(CLIENT_HELLO);
+  AppendU24(&stream, 5);
+  for (unsigned i = 0; i < 5; i++)
+    stream.push_back(0xf0 + i);
+
+  for (unsigned i = 0; i < sizeof(kSuites) / sizeof(kSuites[0]); i++) {
+    const CipherSuite* suite = NULL;
+    for (const CipherSuite* s = AllCipherSuites(); s->flags; s++) {
+      if (s->value == kSuites[i])
+        suite = s;
+    }
+    ASSERT_TRUE(suite);
+
+    KeyBlock kb;
+    memset(&kb, 0, sizeof(kb));
+    kb.key_len = suite->key_len;
+    kb.mac_len = suite->mac_len;
+    kb.iv_len = suite->iv_len;
+    memset(kb.client_key, 1, sizeof(kb.client_key));
+    memset(kb.server_key, 1, sizeof(kb.server_key));
+    memset(kb.client_mac, 2, sizeof(kb.client_mac));
+    memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+    for (unsigned j = 0; j < sizeof(kVersions) / sizeof(kVersions[0]); j++) {
+      SCOPED_TRACE(i * 2 + j);
+      CipherSpec* const writer = suite->create(kVersions[j], kb);
+
+      // The stream is sent in records of 100 bytes, so the first message
+      // spans four records and the second starts at the end of the fourth.
+      std::vector<uint8_t> wire;
+      uint64_t seq_num = 0;
+      for (size_t offset = 0; offset < stream.size(); offset += 100) {
+        const size_t n = std::min(static_cast<size_t>(100), stream.size() - offset);
+        const size_t start = wire.size();
+        wire.resize(start + 5 + writer->PrefixBytes() + n + writer->ScratchBytesNeeded(n));
+        size_t written;
+        ASSERT_TRUE(writer->Seal(&wire[start], &written, RECORD_HANDSHAKE, kVersions[j], &stream[offset], n, seq_num++));
+        wire.resize(start + written);
+      }
+      writer->DecRef();
+
+      ConnectionPrivate priv(NULL);
+      priv.version = kVersions[j];
+      priv.version_established = true;
+      priv.reader.cipher_spec = suite->create(kVersions[j], kb);
+
+      struct iovec iov = {&wire[0], wire.size()};
+      Buffer in(&iov, 1);
+      bool found;
+      RecordType type;
+      HandshakeMessage htype;
+      std::vector<struct iovec> out;
+
+      Result r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
+      ASSERT_EQ(0, ErrorCodeFromResult(r));
+      ASSERT_TRUE(found);
+      ASSERT_EQ(CLIENT_HELLO, htype);
+      std::vector<uint8_t> message = Flatten(&out[0], out.size());
+      ASSERT_EQ(300u, message.size());
+      ASSERT_TRUE(memcmp(&message[0], &stream[4], 300) == 0);
+
+      out.clear();
+      r = GetRecordOrHandshake(&found, &type, &htype, &out, &in, &priv);
+      ASSERT_EQ(0, ErrorCodeFromResult(r));
+      ASSERT_TRUE(found);
+      ASSERT_EQ(CLIENT_HELLO, htype);
+      message = Flatten(&out[0], out.size());
+      ASSERT_EQ(5u, message.size());
+      ASSERT_TRUE(memcmp(&message[0], &stream[308], 5) == 0);
+      ASSERT_EQ(wire.size(), in.TellBytes());
+    }
+  }
+}
+
+TEST_F(HandshakeTest, SealOpen) {
+  for (const CipherSuite* suite = AllCipherSuites(); suite->flags; suite++) {
+    KeyBlock kb;
+    memset(&kb, 0, sizeof(kb));
+    kb.key_len = suite->key_len;
+    kb.mac_len = suite->mac_len;
+    kb.iv_len = suite->iv_len;
+    memset(kb.client_key, 1, sizeof(kb.client_key));
+    memset(kb.server_key, 1, sizeof(kb.server_key));
+    memset(kb.client_mac, 2, sizeof(kb.client_mac));
+    memset(kb.server_mac, 2, sizeof(kb.server_mac));
+
+    static const TLSVersion kVersions[] = {SSLv3, TLSv10, TLSv11, TLSv12};
+    for (unsigned i = 0; i < sizeof(kVersions) / sizeof(kVersions[0]); i++) {
+      SCOPED_TRACE(suite->name);
+      SCOPED_TRACE(i);
+      CipherSpec* const sealer = suite->create(kVersions[i], kb);
+      CipherSpec* const generic_sealer = suite->create(kVersions[i], kb);
+      CipherSpec* const opener = suite->create(kVersions[i], kb);
+      CipherSpec* const generic_opener = suite->create(kVersions[i], kb);
+      const unsigned prefix = sealer->PrefixBytes();
+
+      uint64_t seq_num = 0;
+      for (size_t len = 0; len < 1100; len += len < 40 ? 1 : 500, seq_num++) {
+        std::vector<uint8_t> data(len + 1);
+        for (size_t j = 0; j < len; j++)
+          data[j] = j;
+        const size_t space = 5 + prefix + len + sealer->ScratchBytesNeeded(len);
+
+        // Odd lengths are sealed in place.
+        std::vector<uint8_t> record(space);
+        const uint8_t* in = &data[0];
+        if (len & 1) {
+          memcpy(&record[5 + prefix], &data[0], len);
+          in = &record[5 + prefix];
+        }
+        size_t record_len;
+        ASSERT_TRUE(sealer->Seal(&record[0], &record_len, RECORD_APPLICATION_DATA, kVersions[i], in, len, seq_num));
+
+        std::vector<uint8_t> expected(space);
+        size_t expected_len;
+        ASSERT_TRUE(GenericSeal(generic_sealer, &expected[0], &expected_len, RECORD_APPLICATION_DATA, kVersions[i], &data[0], len, seq_num));
+        ASSERT_EQ(expected_len, record_len);
+        ASSERT_TRUE(memcmp(&expected[0], &record[0], record_len) == 0);
+
+        uint8_t* plaintext;
+        size_t plaintext_len;
+        ASSERT_TRUE(opener->Open(&plaintext, &plaintext_len, &record[0], &record[5], record_len - 5, seq_num));
+        ASSERT_EQ(len, plaintext_len);
+        ASSERT_TRUE(memcmp(plaintext, &data[0], len) == 0);
+        ASSERT_TRUE(GenericOpen(generic_opener, &plaintext, &plaintext_len, &expected[0], &expected[5], expected_len - 5, seq_num));
+        ASSERT_EQ(len, plaintext_len);
+        ASSERT_TRUE(memcmp(plaintext, &data[0], len) == 0);
+      }
+
+      // A tampered record fails to open.
+      std::vector<uint8_t> data(32, 42);
+      std::vector<uint8_t> record(5 + prefix + data.size() + sealer->ScratchBytesNeeded(data.size()));
+      size_t record_len;
+      ASSERT_TRUE(sealer->Seal(&record[0], &record_len, RECORD_APPLICATION_DATA, kVersions[i], &data[0], data.size(), seq_num));
+      record[5 + prefix] ^= 1;
+      uint8_t* plaintext;
+      size_t plaintext_len;
+      ASSERT_FALSE(opener->Open(&plaintext, &plaintext_len, &record[0], &record[5], record_len - 5, seq_num));
+
+      sealer->DecRef();
+      generic_sealer->DecRef();
+      opener->DecRef();
+      generic_opener->DecRef();
+    }
+  }
+}
+
+// EncryptBatch gives the same records as calling Encrypt on each Connection
+// in turn, whether or not the cipher suite supports lanes.
+TEST_F(HandshakeTest, EncryptBatch) {
+  static const TLSVersion kVersions[] = {SSLv3, TLSv10, TLSv11};
+  static const unsigned kPerConfig = 3;
+  ContextBase ctx;
+  std::vector<Connection*> batched, singles;
+
+  for (const CipherSuite* suite = AllCipherSuites(); suite->flags; suite++) {
+    for (unsigned v = 0; v < sizeof(kVersions) / sizeof(kVersions[0]); v++) {
+      for (unsigned i = 0; i < kPerConfig; i++) {
+        KeyBlock kb;
+        memset(&kb, 0, sizeof(kb));
+        kb.key_len = suite->key_len;
+        kb.mac_len = suite->mac_len;
+        kb.iv_len = suite->iv_len;
+        memset(kb.client_key, i + 1, sizeof(kb.client_key));
+        memset(kb.client_mac, i + 2, sizeof(kb.client_mac));
+        memset(kb.client_iv, i + 3, sizeof(kb.client_iv));
+
+        for (unsigned j = 0; j < 2; j++) {
+          Connection* const conn = new Connection(&ctx);
+          conn->priv()->version = kVersions[v];
+          conn->priv()->can_send_application_data = true;
+          conn->priv()->writer.cipher_spec = suite->create(kVersions[v], kb);
+          (j ? singles : batched).push_back(conn);
+        }
+      }
+    }
+  }
+  // The last Connection can't send application data yet.
+  Connection not_ready(&ctx);
+  batched.push_back(&not_ready);
+
+  const unsigned n = batched.size();
+  for (unsigned round = 0; round < 2; round++) {
+    std::vector<std::vector<uint8_t> > data(n);
+    std::vector<struct iovec> iovs(2 * n);
+    std::vector<EncryptRequest> requests(n);
+
+    for (unsigned i = 0; i < n; i++) {
+      data[i].resize(1 + (i * 37 + round * 101) % 300);
+      for (size_t j = 0; j < data[i].size(); j++)
+        data[i][j] = i + j;
+      // Each request is split across two iovecs.
+      const size_t split = data[i].size() / 3;
+      iovs[2 * i].iov_base = &data[i][0];
+      iovs[2 * i].iov_len = split;
+      iovs[2 * i + 1].iov_base = &data[i][split];
+      iovs[2 * i + 1].iov_len = data[i].size() - split;
+      requests[i].conn = batched[i];
+      requests[i].iov = &iovs[2 * i];
+      requests[i].iov_len = 2;
+    }
+
+    Connection::EncryptBatch(&requests[0], n);
+
+    for (unsigned i = 0; i < n - 1; i++) {
+      ASSERT_EQ(0, ErrorCodeFromResult(requests[i].result));
+      std::vector<uint8_t> plaintext(data[i].size());
+      for (size_t j = 0; j < plaintext.size(); j++)
+        plaintext[j] = i + j;
+      const struct iovec iov = {&plaintext[0], plaintext.size()};
+      struct iovec start, end;
+      ASSERT_EQ(0, ErrorCodeFromResult(singles[i]->Encrypt(&start, &end, &iov, 1)));
+
+      const struct iovec expected_iovs[3] = {start, iov, end};
+      const struct iovec batched_iovs[4] = {requests[i].start, iovs[2 * i], iovs[2 * i + 1], requests[i].end};
+      ASSERT_TRUE(Flatten(expected_iovs, 3) == Flatten(batched_iovs, 4));
+    }
+    ASSERT_EQ(ERR_NOT_READY_TO_SEND_APPLICATION_DATA, ErrorCodeFromResult(requests[n - 1].result));
+  }
+
+  for (unsigned i = 0; i < n - 1; i++) {
+    delete batched[i];
+    delete singles[i];
+  }
+}
+
+// A Connection can appear more than once in a batch, including across
+// chunks, and each of its records is then the same as from a call to Encrypt.
+TEST_F(HandshakeTest, EncryptBatchRepeatedConnection) {
+  static const TLSVersion kVersions[] = {TLSv10, TLSv11};
+  static const unsigned kConns = 3, kRequests = 40;
+  ContextBase ctx;
+
+  for (const CipherSuite* suite = AllCipherSuites(); suite->flags; suite++) {
+    for (unsigned v = 0; v < sizeof(kVersions) / sizeof(kVersions[0]); v++) {
+      SCOPED_TRACE(suite->name);
+      Connection* batched[kConns];
+      Connection* singles[kConns];
+      for (unsigned i = 0; i < kConns; i++) {
+        KeyBlock kb;
+        memset(&kb, 0, sizeof(kb));
+        kb.key_len = suite->key_len;
+        kb.mac_len = suite->mac_len;
+        kb.iv_len = suite->iv_len;
+        memset(kb.client_key, i + 1, sizeof(kb.client_key));
+        memset(kb.client_mac, i + 2, sizeof(kb.client_mac));
+        memset(kb.client_iv, i + 3, sizeof(kb.client_iv));
+        for (unsigned j = 0; j < 2; j++) {
+          Connection* const conn = new Connection(&ctx);
+          conn->priv()->version = kVersions[v];
+          conn->priv()->can_send_application_data = true;
+          conn->priv()->writer.cipher_spec = suite->create(kVersions[v], kb);
+          (j ? singles : batched)[i] = conn;
+        }
+      }
+
+      // Runs of the same Connection and interleaved ones both occur.
+      std::vector<std::vector<uint8_t> > data(kRequests);
+      std::vector<struct iovec> iovs(kRequests);
+      std::vector<EncryptRequest> requests(kRequests);
+      for (unsigned i = 0; i < kRequests; i++) {
+        data[i].resize(1 + i * 13 % 200);
+        for (size_t j = 0; j < data[i].size(); j++)
+          data[i][j] = i + j;
+        iovs[i].iov_base = &data[i][0];
+        iovs[i].iov_len = data[i].size();
+        requests[i].conn = batched[i * i % kConns];
+        requests[i].iov = &iovs[i];
+        requests[i].iov_len = 1;
+      }
+
+      Connection::EncryptBatch(&requests[0], kRequests);
+
+      for (unsigned i = 0; i < kRequests; i++) {
+        ASSERT_EQ(0, ErrorCodeFromResult(requests[i].result));
+        std::vector<uint8_t> plaintext(data[i].size());
+        for (size_t j = 0; j < plaintext.size(); j++)
+          plaintext[j] = i + j;
+        const struct iovec iov = {&plaintext[0], plaintext.size()};
+        struct iovec start, end;
+        ASSERT_EQ(0, ErrorCodeFromResult(singles[i * i % kConns]->Encrypt(&start, &end, &iov, 1)));
+
+        const struct iovec expected_iovs[3] = {start, iov, end};
+        const struct iovec batched_iovs[3] = {requests[i].start, iovs[i], requests[i].end};
+        ASSERT_TRUE(Flatten(expected_iovs, 3) == Flatten(batched_iovs, 3)) << i;
+      }
+
+      for (unsigned i = 0; i < kConns; i++) {
+        delete batched[i];
+        delete singles[i];
+      }
+    }
+  }
+}
+
 static const uint8_t kServerHelloTempl[] = {
   0x03, 0x02,   // version
   // server random
@@ -556,7 +2367,7 @@ TEST_F(HandshakeTest, ProcessServerHelloBadVersion) {
   memcpy(kServerHello, kServerHelloTempl, sizeof(kServerHelloTempl));
   struct iovec iov = {kServerHello, sizeof(kServerHello)};
   Buffer buf(&iov, 1);
-  priv.cipher_suite_flags_enabled = -1;
+  priv.handshake->cipher_suite_flags_enabled = -1;
 
   kServerHello[0] = 10;
 
@@ -570,7 +2381,7 @@ TEST_F(HandshakeTest, ProcessServerHelloBadCipherSuite) {
   memcpy(kServerHello, kServerHelloTempl, sizeof(kServerHelloTempl));
   struct iovec iov = {kServerHello, sizeof(kServerHello)};
   Buffer buf(&iov, 1);
-  priv.cipher_suite_flags_enabled = -1;
+  priv.handshake->cipher_suite_flags_enabled = -1;
 
   // Set ciphersuite to 0000
   kServerHello[36] = 0;
@@ -585,7 +2396,7 @@ TEST_F(HandshakeTest, ProcessServerHelloBadCompressionMethod) {
   memcpy(kServerHello, kServerHelloTempl, sizeof(kServerHelloTempl));
   struct iovec iov = {kServerHello, sizeof(kServerHello)};
   Buffer buf(&iov, 1);
-  priv.cipher_suite_flags_enabled = -1;
+  priv.handshake->cipher_suite_flags_enabled = -1;
 
   // Set compression method to 22
   kServerHello[37] = 22;
@@ -599,13 +2410,13 @@ TEST_F(HandshakeTest, ProcessServerHello) {
   priv.state = RECV_SERVER_HELLO;
   struct iovec iov = {const_cast<uint8_t*>(kServerHelloTempl), sizeof(kServerHelloTempl)};
   Buffer buf(&iov, 1);
-  priv.cipher_suite_flags_enabled = -1;
+  priv.handshake->cipher_suite_flags_enabled = -1;
 
   Result r = ProcessServerHello(&priv, &buf);
   ASSERT_EQ(0, ErrorCodeFromResult(r));
   ASSERT_TRUE(priv.cipher_suite);
   ASSERT_EQ(0x0005, priv.cipher_suite->value);
-  ASSERT_TRUE(memcmp(priv.server_random, &kServerHelloTempl[2], 32) == 0);
+  ASSERT_TRUE(memcmp(priv.handshake->server_random, &kServerHelloTempl[2], 32) == 0);
 }
 
 TEST_F(HandshakeTest, ProcessServerHelloNoExtensions) {
@@ -615,20 +2426,20 @@ TEST_F(HandshakeTest, ProcessServerHelloNoExtensions) {
   // without them.
   struct iovec iov = {const_cast<uint8_t*>(kServerHelloTempl), sizeof(kServerHelloTempl) - 2};
   Buffer buf(&iov, 1);
-  priv.cipher_suite_flags_enabled = -1;
+  priv.handshake->cipher_suite_flags_enabled = -1;
 
   Result r = ProcessServerHello(&priv, &buf);
   ASSERT_EQ(0, ErrorCodeFromResult(r));
   ASSERT_TRUE(priv.cipher_suite);
   ASSERT_EQ(0x0005, priv.cipher_suite->value);
-  ASSERT_TRUE(memcmp(priv.server_random, &kServerHelloTempl[2], 32) == 0);
+  ASSERT_TRUE(memcmp(priv.handshake->server_random, &kServerHelloTempl[2], 32) == 0);
 }
 
 TEST_F(HandshakeTest, ProcessServerHelloPartial) {
   ConnectionPrivate priv(NULL);
   struct iovec iov = {const_cast<uint8_t*>(kServerHelloTempl), 0};
   Buffer buf(&iov, 1);
-  priv.cipher_suite_flags_enabled = -1;
+  priv.handshake->cipher_suite_flags_enabled = -1;
 
   // We want to check that all prefixes are invalid, but the prefix which cuts
   // off the two extension length bytes *is* valid, so we only check up to
@@ -705,14 +2516,568 @@ TEST_F(HandshakeTest, ProcessCertificate) {
 
   Result r = ProcessServerCertificate(&priv, &buf);
   ASSERT_EQ(0, ErrorCodeFromResult(r));
-  ASSERT_EQ(3u, priv.server_certificates.size());
-  ASSERT_EQ(3u, priv.server_certificates[0].iov_len);
-  ASSERT_EQ(3u, priv.server_certificates[1].iov_len);
-  ASSERT_EQ(4u, priv.server_certificates[2].iov_len);
-  ASSERT_TRUE(memcmp(priv.server_certificates[0].iov_base, "\x04\x05\x06", 3) == 0);
-  ASSERT_TRUE(memcmp(priv.server_certificates[1].iov_base, "\x04\x05\x07", 3) == 0);
-  ASSERT_TRUE(memcmp(priv.server_certificates[2].iov_base, "\x04\x05\x06\x08", 4) == 0);
-  ASSERT_TRUE(priv.server_cert);
+  ASSERT_EQ(3u, priv.handshake->server_certificates.size());
+  ASSERT_EQ(3u, priv.handshake->server_certificates[0].iov_len);
+  ASSERT_EQ(3u, priv.handshake->server_certificates[1].iov_len);
+  ASSERT_EQ(4u, priv.handshake->server_certificates[2].iov_len);
+  ASSERT_TRUE(memcmp(priv.handshake->server_certificates[0].iov_base, "\x04\x05\x06", 3) == 0);
+  ASSERT_TRUE(memcmp(priv.handshake->server_certificates[1].iov_base, "\x04\x05\x07", 3) == 0);
+  ASSERT_TRUE(memcmp(priv.handshake->server_certificates[2].iov_base, "\x04\x05\x06\x08", 4) == 0);
+  ASSERT_TRUE(priv.handshake->server_cert);
+}
+
+// CertificatesSeen records the arguments to a CertificatesCallback.
+struct CertificatesSeen {
+  CertificatesSeen()
+      : calls(0),
+        complete_calls(0),
+        complete(false) {
+  }
+
+  unsigned calls;
+  // complete_calls counts the calls with |complete| set and |complete| is
+  // the value from the latest call.
+  unsigned complete_calls;
+  bool complete;
+  std::vector<std::string> certs;
+};
+
+static void RecordCertificates(void* arg, const struct iovec* certs, unsigned len, bool complete) {
+  CertificatesSeen* const seen = static_cast<CertificatesSeen*>(arg);
+  seen->calls++;
+  if (complete)
+    seen->complete_calls++;
+  seen->complete = complete;
+  for (unsigned i = 0; i < len; i++)
+    seen->certs.push_back(std::string(static_cast<char*>(certs[i].iov_base), certs[i].iov_len));
+}
+
+TEST_F(HandshakeTest, ProcessCertificateRetention) {
+  static const CertificateRetention kRetentions[] = {
+    RETAIN_ALL_CERTIFICATES, RETAIN_LEAF_CERTIFICATE, RETAIN_NO_CERTIFICATES,
+  };
+  static const size_t kExpectedRetained[] = {3, 1, 0};
+
+  for (unsigned i = 0; i < sizeof(kRetentions) / sizeof(kRetentions[0]); i++) {
+    // The message is split so that the second certificate spans two iovecs.
+    for (unsigned split = 0; split < 2; split++) {
+      SCOPED_TRACE(i * 2 + split);
+      ContextCanParseCertificates ctx;
+      Connection conn(&ctx);
+      ConnectionPrivate* const priv = conn.priv();
+      CertificatesSeen seen;
+      conn.set_certificate_retention(kRetentions[i]);
+      conn.set_certificates_callback(RecordCertificates, &seen);
+
+      struct iovec iovs[2];
+      iovs[0].iov_base = const_cast<uint8_t*>(kCertificateTempl);
+      iovs[0].iov_len = split ? 10 : sizeof(kCertificateTempl);
+      iovs[1].iov_base = const_cast<uint8_t*>(kCertificateTempl) + iovs[0].iov_len;
+      iovs[1].iov_len = sizeof(kCertificateTempl) - iovs[0].iov_len;
+      Buffer buf(iovs, split ? 2 : 1);
+
+      Result r = ProcessServerCertificate(priv, &buf);
+      ASSERT_EQ(0, ErrorCodeFromResult(r));
+      ASSERT_TRUE(priv->handshake->server_cert);
+
+      // The callback sees the whole chain whatever is retained.
+      ASSERT_EQ(1u, seen.calls);
+      ASSERT_TRUE(seen.complete);
+      ASSERT_EQ(3u, seen.certs.size());
+      ASSERT_EQ(std::string("\x04\x05\x06", 3), seen.certs[0]);
+      ASSERT_EQ(std::string("\x04\x05\x07", 3), seen.certs[1]);
+      ASSERT_EQ(std::string("\x04\x05\x06\x08", 4), seen.certs[2]);
+
+      const struct iovec* certs;
+      unsigned len;
+      ASSERT_EQ(0, conn.server_certificates(&certs, &len));
+      ASSERT_EQ(kExpectedRetained[i], len);
+      for (unsigned j = 0; j < len; j++) {
+        ASSERT_EQ(seen.certs[j].size(), certs[j].iov_len);
+        ASSERT_TRUE(memcmp(seen.certs[j].data(), certs[j].iov_base, certs[j].iov_len) == 0);
+        // Retained certificates are copies.
+        ASSERT_TRUE(certs[j].iov_base < iovs[0].iov_base ||
+                    certs[j].iov_base >= kCertificateTempl + sizeof(kCertificateTempl));
+      }
+    }
+  }
+}
+
+// A chain whose leaf can't be parsed isn't reported or kept.
+TEST_F(HandshakeTest, ProcessCertificateUnparsable) {
+  ContextBase ctx;
+  Connection conn(&ctx);
+  ConnectionPrivate* const priv = conn.priv();
+  CertificatesSeen seen;
+  conn.set_certificates_callback(RecordCertificates, &seen);
+  conn.set_certificate_fingerprints(true);
+
+  struct iovec iov = {const_cast<uint8_t*>(kCertificateTempl), sizeof(kCertificateTempl)};
+  Buffer buf(&iov, 1);
+  Result r = ProcessServerCertificate(priv, &buf);
+  ASSERT_EQ(ERR_CANNOT_PARSE_CERTIFICATE, ErrorCodeFromResult(r));
+  ASSERT_EQ(0u, seen.calls);
+  ASSERT_FALSE(conn.is_server_cert_available());
+  ASSERT_FALSE(priv->handshake->have_fingerprints);
+
+  const struct iovec* certs;
+  unsigned len;
+  ASSERT_EQ(0, conn.server_certificates(&certs, &len));
+  ASSERT_EQ(0u, len);
+}
+
+// ContextCountingCertificates counts the certificates which it parses.
+class ContextCountingCertificates : public ContextBase {
+ public:
+  ContextCountingCertificates()
+      : parsed(0) {
+  }
+
+  Certificate* ParseCertificate(const uint8_t* bytes, size_t length) {
+    parsed++;
+    return new FakeCertificate;
+  }
+
+  unsigned parsed;
+};
+
+// A Certificate message which spans records is parsed as they arrive, so
+// it may be longer than any other handshake message. The callback is given
+// the certificates as they're completed and nothing but the retained
+// certificates is copied.
+TEST_F(HandshakeTest, StreamCertificates) {
+  static const size_t kCertificateLength = 20000;
+  static const unsigned kCertificates = 5;
+  static const size_t kMaxRecordLength = 16384;
+
+  std::vector<uint8_t> message;
+  message.push_back(CERTIFICATE);
+  AppendU24(&message, 3 + kCertificates * (3 + kCertificateLength));
+  AppendU24(&message, kCertificates * (3 + kCertificateLength));
+  for (unsigned i = 0; i < kCertificates; i++) {
+    AppendU24(&message, kCertificateLength);
+    message.resize(message.size() + kCertificateLength, i + 1);
+  }
+
+  std::vector<uint8_t> wire;
+  for (size_t offset = 0; offset < message.size(); offset += kMaxRecordLength) {
+    const size_t n = std::min(kMaxRecordLength, message.size() - offset);
+    const uint8_t header[5] = {RECORD_HANDSHAKE, 3, 1, static_cast<uint8_t>(n >> 8), static_cast<uint8_t>(n)};
+    wire.insert(wire.end(), header, header + sizeof(header));
+    wire.insert(wire.end(), message.begin() + offset, message.begin() + offset + n);
+  }
+
+  // The message is longer than the 64KB which other messages are limited to.
+  ASSERT_LT(65536u, message.size());
+
+  static const CertificateRetention kRetentions[] = {
+    RETAIN_ALL_CERTIFICATES, RETAIN_LEAF_CERTIFICATE, RETAIN_NO_CERTIFICATES,
+  };
+  static const unsigned kExpectedRetained[] = {kCertificates, 1, 0};
+
+  for (unsigned i = 0; i < sizeof(kRetentions) / sizeof(kRetentions[0]); i++) {
+    SCOPED_TRACE(i);
+    ContextCountingCertificates ctx;
+    Connection conn(&ctx);
+    ConnectionPrivate* const priv = conn.priv();
+    CertificatesSeen seen;
+    conn.set_certificate_retention(kRetentions[i]);
+    conn.set_certificates_callback(RecordCertificates, &seen);
+    conn.set_certificate_fingerprints(true);
+    priv->state = RECV_CERTIFICATE;
+    priv->handshake->handshake_hash = HandshakeHashForVersion(TLSv10);
+    const size_t arena_start = priv->arena.bytes_allocated();
+
+    unsigned records = 0;
+    for (size_t offset = 0; offset < wire.size(); records++) {
+      const size_t record_length = 5 + (static_cast<size_t>(wire[offset + 3]) << 8 | wire[offset + 4]);
+      const struct iovec iov = {&wire[offset], record_length};
+      struct iovec* out;
+      unsigned out_n;
+      size_t used;
+      Result r = conn.Process(&out, &out_n, &used, &iov, 1);
+      ASSERT_EQ(0, ErrorCodeFromResult(r));
+      ASSERT_EQ(record_length, used);
+      offset += used;
+
+      // No more than the certificate in progress is ever held, and only the
+      // retained certificates are copied into the arena.
+      ASSERT_LT(priv->handshake_reassembly.size(), 3 + kCertificateLength);
+      ASSERT_LE(priv->arena.bytes_allocated() - arena_start, kExpectedRetained[i] * (sizeof(Arena::Header) + kCertificateLength));
+      ASSERT_EQ(offset == wire.size(), seen.complete);
+      // The leaf is parsed as soon as the second record completes it.
+      ASSERT_EQ(records ? 1u : 0u, ctx.parsed);
+      if (offset < wire.size()) {
+        ASSERT_EQ(RECV_CERTIFICATE, priv->state);
+      }
+    }
+    ASSERT_EQ(RECV_SERVER_HELLO_DONE, priv->state);
+    ASSERT_TRUE(priv->handshake->server_cert);
+
+    ASSERT_LT(1u, seen.calls);
+    ASSERT_EQ(1u, seen.complete_calls);
+    ASSERT_EQ(kCertificates, seen.certs.size());
+    for (unsigned j = 0; j < kCertificates; j++)
+      ASSERT_EQ(std::string(kCertificateLength, j + 1), seen.certs[j]);
+
+    const struct iovec* certs;
+    unsigned len;
+    ASSERT_EQ(0, conn.server_certificates(&certs, &len));
+    ASSERT_EQ(kExpectedRetained[i], len);
+    for (unsigned j = 0; j < len; j++) {
+      ASSERT_EQ(seen.certs[j].size(), certs[j].iov_len);
+      ASSERT_TRUE(memcmp(seen.certs[j].data(), certs[j].iov_base, certs[j].iov_len) == 0);
+    }
+
+    // Every certificate was fingerprinted as it arrived.
+    const Fingerprint* fingerprints;
+    Fingerprint chain;
+    ASSERT_EQ(0, conn.server_certificate_fingerprints(&fingerprints, &len, &chain));
+    ASSERT_EQ(kCertificates, len);
+    SHA256 chain_sha256;
+    for (unsigned j = 0; j < kCertificates; j++) {
+      SHA256 sha256;
+      uint8_t digest[SHA256::DIGEST_SIZE];
+      sha256.Update(seen.certs[j].data(), seen.certs[j].size());
+      sha256.Final(digest);
+      ASSERT_TRUE(memcmp(digest, fingerprints[j].bytes, sizeof(digest)) == 0);
+      chain_sha256.Update(digest, sizeof(digest));
+    }
+    uint8_t chain_digest[SHA256::DIGEST_SIZE];
+    chain_sha256.Final(chain_digest);
+    ASSERT_TRUE(memcmp(chain_digest, chain.bytes, sizeof(chain_digest)) == 0);
+
+    // The message was hashed as though it had been processed in one piece.
+    HandshakeHash* const expected = HandshakeHashForVersion(TLSv10);
+    expected->Update(&message[0], message.size());
+    static const uint8_t kMasterSecret[48] = {0};
+    unsigned expected_len, actual_len;
+    const uint8_t* const expected_verify = expected->ClientVerifyData(&expected_len, kMasterSecret, sizeof(kMasterSecret));
+    const uint8_t* const actual_verify = priv->handshake->handshake_hash->ClientVerifyData(&actual_len, kMasterSecret, sizeof(kMasterSecret));
+    ASSERT_EQ(expected_len, actual_len);
+    ASSERT_TRUE(memcmp(expected_verify, actual_verify, actual_len) == 0);
+    delete expected;
+  }
+}
+
+// A streamed certificate chain is rejected as soon as the leaf can't be
+// parsed.
+TEST_F(HandshakeTest, StreamCertificatesBadLeaf) {
+  // Only the leaf is sent: the second certificate never arrives.
+  std::vector<uint8_t> message;
+  message.push_back(CERTIFICATE);
+  AppendU24(&message, 3 + 3 + 100 + 3 + 60000);
+  AppendU24(&message, 3 + 100 + 3 + 60000);
+  AppendU24(&message, 100);
+  message.resize(message.size() + 100, 1);
+
+  std::vector<uint8_t> wire;
+  const uint8_t header[5] = {RECORD_HANDSHAKE, 3, 1, 0, static_cast<uint8_t>(message.size())};
+  wire.insert(wire.end(), header, header + sizeof(header));
+  wire.insert(wire.end(), message.begin(), message.end());
+
+  ContextBase ctx;
+  Connection conn(&ctx);
+  conn.priv()->state = RECV_CERTIFICATE;
+  const struct iovec iov = {&wire[0], wire.size()};
+  struct iovec* out;
+  unsigned out_n;
+  size_t used;
+  Result r = conn.Process(&out, &out_n, &used, &iov, 1);
+  ASSERT_EQ(ERR_CANNOT_PARSE_CERTIFICATE, ErrorCodeFromResult(r));
+}
+
+// StateAtCallback records the handshake state when the certificates
+// callback is called.
+struct StateAtCallback {
+  ConnectionPrivate* priv;
+  HandshakeState state;
+};
+
+static void RecordStateAtCallback(void* arg, const struct iovec* certs, unsigned len, bool complete) {
+  StateAtCallback* const seen = static_cast<StateAtCallback*>(arg);
+  seen->state = seen->priv->state;
+}
+
+// The server's certificates are available, and the callback is called,
+// before the messages which follow the Certificate message are processed.
+TEST_F(HandshakeTest, ServerCertAvailable) {
+  std::vector<uint8_t> message;
+  message.push_back(CERTIFICATE);
+  AppendU24(&message, sizeof(kCertificateTempl));
+  message.insert(message.end(), kCertificateTempl, kCertificateTempl + sizeof(kCertificateTempl));
+  message.push_back(SERVER_HELLO_DONE);
+  AppendU24(&message, 0);
+
+  std::vector<uint8_t> wire;
+  const uint8_t header[5] = {RECORD_HANDSHAKE, 3, 1, 0, static_cast<uint8_t>(message.size())};
+  wire.insert(wire.end(), header, header + sizeof(header));
+  wire.insert(wire.end(), message.begin(), message.end());
+
+  ContextCanParseCertificates ctx;
+  Connection conn(&ctx);
+  ConnectionPrivate* const priv = conn.priv();
+  StateAtCallback seen;
+  seen.priv = priv;
+  seen.state = STATE_MUST_BRANCH;
+  conn.set_certificates_callback(RecordStateAtCallback, &seen);
+  priv->state = RECV_CERTIFICATE;
+  ASSERT_FALSE(conn.is_server_cert_available());
+
+  const struct iovec iov = {&wire[0], wire.size()};
+  struct iovec* out;
+  unsigned out_n;
+  size_t used;
+  Result r = conn.Process(&out, &out_n, &used, &iov, 1);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(RECV_CERTIFICATE, seen.state);
+  ASSERT_NE(RECV_CERTIFICATE, priv->state);
+  ASSERT_TRUE(conn.is_server_cert_available());
+
+  const struct iovec* certs;
+  unsigned len;
+  ASSERT_EQ(0, conn.server_certificates(&certs, &len));
+  ASSERT_EQ(3u, len);
+}
+
+// ProcessCertificateMessage feeds a Certificate message, containing the
+// certificates from |kCertificateTempl|, to |conn|.
+static void ProcessCertificateMessage(Connection* conn) {
+  std::vector<uint8_t> wire;
+  const uint8_t header[9] = {RECORD_HANDSHAKE, 3, 1, 0, 4 + sizeof(kCertificateTempl), CERTIFICATE, 0, 0, sizeof(kCertificateTempl)};
+  wire.insert(wire.end(), header, header + sizeof(header));
+  wire.insert(wire.end(), kCertificateTempl, kCertificateTempl + sizeof(kCertificateTempl));
+
+  conn->priv()->state = RECV_CERTIFICATE;
+  const struct iovec iov = {&wire[0], wire.size()};
+  struct iovec* out;
+  unsigned out_n;
+  size_t used;
+  Result r = conn->Process(&out, &out_n, &used, &iov, 1);
+  ASSERT_EQ(0, ErrorCodeFromResult(r));
+  ASSERT_EQ(wire.size(), used);
+}
+
+TEST_F(HandshakeTest, ServerCertificateFingerprints) {
+  ContextCanParseCertificates ctx;
+  const Fingerprint* fingerprints;
+  unsigned len;
+  Fingerprint chain;
+  bool found;
+  int result;
+
+  // Fingerprints are only computed when asked for.
+  Connection plain(&ctx);
+  ProcessCertificateMessage(&plain);
+  ASSERT_EQ(ERR_NO_CERTIFICATE_FINGERPRINTS, ErrorCodeFromResult(plain.server_certificate_fingerprints(&fingerprints, &len, &chain)));
+
+  MemoryVerificationCache cache(4);
+  Connection first(&ctx);
+  first.set_verification_cache(&cache);
+  first.set_certificate_retention(RETAIN_NO_CERTIFICATES);
+  ASSERT_EQ(ERR_NO_CERTIFICATE_FINGERPRINTS, ErrorCodeFromResult(first.GetCachedVerificationResult(&found, &result)));
+  ProcessCertificateMessage(&first);
+
+  // Each of the certificates is fingerprinted, whatever is retained.
+  ASSERT_EQ(0, first.server_certificate_fingerprints(&fingerprints, &len, &chain));
+  ASSERT_EQ(3u, len);
+  SHA256 sha256;
+  uint8_t digest[SHA256::DIGEST_SIZE];
+  sha256.Update("\x04\x05\x07", 3);
+  sha256.Final(digest);
+  ASSERT_TRUE(memcmp(digest, fingerprints[1].bytes, sizeof(digest)) == 0);
+
+  ASSERT_EQ(0, first.GetCachedVerificationResult(&found, &result));
+  ASSERT_FALSE(found);
+  ASSERT_EQ(0, first.CacheVerificationResult(1, 60));
+
+  // A later connection to the same server finds the result.
+  Connection second(&ctx);
+  second.set_verification_cache(&cache);
+  ProcessCertificateMessage(&second);
+  ASSERT_EQ(0, second.GetCachedVerificationResult(&found, &result));
+  ASSERT_TRUE(found);
+  ASSERT_EQ(1, result);
+
+  // But a connection to another server with the same chain doesn't.
+  Connection other(&ctx);
+  other.set_host_name("other.example.com");
+  other.set_verification_cache(&cache);
+  ProcessCertificateMessage(&other);
+  ASSERT_EQ(0, other.GetCachedVerificationResult(&found, &result));
+  ASSERT_FALSE(found);
+}
+
+// ExpectFingerprints checks that |conn| reports the fingerprints of the
+// certificates from |kCertificateTempl|.
+static void ExpectFingerprints(Connection* conn) {
+  static const char* const kCertificates[] = {"\x04\x05\x06", "\x04\x05\x07", "\x04\x05\x06\x08"};
+  const Fingerprint* fingerprints;
+  unsigned len;
+  Fingerprint chain;
+  ASSERT_EQ(0, ErrorCodeFromResult(conn->server_certificate_fingerprints(&fingerprints, &len, &chain)));
+  ASSERT_EQ(3u, len);
+
+  SHA256 chain_sha256;
+  for (unsigned i = 0; i < len; i++) {
+    SHA256 sha256;
+    uint8_t digest[SHA256::DIGEST_SIZE];
+    sha256.Update(kCertificates[i], strlen(kCertificates[i]));
+    sha256.Final(digest);
+    ASSERT_TRUE(memcmp(digest, fingerprints[i].bytes, sizeof(digest)) == 0);
+    chain_sha256.Update(digest, sizeof(digest));
+  }
+  uint8_t digest[SHA256::DIGEST_SIZE];
+  chain_sha256.Final(digest);
+  ASSERT_TRUE(memcmp(digest, chain.bytes, sizeof(digest)) == 0);
+}
+
+// Fingerprints which are enabled after the certificates have arrived are
+// computed from them, if they were all retained.
+TEST_F(HandshakeTest, ServerCertificateFingerprintsEnabledLate) {
+  ContextCanParseCertificates ctx;
+
+  Connection all(&ctx);
+  ProcessCertificateMessage(&all);
+  all.set_certificate_fingerprints(true);
+  ExpectFingerprints(&all);
+
+  Connection leaf(&ctx);
+  leaf.set_certificate_retention(RETAIN_LEAF_CERTIFICATE);
+  ProcessCertificateMessage(&leaf);
+  leaf.set_certificate_fingerprints(true);
+  const Fingerprint* fingerprints;
+  unsigned len;
+  Fingerprint chain;
+  ASSERT_EQ(ERR_NO_CERTIFICATE_FINGERPRINTS, ErrorCodeFromResult(leaf.server_certificate_fingerprints(&fingerprints, &len, &chain)));
+}
+
+// CacheFromCallback enables a verification cache from within the
+// certificates callback and then looks up the chain.
+struct CacheFromCallback {
+  Connection* conn;
+  VerificationCache* cache;
+  Result lookup;
+};
+
+static void LookUpFromCallback(void* arg, const struct iovec* certs, unsigned len, bool complete) {
+  CacheFromCallback* const state = static_cast<CacheFromCallback*>(arg);
+  bool found;
+  int result;
+  state->conn->set_verification_cache(state->cache);
+  state->lookup = state->conn->GetCachedVerificationResult(&found, &result);
+}
+
+// The chain can be looked up from within the certificates callback if
+// fingerprints were enabled beforehand. Otherwise it can be looked up once
+// the callback has returned.
+TEST_F(HandshakeTest, ServerCertificateFingerprintsFromCallback) {
+  ContextCanParseCertificates ctx;
+  MemoryVerificationCache cache(4);
+
+  for (unsigned enabled = 0; enabled < 2; enabled++) {
+    SCOPED_TRACE(enabled);
+    Connection conn(&ctx);
+    CacheFromCallback state = {&conn, &cache, 0};
+    conn.set_certificates_callback(LookUpFromCallback, &state);
+    conn.set_certificate_fingerprints(enabled != 0);
+    ProcessCertificateMessage(&conn);
+    ASSERT_EQ(enabled ? 0 : ERR_NO_CERTIFICATE_FINGERPRINTS, ErrorCodeFromResult(state.lookup));
+
+    bool found;
+    int result;
+    ASSERT_EQ(0, ErrorCodeFromResult(conn.GetCachedVerificationResult(&found, &result)));
+    ExpectFingerprints(&conn);
+  }
+}
+
+// The fingerprints are those of the chain which the server sent, not the
+// predicted one, unless an accepted snap start means that it sent none.
+TEST_F(HandshakeTest, ServerCertificateFingerprintsPredicted) {
+  ContextCanParseCertificates ctx;
+  static const uint8_t kPredicted[] = {1, 2, 3};
+  const struct iovec predicted = {const_cast<uint8_t*>(kPredicted), sizeof(kPredicted)};
+  const Fingerprint* fingerprints;
+  unsigned len;
+  Fingerprint chain;
+
+  for (unsigned enabled = 0; enabled < 2; enabled++) {
+    SCOPED_TRACE(enabled);
+    Connection conn(&ctx);
+    conn.SetPredictedCertificates(&predicted, 1);
+    conn.set_certificate_fingerprints(enabled != 0);
+    ASSERT_EQ(ERR_NO_CERTIFICATE_FINGERPRINTS, ErrorCodeFromResult(conn.server_certificate_fingerprints(&fingerprints, &len, &chain)));
+    ProcessCertificateMessage(&conn);
+    conn.set_certificate_fingerprints(true);
+    ExpectFingerprints(&conn);
+  }
+
+  Connection snap_start(&ctx);
+  snap_start.SetPredictedCertificates(&predicted, 1);
+  snap_start.set_certificate_fingerprints(true);
+  snap_start.priv()->did_snap_start = true;
+  ASSERT_EQ(0, ErrorCodeFromResult(snap_start.server_certificate_fingerprints(&fingerprints, &len, &chain)));
+  ASSERT_EQ(1u, len);
+  SHA256 sha256;
+  uint8_t digest[SHA256::DIGEST_SIZE];
+  sha256.Update(kPredicted, sizeof(kPredicted));
+  sha256.Final(digest);
+  ASSERT_TRUE(memcmp(digest, fingerprints[0].bytes, sizeof(digest)) == 0);
+}
+
+// Fingerprints which are enabled part way through a streamed Certificate
+// message aren't computed from just the rest of the chain.
+TEST_F(HandshakeTest, ServerCertificateFingerprintsEnabledMidStream) {
+  std::vector<uint8_t> message;
+  message.push_back(CERTIFICATE);
+  AppendU24(&message, sizeof(kCertificateTempl));
+  message.insert(message.end(), kCertificateTempl, kCertificateTempl + sizeof(kCertificateTempl));
+
+  // The message is streamed and only the leaf is complete after the second
+  // record.
+  static const size_t kRecordLength = 8;
+  std::vector<std::vector<uint8_t> > records;
+  for (size_t offset = 0; offset < message.size(); offset += kRecordLength) {
+    const size_t n = std::min(kRecordLength, message.size() - offset);
+    const uint8_t header[5] = {RECORD_HANDSHAKE, 3, 1, 0, static_cast<uint8_t>(n)};
+    std::vector<uint8_t> record(header, header + sizeof(header));
+    record.insert(record.end(), message.begin() + offset, message.begin() + offset + n);
+    records.push_back(record);
+  }
+
+  static const CertificateRetention kRetentions[] = {
+    RETAIN_ALL_CERTIFICATES, RETAIN_LEAF_CERTIFICATE,
+  };
+  for (unsigned i = 0; i < sizeof(kRetentions) / sizeof(kRetentions[0]); i++) {
+    SCOPED_TRACE(i);
+    ContextCanParseCertificates ctx;
+    Connection conn(&ctx);
+    conn.set_certificate_retention(kRetentions[i]);
+    conn.priv()->state = RECV_CERTIFICATE;
+
+    for (unsigned j = 0; j < records.size(); j++) {
+      if (j == 2) {
+        ASSERT_EQ(1u, conn.priv()->handshake->num_streamed_certificates);
+        conn.set_certificate_fingerprints(true);
+      }
+      const struct iovec iov = {&records[j][0], records[j].size()};
+      struct iovec* out;
+      unsigned out_n;
+      size_t used;
+      ASSERT_EQ(0, ErrorCodeFromResult(conn.Process(&out, &out_n, &used, &iov, 1)));
+      ASSERT_EQ(records[j].size(), used);
+    }
+    ASSERT_TRUE(conn.is_server_cert_available());
+
+    if (kRetentions[i] == RETAIN_ALL_CERTIFICATES) {
+      ExpectFingerprints(&conn);
+    } else {
+      const Fingerprint* fingerprints;
+      unsigned len;
+      Fingerprint chain;
+      ASSERT_EQ(ERR_NO_CERTIFICATE_FINGERPRINTS, ErrorCodeFromResult(conn.server_certificate_fingerprints(&fingerprints, &len, &chain)));
+    }
+  }
 }
 
 }  // anonymous namespace
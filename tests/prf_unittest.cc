@@ -4,6 +4,8 @@
 
 #include "tlsclient/src/crypto/prf/prf.h"
 
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include "tlsclient/src/base-internal.h"
@@ -117,4 +119,42 @@ TEST_F(PRFTest, Simple) {
   }
 }
 
+// Feeding a HandshakeHash in one go gives the same verify data as feeding it
+// message by message, including messages which are longer than the slices
+// which the MD5 and SHA1 updates are interleaved over.
+TEST_F(PRFTest, HandshakeHashSlices) {
+  static const TLSVersion kVersions[] = {SSLv3, TLSv10, TLSv11, TLSv12};
+  uint8_t master[48];
+  memset(master, 0x42, sizeof(master));
+
+  std::vector<uint8_t> messages(5000);
+  for (unsigned i = 0; i < messages.size(); i++)
+    messages[i] = i * 7;
+  static const size_t kLengths[] = {1, 4, 200, 4, 3000, 4, 0, 37};
+
+  for (unsigned v = 0; v < arraysize(kVersions); v++) {
+    HandshakeHash* whole = HandshakeHashForVersion(kVersions[v]);
+    HandshakeHash* pieces = HandshakeHashForVersion(kVersions[v]);
+    ASSERT_TRUE(whole);
+    ASSERT_TRUE(pieces);
+
+    size_t offset = 0;
+    for (unsigned i = 0; i < arraysize(kLengths); i++) {
+      pieces->Update(&messages[offset], kLengths[i]);
+      offset += kLengths[i];
+    }
+    whole->Update(&messages[0], offset);
+
+    unsigned whole_len, pieces_len;
+    const uint8_t* whole_verify = whole->ClientVerifyData(&whole_len, master, sizeof(master));
+    const uint8_t* pieces_verify = pieces->ClientVerifyData(&pieces_len, master, sizeof(master));
+    ASSERT_EQ(whole->Length(), whole_len);
+    ASSERT_EQ(whole_len, pieces_len);
+    ASSERT_EQ(0, memcmp(whole_verify, pieces_verify, whole_len));
+
+    delete whole;
+    delete pieces;
+  }
+}
+
 }  // anonymous namespace
@@ -7,6 +7,7 @@
 #include <gtest/gtest.h>
 
 #include "tlsclient/src/base-internal.h"
+#include "tlsclient/src/buffer.h"
 #include "tlsclient/tests/util.h"
 
 using namespace tlsclient;
@@ -86,4 +87,47 @@ TEST_F(SHA1Test, ByteByByte) {
   }
 }
 
+TEST_F(SHA1Test, Lanes) {
+  uint8_t digest[SHA1::DIGEST_SIZE];
+  char hexdigest[SHA1::DIGEST_SIZE * 2 + 1];
+
+  // Each group of lanes starts at a different test case and each lane has
+  // already been given a little of its input, so that the lanes are out of
+  // step with each other.
+  for (size_t start = 0; start < arraysize(SHA1Tests); start++) {
+    for (unsigned n = 1; n <= SHA1::LANES; n++) {
+      SHA1 hashes[SHA1::LANES];
+      SHA1* hash_ptrs[SHA1::LANES];
+      struct iovec iovs[SHA1::LANES][2];
+      Buffer* bufs[SHA1::LANES];
+      size_t lengths[SHA1::LANES];
+      const SHA1TestCase* cases[SHA1::LANES];
+
+      for (unsigned i = 0; i < n; i++) {
+        cases[i] = &SHA1Tests[(start + i) % arraysize(SHA1Tests)];
+        const size_t length = strlen(cases[i]->input);
+        const size_t done = std::min(length, static_cast<size_t>(i * 7));
+        char* const rest = const_cast<char*>(cases[i]->input) + done;
+        hashes[i].Update(cases[i]->input, done);
+        iovs[i][0].iov_base = rest;
+        iovs[i][0].iov_len = (length - done) / 2;
+        iovs[i][1].iov_base = rest + iovs[i][0].iov_len;
+        iovs[i][1].iov_len = length - done - iovs[i][0].iov_len;
+        bufs[i] = new Buffer(iovs[i], 2);
+        hash_ptrs[i] = &hashes[i];
+        lengths[i] = length - done;
+      }
+
+      SHA1::UpdateLanes(hash_ptrs, bufs, lengths, n);
+
+      for (unsigned i = 0; i < n; i++) {
+        hashes[i].Final(digest);
+        HexDump(hexdigest, digest, SHA1::DIGEST_SIZE);
+        ASSERT_STREQ(cases[i]->digest, hexdigest);
+        delete bufs[i];
+      }
+    }
+  }
+}
+
 }  // anonymous namespace
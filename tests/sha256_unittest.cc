@@ -8,6 +8,7 @@
 #include <gtest/gtest.h>
 
 #include "tlsclient/src/base-internal.h"
+#include "tlsclient/src/buffer.h"
 #include "tlsclient/tests/util.h"
 
 using namespace tlsclient;
@@ -102,6 +103,49 @@ TEST_F(SHA256Test, ByteByByte) {
   }
 }
 
+TEST_F(SHA256Test, Lanes) {
+  uint8_t digest[SHA256::DIGEST_SIZE];
+  char hexdigest[SHA256::DIGEST_SIZE * 2 + 1];
+
+  // Each group of lanes starts at a different test case and each lane has
+  // already been given a little of its input, so that the lanes are out of
+  // step with each other.
+  for (size_t start = 0; start < arraysize(SHA256Tests); start++) {
+    for (unsigned n = 1; n <= SHA256::LANES; n++) {
+      SHA256 hashes[SHA256::LANES];
+      SHA256* hash_ptrs[SHA256::LANES];
+      struct iovec iovs[SHA256::LANES][2];
+      Buffer* bufs[SHA256::LANES];
+      size_t lengths[SHA256::LANES];
+      const SHA256TestCase* cases[SHA256::LANES];
+
+      for (unsigned i = 0; i < n; i++) {
+        cases[i] = &SHA256Tests[(start + i) % arraysize(SHA256Tests)];
+        const size_t length = strlen(cases[i]->input);
+        const size_t done = std::min(length, static_cast<size_t>(i * 7));
+        char* const rest = const_cast<char*>(cases[i]->input) + done;
+        hashes[i].Update(cases[i]->input, done);
+        iovs[i][0].iov_base = rest;
+        iovs[i][0].iov_len = (length - done) / 2;
+        iovs[i][1].iov_base = rest + iovs[i][0].iov_len;
+        iovs[i][1].iov_len = length - done - iovs[i][0].iov_len;
+        bufs[i] = new Buffer(iovs[i], 2);
+        hash_ptrs[i] = &hashes[i];
+        lengths[i] = length - done;
+      }
+
+      SHA256::UpdateLanes(hash_ptrs, bufs, lengths, n);
+
+      for (unsigned i = 0; i < n; i++) {
+        hashes[i].Final(digest);
+        HexDump(hexdigest, digest, SHA256::DIGEST_SIZE);
+        ASSERT_STREQ(cases[i]->digest, hexdigest);
+        delete bufs[i];
+      }
+    }
+  }
+}
+
 typedef HMAC<SHA256> H;
 
 TEST_F(SHA256Test, HMAC) {
@@ -0,0 +1,85 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tlsclient/public/snap_start_cache.h"
+
+#include <gtest/gtest.h>
+
+#include "tlsclient/public/certificate_chain.h"
+#include "tlsclient/src/arena.h"
+#include "tlsclient/src/snap_start_cache.h"
+
+using namespace tlsclient;
+
+namespace {
+
+class SnapStartCacheTest : public ::testing::Test {
+};
+
+static struct iovec MakeIOVec(const char* str) {
+  struct iovec iov = {const_cast<char*>(str), strlen(str)};
+  return iov;
+}
+
+TEST_F(SnapStartCacheTest, GetAndPut) {
+  SnapStartCache cache(4);
+  Arena arena;
+  const struct iovec server_hello = MakeIOVec("server hello");
+  struct iovec certs[2];
+  certs[0] = MakeIOVec("leaf");
+  certs[1] = MakeIOVec("intermediate");
+  CertificateChain* const chain = CertificateChain::Create(certs, 2);
+  const struct iovec response = MakeIOVec("predicted response");
+
+  struct iovec out;
+  ASSERT_FALSE(SnapStartCacheGet(&cache, &out, &arena, false, server_hello, chain));
+  SnapStartCachePut(&cache, response, false, server_hello, chain);
+  ASSERT_TRUE(SnapStartCacheGet(&cache, &out, &arena, false, server_hello, chain));
+  ASSERT_EQ(response.iov_len, out.iov_len);
+  ASSERT_EQ(0, memcmp(response.iov_base, out.iov_base, out.iov_len));
+
+  // A different chain with the same certificates matches.
+  CertificateChain* const same_chain = CertificateChain::Create(certs, 2);
+  ASSERT_TRUE(SnapStartCacheGet(&cache, &out, &arena, false, server_hello, same_chain));
+  same_chain->DecRef();
+
+  // Any difference in the prediction is a different entry.
+  ASSERT_FALSE(SnapStartCacheGet(&cache, &out, &arena, true, server_hello, chain));
+  const struct iovec other_server_hello = MakeIOVec("server hellO");
+  ASSERT_FALSE(SnapStartCacheGet(&cache, &out, &arena, false, other_server_hello, chain));
+  certs[1] = MakeIOVec("intermediatf");
+  CertificateChain* other_chain = CertificateChain::Create(certs, 2);
+  ASSERT_FALSE(SnapStartCacheGet(&cache, &out, &arena, false, server_hello, other_chain));
+  other_chain->DecRef();
+  other_chain = CertificateChain::Create(certs, 1);
+  ASSERT_FALSE(SnapStartCacheGet(&cache, &out, &arena, false, server_hello, other_chain));
+  other_chain->DecRef();
+
+  // The cache keeps its own reference to the chain.
+  chain->DecRef();
+}
+
+TEST_F(SnapStartCacheTest, Eviction) {
+  SnapStartCache cache(2);
+  Arena arena;
+  const struct iovec server_hellos[3] = {
+    MakeIOVec("one"), MakeIOVec("two"), MakeIOVec("three"),
+  };
+  const struct iovec cert = MakeIOVec("leaf");
+  CertificateChain* const chain = CertificateChain::Create(&cert, 1);
+
+  for (unsigned i = 0; i < 3; i++)
+    SnapStartCachePut(&cache, server_hellos[i], false, server_hellos[i], chain);
+  chain->DecRef();
+
+  struct iovec out;
+  ASSERT_FALSE(SnapStartCacheGet(&cache, &out, &arena, false, server_hellos[0], chain));
+  for (unsigned i = 1; i < 3; i++) {
+    ASSERT_TRUE(SnapStartCacheGet(&cache, &out, &arena, false, server_hellos[i], chain));
+    ASSERT_EQ(server_hellos[i].iov_len, out.iov_len);
+    ASSERT_EQ(0, memcmp(server_hellos[i].iov_base, out.iov_base, out.iov_len));
+  }
+}
+
+}  // anonymous namespace
@@ -0,0 +1,78 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tlsclient/public/verification_cache.h"
+
+#include <gtest/gtest.h>
+
+using namespace tlsclient;
+
+namespace {
+
+class VerificationCacheTest : public ::testing::Test {
+};
+
+static const char kHost[] = "example.com";
+
+static Fingerprint MakeFingerprint(uint8_t value) {
+  Fingerprint fingerprint;
+  memset(fingerprint.bytes, value, sizeof(fingerprint.bytes));
+  return fingerprint;
+}
+
+TEST_F(VerificationCacheTest, LookupAndStore) {
+  MemoryVerificationCache cache(4);
+  const Fingerprint a = MakeFingerprint(1);
+  const Fingerprint b = MakeFingerprint(2);
+  int result;
+
+  ASSERT_FALSE(cache.Lookup(kHost, a, 1000, &result));
+  cache.Store(kHost, a, 42, 1000, 60);
+  ASSERT_TRUE(cache.Lookup(kHost, a, 1000, &result));
+  ASSERT_EQ(42, result);
+  ASSERT_FALSE(cache.Lookup(kHost, b, 1000, &result));
+  // The same chain for a different host is a different entry.
+  ASSERT_FALSE(cache.Lookup("other.example.com", a, 1000, &result));
+  ASSERT_FALSE(cache.Lookup("", a, 1000, &result));
+  cache.Store("other.example.com", a, 43, 1000, 60);
+  ASSERT_TRUE(cache.Lookup("other.example.com", a, 1000, &result));
+  ASSERT_EQ(43, result);
+  ASSERT_TRUE(cache.Lookup(kHost, a, 1000, &result));
+  ASSERT_EQ(42, result);
+
+  // Results expire after their TTL.
+  ASSERT_TRUE(cache.Lookup(kHost, a, 1059, &result));
+  ASSERT_FALSE(cache.Lookup(kHost, a, 1060, &result));
+
+  // Storing again replaces the result and its expiry.
+  cache.Store(kHost, a, 7, 1060, 10);
+  ASSERT_TRUE(cache.Lookup(kHost, a, 1069, &result));
+  ASSERT_EQ(7, result);
+  ASSERT_FALSE(cache.Lookup(kHost, a, 1070, &result));
+}
+
+TEST_F(VerificationCacheTest, Eviction) {
+  MemoryVerificationCache cache(2);
+  int result;
+
+  // When full, an expired result goes first...
+  cache.Store(kHost, MakeFingerprint(1), 1, 0, 100);
+  cache.Store(kHost, MakeFingerprint(2), 2, 0, 10);
+  cache.Store(kHost, MakeFingerprint(3), 3, 50, 100);
+  ASSERT_TRUE(cache.Lookup(kHost, MakeFingerprint(1), 50, &result));
+  ASSERT_FALSE(cache.Lookup(kHost, MakeFingerprint(2), 5, &result));
+  ASSERT_TRUE(cache.Lookup(kHost, MakeFingerprint(3), 50, &result));
+
+  // ... otherwise the oldest does.
+  cache.Store(kHost, MakeFingerprint(4), 4, 50, 100);
+  ASSERT_FALSE(cache.Lookup(kHost, MakeFingerprint(1), 50, &result));
+  ASSERT_TRUE(cache.Lookup(kHost, MakeFingerprint(3), 50, &result));
+  ASSERT_TRUE(cache.Lookup(kHost, MakeFingerprint(4), 50, &result));
+
+  MemoryVerificationCache empty(0);
+  empty.Store(kHost, MakeFingerprint(1), 1, 0, 100);
+  ASSERT_FALSE(empty.Lookup(kHost, MakeFingerprint(1), 0, &result));
+}
+
+}  // anonymous namespace
@@ -0,0 +1,82 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "tlsclient/public/worker_pool.h"
+
+#include <vector>
+
+#include <pthread.h>
+
+#include <gtest/gtest.h>
+
+using namespace tlsclient;
+
+namespace {
+
+class WorkerPoolTest : public ::testing::Test {
+};
+
+static void Increment(void* arg, unsigned i) {
+  unsigned* const counts = static_cast<unsigned*>(arg);
+  counts[i]++;
+}
+
+TEST_F(WorkerPoolTest, Create) {
+  WorkerPool pool(4);
+}
+
+TEST_F(WorkerPoolTest, Run) {
+  WorkerPool pool(3);
+  std::vector<unsigned> counts(1000);
+
+  pool.Run(Increment, &counts[0], counts.size());
+  for (unsigned i = 0; i < counts.size(); i++)
+    ASSERT_EQ(1u, counts[i]);
+
+  pool.Run(Increment, &counts[0], counts.size());
+  pool.Run(Increment, &counts[0], 0);
+  for (unsigned i = 0; i < counts.size(); i++)
+    ASSERT_EQ(2u, counts[i]);
+}
+
+TEST_F(WorkerPoolTest, NoThreads) {
+  WorkerPool pool(0);
+  std::vector<unsigned> counts(10);
+
+  pool.Run(Increment, &counts[0], counts.size());
+  for (unsigned i = 0; i < counts.size(); i++)
+    ASSERT_EQ(1u, counts[i]);
+}
+
+struct ConcurrentRunArgs {
+  WorkerPool* pool;
+  std::vector<unsigned> counts;
+};
+
+static void* ConcurrentRun(void* arg) {
+  ConcurrentRunArgs* const args = static_cast<ConcurrentRunArgs*>(arg);
+  for (unsigned i = 0; i < 100; i++)
+    args->pool->Run(Increment, &args->counts[0], args->counts.size());
+  return NULL;
+}
+
+// Several threads can share a pool.
+TEST_F(WorkerPoolTest, ConcurrentRuns) {
+  WorkerPool pool(2);
+  ConcurrentRunArgs args[4];
+  pthread_t threads[4];
+
+  for (unsigned i = 0; i < 4; i++) {
+    args[i].pool = &pool;
+    args[i].counts.resize(50);
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, ConcurrentRun, &args[i]));
+  }
+  for (unsigned i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    for (unsigned j = 0; j < args[i].counts.size(); j++)
+      ASSERT_EQ(100u, args[i].counts[j]);
+  }
+}
+
+}  // anonymous namespace
@@ -14,11 +14,15 @@
         '..',
       ],
       'sources': [
+        'src/certificate_chain.cc',
         'src/connection.cc',
         'src/error.cc',
         'src/extension.cc',
         'src/handshake.cc',
         'src/record.cc',
+        'src/snap_start_cache.cc',
+        'src/verification_cache.cc',
+        'src/worker_pool.cc',
         'src/crypto/aes/aes.cc',
         'src/crypto/cipher_suites.cc',
         'src/crypto/fnv1a64/fnv1a64.cc',
@@ -28,6 +32,11 @@
         'src/crypto/sha1/sha1.cc',
         'src/crypto/sha256/sha256.cc',
       ],
+      'link_settings': {
+        'libraries': [
+          '-lpthread',
+        ],
+      },
     },
 
     {
@@ -41,7 +50,9 @@
         'tests/arena_unittest.cc',
         'tests/cbc_unittest.cc',
         'tests/buffer_unittest.cc',
+        'tests/certificate_chain_unittest.cc',
         'tests/error_unittest.cc',
+        'tests/fnv1a64_unittest.cc',
         'tests/handshake_unittest.cc',
         'tests/hmac_unittest.cc',
         'tests/md5_unittest.cc',
@@ -50,7 +61,10 @@
         'tests/sha1_unittest.cc',
         'tests/sha256_unittest.cc',
         'tests/sink_unittest.cc',
+        'tests/snap_start_cache_unittest.cc',
         'tests/util.cc',
+        'tests/verification_cache_unittest.cc',
+        'tests/worker_pool_unittest.cc',
       ],
       'dependencies': [
         'libtlsclient',
@@ -122,6 +136,34 @@
 #      ],
 #    },
 
+    {
+      'target_name': 'encrypt-file-benchmark',
+      'type': 'executable',
+      'sources': [
+        'util/encrypt_file_benchmark.cc',
+      ],
+      'include_dirs': [
+        '..',
+      ],
+      'dependencies': [
+        'libtlsclient',
+      ],
+    },
+
+    {
+      'target_name': 'many-connections-benchmark',
+      'type': 'executable',
+      'sources': [
+        'util/many_connections_benchmark.cc',
+      ],
+      'include_dirs': [
+        '..',
+      ],
+      'dependencies': [
+        'libtlsclient',
+      ],
+    },
+
     {
       'target_name': 'tc-client',
       'type': 'executable',
@@ -141,5 +183,24 @@
         '-lcrypto',
       ],
     },
+    {
+      'target_name': 'handoff-example',
+      'type': 'executable',
+      'sources': [
+        'util/handoff_example.cc',
+        'tests/openssl-context.cc',
+      ],
+      'include_dirs': [
+        '..',
+        '/home/agl/devel/openssl-0.9.8m/include',
+      ],
+      'dependencies': [
+        'libtlsclient',
+      ],
+      'ldflags': [
+        '-L/home/agl/devel/openssl-0.9.8m',
+        '-lcrypto',
+      ],
+    },
   ],
 }
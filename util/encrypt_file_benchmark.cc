@@ -0,0 +1,172 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// encrypt_file_benchmark compares two ways of sending a file over a
+// connection: a loop of read, |Connection::Encrypt| and writev, and
+// |Connection::EncryptFromFile| followed by write. The records are written to
+// /dev/null.
+//
+// Usage: encrypt_file_benchmark <file> [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "tlsclient/public/connection.h"
+#include "tlsclient/public/context.h"
+#include "tlsclient/public/error.h"
+#include "tlsclient/src/connection_private.h"
+#include "tlsclient/src/crypto/cipher_suites.h"
+#include "tlsclient/src/handshake.h"
+
+using namespace tlsclient;
+
+namespace {
+
+// The connections in this benchmark never perform a handshake so nothing
+// here is ever called.
+class BenchmarkContext : public Context {
+ public:
+  bool RandomBytes(void* addr, size_t len) {
+    return false;
+  }
+
+  uint64_t EpochSeconds() {
+    return 0;
+  }
+
+  Certificate* ParseCertificate(const uint8_t* bytes, size_t length) {
+    return NULL;
+  }
+};
+
+// The amount of the file that's read, or encrypted from the file, at once.
+static const size_t kReadSize = 16384;
+static const size_t kChunkSize = 1024 * 1024;
+
+// NewConnection returns a Connection which is ready to send application data
+// using |suite| with a dummy key.
+static Connection* NewConnection(Context* ctx, const CipherSuite* suite) {
+  KeyBlock kb;
+  memset(&kb, 0x42, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+
+  Connection* conn = new Connection(ctx);
+  conn->priv()->version = TLSv10;
+  conn->priv()->can_send_application_data = true;
+  conn->priv()->writer.cipher_spec = suite->create(TLSv10, kb);
+  return conn;
+}
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool ReadEncryptWrite(Connection* conn, int fd, int out_fd, size_t len) {
+  std::vector<uint8_t> buf(kReadSize);
+
+  for (size_t done = 0; done < len; ) {
+    const ssize_t n = read(fd, &buf[0], buf.size());
+    if (n <= 0)
+      return false;
+    struct iovec iov[3];
+    iov[1].iov_base = &buf[0];
+    iov[1].iov_len = n;
+    if (conn->Encrypt(&iov[0], &iov[2], &iov[1], 1))
+      return false;
+    if (writev(out_fd, iov, 3) < 0)
+      return false;
+    done += n;
+  }
+
+  return true;
+}
+
+static bool EncryptFromFileWrite(Connection* conn, int fd, int out_fd, size_t len) {
+  std::vector<uint8_t> out(2 * kChunkSize);
+
+  for (size_t done = 0; done < len; ) {
+    size_t todo = len - done;
+    if (todo > kChunkSize)
+      todo = kChunkSize;
+    size_t out_len = out.size();
+    if (conn->EncryptFromFile(&out[0], &out_len, fd, done, todo))
+      return false;
+    if (write(out_fd, &out[0], out_len) < 0)
+      return false;
+    done += todo;
+  }
+
+  return true;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char** argv) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s <file> [iterations]\n", argv[0]);
+    return 1;
+  }
+  const unsigned iterations = argc == 3 ? atoi(argv[2]) : 5;
+
+  const int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    perror("fstat");
+    return 1;
+  }
+  const size_t len = st.st_size;
+  const int out_fd = open("/dev/null", O_WRONLY);
+  if (out_fd < 0) {
+    perror("open");
+    return 1;
+  }
+
+  BenchmarkContext ctx;
+  for (const CipherSuite* suite = AllCipherSuites(); suite->flags; suite++) {
+    Connection* conn = NewConnection(&ctx, suite);
+    double read_encrypt_write = 0, encrypt_from_file = 0;
+
+    for (unsigned i = 0; i < iterations; i++) {
+      lseek(fd, 0, SEEK_SET);
+      double start = Now();
+      if (!ReadEncryptWrite(conn, fd, out_fd, len)) {
+        fprintf(stderr, "read+Encrypt+write failed\n");
+        return 1;
+      }
+      read_encrypt_write += Now() - start;
+
+      start = Now();
+      if (!EncryptFromFileWrite(conn, fd, out_fd, len)) {
+        fprintf(stderr, "EncryptFromFile+write failed\n");
+        return 1;
+      }
+      encrypt_from_file += Now() - start;
+    }
+
+    const double mb = static_cast<double>(len) * iterations / (1024 * 1024);
+    printf("%-40s read+Encrypt+write: %8.1f MB/s  EncryptFromFile+write: %8.1f MB/s\n",
+           suite->name, mb / read_encrypt_write, mb / encrypt_from_file);
+    delete conn;
+  }
+
+  return 0;
+}
@@ -0,0 +1,333 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// handoff-example shows how an established connection can be passed to
+// another process: the parent connects and performs the handshake, then
+// sends the socket, via SCM_RIGHTS, and the result of
+// |Connection::ExportState| to a child process, which continues the
+// connection with |Connection::ImportState| and makes an HTTP request.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <vector>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netdb.h>
+
+#include "tlsclient/public/connection.h"
+#include "tlsclient/public/context.h"
+#include "tlsclient/public/error.h"
+#include "tlsclient/tests/openssl-context.h"
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+static int usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s <hostname> [<port number>]\n", argv0);
+  return 1;
+}
+
+static int fatal_result(tlsclient::Result r) {
+  char filename[8];
+  tlsclient::FilenameFromResult(filename, r);
+  fprintf(stderr, "libtlsclient error: %s:%d %s\n", filename, tlsclient::LineNumberFromResult(r), tlsclient::StringFromResult(r));
+  return 1;
+}
+
+static int fatal_error(const char* err) {
+  fprintf(stderr, "fatal error: %s\n", err);
+  return 1;
+}
+
+static bool write_all(int fd, const struct iovec* iovs, unsigned iov_len) {
+  std::vector<struct iovec> todo(iovs, iovs + iov_len);
+  unsigned i = 0;
+
+  while (i < todo.size()) {
+    ssize_t n = writev(fd, &todo[i], todo.size() - i);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("writev");
+      return false;
+    }
+    while (i < todo.size() && static_cast<size_t>(n) >= todo[i].iov_len) {
+      n -= todo[i].iov_len;
+      i++;
+    }
+    if (n) {
+      todo[i].iov_base = static_cast<uint8_t*>(todo[i].iov_base) + n;
+      todo[i].iov_len -= n;
+    }
+  }
+
+  return true;
+}
+
+static int connect_to(const char* hostname, const char* port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* res;
+  int r = getaddrinfo(hostname, port, &hints, &res);
+  if (r) {
+    fprintf(stderr, " - getaddrinfo: %s\n", gai_strerror(r));
+    return -1;
+  }
+
+  int sock = -1;
+  for (struct addrinfo* cur = res; cur && sock < 0; cur = cur->ai_next) {
+    sock = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+    if (sock < 0)
+      continue;
+    if (connect(sock, cur->ai_addr, cur->ai_addrlen)) {
+      close(sock);
+      sock = -1;
+    }
+  }
+
+  freeaddrinfo(res);
+  return sock;
+}
+
+// Process feeds |*unprocessed| to |conn| and leaves only those bytes which it
+// didn't use. Any application data is written to stdout.
+static tlsclient::Result Process(tlsclient::Connection* conn, std::vector<uint8_t>* unprocessed) {
+  while (!unprocessed->empty()) {
+    const struct iovec in = {&(*unprocessed)[0], unprocessed->size()};
+    struct iovec* out;
+    unsigned out_len;
+    size_t used;
+
+    tlsclient::Result r = conn->Process(&out, &out_len, &used, &in, 1);
+    if (r)
+      return r;
+    if (out_len)
+      write_all(1, out, out_len);
+    unprocessed->erase(unprocessed->begin(), unprocessed->begin() + used);
+    if (!used)
+      break;
+  }
+
+  return 0;
+}
+
+// Handshake runs the handshake on the blocking socket |sock|. On return,
+// |*unprocessed| contains any bytes which were read from |sock| but which
+// were beyond the end of the handshake.
+static int Handshake(tlsclient::Connection* conn, int sock, std::vector<uint8_t>* unprocessed) {
+  while (!conn->is_ready_to_send_application_data() || conn->need_to_write()) {
+    if (conn->need_to_write()) {
+      struct iovec iov;
+      tlsclient::Result r = conn->Get(&iov);
+      if (r)
+        return fatal_result(r);
+      if (!write_all(sock, &iov, 1))
+        return 1;
+      continue;
+    }
+
+    uint8_t buf[4096];
+    const ssize_t n = read(sock, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return fatal_error("connection closed during handshake");
+    unprocessed->insert(unprocessed->end(), buf, buf + n);
+
+    tlsclient::Result r = Process(conn, unprocessed);
+    if (r)
+      return fatal_result(r);
+  }
+
+  return 0;
+}
+
+// SendConnection sends |sock| over the Unix socket |channel|, together with
+// |state| and any |unprocessed| bytes.
+static bool SendConnection(int channel, int sock, const struct iovec& state, const std::vector<uint8_t>& unprocessed) {
+  uint8_t state_len[4];
+  state_len[0] = state.iov_len >> 24;
+  state_len[1] = state.iov_len >> 16;
+  state_len[2] = state.iov_len >> 8;
+  state_len[3] = state.iov_len;
+
+  struct iovec iovs[3];
+  iovs[0].iov_base = state_len;
+  iovs[0].iov_len = sizeof(state_len);
+  iovs[1] = state;
+  iovs[2].iov_base = const_cast<uint8_t*>(unprocessed.empty() ? NULL : &unprocessed[0]);
+  iovs[2].iov_len = unprocessed.size();
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iovs;
+  msg.msg_iovlen = 3;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+
+  return sendmsg(channel, &msg, 0) >= 0;
+}
+
+// ReceiveConnection is the inverse of |SendConnection|.
+static bool ReceiveConnection(int channel, int* sock, std::vector<uint8_t>* state, std::vector<uint8_t>* unprocessed) {
+  std::vector<uint8_t> data(65536);
+  struct iovec iov = {&data[0], data.size()};
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  const ssize_t n = recvmsg(channel, &msg, 0);
+  if (n < 4 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+    return false;
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    return false;
+  memcpy(sock, CMSG_DATA(cmsg), sizeof(int));
+
+  const size_t state_len = static_cast<uint32_t>(data[0]) << 24 |
+                           static_cast<uint32_t>(data[1]) << 16 |
+                           static_cast<uint32_t>(data[2]) << 8 |
+                           data[3];
+  if (state_len > static_cast<size_t>(n) - 4)
+    return false;
+  state->assign(data.begin() + 4, data.begin() + 4 + state_len);
+  unprocessed->assign(data.begin() + 4 + state_len, data.begin() + n);
+  return true;
+}
+
+static int Child(int channel, const char* hostname) {
+  int sock;
+  std::vector<uint8_t> state, unprocessed;
+  if (!ReceiveConnection(channel, &sock, &state, &unprocessed))
+    return fatal_error("failed to receive connection");
+  close(channel);
+  fprintf(stderr, " - child received connection\n");
+
+  OpenSSLContext context;
+  tlsclient::Connection conn(&context);
+  conn.EnableDefault();
+  tlsclient::Result r = conn.ImportState(&state[0], state.size());
+  if (r)
+    return fatal_result(r);
+  fprintf(stderr, " - child continuing with %s\n", conn.cipher_suite_name());
+
+  std::vector<char> request(256);
+  snprintf(&request[0], request.size(), "GET / HTTP/1.0\r\nHost: %s\r\n\r\n", hostname);
+  struct iovec iovs[3];
+  iovs[1].iov_base = &request[0];
+  iovs[1].iov_len = strlen(&request[0]);
+  r = conn.Encrypt(&iovs[0], &iovs[2], &iovs[1], 1);
+  if (r)
+    return fatal_result(r);
+  if (!write_all(sock, iovs, 3))
+    return 1;
+
+  for (;;) {
+    r = Process(&conn, &unprocessed);
+    if (r) {
+      if (tlsclient::ErrorCodeFromResult(r) == tlsclient::ERR_ALERT_CLOSE_NOTIFY)
+        return 0;
+      return fatal_result(r);
+    }
+
+    uint8_t buf[4096];
+    const ssize_t n = read(sock, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    unprocessed.insert(unprocessed.end(), buf, buf + n);
+  }
+}
+
+int
+main(int argc, char** argv) {
+  ERR_load_crypto_strings();
+  OpenSSL_add_all_algorithms();
+
+  if (argc < 2 || argc > 3)
+    return usage(argv[0]);
+  const char* const hostname = argv[1];
+  const char* const port = argc == 3 ? argv[2] : "443";
+
+  int channel[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel)) {
+    perror("socketpair");
+    return 1;
+  }
+
+  const pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (pid == 0) {
+    close(channel[0]);
+    return Child(channel[1], hostname);
+  }
+  close(channel[1]);
+
+  const int sock = connect_to(hostname, port);
+  if (sock < 0)
+    return fatal_error("cannot connect");
+  fprintf(stderr, " - connected\n");
+
+  OpenSSLContext context;
+  tlsclient::Connection conn(&context);
+  conn.set_host_name(hostname);
+  conn.EnableDefault();
+
+  std::vector<uint8_t> unprocessed;
+  int ret = Handshake(&conn, sock, &unprocessed);
+  if (ret)
+    return ret;
+  fprintf(stderr, " - handshake complete using %s\n", conn.cipher_suite_name());
+
+  struct iovec state;
+  tlsclient::Result r = conn.ExportState(&state);
+  if (r)
+    return fatal_result(r);
+  if (!SendConnection(channel[0], sock, state, unprocessed))
+    return fatal_error("failed to send connection");
+  close(sock);
+  close(channel[0]);
+  fprintf(stderr, " - handed connection to child %d\n", static_cast<int>(pid));
+
+  int status;
+  if (waitpid(pid, &status, 0) != pid)
+    return 1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,188 @@
+// Copyright (c) 2010 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// many_connections_benchmark measures the cost of the record layer when a
+// single thread services many connections, each of which only sends and
+// receives a small record at a time. In each round, every connection, in a
+// shuffled order, encrypts a record with |Connection::EncryptTo| which its
+// peer then decrypts with |Connection::Process|. Since the connections are
+// visited in no useful order, the cost is dominated by cache misses on the
+// connection state. The benchmark is run with the handshake state kept and
+// then freed with |Connection::FreeHandshakeState|.
+//
+// Usage: many_connections_benchmark [connections] [rounds] [record size]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "tlsclient/public/connection.h"
+#include "tlsclient/public/context.h"
+#include "tlsclient/public/error.h"
+#include "tlsclient/src/connection_private.h"
+#include "tlsclient/src/crypto/cipher_suites.h"
+#include "tlsclient/src/handshake.h"
+
+using namespace tlsclient;
+
+namespace {
+
+// The connections in this benchmark never perform a handshake so nothing
+// here is ever called.
+class BenchmarkContext : public Context {
+ public:
+  bool RandomBytes(void* addr, size_t len) {
+    return false;
+  }
+
+  uint64_t EpochSeconds() {
+    return 0;
+  }
+
+  Certificate* ParseCertificate(const uint8_t* bytes, size_t length) {
+    return NULL;
+  }
+};
+
+// Pair is a connection and the peer which receives its records. The keys are
+// the same in both directions so a Connection can act as the peer.
+struct Pair {
+  Connection* sender;
+  Connection* receiver;
+};
+
+// NewConnection returns a Connection which has, as far as the record layer
+// is concerned, completed a handshake for |suite| with a dummy key.
+static Connection* NewConnection(Context* ctx, const CipherSuite* suite) {
+  KeyBlock kb;
+  memset(&kb, 0x42, sizeof(kb));
+  kb.key_len = suite->key_len;
+  kb.mac_len = suite->mac_len;
+  kb.iv_len = suite->iv_len;
+
+  Connection* conn = new Connection(ctx);
+  ConnectionPrivate* const priv = conn->priv();
+  priv->state = AWAIT_HELLO_REQUEST;
+  priv->version = TLSv10;
+  priv->version_established = true;
+  priv->application_data_allowed = true;
+  priv->can_send_application_data = true;
+  priv->reader.cipher_spec = suite->create(TLSv10, kb);
+  priv->writer.cipher_spec = suite->create(TLSv10, kb);
+  return conn;
+}
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Shuffle permutes |order| with a fixed sequence of pseudo-random numbers so
+// that runs are comparable.
+static void Shuffle(std::vector<unsigned>* order, uint32_t* seed) {
+  for (unsigned i = order->size() - 1; i > 0; i--) {
+    *seed = *seed * 1103515245 + 12345;
+    const unsigned j = (*seed >> 8) % (i + 1);
+    const unsigned t = (*order)[i];
+    (*order)[i] = (*order)[j];
+    (*order)[j] = t;
+  }
+}
+
+// RunRounds sends |rounds| records of |record_size| bytes over each of
+// |pairs| and returns the number of seconds taken, or a negative number on
+// error.
+static double RunRounds(const std::vector<Pair>& pairs, unsigned rounds, size_t record_size) {
+  std::vector<uint8_t> plaintext(record_size, 'a');
+  std::vector<uint8_t> wire(record_size + 1024);
+  std::vector<unsigned> order(pairs.size());
+  for (unsigned i = 0; i < order.size(); i++)
+    order[i] = i;
+  uint32_t seed = 1;
+
+  const double start = Now();
+  for (unsigned round = 0; round < rounds; round++) {
+    Shuffle(&order, &seed);
+    for (unsigned i = 0; i < order.size(); i++) {
+      const Pair& pair = pairs[order[i]];
+      const struct iovec in = {&plaintext[0], plaintext.size()};
+      size_t wire_len = wire.size();
+      if (pair.sender->EncryptTo(&wire[0], &wire_len, &in, 1))
+        return -1;
+
+      const struct iovec record = {&wire[0], wire_len};
+      struct iovec* out;
+      unsigned out_n;
+      size_t used;
+      if (pair.receiver->Process(&out, &out_n, &used, &record, 1) || used != wire_len)
+        return -1;
+    }
+  }
+
+  return Now() - start;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char** argv) {
+  if (argc > 4) {
+    fprintf(stderr, "Usage: %s [connections] [rounds] [record size]\n", argv[0]);
+    return 1;
+  }
+  const unsigned connections = argc > 1 ? atoi(argv[1]) : 10000;
+  const unsigned rounds = argc > 2 ? atoi(argv[2]) : 20;
+  const size_t record_size = argc > 3 ? atoi(argv[3]) : 128;
+  if (!connections || !rounds || !record_size || record_size > 16384) {
+    fprintf(stderr, "Bad arguments\n");
+    return 1;
+  }
+
+  printf("sizeof(ConnectionPrivate): %u  sizeof(HandshakeData): %u\n",
+         static_cast<unsigned>(sizeof(ConnectionPrivate)),
+         static_cast<unsigned>(sizeof(HandshakeData)));
+
+  BenchmarkContext ctx;
+  for (const CipherSuite* suite = AllCipherSuites(); suite->flags; suite++) {
+    std::vector<Pair> pairs(connections);
+    for (unsigned i = 0; i < connections; i++) {
+      pairs[i].sender = NewConnection(&ctx, suite);
+      pairs[i].receiver = NewConnection(&ctx, suite);
+    }
+
+    // The first round warms up the buffers which each Connection keeps.
+    if (RunRounds(pairs, 1, record_size) < 0) {
+      fprintf(stderr, "%s: failed\n", suite->name);
+      return 1;
+    }
+    const double kept = RunRounds(pairs, rounds, record_size);
+
+    for (unsigned i = 0; i < connections; i++) {
+      if (pairs[i].sender->FreeHandshakeState() ||
+          pairs[i].receiver->FreeHandshakeState()) {
+        fprintf(stderr, "%s: FreeHandshakeState failed\n", suite->name);
+        return 1;
+      }
+    }
+    const double freed = RunRounds(pairs, rounds, record_size);
+    if (kept < 0 || freed < 0) {
+      fprintf(stderr, "%s: failed\n", suite->name);
+      return 1;
+    }
+
+    const double records = static_cast<double>(connections) * rounds;
+    printf("%-40s handshake state kept: %8.0f records/s  freed: %8.0f records/s\n",
+           suite->name, records / kept, records / freed);
+
+    for (unsigned i = 0; i < connections; i++) {
+      delete pairs[i].sender;
+      delete pairs[i].receiver;
+    }
+  }
+
+  return 0;
+}
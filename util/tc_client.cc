@@ -17,6 +17,7 @@
 #include <netinet/in.h>
 #include <sys/epoll.h>
 
+#include "tlsclient/public/certificate_chain.h"
 #include "tlsclient/public/connection.h"
 #include "tlsclient/public/context.h"
 #include "tlsclient/public/error.h"
@@ -335,7 +336,11 @@ main(int argc, char **argv) {
         certs.push_back(cert);
       }
 
-      conn.SetPredictedCertificates(&certs[0], certs.size());
+      // A client which makes many connections to the same server would
+      // create the chain once and attach it to each of them.
+      tlsclient::CertificateChain* const chain = tlsclient::CertificateChain::Create(&certs[0], certs.size());
+      conn.SetPredictedCertificateChain(chain);
+      chain->DecRef();
 
       size_t snap_start_data_len = buf.remaining();
       uint8_t* bytes = buf.Get(NULL, snap_start_data_len);
@@ -380,6 +385,7 @@ main(int argc, char **argv) {
   Buffer q_in;
   Buffer q_out;
 
+  bool have_printed_cert_available = false;
   bool have_printed_cipher_suite = false;
   bool have_printed_did_resume = false;
   bool have_printed_did_snap_start = false;
@@ -451,6 +457,16 @@ main(int argc, char **argv) {
       snap_start_state = NULL;
     }
 
+    if (!have_printed_cert_available && conn.is_server_cert_available()) {
+      const struct iovec* certs;
+      unsigned num_certs;
+      tlsclient::Result r = conn.server_certificates(&certs, &num_certs);
+      if (r)
+        return fatal_result(r);
+      fprintf(stderr, " - server certificates available (%u)\n", num_certs);
+      have_printed_cert_available = true;
+    }
+
     if (!have_printed_cipher_suite && conn.is_ready_to_send_application_data()) {
       fprintf(stderr, " - using %s\n", conn.cipher_suite_name());
       have_printed_cipher_suite = true;